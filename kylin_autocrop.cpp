@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "kylin_autocrop.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BBOX_BORDER	2       /* rows and columns of the page border sampled for the background */
+
+typedef struct
+{
+    int delta;
+    Strip_Format fmt;
+    uint8_t *gray;          /* the page, one byte per pixel */
+    size_t gray_size;
+    int lines;
+    Bbox_Result result;
+} Bbox_Sink;
+
+static void gray_line(const Strip_Format *fmt, const SANE_Byte *src, uint8_t *dst)
+{
+    int n = fmt->pixels_per_line;
+    int i;
+
+    if (fmt->depth == 1)
+    {
+        // set bits are black
+        for (i = 0; i < n; i++)
+            dst[i] = (src[i >> 3] & (0x80 >> (i & 7))) ? 0 : 255;
+    }
+    else if (fmt->format == SANE_FRAME_GRAY)
+    {
+        if (fmt->depth == 8)
+            memcpy (dst, src, n);
+        else
+            for (i = 0; i < n; i++)
+                dst[i] = ((const uint16_t *)src)[i] >> 8;
+    }
+    else if (fmt->depth == 8)
+    {
+        for (i = 0; i < n; i++, src += 3)
+            dst[i] = (src[0] + 2 * src[1] + src[2] + 2) >> 2;
+    }
+    else
+    {
+        const uint16_t *px = (const uint16_t *)src;
+
+        for (i = 0; i < n; i++, px += 3)
+            dst[i] = (px[0] + 2 * px[1] + px[2]) >> 10;
+    }
+}
+
+// Most common level on the border of the page
+static int border_level(const Bbox_Sink *b)
+{
+    int width = b->fmt.pixels_per_line;
+    int hist[256];
+    int x, y, i, best = 0;
+
+    memset (hist, 0, sizeof (hist));
+    for (y = 0; y < b->lines; y++)
+    {
+        const uint8_t *row = b->gray + (size_t) y * width;
+
+        if (y < BBOX_BORDER || y >= b->lines - BBOX_BORDER)
+        {
+            for (x = 0; x < width; x++)
+                hist[row[x]]++;
+            continue;
+        }
+        for (x = 0; x < BBOX_BORDER && x < width; x++)
+        {
+            hist[row[x]]++;
+            hist[row[width - 1 - x]]++;
+        }
+    }
+    for (i = 1; i < 256; i++)
+        if (hist[i] > hist[best])
+            best = i;
+    return best;
+}
+
+static void find_box(Bbox_Sink *b)
+{
+    Bbox_Result *r = &b->result;
+    int width = b->fmt.pixels_per_line;
+    int *cols = (int *)calloc (width, sizeof (int));
+    int row_noise = width / 200 + 2, col_noise = b->lines / 200 + 2;
+    int x, y;
+
+    r->width = width;
+    r->height = b->lines;
+    r->x0 = r->y0 = 0;
+    r->x1 = r->y1 = 0;
+    if (!cols || !b->lines)
+    {
+        free (cols);
+        return;
+    }
+    r->background = border_level (b);
+
+    r->y0 = -1;
+    for (y = 0; y < b->lines; y++)
+    {
+        const uint8_t *row = b->gray + (size_t) y * width;
+        int count = 0;
+
+        for (x = 0; x < width; x++)
+        {
+            int d = row[x] - r->background;
+
+            if (d > b->delta || d < -b->delta)
+            {
+                cols[x]++;
+                count++;
+            }
+        }
+        if (count >= row_noise)
+        {
+            if (r->y0 < 0)
+                r->y0 = y;
+            r->y1 = y + 1;
+        }
+    }
+
+    r->x0 = -1;
+    for (x = 0; x < width; x++)
+    {
+        if (cols[x] >= col_noise)
+        {
+            if (r->x0 < 0)
+                r->x0 = x;
+            r->x1 = x + 1;
+        }
+    }
+    free (cols);
+
+    r->found = (r->x0 >= 0 && r->y0 >= 0);
+    if (!r->found)
+        r->x0 = r->y0 = 0;
+}
+
+/* -------------------------------------------- */
+// Sink
+
+static SANE_Status bbox_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Bbox_Sink *b = (Bbox_Sink *)sink->priv;
+
+    b->fmt = *fmt;
+    b->lines = 0;
+    memset (&b->result, 0, sizeof (b->result));
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status bbox_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Bbox_Sink *b = (Bbox_Sink *)sink->priv;
+    size_t need = (size_t)(b->lines + strip->lines) * b->fmt.pixels_per_line;
+    int line;
+
+    if (b->gray_size < need)
+    {
+        size_t size = b->gray_size ? b->gray_size : (size_t) b->fmt.pixels_per_line * STRIP_HEIGHT;
+        uint8_t *gray;
+
+        while (size < need)
+            size *= 2;
+        gray = (uint8_t *)realloc (b->gray, size);
+        if (!gray)
+            return SANE_STATUS_NO_MEM;
+        b->gray = gray;
+        b->gray_size = size;
+    }
+
+    for (line = 0; line < strip->lines; line++, b->lines++)
+        gray_line (&b->fmt, strip->data + (size_t) line * b->fmt.bytes_per_line,
+                   b->gray + (size_t) b->lines * b->fmt.pixels_per_line);
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status bbox_sink_end(Strip_Sink *sink, int lines)
+{
+    find_box ((Bbox_Sink *)sink->priv);
+    return SANE_STATUS_GOOD;
+}
+
+static void bbox_sink_destroy(Strip_Sink *sink)
+{
+    Bbox_Sink *b = (Bbox_Sink *)sink->priv;
+
+    free (b->gray);
+    free (b);
+    free (sink);
+}
+
+Strip_Sink *bbox_sink_create(int delta)
+{
+    Strip_Sink *sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    Bbox_Sink *b = (Bbox_Sink *)calloc (1, sizeof (Bbox_Sink));
+
+    if (!sink || !b)
+    {
+        free (sink);
+        free (b);
+        return NULL;
+    }
+    b->delta = delta;
+    sink->begin = bbox_sink_begin;
+    sink->write = bbox_sink_write;
+    sink->end = bbox_sink_end;
+    sink->destroy = bbox_sink_destroy;
+    sink->priv = b;
+    return sink;
+}
+
+void bbox_sink_result(Strip_Sink *sink, Bbox_Result *result)
+{
+    *result = ((Bbox_Sink *)sink->priv)->result;
+}
+
+#ifdef __cplusplus
+}
+#endif
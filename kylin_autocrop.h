@@ -0,0 +1,33 @@
+#ifndef KYLIN_AUTOCROP_H
+#define KYLIN_AUTOCROP_H
+
+#include "kylin_pipeline.h"
+
+/**
+ * Document bounding box on a preview page.  The page is kept as 8-bit
+ * gray (previews are small); at end the background level is taken from
+ * the border of the page and every pixel further than delta from it is
+ * document.  Rows and columns with only a few such pixels are noise.
+ **/
+typedef struct
+{
+    int found;
+    int x0, y0;             /* first column and row of the document */
+    int x1, y1;             /* one past the last */
+    int width, height;      /* of the whole preview */
+    int background;         /* 8-bit gray level of the background */
+} Bbox_Result;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+Strip_Sink *bbox_sink_create(int delta);
+// Result of the last page that ended on the sink
+void bbox_sink_result(Strip_Sink *sink, Bbox_Result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
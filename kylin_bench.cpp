@@ -0,0 +1,557 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kylin_sane.h"
+#include "kylin_lut.h"
+#include "kylin_blank.h"
+#include "kylin_stats.h"
+
+/**
+ * Benchmarks of the host-side scan path, run with
+ *     ./kylinBench [name]
+ * Pages are synthetic, no scanner is needed.
+ **/
+
+#define READ_SIZE	(32 * 1024)     /* same chunks as do_scan reads */
+#define USB2_RATE	40.             /* MB/s, ceiling of a USB 2.0 bulk transfer */
+
+typedef struct
+{
+    const char *name;
+    int dpi;
+    int width_mm;
+    int height_mm;
+} Bench_Page;
+
+static const Bench_Page page_1200 = { "A4 1200dpi", 1200, 210, 297 };
+static const Bench_Page page_300 = { "A4 300dpi", 300, 210, 297 };
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static SANE_Status null_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    return SANE_STATUS_GOOD;
+}
+
+static void page_format(const Bench_Page *page, SANE_Frame format, int depth, Strip_Format *fmt)
+{
+    fmt->format = format;
+    fmt->depth = depth;
+    fmt->pixels_per_line = (int)(page->width_mm / 25.4 * page->dpi);
+    fmt->lines = (int)(page->height_mm / 25.4 * page->dpi);
+    fmt->bytes_per_line = strip_format_line_bytes (format, depth, fmt->pixels_per_line);
+}
+
+/**
+ * Push one page through the pipeline in sane_read sized chunks and return
+ * the seconds it took.  The data repeats a random strip.  A NULL sink
+ * drops the output.
+ **/
+static double run_page(Strip_Pipeline *p, const Strip_Format *fmt, Strip_Sink *out)
+{
+    size_t total = (size_t) fmt->bytes_per_line * fmt->lines;
+    size_t pattern_size = (size_t) fmt->bytes_per_line * STRIP_HEIGHT;
+    SANE_Byte *pattern = (SANE_Byte *)malloc (pattern_size);
+    Strip_Sink sink;
+    size_t done = 0, i;
+    double start;
+
+    for (i = 0; i < pattern_size; i++)
+        pattern[i] = (SANE_Byte) rand ();
+
+    memset (&sink, 0, sizeof (sink));
+    sink.write = null_sink_write;
+    pipeline_set_sink (p, out ? out : &sink);
+
+    start = now_sec ();
+    pipeline_begin (p, fmt);
+    while (done < total)
+    {
+        size_t offset = done % pattern_size;
+        size_t n = total - done;
+
+        if (n > READ_SIZE)
+            n = READ_SIZE;
+        if (n > pattern_size - offset)
+            n = pattern_size - offset;
+        pipeline_push (p, pattern + offset, n);
+        done += n;
+    }
+    pipeline_end (p);
+    start = now_sec () - start;
+
+    pipeline_set_sink (p, NULL);
+    free (pattern);
+    return start;
+}
+
+static void report(const char *what, const Strip_Format *fmt, double sec)
+{
+    double mb = (double) fmt->bytes_per_line * fmt->lines / 1e6;
+
+    printf("%-28s %8.1f MB %7.3f s %8.1f MB/s  %s\n", what, mb, sec, mb / sec,
+           (mb / sec >= USB2_RATE) ? "keeps up" : "TOO SLOW");
+}
+
+/* -------------------------------------------- */
+
+static void bench_lut()
+{
+    static const int depths[] = { 8, 16 };
+    Levels levels[3];
+    Strip_Format fmt;
+    char what[64];
+    int d, simd, i;
+
+    for (i = 0; i < 3; i++)
+    {
+        levels_init (&levels[i]);
+        levels[i].gamma = 1.8 + 0.1 * i;
+        levels[i].black = 0.05;
+        levels[i].white = 0.95;
+        levels[i].contrast = 0.1;
+    }
+
+    printf("gamma/levels LUT, %s RGB, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    for (d = 0; d < 2; d++)
+    {
+        Strip_Pipeline p;
+
+        page_format (&page_1200, SANE_FRAME_RGB, depths[d], &fmt);
+
+        pipeline_init (&p);
+        snprintf (what, sizeof (what), "%d-bit no stage", depths[d]);
+        report (what, &fmt, run_page (&p, &fmt, NULL));
+
+        pipeline_add_stage (&p, lut_stage_create (levels, 3));
+        for (simd = 0; simd < 2; simd++)
+        {
+            lut_set_simd (simd);
+            if (simd && !lut_simd_enabled ())
+            {
+                printf("%d-bit simd: not supported by this CPU\n", depths[d]);
+                continue;
+            }
+            snprintf (what, sizeof (what), "%d-bit lut %s", depths[d], simd ? "simd" : "scalar");
+            report (what, &fmt, run_page (&p, &fmt, NULL));
+        }
+        pipeline_clear_stages (&p);
+        pipeline_release (&p);
+    }
+    lut_set_simd (1);
+}
+
+static void bench_blank()
+{
+    static const SANE_Frame formats[] = { SANE_FRAME_GRAY, SANE_FRAME_GRAY, SANE_FRAME_RGB };
+    static const int depths[] = { 1, 8, 8 };
+    Strip_Sink null_sink, *blank;
+    Strip_Format fmt;
+    char what[64];
+    int i;
+
+    memset (&null_sink, 0, sizeof (null_sink));
+    null_sink.write = null_sink_write;
+    blank = blank_sink_create (&null_sink, NULL);
+
+    printf("blank page detection, %s, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    for (i = 0; i < 3; i++)
+    {
+        Strip_Pipeline p;
+
+        page_format (&page_1200, formats[i], depths[i], &fmt);
+        pipeline_init (&p);
+        snprintf (what, sizeof (what), "%s %d-bit", (formats[i] == SANE_FRAME_RGB) ? "RGB" : "gray", depths[i]);
+        report (what, &fmt, run_page (&p, &fmt, blank));
+        pipeline_release (&p);
+    }
+    strip_sink_destroy (blank);
+}
+
+static void bench_stats()
+{
+    static const SANE_Frame formats[] = { SANE_FRAME_GRAY, SANE_FRAME_GRAY, SANE_FRAME_GRAY,
+                                          SANE_FRAME_RGB, SANE_FRAME_RGB };
+    static const int depths[] = { 1, 8, 16, 8, 16 };
+    Strip_Sink null_sink, *stats;
+    Strip_Format fmt;
+    char what[64];
+    int i;
+
+    memset (&null_sink, 0, sizeof (null_sink));
+    null_sink.write = null_sink_write;
+    stats = stats_sink_create (&null_sink);
+
+    printf("page statistics, %s, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    for (i = 0; i < 5; i++)
+    {
+        Strip_Pipeline p;
+
+        page_format (&page_1200, formats[i], depths[i], &fmt);
+        pipeline_init (&p);
+        snprintf (what, sizeof (what), "%s %d-bit", (formats[i] == SANE_FRAME_RGB) ? "RGB" : "gray", depths[i]);
+        report (what, &fmt, run_page (&p, &fmt, stats));
+        pipeline_release (&p);
+    }
+    strip_sink_destroy (stats);
+}
+
+// What scan_it did with every chunk before the kernels, the frame kind tested per chunk
+static SANE_Status generic_chunk(Strip_Pipeline *p, uint8_t *image, size_t *offset, int must_buffer,
+                                 const SANE_Byte *buffer, int len)
+{
+    int i;
+
+    if (must_buffer)
+    {
+        for (i = 0; i < len; ++i)
+            image[*offset + 3 * i] = buffer[i];
+        *offset += 3 * len;
+        return SANE_STATUS_GOOD;
+    }
+    return pipeline_push (p, buffer, len);
+}
+
+// PNM sink to /dev/null, bare and with each digest
+static void bench_digest()
+{
+    static const int kinds[] = { DIGEST_NONE, DIGEST_CRC32C, DIGEST_XXH64 };
+    Strip_Format fmt;
+    Digest digest;
+    char what[64];
+    int i;
+
+    page_format (&page_1200, SANE_FRAME_RGB, 8, &fmt);
+    printf("file digests, %s, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    for (i = 0; i < 3; i++)
+    {
+        File_Writer *fw = file_writer_open ("/dev/null", 0, 1);
+        Strip_Sink *pnm;
+        Strip_Pipeline p;
+
+        if (!fw)
+            return;
+        pnm = pnm_sink_create (fw);
+        if (kinds[i] != DIGEST_NONE)
+        {
+            digest_init (&digest, kinds[i]);
+            pnm_sink_set_digest (pnm, &digest);
+        }
+        pipeline_init (&p);
+        snprintf (what, sizeof (what), "RGB 8-bit %s", kinds[i] ? digest_name (kinds[i]) : "no digest");
+        report (what, &fmt, run_page (&p, &fmt, pnm));
+        pipeline_release (&p);
+        strip_sink_destroy (pnm);
+        file_writer_close (fw);
+    }
+}
+
+// A page to a file in the current directory, /tmp is often tmpfs
+static void bench_writer()
+{
+    static const int flags[] =
+    {
+        0, WRITER_PREALLOCATE, WRITER_PREALLOCATE | WRITER_DIRECT,
+        WRITER_PREALLOCATE | WRITER_ASYNC, WRITER_PREALLOCATE | WRITER_DIRECT | WRITER_ASYNC
+    };
+    static const char *names[] =
+    {
+        "RGB 8-bit buffered", "RGB 8-bit preallocated", "RGB 8-bit direct",
+        "RGB 8-bit io_uring", "RGB 8-bit io_uring direct"
+    };
+    const char *path = "kylinBench.pnm";
+    Strip_Format fmt;
+    Writer_Stats ws;
+    int i;
+
+    page_format (&page_1200, SANE_FRAME_RGB, 8, &fmt);
+    printf("file writer, %s, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    for (i = 0; i < 5; i++)
+    {
+        File_Writer *fw = file_writer_open (path, flags[i], WRITER_DEFAULT_DEPTH);
+        Strip_Sink *pnm;
+        Strip_Pipeline p;
+        double sec;
+
+        if (!fw)
+            return;
+        pnm = pnm_sink_create (fw);
+        pipeline_init (&p);
+        sec = run_page (&p, &fmt, pnm);
+        file_writer_get_stats (fw, &ws);
+        // the last partial buffer goes out on close
+        sec -= now_sec ();
+        file_writer_close (fw);
+        sec += now_sec ();
+        report (names[i], &fmt, sec);
+        printf("    %llu writes, %.1f MB preallocated%s%s, latency %.2f ms mean %.2f ms max, %llu waits\n",
+               (unsigned long long) ws.writes, ws.preallocated / 1e6, ws.direct ? ", O_DIRECT" : "",
+               ws.async ? ", io_uring" : "", ws.completions ? ws.latency_ns / 1e6 / ws.completions : 0.,
+               ws.max_latency_ns / 1e6, (unsigned long long) ws.waits);
+        pipeline_release (&p);
+        strip_sink_destroy (pnm);
+        remove (path);
+    }
+}
+
+#define DURABLE_PAGES	16      /* per run */
+
+static void bench_page_path(char *path, size_t size, int page)
+{
+    snprintf (path, size, "kylinBench_%d.pnm", page);
+}
+
+/**
+ * The pages of one scan, committed as do_scan does, under every policy;
+ * the last group is flushed within the time.  Files are removed after
+ * the run, so none of them is dropped before it was written out.
+ **/
+static void bench_durable()
+{
+    Durable_Config config;
+    Durable_Stats before, after;
+    Strip_Format fmt;
+    Strip_Pipeline p;
+    char path[64], part[72];
+    int policy, i;
+
+    page_format (&page_300, SANE_FRAME_GRAY, 8, &fmt);
+    pipeline_init (&p);
+    printf("durability, %d pages %s gray, in the current directory\n", DURABLE_PAGES, page_300.name);
+    for (policy = DURABLE_NONE; policy <= DURABLE_WRITE_BEHIND; policy++)
+    {
+        int flags = WRITER_PREALLOCATE | ((policy == DURABLE_WRITE_BEHIND) ? WRITER_WRITE_BEHIND : 0);
+        double sec, mb = (double) fmt.bytes_per_line * fmt.lines * DURABLE_PAGES / 1e6;
+
+        durable_config_init (&config);
+        config.policy = policy;
+        durable_get_stats (&before);
+        sec = now_sec ();
+        for (i = 0; i < DURABLE_PAGES; i++)
+        {
+            File_Writer *fw;
+            Strip_Sink *pnm;
+            Durable_File f;
+
+            bench_page_path (path, sizeof (path), i);
+            snprintf (part, sizeof (part), "%s.part", path);
+            if (!(fw = file_writer_open (part, flags, 1)))
+                break;
+            pnm = pnm_sink_create (fw);
+            run_page (&p, &fmt, pnm);
+            file_writer_finish (fw);
+            f.fd = fw->fd;
+            f.from = part;
+            f.to = path;
+            durable_commit (&config, &f, 1);
+            file_writer_close (fw);
+            strip_sink_destroy (pnm);
+        }
+        durable_flush (NULL);
+        sec = now_sec () - sec;
+        durable_get_stats (&after);
+
+        printf("%-14s %7.3f s %7.1f pages/s %8.1f MB/s  %llu fsyncs, %llu commits\n",
+               durable_policy_name (policy), sec, DURABLE_PAGES / sec, mb / sec,
+               (unsigned long long) (after.fsyncs - before.fsyncs),
+               (unsigned long long) (after.groups - before.groups));
+        for (i = 0; i < DURABLE_PAGES; i++)
+        {
+            bench_page_path (path, sizeof (path), i);
+            remove (path);
+        }
+        sync ();
+    }
+    pipeline_release (&p);
+}
+
+#define SHM_BENCH_PAGES	8
+
+// Reads every record, as the consumer process would
+static void *shm_consumer(void *arg)
+{
+    Shm_Ring *ring = (Shm_Ring *)arg;
+    const Shm_Record *record;
+    const SANE_Byte *data;
+    int pages = 0;
+    uint32_t sum = 0;
+
+    while (pages < SHM_BENCH_PAGES && shm_ring_next (ring, &record, &data, 5.) == SANE_STATUS_GOOD)
+    {
+        if (record->bytes)
+            sum += data[0] + data[record->bytes - 1];
+        if (record->type == SHM_RECORD_END)
+            pages++;
+        shm_ring_release (ring);
+    }
+    return (void *)(uintptr_t) sum;
+}
+
+/**
+ * Pages published to a consumer thread; it maps the ring as another
+ * process would, so this is the copy and handoff cost of the ring.
+ **/
+static void bench_shm()
+{
+    static const int slots[] = { 2, SHM_RING_DEFAULT_SLOTS };
+    Strip_Pipeline p;
+    Strip_Format fmt;
+    int i, k;
+
+    page_format (&page_300, SANE_FRAME_RGB, 8, &fmt);
+    pipeline_init (&p);
+    for (i = 0; i < 2; i++)
+    {
+        Shm_Ring *ring = shm_ring_create ("/kylinBench", slots[i], SHM_RING_DEFAULT_SLOT_SIZE);
+        Shm_Ring *consumer = shm_ring_attach ("/kylinBench");
+        Strip_Sink *sink = shm_ring_sink_create (NULL, ring, 0.);
+        Shm_Ring_Stats stats;
+        pthread_t thread;
+        char what[64];
+        double sec = 0.;
+
+        if (!ring || !consumer || !sink)
+        {
+            printf("shared memory ring: cannot create /kylinBench\n");
+            strip_sink_destroy (sink);
+            shm_ring_detach (consumer);
+            shm_ring_destroy (ring);
+            break;
+        }
+        pthread_create (&thread, NULL, shm_consumer, consumer);
+        for (k = 0; k < SHM_BENCH_PAGES; k++)
+            sec += run_page (&p, &fmt, sink);
+        pthread_join (thread, NULL);
+        shm_ring_get_stats (ring, &stats);
+
+        snprintf (what, sizeof (what), "shm ring %d slots", slots[i]);
+        report (what, &fmt, sec / SHM_BENCH_PAGES);
+        printf("%-28s %llu records, %llu waits, %.1f ms waiting\n", "", (unsigned long long) stats.records,
+               (unsigned long long) stats.waits, stats.wait_ns / 1e6);
+
+        strip_sink_destroy (sink);
+        shm_ring_detach (consumer);
+        shm_ring_destroy (ring);
+    }
+    pipeline_release (&p);
+}
+
+/**
+ * One frame in sane_read sized chunks through the generic loop or the
+ * kernel; three-pass frames go into a page three times the size.
+ **/
+static double run_loop(const Strip_Format *fmt, int interleave, int generic)
+{
+    size_t total = (size_t) fmt->bytes_per_line * fmt->lines;
+    SANE_Byte *data = (SANE_Byte *)malloc (READ_SIZE);
+    uint8_t *image = interleave ? (uint8_t *)malloc (3 * total) : NULL;
+    Scan_Chunk_Kernel consume = scan_chunk_kernel (interleave);
+    Strip_Pipeline p;
+    Strip_Sink sink;
+    Scan_Chunk chunk;
+    size_t done = 0, offset = 0, i;
+    double start;
+
+    for (i = 0; i < READ_SIZE; i++)
+        data[i] = (SANE_Byte) rand ();
+    memset (&sink, 0, sizeof (sink));
+    sink.write = null_sink_write;
+    pipeline_init (&p);
+    pipeline_set_sink (&p, &sink);
+    scan_chunk_init (&chunk, &p);
+    chunk.image = image;
+
+    start = now_sec ();
+    if (!interleave)
+        pipeline_begin (&p, fmt);
+    while (done < total)
+    {
+        // the odd sizes sane_read returns
+        int n = READ_SIZE - (int) (done % 7);
+
+        if ((size_t) n > total - done)
+            n = total - done;
+        if (generic)
+            generic_chunk (&p, image, &offset, interleave, data, n);
+        else
+            consume (&chunk, data, n);
+        done += n;
+    }
+    if (!interleave)
+        pipeline_end (&p);
+    start = now_sec () - start;
+
+    pipeline_set_sink (&p, NULL);
+    pipeline_release (&p);
+    free (image);
+    free (data);
+    return start;
+}
+
+/**
+ * Only three-pass frames have a kernel of their own: one-pass chunks go
+ * straight to pipeline_push() in both loops, depth and byte order being
+ * handled further down, so there is nothing to compare for them.
+ **/
+static void bench_scanloop()
+{
+    Strip_Format fmt;
+    int generic;
+
+    printf("scan loop, %s, reference %.0f MB/s (USB 2.0)\n", page_1200.name, USB2_RATE);
+    page_format (&page_1200, SANE_FRAME_RED, 8, &fmt);
+    for (generic = 1; generic >= 0; generic--)
+        report (generic ? "three-pass 8-bit generic" : "three-pass 8-bit kernel", &fmt,
+                run_loop (&fmt, 1, generic));
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run) ();
+} Bench;
+
+static const Bench benches[] =
+{
+    { "lut", bench_lut },
+    { "blank", bench_blank },
+    { "stats", bench_stats },
+    { "scanloop", bench_scanloop },
+    { "digest", bench_digest },
+    { "writer", bench_writer },
+    { "durable", bench_durable },
+    { "shm", bench_shm },
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof (benches) / sizeof (benches[0]); i++)
+    {
+        if (argc < 2 || !strcmp (argv[1], benches[i].name))
+        {
+            benches[i].run ();
+            found = 1;
+        }
+    }
+    if (!found)
+    {
+        fprintf (stderr, "usage: %s [", argv[0]);
+        for (i = 0; i < sizeof (benches) / sizeof (benches[0]); i++)
+            fprintf (stderr, "%s%s", i ? "|" : "", benches[i].name);
+        fprintf (stderr, "]\n");
+        return 1;
+    }
+    return 0;
+}
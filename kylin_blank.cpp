@@ -0,0 +1,435 @@
+#include <string.h>
+
+#include "kylin_cpu.h"
+#include "kylin_blank.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLANK_TILE	32      /* tile edge in pixels for gray and RGB pages */
+
+typedef struct
+{
+    uint32_t sum;
+    uint32_t sumsq;
+} Blank_Tile;
+
+typedef struct
+{
+    Strip_Sink *next;
+    Blank_Config config;
+    Strip_Format fmt;
+    int x0, x1;             /* examined columns */
+    int y0, y1;             /* examined rows, y1 < 0: up to the end of the page */
+    uint64_t ink;           /* black pixels or ink tiles */
+    uint64_t area;          /* pixels or tiles examined */
+    uint64_t limit;         /* more ink than this and the page is not blank, 0: height unknown */
+    Blank_Tile *tiles;      /* the row of tiles being summed */
+    int n_tiles;
+    int tile_rows;          /* lines summed in tiles */
+    uint8_t *gray;          /* examined part of a line as 8-bit gray */
+    SANE_Byte *held;        /* start of the page, not passed on yet */
+    size_t held_size;
+    size_t held_len;
+    int deferring;
+    Blank_Result result;
+} Blank_Sink;
+
+void blank_config_init(Blank_Config *config)
+{
+    config->margin = 0.05;
+    config->max_coverage = 0.005;
+    config->noise = 10;
+    config->defer_bytes = 0;
+}
+
+/* -------------------------------------------- */
+// 1-bit pages: black pixels are set bits, the leftmost pixel is the high bit
+
+static uint64_t popcount_bytes(const uint8_t *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w;
+
+        memcpy (&w, p + i, 8);
+        count += __builtin_popcountll (w);
+    }
+    for (; i < n; i++)
+        count += __builtin_popcount (p[i]);
+    return count;
+}
+
+#ifdef KYLIN_X86
+// Bits of each nibble looked up with a byte shuffle, summed per 8 bytes
+__attribute__((target("avx2")))
+static uint64_t popcount_bytes_avx2(const uint8_t *p, size_t n)
+{
+    const __m256i nibble_bits = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8 (0x0f);
+    __m256i acc = _mm256_setzero_si256 ();
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)(p + i));
+        __m256i c = _mm256_add_epi8 (_mm256_shuffle_epi8 (nibble_bits, _mm256_and_si256 (v, low)),
+                                     _mm256_shuffle_epi8 (nibble_bits, _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low)));
+
+        acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (c, _mm256_setzero_si256 ()));
+    }
+    _mm256_storeu_si256 ((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_bytes (p + i, n - i);
+}
+#endif
+
+static uint64_t count_black(const Blank_Sink *b, const uint8_t *line)
+{
+    int first = b->x0 >> 3, last = (b->x1 - 1) >> 3;
+    uint8_t head = 0xff >> (b->x0 & 7);
+    uint8_t tail = 0xff << (7 - ((b->x1 - 1) & 7));
+    uint64_t count;
+
+    if (first == last)
+        return __builtin_popcount (line[first] & head & tail);
+
+    count = __builtin_popcount (line[first] & head) + __builtin_popcount (line[last] & tail);
+#ifdef KYLIN_X86
+    if (cpu_has_avx2 ())
+        return count + popcount_bytes_avx2 (line + first + 1, last - first - 1);
+#endif
+    return count + popcount_bytes (line + first + 1, last - first - 1);
+}
+
+/* -------------------------------------------- */
+// Gray and RGB pages: brightness variance per tile
+
+static void tile_sums(Blank_Tile *tiles, const uint8_t *px, int n)
+{
+    int i;
+
+    for (; n > 0; tiles++, px += BLANK_TILE, n -= BLANK_TILE)
+    {
+        int w = (n < BLANK_TILE) ? n : BLANK_TILE;
+
+        for (i = 0; i < w; i++)
+        {
+            tiles->sum += px[i];
+            tiles->sumsq += px[i] * px[i];
+        }
+    }
+}
+
+#ifdef KYLIN_X86
+__attribute__((target("avx2")))
+static void tile_sums_avx2(Blank_Tile *tiles, const uint8_t *px, int n)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+
+    for (; n >= BLANK_TILE; tiles++, px += BLANK_TILE, n -= BLANK_TILE)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)px);
+        __m256i lo = _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (v));
+        __m256i hi = _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (v, 1));
+        __m256i sum = _mm256_sad_epu8 (v, zero);
+        __m256i sq = _mm256_add_epi32 (_mm256_madd_epi16 (lo, lo), _mm256_madd_epi16 (hi, hi));
+        __m128i s, q;
+
+        s = _mm_add_epi64 (_mm256_castsi256_si128 (sum), _mm256_extracti128_si256 (sum, 1));
+        s = _mm_add_epi64 (s, _mm_unpackhi_epi64 (s, s));
+        q = _mm_add_epi32 (_mm256_castsi256_si128 (sq), _mm256_extracti128_si256 (sq, 1));
+        q = _mm_add_epi32 (q, _mm_unpackhi_epi64 (q, q));
+        q = _mm_add_epi32 (q, _mm_shuffle_epi32 (q, 0x55));
+        tiles->sum += (uint32_t) _mm_cvtsi128_si32 (s);
+        tiles->sumsq += (uint32_t) _mm_cvtsi128_si32 (q);
+    }
+    tile_sums (tiles, px, n);
+}
+#endif
+
+// The examined part of a line as 8-bit gray, RGB as (r + 2g + b) / 4
+static const uint8_t *gray_line(Blank_Sink *b, const SANE_Byte *line)
+{
+    int n = b->x1 - b->x0;
+    int i;
+
+    if (b->fmt.format == SANE_FRAME_GRAY)
+    {
+        const uint16_t *px = (const uint16_t *)line + b->x0;
+
+        if (b->fmt.depth == 8)
+            return line + b->x0;
+        for (i = 0; i < n; i++)
+            b->gray[i] = px[i] >> 8;
+    }
+    else if (b->fmt.depth == 8)
+    {
+        const uint8_t *px = line + 3 * b->x0;
+
+        for (i = 0; i < n; i++, px += 3)
+            b->gray[i] = (px[0] + 2 * px[1] + px[2] + 2) >> 2;
+    }
+    else
+    {
+        const uint16_t *px = (const uint16_t *)line + 3 * b->x0;
+
+        for (i = 0; i < n; i++, px += 3)
+            b->gray[i] = (px[0] + 2 * px[1] + px[2]) >> 10;
+    }
+    return b->gray;
+}
+
+// A tile is ink when its variance is above that of paper
+static void close_tiles(Blank_Sink *b)
+{
+    double noise = (double) b->config.noise * b->config.noise;
+    int t;
+
+    for (t = 0; t < b->n_tiles; t++)
+    {
+        int w = b->x1 - b->x0 - t * BLANK_TILE;
+        double n, mean;
+
+        if (w > BLANK_TILE)
+            w = BLANK_TILE;
+        n = (double) w * b->tile_rows;
+        mean = b->tiles[t].sum / n;
+        if (b->tiles[t].sumsq / n - mean * mean > noise)
+            b->ink++;
+        b->area++;
+    }
+    memset (b->tiles, 0, b->n_tiles * sizeof (Blank_Tile));
+    b->tile_rows = 0;
+}
+
+static void measure_line(Blank_Sink *b, const SANE_Byte *line)
+{
+    const uint8_t *gray;
+
+    if (b->fmt.depth == 1)
+    {
+        b->ink += count_black (b, line);
+        b->area += b->x1 - b->x0;
+        return;
+    }
+
+    gray = gray_line (b, line);
+#ifdef KYLIN_X86
+    if (cpu_has_avx2 ())
+        tile_sums_avx2 (b->tiles, gray, b->x1 - b->x0);
+    else
+#endif
+        tile_sums (b->tiles, gray, b->x1 - b->x0);
+    if (++b->tile_rows == BLANK_TILE)
+        close_tiles (b);
+}
+
+/* -------------------------------------------- */
+// Sink
+
+// Start the page on the next sink; what was held back goes as one strip
+static SANE_Status blank_release(Blank_Sink *b)
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    b->deferring = 0;
+    if (b->next->begin)
+        status = b->next->begin (b->next, &b->fmt);
+    if (status == SANE_STATUS_GOOD && b->held_len)
+    {
+        Strip strip;
+
+        memset (&strip, 0, sizeof (strip));
+        strip.data = b->held;
+        strip.size = b->held_size;
+        strip.lines = b->held_len / b->fmt.bytes_per_line;
+        status = b->next->write (b->next, &strip);
+    }
+    b->held_len = 0;
+    return status;
+}
+
+static SANE_Status blank_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Blank_Sink *b = (Blank_Sink *)sink->priv;
+    int margin = (int)(b->config.margin * fmt->pixels_per_line);
+    int width;
+
+    if (fmt->format == SANE_FRAME_RGB && fmt->depth == 1)
+        return SANE_STATUS_UNSUPPORTED;
+
+    b->fmt = *fmt;
+    b->x0 = margin;
+    b->x1 = fmt->pixels_per_line - margin;
+    if (b->x1 <= b->x0)
+    {
+        b->x0 = 0;
+        b->x1 = fmt->pixels_per_line;
+    }
+    width = b->x1 - b->x0;
+
+    // the side margin stands in for the top one while the height is unknown
+    b->y0 = margin;
+    b->y1 = -1;
+    b->limit = 0;
+    if (fmt->lines >= 0)
+    {
+        b->y0 = (int)(b->config.margin * fmt->lines);
+        b->y1 = fmt->lines - b->y0;
+        if (b->y1 <= b->y0)
+        {
+            b->y0 = 0;
+            b->y1 = fmt->lines;
+        }
+        if (fmt->depth == 1)
+            b->limit = (uint64_t)(b->config.max_coverage * width * (b->y1 - b->y0));
+        else
+            b->limit = (uint64_t)(b->config.max_coverage * ((width + BLANK_TILE - 1) / BLANK_TILE)
+                                  * ((b->y1 - b->y0 + BLANK_TILE - 1) / BLANK_TILE));
+    }
+
+    b->ink = b->area = 0;
+    b->tile_rows = 0;
+    if (fmt->depth != 1)
+    {
+        b->n_tiles = (width + BLANK_TILE - 1) / BLANK_TILE;
+        free (b->tiles);
+        free (b->gray);
+        b->tiles = (Blank_Tile *)calloc (b->n_tiles, sizeof (Blank_Tile));
+        b->gray = (uint8_t *)malloc (width);
+        if (!b->tiles || !b->gray)
+            return SANE_STATUS_NO_MEM;
+    }
+
+    memset (&b->result, 0, sizeof (b->result));
+    b->held_len = 0;
+    b->deferring = (b->config.defer_bytes > 0);
+    if (b->deferring || !b->next->begin)
+        return SANE_STATUS_GOOD;
+    return b->next->begin (b->next, fmt);
+}
+
+static SANE_Status blank_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Blank_Sink *b = (Blank_Sink *)sink->priv;
+    size_t len = (size_t) strip->lines * b->fmt.bytes_per_line;
+    SANE_Status status;
+    int line;
+
+    for (line = 0; line < strip->lines; line++)
+    {
+        int y = strip->y + line;
+
+        if (y < b->y0 || (b->y1 >= 0 && y >= b->y1))
+            continue;
+        measure_line (b, strip->data + (size_t) line * b->fmt.bytes_per_line);
+    }
+
+    if (b->deferring)
+    {
+        if (b->held_len + len <= b->config.defer_bytes && (b->limit == 0 || b->ink <= b->limit))
+        {
+            if (b->held_size < b->held_len + len)
+            {
+                SANE_Byte *held = (SANE_Byte *)realloc (b->held, b->config.defer_bytes);
+                if (!held)
+                    return SANE_STATUS_NO_MEM;
+                b->held = held;
+                b->held_size = b->config.defer_bytes;
+            }
+            memcpy (b->held + b->held_len, strip->data, len);
+            b->held_len += len;
+            return SANE_STATUS_GOOD;
+        }
+        // ink found, or too much to hold: this page gets written
+        status = blank_release (b);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    return b->next->write (b->next, strip);
+}
+
+static SANE_Status blank_sink_end(Strip_Sink *sink, int lines)
+{
+    Blank_Sink *b = (Blank_Sink *)sink->priv;
+    SANE_Status status;
+
+    if (b->tile_rows)
+        close_tiles (b);
+    b->result.coverage = b->area ? (double) b->ink / b->area : 0.;
+    b->result.blank = (b->result.coverage < b->config.max_coverage);
+    b->result.lines = lines;
+    b->result.written = 1;
+
+    if (b->deferring)
+    {
+        if (b->result.blank)
+        {
+            b->result.written = 0;
+            b->held_len = 0;
+            b->deferring = 0;
+            return SANE_STATUS_GOOD;
+        }
+        status = blank_release (b);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    if (!b->next->end)
+        return SANE_STATUS_GOOD;
+    return b->next->end (b->next, lines);
+}
+
+static void blank_sink_destroy(Strip_Sink *sink)
+{
+    Blank_Sink *b = (Blank_Sink *)sink->priv;
+
+    free (b->tiles);
+    free (b->gray);
+    free (b->held);
+    free (b);
+    free (sink);
+}
+
+Strip_Sink *blank_sink_create(Strip_Sink *next, const Blank_Config *config)
+{
+    Strip_Sink *sink;
+    Blank_Sink *b;
+
+    if (!next)
+        return NULL;
+    sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    b = (Blank_Sink *)calloc (1, sizeof (Blank_Sink));
+    if (!sink || !b)
+    {
+        free (sink);
+        free (b);
+        return NULL;
+    }
+    b->next = next;
+    if (config)
+        b->config = *config;
+    else
+        blank_config_init (&b->config);
+
+    sink->begin = blank_sink_begin;
+    sink->write = blank_sink_write;
+    sink->end = blank_sink_end;
+    sink->destroy = blank_sink_destroy;
+    sink->priv = b;
+    return sink;
+}
+
+void blank_sink_result(Strip_Sink *sink, Blank_Result *result)
+{
+    *result = ((Blank_Sink *)sink->priv)->result;
+}
+
+#ifdef __cplusplus
+}
+#endif
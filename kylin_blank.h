@@ -0,0 +1,50 @@
+#ifndef KYLIN_BLANK_H
+#define KYLIN_BLANK_H
+
+#include <stddef.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Blank page detection while the page is written.  Ink is measured inside
+ * the margins: for 1-bit pages as the share of black pixels, for gray and
+ * RGB pages as the share of 32x32 tiles whose brightness varies more than
+ * paper does.  A page with less ink than max_coverage is blank.
+ **/
+typedef struct
+{
+    double margin;          /* part of width and height skipped on every side, 0 .. 0.5 */
+    double max_coverage;    /* 0 .. 1 */
+    int noise;              /* standard deviation of a paper tile, in 8-bit levels */
+    size_t defer_bytes;     /* hold back up to this much of a page until it has ink, 0: don't */
+} Blank_Config;
+
+typedef struct
+{
+    int blank;
+    double coverage;        /* black pixels or ink tiles over the examined area */
+    int lines;
+    int written;            /* the page went on to the next sink */
+} Blank_Result;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void blank_config_init(Blank_Config *config);
+
+/**
+ * Sink passing pages on to next and measuring them on the way.  With
+ * defer_bytes the page is only passed on once ink is found or more than
+ * defer_bytes arrived; a blank page that fits never reaches next at all.
+ * next stays owned by the caller.
+ **/
+Strip_Sink *blank_sink_create(Strip_Sink *next, const Blank_Config *config);
+// Result of the last page that ended on the sink
+void blank_sink_result(Strip_Sink *sink, Blank_Result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,653 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "kylin_capture.h"
+#include "kylin_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------- */
+// Straight to SANE
+
+const Scan_Backend sane_backend =
+{
+    "sane",
+    sane_start,
+    sane_get_parameters,
+    sane_read,
+    sane_cancel,
+    sane_set_io_mode,
+    sane_get_select_fd
+};
+
+/* -------------------------------------------- */
+// Recorder
+
+typedef struct
+{
+    pthread_mutex_t lock;   /* cancel comes from other threads */
+    FILE *fp;
+    double origin;
+    Capture_Header header;
+    SANE_Byte *block;       /* stream bytes not yet deflated */
+    size_t fill;
+    Bytef *deflated;
+    uLongf deflated_size;
+    Capture_Block *blocks;
+    size_t alloc_blocks;
+    Capture_Event *events;
+    size_t alloc_events;
+    int failed;
+} Capture;
+
+static Capture capture = { PTHREAD_MUTEX_INITIALIZER };
+
+// Called with the lock held
+static void flush_block()
+{
+    Capture_Block *b;
+    uLongf size = capture.deflated_size;
+
+    if (!capture.fill || capture.failed)
+        return;
+    if (capture.header.n_blocks == capture.alloc_blocks)
+    {
+        size_t alloc = capture.alloc_blocks ? 2 * capture.alloc_blocks : 64;
+
+        b = (Capture_Block *)realloc (capture.blocks, alloc * sizeof (Capture_Block));
+        if (!b)
+        {
+            capture.failed = 1;
+            return;
+        }
+        capture.blocks = b;
+        capture.alloc_blocks = alloc;
+    }
+    // fast level, this runs between reads
+    if (compress2 (capture.deflated, &size, capture.block, capture.fill, 1) != Z_OK)
+    {
+        capture.failed = 1;
+        return;
+    }
+    b = &capture.blocks[capture.header.n_blocks++];
+    b->offset = ftell (capture.fp);
+    b->compressed = size;
+    b->bytes = capture.fill;
+    if (fwrite (capture.deflated, 1, size, capture.fp) != size)
+        capture.failed = 1;
+    capture.fill = 0;
+}
+
+// Called with the lock held; returns the stream offset of data
+static uint64_t append_stream(const void *data, size_t len)
+{
+    uint64_t offset = capture.header.stream_bytes;
+    const SANE_Byte *p = (const SANE_Byte *)data;
+
+    while (len && !capture.failed)
+    {
+        size_t n = CAPTURE_BLOCK - capture.fill;
+
+        if (n > len)
+            n = len;
+        memcpy (capture.block + capture.fill, p, n);
+        capture.fill += n;
+        capture.header.stream_bytes += n;
+        p += n;
+        len -= n;
+        if (capture.fill == CAPTURE_BLOCK)
+            flush_block ();
+    }
+    return offset;
+}
+
+static void add_event(uint32_t kind, SANE_Status status, double start, const void *data, size_t len)
+{
+    Capture_Event *e;
+    double end = now_sec ();
+
+    pthread_mutex_lock (&capture.lock);
+    if (!capture.fp || capture.failed)
+    {
+        pthread_mutex_unlock (&capture.lock);
+        return;
+    }
+    if (capture.header.n_events == capture.alloc_events)
+    {
+        size_t alloc = capture.alloc_events ? 2 * capture.alloc_events : 4096;
+
+        e = (Capture_Event *)realloc (capture.events, alloc * sizeof (Capture_Event));
+        if (!e)
+        {
+            capture.failed = 1;
+            pthread_mutex_unlock (&capture.lock);
+            return;
+        }
+        capture.events = e;
+        capture.alloc_events = alloc;
+    }
+    e = &capture.events[capture.header.n_events++];
+    memset (e, 0, sizeof (*e));
+    e->kind = kind;
+    e->status = status;
+    e->time = end - capture.origin;
+    e->duration = end - start;
+    e->offset = capture.header.stream_bytes;
+    e->length = len;
+    if (len)
+        append_stream (data, len);
+    pthread_mutex_unlock (&capture.lock);
+}
+
+static SANE_Status record_start(SANE_Handle handle)
+{
+    double start = now_sec ();
+    SANE_Status status = sane_start (handle);
+
+    add_event (CAPTURE_START, status, start, NULL, 0);
+    return status;
+}
+
+static SANE_Status record_get_parameters(SANE_Handle handle, SANE_Parameters *parm)
+{
+    double start = now_sec ();
+    SANE_Status status = sane_get_parameters (handle, parm);
+
+    add_event (CAPTURE_PARAMETERS, status, start, parm, (status == SANE_STATUS_GOOD) ? sizeof (*parm) : 0);
+    return status;
+}
+
+static SANE_Status record_read(SANE_Handle handle, SANE_Byte *data, SANE_Int max_length, SANE_Int *length)
+{
+    double start = now_sec ();
+    SANE_Status status = sane_read (handle, data, max_length, length);
+
+    add_event (CAPTURE_READ, status, start, data, (*length > 0) ? *length : 0);
+    return status;
+}
+
+static void record_cancel(SANE_Handle handle)
+{
+    double start = now_sec ();
+
+    sane_cancel (handle);
+    add_event (CAPTURE_CANCEL, SANE_STATUS_GOOD, start, NULL, 0);
+}
+
+static const Scan_Backend capture_backend =
+{
+    "capture",
+    record_start,
+    record_get_parameters,
+    record_read,
+    record_cancel,
+    sane_set_io_mode,
+    sane_get_select_fd
+};
+
+static void write_options(SANE_Handle handle)
+{
+    const SANE_Option_Descriptor *opt;
+    Capture_Option o;
+    SANE_Int count = 0;
+    void *value;
+    int i;
+
+    if (sane_control_option (handle, 0, SANE_ACTION_GET_VALUE, &count, NULL) != SANE_STATUS_GOOD)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        static const char pad[4] = { 0 };
+
+        opt = sane_get_option_descriptor (handle, i);
+        if (!opt)
+            continue;
+        memset (&o, 0, sizeof (o));
+        snprintf (o.name, sizeof (o.name), "%s", opt->name ? opt->name : "");
+        o.type = opt->type;
+        o.unit = opt->unit;
+        o.size = opt->size;
+        o.cap = opt->cap;
+        o.constraint_type = opt->constraint_type;
+        if (opt->constraint_type == SANE_CONSTRAINT_RANGE)
+        {
+            o.range[0] = opt->constraint.range->min;
+            o.range[1] = opt->constraint.range->max;
+            o.range[2] = opt->constraint.range->quant;
+        }
+        value = NULL;
+        if (opt->size > 0 && opt->type != SANE_TYPE_BUTTON && opt->type != SANE_TYPE_GROUP
+            && SANE_OPTION_IS_ACTIVE (opt->cap))
+        {
+            value = calloc (1, opt->size);
+            if (value && sane_control_option (handle, i, SANE_ACTION_GET_VALUE, value, NULL) == SANE_STATUS_GOOD)
+                o.value_length = opt->size;
+        }
+        fwrite (&o, sizeof (o), 1, capture.fp);
+        if (o.value_length)
+        {
+            fwrite (value, 1, o.value_length, capture.fp);
+            fwrite (pad, 1, (4 - o.value_length % 4) % 4, capture.fp);
+        }
+        free (value);
+        capture.header.n_options++;
+    }
+}
+
+const Scan_Backend *capture_begin(const char *path, SANE_Handle handle)
+{
+    capture_end ();
+    pthread_mutex_lock (&capture.lock);
+    capture.fp = fopen (path, "wb");
+    capture.block = (SANE_Byte *)malloc (CAPTURE_BLOCK);
+    capture.deflated_size = compressBound (CAPTURE_BLOCK);
+    capture.deflated = (Bytef *)malloc (capture.deflated_size);
+    if (!capture.fp || !capture.block || !capture.deflated)
+    {
+        if (capture.fp)
+            fclose (capture.fp);
+        capture.fp = NULL;
+        free (capture.block);
+        free (capture.deflated);
+        pthread_mutex_unlock (&capture.lock);
+        return NULL;
+    }
+    memset (&capture.header, 0, sizeof (capture.header));
+    memcpy (capture.header.magic, CAPTURE_MAGIC, 8);
+    capture.header.version = CAPTURE_VERSION;
+    capture.fill = 0;
+    capture.failed = 0;
+    fwrite (&capture.header, sizeof (capture.header), 1, capture.fp);
+    capture.header.options_offset = sizeof (capture.header);
+    write_options (handle);
+    capture.origin = now_sec ();
+    pthread_mutex_unlock (&capture.lock);
+    return &capture_backend;
+}
+
+// Pad the file to a multiple of 8 and return the offset
+static uint64_t align_file()
+{
+    static const char pad[8] = { 0 };
+    long pos = ftell (capture.fp);
+
+    fwrite (pad, 1, (8 - pos % 8) % 8, capture.fp);
+    return ftell (capture.fp);
+}
+
+SANE_Status capture_end()
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    pthread_mutex_lock (&capture.lock);
+    if (!capture.fp)
+    {
+        pthread_mutex_unlock (&capture.lock);
+        return SANE_STATUS_GOOD;
+    }
+    flush_block ();
+    capture.header.blocks_offset = align_file ();
+    fwrite (capture.blocks, sizeof (Capture_Block), capture.header.n_blocks, capture.fp);
+    capture.header.index_offset = align_file ();
+    fwrite (capture.events, sizeof (Capture_Event), capture.header.n_events, capture.fp);
+    if (capture.failed || fseek (capture.fp, 0, SEEK_SET) != 0
+        || fwrite (&capture.header, sizeof (capture.header), 1, capture.fp) != 1)
+        status = SANE_STATUS_IO_ERROR;
+    if (fclose (capture.fp) != 0)
+        status = SANE_STATUS_IO_ERROR;
+    log_info("capture: %lu events, %lu bytes of data in %lu blocks\n", (unsigned long) capture.header.n_events,
+             (unsigned long) capture.header.stream_bytes, (unsigned long) capture.header.n_blocks);
+    capture.fp = NULL;
+    free (capture.block);
+    free (capture.deflated);
+    free (capture.blocks);
+    free (capture.events);
+    capture.block = NULL;
+    capture.deflated = NULL;
+    capture.blocks = NULL;
+    capture.events = NULL;
+    capture.alloc_blocks = capture.alloc_events = 0;
+    pthread_mutex_unlock (&capture.lock);
+    return status;
+}
+
+/* -------------------------------------------- */
+// Replay
+
+struct Replay
+{
+    uint8_t *base;          /* the whole file, mapped */
+    size_t size;
+    const Capture_Header *header;
+    const Capture_Block *blocks;
+    const Capture_Event *events;
+    uint64_t next;          /* event */
+    uint32_t used;          /* bytes of a split read already returned */
+    int cancelled;
+    double speed;
+    double origin;          /* when the replay of the first start began */
+    double recorded_origin; /* and when that start was called in the recording */
+    uint8_t *block;         /* inflated block */
+    int64_t block_index;
+};
+
+static Replay *replaying = NULL;
+
+// Whether count entries of size bytes at offset lie in the file
+static int in_file(const Replay *r, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset <= r->size && count <= (r->size - offset) / size;
+}
+
+/**
+ * Everything replay_option() and read_stream() rely on: a damaged or
+ * truncated capture is refused here instead of read past the mapping.
+ **/
+static int check_capture(const Replay *r)
+{
+    const Capture_Header *h = r->header;
+    uint64_t offset = h->options_offset, i;
+
+    if (memcmp (h->magic, CAPTURE_MAGIC, 8) || h->version != CAPTURE_VERSION
+        || !in_file (r, h->index_offset, h->n_events, sizeof (Capture_Event))
+        || !in_file (r, h->blocks_offset, h->n_blocks, sizeof (Capture_Block))
+        || h->stream_bytes > h->n_blocks * (uint64_t) CAPTURE_BLOCK)
+        return 0;
+    for (i = 0; i < h->n_options; i++)
+    {
+        const Capture_Option *o = (const Capture_Option *)(r->base + offset);
+
+        if (!in_file (r, offset, 1, sizeof (Capture_Option))
+            || !in_file (r, offset + sizeof (Capture_Option), (o->value_length + 3ull) / 4 * 4, 1))
+            return 0;
+        offset += sizeof (Capture_Option) + (o->value_length + 3ull) / 4 * 4;
+    }
+    for (i = 0; i < h->n_blocks; i++)
+    {
+        const Capture_Block *b = (const Capture_Block *)(r->base + h->blocks_offset) + i;
+
+        if (!in_file (r, b->offset, b->compressed, 1) || b->bytes > CAPTURE_BLOCK)
+            return 0;
+    }
+    for (i = 0; i < h->n_events; i++)
+    {
+        const Capture_Event *e = (const Capture_Event *)(r->base + h->index_offset) + i;
+
+        if (e->offset > h->stream_bytes || e->length > h->stream_bytes - e->offset)
+            return 0;
+    }
+    return 1;
+}
+
+Replay *replay_open(const char *path, double speed)
+{
+    struct stat st;
+    Replay *r;
+    int fd = open (path, O_RDONLY);
+    void *base;
+
+    if (fd < 0)
+        return NULL;
+    if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (Capture_Header))
+    {
+        close (fd);
+        return NULL;
+    }
+    base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    r = (Replay *)calloc (1, sizeof (Replay));
+    if (!r)
+    {
+        munmap (base, st.st_size);
+        return NULL;
+    }
+    r->base = (uint8_t *)base;
+    r->size = st.st_size;
+    r->header = (const Capture_Header *)base;
+    r->speed = speed;
+    r->block_index = -1;
+    if (!check_capture (r) || !(r->block = (uint8_t *)malloc (CAPTURE_BLOCK)))
+    {
+        log_error("replay: %s is not a capture\n", path);
+        replay_close (r);
+        return NULL;
+    }
+    r->blocks = (const Capture_Block *)(r->base + r->header->blocks_offset);
+    r->events = (const Capture_Event *)(r->base + r->header->index_offset);
+    return r;
+}
+
+void replay_close(Replay *replay)
+{
+    if (!replay)
+        return;
+    if (replaying == replay)
+        replaying = NULL;
+    munmap (replay->base, replay->size);
+    free (replay->block);
+    free (replay);
+}
+
+int replay_pending(const Replay *replay)
+{
+    uint64_t i;
+
+    for (i = replay->next; i < replay->header->n_events; i++)
+        if (replay->events[i].kind == CAPTURE_START)
+            return 1;
+    return 0;
+}
+
+const Capture_Header *replay_header(const Replay *replay)
+{
+    return replay->header;
+}
+
+const Capture_Option *replay_option(const Replay *replay, int index, const void **value)
+{
+    const uint8_t *p = replay->base + replay->header->options_offset;
+    const Capture_Option *o;
+    int i;
+
+    if (index < 0 || (uint32_t) index >= replay->header->n_options)
+        return NULL;
+    for (i = 0; ; i++)
+    {
+        o = (const Capture_Option *)p;
+        if (i == index)
+            break;
+        p += sizeof (Capture_Option) + (o->value_length + 3) / 4 * 4;
+    }
+    if (value)
+        *value = o->value_length ? (const void *)(o + 1) : NULL;
+    return o;
+}
+
+// Copy len bytes of the stream from offset
+static SANE_Status read_stream(Replay *r, uint64_t offset, SANE_Byte *data, size_t len)
+{
+    while (len)
+    {
+        int64_t index = offset / CAPTURE_BLOCK;
+        size_t in_block = offset % CAPTURE_BLOCK, n;
+
+        if ((uint64_t) index >= r->header->n_blocks)
+            return SANE_STATUS_IO_ERROR;
+        if (index != r->block_index)
+        {
+            const Capture_Block *b = &r->blocks[index];
+            uLongf size = CAPTURE_BLOCK;
+
+            if (uncompress (r->block, &size, r->base + b->offset, b->compressed) != Z_OK || size != b->bytes)
+                return SANE_STATUS_IO_ERROR;
+            r->block_index = index;
+        }
+        // a block short of CAPTURE_BLOCK ends the stream
+        if (in_block >= r->blocks[index].bytes)
+            return SANE_STATUS_IO_ERROR;
+        n = r->blocks[index].bytes - in_block;
+        if (n > len)
+            n = len;
+        memcpy (data, r->block + in_block, n);
+        data += n;
+        offset += n;
+        len -= n;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+// Next event of kind, after any recorded cancel; NULL when the recording does not go on like this
+static const Capture_Event *next_event(Replay *r, uint32_t kind)
+{
+    const Capture_Event *e;
+
+    while (r->next < r->header->n_events && r->events[r->next].kind == CAPTURE_CANCEL)
+        r->next++;
+    if (r->next >= r->header->n_events)
+        return NULL;
+    e = &r->events[r->next];
+    if (e->kind != kind)
+    {
+        log_error("replay: event %lu is of kind %u, not %u\n", (unsigned long) r->next, e->kind, kind);
+        return NULL;
+    }
+    return e;
+}
+
+// Keep the recorded pace
+static void wait_for(Replay *r, const Capture_Event *e)
+{
+    double delay;
+
+    if (r->speed <= 0.)
+        return;
+    delay = r->origin + (e->time - r->recorded_origin) / r->speed - now_sec ();
+    if (delay > 0.)
+        usleep ((useconds_t) (delay * 1e6));
+}
+
+static SANE_Status replay_start(SANE_Handle)
+{
+    Replay *r = replaying;
+    const Capture_Event *e;
+
+    // whatever the last frame left unread
+    while (r->next < r->header->n_events && r->events[r->next].kind != CAPTURE_START)
+        r->next++;
+    r->used = 0;
+    r->cancelled = 0;
+    e = next_event (r, CAPTURE_START);
+    if (!e)
+        return SANE_STATUS_NO_DOCS;
+    if (r->origin == 0.)
+    {
+        r->origin = now_sec ();
+        r->recorded_origin = e->time - e->duration;
+    }
+    wait_for (r, e);
+    r->next++;
+    return (SANE_Status) e->status;
+}
+
+static SANE_Status replay_get_parameters(SANE_Handle, SANE_Parameters *parm)
+{
+    Replay *r = replaying;
+    const Capture_Event *e = next_event (r, CAPTURE_PARAMETERS);
+
+    if (!e)
+        return SANE_STATUS_INVAL;
+    r->next++;
+    if (e->status != SANE_STATUS_GOOD)
+        return (SANE_Status) e->status;
+    if (e->length != sizeof (*parm))
+        return SANE_STATUS_INVAL;
+    return read_stream (r, e->offset, (SANE_Byte *)parm, sizeof (*parm));
+}
+
+static SANE_Status replay_read(SANE_Handle, SANE_Byte *data, SANE_Int max_length, SANE_Int *length)
+{
+    Replay *r = replaying;
+    const Capture_Event *e;
+    SANE_Status status;
+    uint32_t n;
+
+    *length = 0;
+    if (__atomic_load_n (&r->cancelled, __ATOMIC_ACQUIRE))
+        return SANE_STATUS_CANCELLED;
+    e = next_event (r, CAPTURE_READ);
+    if (!e)
+        return SANE_STATUS_IO_ERROR;
+    if (!r->used)
+        wait_for (r, e);
+    n = e->length - r->used;
+    if (n > (uint32_t) max_length)
+        n = max_length;
+    status = read_stream (r, e->offset + r->used, data, n);
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    *length = n;
+    r->used += n;
+    if (r->used == e->length)
+    {
+        r->used = 0;
+        r->next++;
+    }
+    return (SANE_Status) e->status;
+}
+
+static void replay_cancel(SANE_Handle)
+{
+    if (replaying)
+        __atomic_store_n (&replaying->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+static SANE_Status replay_set_io_mode(SANE_Handle, SANE_Bool non_blocking)
+{
+    return non_blocking ? SANE_STATUS_UNSUPPORTED : SANE_STATUS_GOOD;
+}
+
+static SANE_Status replay_get_select_fd(SANE_Handle, SANE_Int *)
+{
+    return SANE_STATUS_UNSUPPORTED;
+}
+
+static const Scan_Backend replay_backend_calls =
+{
+    "replay",
+    replay_start,
+    replay_get_parameters,
+    replay_read,
+    replay_cancel,
+    replay_set_io_mode,
+    replay_get_select_fd
+};
+
+const Scan_Backend *replay_backend(Replay *replay)
+{
+    replaying = replay;
+    return &replay_backend_calls;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,117 @@
+#ifndef KYLIN_CAPTURE_H
+#define KYLIN_CAPTURE_H
+
+#include <stdint.h>
+
+#include "sane/sane.h"
+
+/**
+ * Calls the scan path makes to the device, so they can go to SANE, to a
+ * recorder in front of SANE, or to a replay of a recording.
+ **/
+typedef struct
+{
+    const char *name;
+    SANE_Status (*start) (SANE_Handle handle);
+    SANE_Status (*get_parameters) (SANE_Handle handle, SANE_Parameters *parm);
+    SANE_Status (*read) (SANE_Handle handle, SANE_Byte *data, SANE_Int max_length, SANE_Int *length);
+    void (*cancel) (SANE_Handle handle);
+    SANE_Status (*set_io_mode) (SANE_Handle handle, SANE_Bool non_blocking);
+    SANE_Status (*get_select_fd) (SANE_Handle handle, SANE_Int *fd);
+} Scan_Backend;
+
+/**
+ * Capture file: the option descriptors and values of the device when the
+ * capture started, then every call of the scan path with its status, the
+ * time it returned and how long it took.  Parameters and read data go to
+ * one byte stream, deflated in blocks of CAPTURE_BLOCK bytes.  The block
+ * table and the fixed-size event index follow at the end and can be
+ * mapped in place; the header, rewritten on close, points at them.
+ **/
+#define CAPTURE_MAGIC	"KSANECAP"
+#define CAPTURE_VERSION	1
+#define CAPTURE_BLOCK	(1024 * 1024)
+
+enum capture_kind
+{
+    CAPTURE_START = 1,
+    CAPTURE_PARAMETERS,     /* a SANE_Parameters in the stream */
+    CAPTURE_READ,
+    CAPTURE_CANCEL
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t n_options;
+    uint64_t options_offset;
+    uint64_t blocks_offset;
+    uint64_t n_blocks;
+    uint64_t index_offset;
+    uint64_t n_events;
+    uint64_t stream_bytes;
+} Capture_Header;
+
+typedef struct
+{
+    uint64_t offset;        /* in the file */
+    uint32_t compressed;
+    uint32_t bytes;
+} Capture_Block;
+
+typedef struct
+{
+    uint32_t kind;
+    int32_t status;
+    double time;            /* s from the start of the capture to the return */
+    double duration;        /* s in the call */
+    uint64_t offset;        /* of the data in the stream */
+    uint32_t length;
+    uint32_t reserved;
+} Capture_Event;
+
+typedef struct
+{
+    char name[64];
+    int32_t type;
+    int32_t unit;
+    int32_t size;
+    int32_t cap;
+    int32_t constraint_type;
+    SANE_Word range[3];     /* min, max, quant of a range constraint */
+    uint32_t value_length;  /* value bytes that follow, 0 if it could not be read */
+} Capture_Option;
+
+typedef struct Replay Replay;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const Scan_Backend sane_backend;
+
+// Record the options of handle now and, through the returned backend, the scan calls
+const Scan_Backend *capture_begin(const char *path, SANE_Handle handle);
+SANE_Status capture_end();
+
+/**
+ * Play a capture back.  With speed 1 every call returns when it did in
+ * the recording, relative to the first sane_start; 0 plays as fast as
+ * possible.  Reads return the recorded chunks, split if the buffer is
+ * smaller than the chunk.
+ **/
+Replay *replay_open(const char *path, double speed);
+void replay_close(Replay *replay);
+// Backend playing replay
+const Scan_Backend *replay_backend(Replay *replay);
+// More recorded frames to start
+int replay_pending(const Replay *replay);
+const Capture_Header *replay_header(const Replay *replay);
+const Capture_Option *replay_option(const Replay *replay, int index, const void **value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef KYLIN_CPU_H
+#define KYLIN_CPU_H
+
+/**
+ * Runtime CPU feature checks for the vector kernels.  The kernels are
+ * compiled with target attributes, so the build itself needs no -m flags.
+ **/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KYLIN_X86 1
+
+static inline int cpu_has_avx2()
+{
+    static int has = -1;
+
+    if (has < 0)
+    {
+        __builtin_cpu_init ();
+        has = __builtin_cpu_supports ("avx2") ? 1 : 0;
+    }
+    return has;
+}
+
+static inline int cpu_has_sse42()
+{
+    static int has = -1;
+
+    if (has < 0)
+    {
+        __builtin_cpu_init ();
+        has = __builtin_cpu_supports ("sse4.2") ? 1 : 0;
+    }
+    return has;
+}
+#endif
+
+#endif
@@ -0,0 +1,313 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kylin_cpu.h"
+#include "kylin_digest.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRC32C_POLY	0x82f63b78u     /* Castagnoli, reflected */
+
+#define XXH_PRIME1	0x9e3779b185ebca87ull
+#define XXH_PRIME2	0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3	0x165667b19e3779f9ull
+#define XXH_PRIME4	0x85ebca77c2b2ae63ull
+#define XXH_PRIME5	0x27d4eb2f165667c5ull
+
+static const char *digest_names[] = { NULL, "crc32c", "xxh64" };
+
+/* -------------------------------------------- */
+// CRC32C
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables()
+{
+    uint32_t c;
+    int n, k;
+
+    for (n = 0; n < 256; n++)
+    {
+        c = n;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    // slicing by 8: table k advances a byte k positions further
+    for (n = 0; n < 256; n++)
+    {
+        c = crc_table[0][n];
+        for (k = 1; k < 8; k++)
+        {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+}
+
+// c is the running register, not the finished CRC
+static uint32_t crc_bytes(uint32_t c, const uint8_t *p, size_t n)
+{
+#if !defined(WORDS_BIGENDIAN)
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t w;
+
+        memcpy (&w, p, 8);
+        w ^= c;
+        c = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff]
+            ^ crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff]
+            ^ crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff]
+            ^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+#endif
+    for (; n; p++, n--)
+        c = crc_table[0][(c ^ *p) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#ifdef KYLIN_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_bytes_sse42(uint32_t c, const uint8_t *p, size_t n)
+{
+#ifdef __x86_64__
+    uint64_t c64 = c;
+
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t w;
+
+        memcpy (&w, p, 8);
+        c64 = _mm_crc32_u64 (c64, w);
+    }
+    c = (uint32_t) c64;
+#endif
+    for (; n; p++, n--)
+        c = _mm_crc32_u8 (c, *p);
+    return c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+#ifdef KYLIN_X86
+    if (cpu_has_sse42 ())
+        return ~crc_bytes_sse42 (~crc, p, len);
+#endif
+    pthread_once (&crc_once, crc_tables);
+    return ~crc_bytes (~crc, p, len);
+}
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_times (mat, mat[n]);
+}
+
+// As zlib's crc32_combine(): crc_a is run through len_b zero bytes by squaring
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+    uint32_t even[32], odd[32], row = 1;
+    int n;
+
+    if (!len_b)
+        return crc_a;
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    gf2_square (even, odd);
+    gf2_square (odd, even);
+    while (1)
+    {
+        gf2_square (even, odd);
+        if (len_b & 1)
+            crc_a = gf2_times (even, crc_a);
+        if (!(len_b >>= 1))
+            break;
+        gf2_square (odd, even);
+        if (len_b & 1)
+            crc_a = gf2_times (odd, crc_a);
+        if (!(len_b >>= 1))
+            break;
+    }
+    return crc_a ^ crc_b;
+}
+
+/* -------------------------------------------- */
+// XXH64
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy (&v, p, 8);
+#if defined(WORDS_BIGENDIAN)
+    v = __builtin_bswap64 (v);
+#endif
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy (&v, p, 4);
+#if defined(WORDS_BIGENDIAN)
+    v = __builtin_bswap32 (v);
+#endif
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl64 (acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxh_round (0, v);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh_stripe(uint64_t *v, const uint8_t *p)
+{
+    v[0] = xxh_round (v[0], read64 (p));
+    v[1] = xxh_round (v[1], read64 (p + 8));
+    v[2] = xxh_round (v[2], read64 (p + 16));
+    v[3] = xxh_round (v[3], read64 (p + 24));
+}
+
+static void xxh_update(Digest *d, const uint8_t *p, size_t len)
+{
+    if (d->mem_size + len < 32)
+    {
+        memcpy (d->mem + d->mem_size, p, len);
+        d->mem_size += len;
+        return;
+    }
+    if (d->mem_size)
+    {
+        size_t fill = 32 - d->mem_size;
+
+        memcpy (d->mem + d->mem_size, p, fill);
+        xxh_stripe (d->v, d->mem);
+        p += fill;
+        len -= fill;
+        d->mem_size = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32)
+        xxh_stripe (d->v, p);
+    memcpy (d->mem, p, len);
+    d->mem_size = len;
+}
+
+static uint64_t xxh_digest(const Digest *d)
+{
+    const uint8_t *p = d->mem, *end = d->mem + d->mem_size;
+    uint64_t h;
+
+    if (d->length >= 32)
+    {
+        h = rotl64 (d->v[0], 1) + rotl64 (d->v[1], 7) + rotl64 (d->v[2], 12) + rotl64 (d->v[3], 18);
+        h = xxh_merge (h, d->v[0]);
+        h = xxh_merge (h, d->v[1]);
+        h = xxh_merge (h, d->v[2]);
+        h = xxh_merge (h, d->v[3]);
+    }
+    else
+        h = XXH_PRIME5;     /* seed 0 */
+    h += d->length;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl64 (h ^ xxh_round (0, read64 (p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (p + 4 <= end)
+    {
+        h = rotl64 (h ^ (read32 (p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64 (h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    return h ^ (h >> 32);
+}
+
+/* -------------------------------------------- */
+
+void digest_init(Digest *d, int kind)
+{
+    memset (d, 0, sizeof (*d));
+    d->kind = kind;
+    d->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    d->v[1] = XXH_PRIME2;
+    d->v[2] = 0;
+    d->v[3] = -XXH_PRIME1;
+}
+
+void digest_update(Digest *d, const void *data, size_t len)
+{
+    if (d->kind == DIGEST_CRC32C)
+        d->crc = crc32c (d->crc, data, len);
+    else if (d->kind == DIGEST_XXH64)
+        xxh_update (d, (const uint8_t *)data, len);
+    d->length += len;
+}
+
+void digest_hex(const Digest *d, char *hex)
+{
+    if (d->kind == DIGEST_CRC32C)
+        snprintf (hex, DIGEST_HEX_MAX, "%08x", d->crc);
+    else if (d->kind == DIGEST_XXH64)
+        snprintf (hex, DIGEST_HEX_MAX, "%016llx", (unsigned long long) xxh_digest (d));
+    else
+        hex[0] = '\0';
+}
+
+const char *digest_name(int kind)
+{
+    if (kind < DIGEST_NONE || kind > DIGEST_XXH64)
+        return NULL;
+    return digest_names[kind];
+}
+
+int digest_by_name(const char *name)
+{
+    int i;
+
+    for (i = DIGEST_CRC32C; i <= DIGEST_XXH64; i++)
+        if (!strcmp (name, digest_names[i]))
+            return i;
+    return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef KYLIN_DIGEST_H
+#define KYLIN_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Checksums of the files a scan writes, taken on the bytes as the PNM
+ * sink writes them so checking a page costs no second read.  CRC32C runs
+ * on the SSE4.2 crc32 instruction where there is one; XXH64 is the
+ * 64-bit xxHash.  The hex digest is what crc32c and xxh64sum tools print.
+ **/
+enum digest_kind
+{
+    DIGEST_NONE = 0,
+    DIGEST_CRC32C,
+    DIGEST_XXH64
+};
+
+#define DIGEST_HEX_MAX	17      /* 16 hex digits and the NUL */
+
+typedef struct
+{
+    int kind;
+    uint64_t length;        /* bytes hashed */
+    uint32_t crc;
+    uint64_t v[4];          /* XXH64 lanes */
+    uint8_t mem[32];        /* XXH64 bytes short of a stripe */
+    int mem_size;
+} Digest;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void digest_init(Digest *d, int kind);
+void digest_update(Digest *d, const void *data, size_t len);
+// Digest of what was hashed so far; d can take more bytes after
+void digest_hex(const Digest *d, char *hex);
+// "crc32c", "xxh64", NULL for DIGEST_NONE
+const char *digest_name(int kind);
+// Kind named by name, -1 if unknown
+int digest_by_name(const char *name);
+
+/**
+ * CRC32C of A followed by B from the CRCs of both, len_b the length of B.
+ * With it a header patched after the data can still be hashed in order.
+ **/
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+#include <math.h>
+#include <string.h>
+
+#include "kylin_cpu.h"
+#include "kylin_downscale.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COVER_EPSILON	1e-9
+
+typedef struct
+{
+    double scale;
+    int max_size;
+    double factor;          /* input pixels per output pixel, both directions */
+    int channels;
+    int in_samples;         /* samples in an input line */
+    int out_width;
+    int *span_first;        /* first input pixel of every output pixel */
+    int *span_count;
+    int *span_offset;       /* index of the first weight in span_weight */
+    float *span_weight;     /* coverage of each input pixel, summing to 1 per span */
+    float *acc;             /* weighted sum of the rows of the current output row */
+    double acc_weight;      /* rows summed in acc */
+    double pos;             /* input rows consumed */
+    int out_row;
+} Downscale_Stage;
+
+/* -------------------------------------------- */
+// Row accumulation, every input sample goes through here once
+
+static void accumulate_8(float *acc, const uint8_t *src, int n, float w)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        acc[i] += w * src[i];
+}
+
+static void accumulate_16(float *acc, const uint16_t *src, int n, float w)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        acc[i] += w * src[i];
+}
+
+// Bits from the most significant, 1 is black
+static void accumulate_1(float *acc, const uint8_t *src, int n, float w)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (src[i >> 3] & (0x80 >> (i & 7)))
+            acc[i] += w;
+}
+
+#ifdef KYLIN_X86
+__attribute__((target("avx2")))
+static void accumulate_8_avx2(float *acc, const uint8_t *src, int n, float w)
+{
+    const __m256 vw = _mm256_set1_ps (w);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_cvtepi32_ps (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *)(src + i))));
+
+        _mm256_storeu_ps (acc + i, _mm256_add_ps (_mm256_loadu_ps (acc + i), _mm256_mul_ps (v, vw)));
+    }
+    accumulate_8 (acc + i, src + i, n - i, w);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_16_avx2(float *acc, const uint16_t *src, int n, float w)
+{
+    const __m256 vw = _mm256_set1_ps (w);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_cvtepi32_ps (_mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *)(src + i))));
+
+        _mm256_storeu_ps (acc + i, _mm256_add_ps (_mm256_loadu_ps (acc + i), _mm256_mul_ps (v, vw)));
+    }
+    accumulate_16 (acc + i, src + i, n - i, w);
+}
+#endif
+
+static void accumulate(Downscale_Stage *d, int depth, const SANE_Byte *line, float w)
+{
+    if (depth == 1)
+    {
+        accumulate_1 (d->acc, line, d->in_samples, w);
+        return;
+    }
+#ifdef KYLIN_X86
+    if (cpu_has_avx2 ())
+    {
+        if (depth == 8)
+            accumulate_8_avx2 (d->acc, line, d->in_samples, w);
+        else
+            accumulate_16_avx2 (d->acc, (const uint16_t *)line, d->in_samples, w);
+        return;
+    }
+#endif
+    if (depth == 8)
+        accumulate_8 (d->acc, line, d->in_samples, w);
+    else
+        accumulate_16 (d->acc, (const uint16_t *)line, d->in_samples, w);
+}
+
+/**
+ * Average acc horizontally into one output line and start the next row.
+ * A 1-bit pixel is black when at least half of the area it covers is.
+ **/
+static void emit_row(Downscale_Stage *d, int depth, SANE_Byte *dst)
+{
+    float max = (depth == 8) ? 255.f : (depth == 16) ? 65535.f : 1.f;
+    float norm = (float)(1. / d->acc_weight);
+    int x, c, k;
+
+    if (depth == 1)
+        memset (dst, 0, ((size_t) d->out_width * d->channels + 7) / 8);
+    for (x = 0; x < d->out_width; x++)
+    {
+        const float *w = d->span_weight + d->span_offset[x];
+        const float *a = d->acc + (size_t) d->span_first[x] * d->channels;
+
+        for (c = 0; c < d->channels; c++)
+        {
+            float sum = 0.f, v;
+
+            for (k = 0; k < d->span_count[x]; k++)
+                sum += w[k] * a[k * d->channels + c];
+            v = sum * norm + 0.5f;
+            if (v > max)
+                v = max;
+            if (depth == 1)
+            {
+                int i = x * d->channels + c;
+
+                if (v >= 1.f)
+                    dst[i >> 3] |= 0x80 >> (i & 7);
+            }
+            else if (depth == 8)
+                dst[x * d->channels + c] = (SANE_Byte) v;
+            else
+                ((uint16_t *)dst)[x * d->channels + c] = (uint16_t) v;
+        }
+    }
+
+    memset (d->acc, 0, (size_t) d->in_samples * sizeof (float));
+    d->acc_weight = 0.;
+    d->out_row++;
+}
+
+/* -------------------------------------------- */
+// Stage
+
+static SANE_Status downscale_configure(Strip_Stage *stage, const Strip_Format *in, Strip_Format *out)
+{
+    Downscale_Stage *d = (Downscale_Stage *)stage->priv;
+    double f = 1. / d->scale;
+    int x, n_weights = 0;
+
+    if (in->depth != 1 && in->depth != 8 && in->depth != 16)
+        return SANE_STATUS_UNSUPPORTED;
+
+    if (d->max_size > 0)
+    {
+        if (in->pixels_per_line > f * d->max_size)
+            f = (double) in->pixels_per_line / d->max_size;
+        // unknown (-1) never is
+        if (in->lines > f * d->max_size)
+            f = (double) in->lines / d->max_size;
+    }
+    if (f < 1.)
+        f = 1.;
+
+    d->factor = f;
+    d->channels = strip_format_channels (in);
+    d->in_samples = in->pixels_per_line * d->channels;
+    d->out_width = (int) ceil (in->pixels_per_line / f - COVER_EPSILON);
+
+    free (d->span_first);
+    free (d->span_count);
+    free (d->span_offset);
+    free (d->span_weight);
+    free (d->acc);
+    d->span_first = (int *)malloc (d->out_width * sizeof (int));
+    d->span_count = (int *)malloc (d->out_width * sizeof (int));
+    d->span_offset = (int *)malloc (d->out_width * sizeof (int));
+    // a span touches at most ceil(f) + 1 input pixels
+    d->span_weight = (float *)malloc ((size_t) d->out_width * ((int) ceil (f) + 1) * sizeof (float));
+    d->acc = (float *)calloc (d->in_samples, sizeof (float));
+    if (!d->span_first || !d->span_count || !d->span_offset || !d->span_weight || !d->acc)
+        return SANE_STATUS_NO_MEM;
+
+    for (x = 0; x < d->out_width; x++)
+    {
+        double lo = x * f, hi = (x + 1) * f;
+        int i, first, last;
+
+        if (hi > in->pixels_per_line)
+            hi = in->pixels_per_line;
+        first = (int) floor (lo);
+        last = (int) ceil (hi - COVER_EPSILON) - 1;
+        if (last < first)
+            last = first;
+
+        d->span_first[x] = first;
+        d->span_count[x] = last - first + 1;
+        d->span_offset[x] = n_weights;
+        for (i = first; i <= last; i++)
+        {
+            double a = (i > lo) ? i : lo;
+            double b = (i + 1 < hi) ? i + 1 : hi;
+
+            d->span_weight[n_weights++] = (float)((b - a) / (hi - lo));
+        }
+    }
+
+    d->acc_weight = 0.;
+    d->pos = 0.;
+    d->out_row = 0;
+
+    *out = *in;
+    out->pixels_per_line = d->out_width;
+    out->bytes_per_line = strip_format_line_bytes (in->format, in->depth, d->out_width);
+    if (in->lines >= 0)
+        out->lines = (int) ceil (in->lines / f - COVER_EPSILON);
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status downscale_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    Downscale_Stage *d = (Downscale_Stage *)stage->priv;
+    int depth = stage->in.depth;
+    int line;
+
+    out->lines = 0;
+    out->y = d->out_row;
+    for (line = 0; line < in->lines; line++)
+    {
+        const SANE_Byte *src = in->data + (size_t) line * stage->in.bytes_per_line;
+        double left = 1.;
+
+        // an input row may straddle two output rows
+        while (left > COVER_EPSILON)
+        {
+            double boundary = (d->out_row + 1) * d->factor;
+            double take = boundary - d->pos;
+
+            if (take > left)
+                take = left;
+            accumulate (d, depth, src, (float) take);
+            d->acc_weight += take;
+            d->pos += take;
+            left -= take;
+
+            if (d->pos >= boundary - COVER_EPSILON)
+            {
+                emit_row (d, depth, out->data + (size_t) out->lines * stage->out.bytes_per_line);
+                out->lines++;
+            }
+        }
+    }
+    return SANE_STATUS_GOOD;
+}
+
+// The bottom output row may cover less than factor input rows
+static SANE_Status downscale_flush(Strip_Stage *stage, Strip *out)
+{
+    Downscale_Stage *d = (Downscale_Stage *)stage->priv;
+
+    out->lines = 0;
+    out->y = d->out_row;
+    if (d->acc_weight > COVER_EPSILON)
+    {
+        emit_row (d, stage->in.depth, out->data);
+        out->lines = 1;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static void downscale_destroy(Strip_Stage *stage)
+{
+    Downscale_Stage *d = (Downscale_Stage *)stage->priv;
+
+    free (d->span_first);
+    free (d->span_count);
+    free (d->span_offset);
+    free (d->span_weight);
+    free (d->acc);
+    free (d);
+    free (stage);
+}
+
+Strip_Stage *downscale_stage_create(double scale, int max_size)
+{
+    Strip_Stage *stage;
+    Downscale_Stage *d;
+
+    if (scale <= 0. || scale > 1.)
+        return NULL;
+    stage = (Strip_Stage *)calloc (1, sizeof (Strip_Stage));
+    d = (Downscale_Stage *)calloc (1, sizeof (Downscale_Stage));
+    if (!stage || !d)
+    {
+        free (stage);
+        free (d);
+        return NULL;
+    }
+    d->scale = scale;
+    d->max_size = max_size;
+
+    stage->name = "downscale";
+    stage->configure = downscale_configure;
+    stage->process = downscale_process;
+    stage->flush = downscale_flush;
+    stage->destroy = downscale_destroy;
+    stage->priv = d;
+    return stage;
+}
+
+#ifdef __cplusplus
+}
+#endif
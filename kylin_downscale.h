@@ -0,0 +1,26 @@
+#ifndef KYLIN_DOWNSCALE_H
+#define KYLIN_DOWNSCALE_H
+
+#include "kylin_pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Area-average downscaler: each output pixel is the mean of the input
+ * area it covers, with partial pixels weighted by their coverage.  Rows
+ * are summed as they arrive, so only one input-width row of sums is kept.
+ * scale is the output/input ratio (e.g. 1/3 for 300 -> 100 dpi); with
+ * max_size > 0 the page is also fitted into max_size x max_size pixels;
+ * a page of unknown height (lines < 0, e.g. from a feeder) is fitted by
+ * its width only, as rows already emitted cannot be scaled again.
+ * 1-bit pages are averaged the same way and thresholded at half black.
+ **/
+Strip_Stage *downscale_stage_create(double scale, int max_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kylin_durable.h"
+#include "kylin_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+static const char *policy_names[] = { "none", "fsync", "group", "write-behind" };
+
+// A page to commit; in a group it has its own copies of the names
+typedef struct Commit_Page
+{
+    Durable_File *files;
+    int n;
+    SANE_Status status;
+    struct Commit_Page *next;
+} Commit_Page;
+
+// A group taken off the queue, on the stack of the thread syncing it
+typedef struct Syncing_Group
+{
+    Commit_Page *list;
+    struct Syncing_Group *next;
+} Syncing_Group;
+
+/**
+ * Pages of DURABLE_GROUP waiting for their group to be committed.  The
+ * page that fills it commits it on the thread of its scan; a group that
+ * is not full by its deadline is committed by group_thread.
+ **/
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_wake;
+static pthread_once_t group_once = PTHREAD_ONCE_INIT;
+static pthread_t group_thread;
+static int group_thread_running = 0;
+static Commit_Page *group_head = NULL;
+static Commit_Page **group_tail = &group_head;
+static int group_size = 0;
+static struct timespec group_deadline;
+static Syncing_Group *syncing = NULL;
+// first error of a page whose durable_commit() had returned, for durable_flush(NULL)
+static SANE_Status deferred_error = SANE_STATUS_GOOD;
+static Durable_Stats stats;     /* under group_lock */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int sync_fd(int fd)
+{
+    int ret;
+
+    do
+        ret = fsync (fd);
+    while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int sync_path(const char *path, int flags)
+{
+    int fd = open (path, O_RDONLY | flags), ret;
+
+    if (fd < 0)
+        return -1;
+    ret = sync_fd (fd);
+    close (fd);
+    return ret;
+}
+
+static void dir_of(const char *path, char *dir)
+{
+    const char *slash = strrchr (path, '/');
+
+    if (!slash)
+        strcpy (dir, ".");
+    else if (slash == path)
+        strcpy (dir, "/");
+    else
+        snprintf (dir, PATH_MAX, "%.*s", (int) (slash - path), path);
+}
+
+/**
+ * Sync the files of every page, rename them, then sync each directory
+ * once: after that the new names are on disk as well as the data.
+ **/
+static void commit_pages(Commit_Page *list, int sync)
+{
+    Commit_Page *w;
+    char (*dirs)[PATH_MAX] = NULL;
+    int *dir_failed = NULL;
+    int n_files = 0, n_dirs = 0, n_pages = 0, fsyncs = 0, i, d;
+    uint64_t start = now_ns ();
+
+    for (w = list; w; w = w->next, n_pages++)
+        n_files += w->n;
+    if (sync)
+    {
+        dirs = (char (*)[PATH_MAX])malloc ((size_t) n_files * PATH_MAX);
+        dir_failed = (int *)calloc (n_files, sizeof (int));
+        if (!dirs || !dir_failed)
+        {
+            for (w = list; w; w = w->next)
+                w->status = SANE_STATUS_NO_MEM;
+            free (dirs);
+            free (dir_failed);
+            return;
+        }
+        for (w = list; w; w = w->next)
+        {
+            for (i = 0; i < w->n && w->status == SANE_STATUS_GOOD; i++, fsyncs++)
+            {
+                const Durable_File *f = &w->files[i];
+
+                if ((f->fd >= 0 ? sync_fd (f->fd) : sync_path (f->from, 0)) != 0)
+                    w->status = SANE_STATUS_IO_ERROR;
+            }
+        }
+    }
+
+    for (w = list; w; w = w->next)
+    {
+        for (i = 0; i < w->n && w->status == SANE_STATUS_GOOD; i++)
+        {
+            if (rename (w->files[i].from, w->files[i].to))
+                w->status = SANE_STATUS_ACCESS_DENIED;
+        }
+    }
+
+    if (sync)
+    {
+        char dir[PATH_MAX];
+
+        for (w = list; w; w = w->next)
+        {
+            for (i = 0; i < w->n; i++)
+            {
+                dir_of (w->files[i].to, dir);
+                for (d = 0; d < n_dirs && strcmp (dirs[d], dir); d++)
+                    ;
+                if (d == n_dirs)
+                {
+                    strcpy (dirs[n_dirs], dir);
+                    dir_failed[n_dirs++] = (sync_path (dir, O_DIRECTORY) != 0);
+                    fsyncs++;
+                }
+                if (dir_failed[d] && w->status == SANE_STATUS_GOOD)
+                    w->status = SANE_STATUS_IO_ERROR;
+            }
+        }
+        free (dirs);
+        free (dir_failed);
+    }
+
+    pthread_mutex_lock (&group_lock);
+    stats.pages += n_pages;
+    stats.files += n_files;
+    stats.fsyncs += fsyncs;
+    stats.groups++;
+    stats.sync_ns += now_ns () - start;
+    pthread_mutex_unlock (&group_lock);
+}
+
+static void free_page(Commit_Page *page)
+{
+    int i;
+
+    for (i = 0; i < page->n; i++)
+    {
+        free ((char *)page->files[i].from);
+        free ((char *)page->files[i].to);
+    }
+    free (page->files);
+    free (page);
+}
+
+// The files are synced by path when their group goes, the fds may be closed by then
+static Commit_Page *copy_page(const Durable_File *files, int n)
+{
+    Commit_Page *page = (Commit_Page *)calloc (1, sizeof (Commit_Page));
+    int i;
+
+    if (!page || !(page->files = (Durable_File *)calloc (n, sizeof (Durable_File))))
+    {
+        free (page);
+        return NULL;
+    }
+    for (i = 0; i < n; i++, page->n++)
+    {
+        page->files[i].fd = -1;
+        page->files[i].from = strdup (files[i].from);
+        page->files[i].to = strdup (files[i].to);
+        if (!page->files[i].from || !page->files[i].to)
+        {
+            page->n++;
+            free_page (page);
+            return NULL;
+        }
+    }
+    page->status = SANE_STATUS_GOOD;
+    return page;
+}
+
+static int group_holds(const Commit_Page *list, const char *path)
+{
+    const Commit_Page *w;
+    int i;
+
+    for (w = list; w; w = w->next)
+        for (i = 0; i < w->n; i++)
+            if (!strcmp (w->files[i].from, path))
+                return 1;
+    return 0;
+}
+
+static int syncing_holds(const char *path)
+{
+    Syncing_Group *g;
+
+    for (g = syncing; g; g = g->next)
+        if (!path || group_holds (g->list, path))
+            return 1;
+    return 0;
+}
+
+/**
+ * Called with group_lock held, which is dropped while committing.
+ * Returns the status of me, or with me NULL the first error.  The other
+ * pages were reported good already: their errors are logged and kept
+ * for durable_flush(NULL).
+ **/
+static SANE_Status take_group(Commit_Page *me)
+{
+    Syncing_Group group, **g;
+    Commit_Page *w, *next;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    group.list = group_head;
+    group.next = syncing;
+    syncing = &group;
+    group_head = NULL;
+    group_tail = &group_head;
+    group_size = 0;
+    pthread_mutex_unlock (&group_lock);
+
+    commit_pages (group.list, 1);
+
+    pthread_mutex_lock (&group_lock);
+    for (w = group.list; w; w = next)
+    {
+        next = w->next;
+        if (w->status != SANE_STATUS_GOOD)
+        {
+            stats.failed++;
+            if (!me && status == SANE_STATUS_GOOD)
+                status = w->status;
+            if (w != me)
+            {
+                log_error("durable: %s not committed: %s\n", w->files[0].to, sane_strstatus (w->status));
+                if (deferred_error == SANE_STATUS_GOOD)
+                    deferred_error = w->status;
+            }
+        }
+        if (w == me)
+            status = w->status;
+        free_page (w);
+    }
+    for (g = &syncing; *g != &group; g = &(*g)->next)
+        ;
+    *g = group.next;
+    pthread_cond_broadcast (&group_wake);
+    return status;
+}
+
+// Commits a group that was not filled in time
+static void *group_main(void *arg)
+{
+    struct timespec now;
+
+    pthread_mutex_lock (&group_lock);
+    for (;;)
+    {
+        if (!group_head)
+        {
+            pthread_cond_wait (&group_wake, &group_lock);
+            continue;
+        }
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > group_deadline.tv_sec
+            || (now.tv_sec == group_deadline.tv_sec && now.tv_nsec >= group_deadline.tv_nsec))
+            take_group (NULL);
+        else
+            pthread_cond_timedwait (&group_wake, &group_lock, &group_deadline);
+    }
+    return NULL;
+}
+
+static void init_group()
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&group_wake, &attr);
+    pthread_condattr_destroy (&attr);
+}
+
+static SANE_Status commit_grouped(const Durable_Config *config, const Durable_File *files, int n)
+{
+    Commit_Page *me = copy_page (files, n);
+
+    if (!me)
+        return SANE_STATUS_NO_MEM;
+    pthread_once (&group_once, init_group);
+    pthread_mutex_lock (&group_lock);
+    if (!group_thread_running && pthread_create (&group_thread, NULL, group_main, NULL) == 0)
+    {
+        pthread_detach (group_thread);
+        group_thread_running = 1;
+    }
+    if (!group_head)
+    {
+        uint64_t deadline = now_ns () + (uint64_t) (config->group_interval * 1e9);
+
+        group_deadline.tv_sec = deadline / 1000000000ull;
+        group_deadline.tv_nsec = deadline % 1000000000ull;
+    }
+    *group_tail = me;
+    group_tail = &me->next;
+    group_size++;
+    stats.deferred++;
+
+    if (group_size >= config->group_pages || !group_thread_running)
+    {
+        SANE_Status status = take_group (me);
+
+        pthread_mutex_unlock (&group_lock);
+        return status;
+    }
+    pthread_cond_broadcast (&group_wake);
+    pthread_mutex_unlock (&group_lock);
+    return SANE_STATUS_GOOD;
+}
+
+void durable_config_init(Durable_Config *config)
+{
+    config->policy = DURABLE_NONE;
+    config->group_pages = DURABLE_GROUP_PAGES;
+    config->group_interval = DURABLE_GROUP_INTERVAL;
+}
+
+const char *durable_policy_name(int policy)
+{
+    if (policy < DURABLE_NONE || policy > DURABLE_WRITE_BEHIND)
+        return NULL;
+    return policy_names[policy];
+}
+
+int durable_policy_by_name(const char *name)
+{
+    int i;
+
+    for (i = DURABLE_NONE; i <= DURABLE_WRITE_BEHIND; i++)
+        if (!strcmp (name, policy_names[i]))
+            return i;
+    return -1;
+}
+
+SANE_Status durable_commit(const Durable_Config *config, const Durable_File *files, int n)
+{
+    Commit_Page me;
+
+    if (config->policy == DURABLE_GROUP && config->group_pages > 1 && config->group_interval > 0.)
+        return commit_grouped (config, files, n);
+
+    memset (&me, 0, sizeof (me));
+    me.files = (Durable_File *)files;
+    me.n = n;
+    me.status = SANE_STATUS_GOOD;
+    commit_pages (&me, config->policy != DURABLE_NONE);
+    return me.status;
+}
+
+SANE_Status durable_flush(const char *path)
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    pthread_once (&group_once, init_group);
+    pthread_mutex_lock (&group_lock);
+    // a group being synced may hold it too; unrelated ones are not waited for
+    while (syncing_holds (path))
+        pthread_cond_wait (&group_wake, &group_lock);
+    if (group_head && (!path || group_holds (group_head, path)))
+        status = take_group (NULL);
+    if (!path)
+    {
+        if (status == SANE_STATUS_GOOD)
+            status = deferred_error;
+        deferred_error = SANE_STATUS_GOOD;
+    }
+    pthread_mutex_unlock (&group_lock);
+    return status;
+}
+
+void durable_get_stats(Durable_Stats *s)
+{
+    pthread_mutex_lock (&group_lock);
+    *s = stats;
+    s->pending = group_size;
+    pthread_mutex_unlock (&group_lock);
+}
+
+#ifdef __cplusplus
+}
+#endif
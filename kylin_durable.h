@@ -0,0 +1,89 @@
+#ifndef KYLIN_DURABLE_H
+#define KYLIN_DURABLE_H
+
+#include <stdint.h>
+
+#include "sane/sane.h"
+
+/**
+ * How a finished page file is committed: its .part file is renamed to
+ * the final name, and the policy says what has to be on disk first so a
+ * power cut never leaves a final name with missing data.
+ *   DURABLE_NONE          rename only, the file system writes when it likes
+ *   DURABLE_FSYNC         fsync the files, rename, fsync their directories
+ *   DURABLE_GROUP         as DURABLE_FSYNC, for group_pages pages at once:
+ *                         a page keeps its .part name until the group is
+ *                         full or group_interval after its first page, then
+ *                         the whole group is synced and renamed, sharing the
+ *                         journal commits and directory syncs
+ *   DURABLE_WRITE_BEHIND  as DURABLE_FSYNC; the writer also starts write-out
+ *                         of every buffer as it is written, so the fsync
+ *                         has little left to do
+ **/
+enum durable_policy
+{
+    DURABLE_NONE = 0,
+    DURABLE_FSYNC,
+    DURABLE_GROUP,
+    DURABLE_WRITE_BEHIND
+};
+
+#define DURABLE_GROUP_PAGES	8
+#define DURABLE_GROUP_INTERVAL	2.          /* s */
+
+typedef struct
+{
+    int policy;
+    int group_pages;        /* DURABLE_GROUP: pages committed together */
+    double group_interval;  /* s, longest wait of the first of them; 0: no grouping */
+} Durable_Config;
+
+// One file to commit; with fd -1 the file is opened to be synced
+typedef struct
+{
+    int fd;
+    const char *from;       /* the .part file */
+    const char *to;
+} Durable_File;
+
+typedef struct
+{
+    uint64_t pages;         /* durable_commit() calls */
+    uint64_t files;
+    uint64_t fsyncs;        /* of files and directories */
+    uint64_t groups;        /* syncs done, a group per call without DURABLE_GROUP */
+    uint64_t sync_ns;       /* spent syncing and renaming */
+    uint64_t deferred;      /* pages that waited for a group */
+    uint64_t failed;        /* of them, pages whose group failed to commit */
+    int pending;            /* pages waiting now */
+} Durable_Stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void durable_config_init(Durable_Config *config);
+// "none", "fsync", "group", "write-behind"; NULL if unknown
+const char *durable_policy_name(int policy);
+int durable_policy_by_name(const char *name);
+/**
+ * Commit the files of one page under config: all of them are renamed
+ * or, on error, as many as got that far.  The fds stay open.  With
+ * DURABLE_GROUP the page may only be queued, the names are copied; an
+ * error in committing it later is logged, counted in Durable_Stats.failed
+ * and returned by the next durable_flush(NULL).
+ **/
+SANE_Status durable_commit(const Durable_Config *config, const Durable_File *files, int n);
+/**
+ * Commit the group waiting now, if it holds the .part file path, or with
+ * path NULL in any case, e.g. at the end of a batch; the first error.
+ * With path NULL that includes the groups committed since the last call.
+ **/
+SANE_Status durable_flush(const char *path);
+void durable_get_stats(Durable_Stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
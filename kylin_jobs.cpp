@@ -0,0 +1,245 @@
+#include <pthread.h>
+
+#include "kylin_sane.h"
+#include "kylin_jobs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOB_DEFAULT_DPI	300         /* set for a job that gives none */
+#define JOB_DEFAULT_WIDTH	210.    /* A4, mm */
+#define JOB_DEFAULT_HEIGHT	297.
+
+enum job_settings
+{
+    JOB_SET_MODE = 1 << 0,
+    JOB_SET_DPI = 1 << 1,
+    JOB_SET_AREA = 1 << 2
+};
+
+typedef struct
+{
+    Scan_Job job;           /* defaults filled in */
+    int requested;          /* job_settings the job gave, the others are defaults */
+    int id;
+    double cost;            /* < 0: not predicted yet */
+    double submitted;
+} Queued_Job;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static Queued_Job queue[SCAN_QUEUE_MAX];
+static int n_queued = 0;
+static int next_id = 1;
+static int queue_policy = SCAN_QUEUE_SJF;
+static double queue_aging = 0.1;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Predicted seconds of a job from its settings and the device history,
+ * at the resolution the device will be set to.
+ **/
+static double job_cost(const Scan_Job *job)
+{
+    SANE_Parameters parm;
+    Scan_Prediction prediction;
+    int dpi = pick_scan_resolution (job->handle, job->dpi);
+
+    parm.last_frame = SANE_TRUE;
+    parm.depth = 8;
+    parm.pixels_per_line = (int)(job->width / 25.4 * dpi);
+    parm.lines = (int)(job->height / 25.4 * dpi);
+    if (!strcmp (job->mode, SANE_VALUE_SCAN_MODE_COLOR))
+        parm.format = SANE_FRAME_RGB;
+    else
+        parm.format = SANE_FRAME_GRAY;
+    if (!strcmp (job->mode, SANE_VALUE_SCAN_MODE_LINEART) || !strcmp (job->mode, SANE_VALUE_SCAN_MODE_HALFTONE))
+        parm.depth = 1;
+    parm.bytes_per_line = strip_format_line_bytes (parm.format, parm.depth, parm.pixels_per_line);
+
+    scan_predict (job->device[0] ? job->device : get_device_name (), dpi, &parm, job->height, &prediction);
+    return prediction.seconds;
+}
+
+int scan_queue_submit(const Scan_Job *job)
+{
+    Queued_Job *q;
+    int id;
+
+    pthread_mutex_lock (&queue_lock);
+    if (n_queued >= SCAN_QUEUE_MAX)
+    {
+        pthread_mutex_unlock (&queue_lock);
+        return -1;
+    }
+    q = &queue[n_queued++];
+    q->job = *job;
+    q->requested = 0;
+    if (job->mode[0])
+        q->requested |= JOB_SET_MODE;
+    else
+        strcpy (q->job.mode, SANE_VALUE_SCAN_MODE_COLOR);
+    if (job->dpi)
+        q->requested |= JOB_SET_DPI;
+    else
+        q->job.dpi = JOB_DEFAULT_DPI;
+    if (job->width > 0. && job->height > 0.)
+        q->requested |= JOB_SET_AREA;
+    else
+    {
+        q->job.width = JOB_DEFAULT_WIDTH;
+        q->job.height = JOB_DEFAULT_HEIGHT;
+    }
+    q->id = id = next_id++;
+    q->cost = -1.;
+    q->submitted = now_sec ();
+    pthread_mutex_unlock (&queue_lock);
+
+    log_info("job %d queued: %s\n", id, job->file_name);
+    return id;
+}
+
+// Predict the jobs submitted since; the device is idle, the queue need not be
+static void cost_new_jobs()
+{
+    Scan_Job job;
+    double cost;
+    int id, i;
+
+    while (1)
+    {
+        pthread_mutex_lock (&queue_lock);
+        for (i = 0; i < n_queued && queue[i].cost >= 0.; i++)
+            ;
+        if (i == n_queued)
+        {
+            pthread_mutex_unlock (&queue_lock);
+            return;
+        }
+        job = queue[i].job;
+        id = queue[i].id;
+        // not picked again should the prediction fail
+        queue[i].cost = 0.;
+        pthread_mutex_unlock (&queue_lock);
+
+        cost = job_cost (&job);
+
+        pthread_mutex_lock (&queue_lock);
+        for (i = 0; i < n_queued; i++)
+            if (queue[i].id == id)
+                queue[i].cost = cost;
+        pthread_mutex_unlock (&queue_lock);
+    }
+}
+
+void scan_queue_set_policy(int policy, double aging)
+{
+    pthread_mutex_lock (&queue_lock);
+    queue_policy = policy;
+    queue_aging = (aging > 0.) ? aging : 0.;
+    pthread_mutex_unlock (&queue_lock);
+}
+
+int scan_queue_length()
+{
+    int n;
+
+    pthread_mutex_lock (&queue_lock);
+    n = n_queued;
+    pthread_mutex_unlock (&queue_lock);
+    return n;
+}
+
+// Take the next job off the queue, called with queue_lock held
+static int take_next(Queued_Job *next, double now)
+{
+    int best = 0, i;
+
+    if (!n_queued)
+        return 0;
+    for (i = 1; i < n_queued; i++)
+    {
+        const Queued_Job *a = &queue[i], *b = &queue[best];
+
+        if (a->job.priority != b->job.priority)
+        {
+            if (a->job.priority > b->job.priority)
+                best = i;
+            continue;
+        }
+        // FIFO keeps submission order, which is queue order
+        if (queue_policy == SCAN_QUEUE_SJF
+            && a->cost - queue_aging * (now - a->submitted) < b->cost - queue_aging * (now - b->submitted))
+            best = i;
+    }
+    *next = queue[best];
+    memmove (&queue[best], &queue[best + 1], (n_queued - best - 1) * sizeof (Queued_Job));
+    n_queued--;
+    return 1;
+}
+
+/**
+ * Set everything the job was costed with.  A default the device refuses
+ * leaves its setting as it was, as the job did not ask for it.
+ **/
+static SANE_Status run_job(const Queued_Job *q)
+{
+    const Scan_Job *job = &q->job;
+    SANE_Status status;
+
+    status = set_scan_mode (job->handle, job->mode);
+    if (status != SANE_STATUS_GOOD && (q->requested & JOB_SET_MODE))
+        return status;
+    status = set_scan_area (job->handle, 0., 0., job->width, job->height);
+    if (status != SANE_STATUS_GOOD && (q->requested & JOB_SET_AREA))
+        return status;
+    status = set_scan_resolution (job->handle, job->dpi, 0, NULL);
+    if (status != SANE_STATUS_GOOD && (q->requested & JOB_SET_DPI))
+        return status;
+    return start_scan (job->handle, job->file_name);
+}
+
+int scan_queue_run(Scan_Job_Result *results, int max_results)
+{
+    Queued_Job next;
+    int n = 0;
+
+    while (1)
+    {
+        Scan_Job_Result r;
+        double start;
+        int found;
+
+        cost_new_jobs ();
+        pthread_mutex_lock (&queue_lock);
+        start = now_sec ();
+        found = take_next (&next, start);
+        pthread_mutex_unlock (&queue_lock);
+        if (!found)
+            break;
+
+        r.id = next.id;
+        r.cost = next.cost;
+        r.wait = start - next.submitted;
+        r.status = run_job (&next);
+        r.run = now_sec () - start;
+        log_info("job %d: %s, waited %.1f s, ran %.1f s (predicted %.1f s)\n",
+                 r.id, sane_strstatus (r.status), r.wait, r.run, r.cost);
+
+        if (n < max_results)
+            results[n] = r;
+        n++;
+    }
+    return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef KYLIN_JOBS_H
+#define KYLIN_JOBS_H
+
+#include "sane/sane.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+/**
+ * Queue of scan jobs in front of start_scan.  Jobs can be submitted from
+ * any thread; scan_queue_run() scans them one after the other.  With the
+ * shortest-job-first policy the next job is the one with the lowest
+ * predicted time, less aging times the time it has waited, so large scans
+ * still get their turn.  A higher priority always goes first.  Every job
+ * sets all of its settings, the defaults included, so none is left over
+ * from the job before and the prediction is for what is scanned; it is
+ * made on the thread of scan_queue_run(), between scans.
+ **/
+enum scan_queue_policy
+{
+    SCAN_QUEUE_FIFO = 0,
+    SCAN_QUEUE_SJF
+};
+
+#define SCAN_QUEUE_MAX	64
+
+typedef struct
+{
+    SANE_Handle handle;
+    char device[64];        /* for the history, "": the device opened last */
+    char file_name[PATH_MAX];
+    char mode[32];          /* scan mode value, "": colour */
+    int dpi;                /* 0: 300 */
+    double width, height;   /* mm from the corner of the bed, 0: A4 */
+    int priority;           /* higher first, whatever the cost */
+} Scan_Job;
+
+typedef struct
+{
+    int id;
+    SANE_Status status;
+    double cost;            /* predicted seconds */
+    double wait;            /* s from submit to start */
+    double run;             /* s in start_scan */
+} Scan_Job_Result;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Job id, or -1 when the queue is full
+int scan_queue_submit(const Scan_Job *job);
+// aging: predicted seconds forgiven for every second waited
+void scan_queue_set_policy(int policy, double aging);
+int scan_queue_length();
+/**
+ * Run jobs until the queue is empty, the results go to results in the
+ * order the jobs ran; returns the number of jobs run.
+ **/
+int scan_queue_run(Scan_Job_Result *results, int max_results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
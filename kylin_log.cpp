@@ -0,0 +1,282 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kylin_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_BUFFER_SIZE	(64 * 1024)     /* per thread */
+#define LOG_LINE_MAX	1024            /* longer messages are cut */
+#define LOG_FLUSH_MS	20
+#define LOG_ALIGN	16
+#define LOG_WRAP	0xffffffffu     /* record len: the rest of the buffer is unused */
+
+typedef struct
+{
+    uint64_t seq;           /* across threads, the output order */
+    uint32_t len;
+    uint32_t level;
+} Log_Record;
+
+/**
+ * Ring of records with one writer, the owning thread, and one reader,
+ * whoever holds log_lock.  head and tail only grow.
+ **/
+typedef struct Log_Buffer
+{
+    struct Log_Buffer *next;
+    size_t head;
+    size_t tail;
+    unsigned long dropped;
+    int closed;             /* the owner has exited */
+    char data[LOG_BUFFER_SIZE];
+} Log_Buffer;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_t flusher;
+static Log_Buffer *buffers;         /* log_lock */
+static unsigned long dropped_gone;  /* log_lock, by freed buffers */
+static unsigned long dropped_reported;
+static int stopping;
+static uint64_t log_seq;
+static int log_level = LOG_MIN_LEVEL;
+static __thread Log_Buffer *own;
+
+static size_t record_size(uint32_t len)
+{
+    return (sizeof (Log_Record) + len + LOG_ALIGN - 1) & ~(size_t) (LOG_ALIGN - 1);
+}
+
+// Next record of b for the reader, skipping the unused end of the ring
+static int peek(Log_Buffer *b, Log_Record *r)
+{
+    size_t head = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE);
+
+    while (b->tail != head)
+    {
+        size_t pos = b->tail % LOG_BUFFER_SIZE;
+
+        memcpy (r, b->data + pos, sizeof (*r));
+        if (r->len != LOG_WRAP)
+            return 1;
+        __atomic_store_n (&b->tail, b->tail + LOG_BUFFER_SIZE - pos, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Called with log_lock held
+static void drain()
+{
+    uint64_t limit = __atomic_load_n (&log_seq, __ATOMIC_ACQUIRE);
+    unsigned long dropped = dropped_gone;
+    Log_Buffer *b, **link;
+    Log_Record r;
+    int wrote = 0;
+
+    // oldest first over all threads, up to what was logged when we started
+    while (1)
+    {
+        Log_Buffer *first = NULL;
+        Log_Record first_r = { 0, 0, 0 };
+
+        for (b = buffers; b; b = b->next)
+            if (peek (b, &r) && r.seq < limit && (!first || r.seq < first_r.seq))
+            {
+                first = b;
+                first_r = r;
+            }
+        if (!first)
+            break;
+        fwrite (first->data + first->tail % LOG_BUFFER_SIZE + sizeof (Log_Record), 1, first_r.len,
+                (first_r.level >= LOG_LEVEL_WARN) ? stderr : stdout);
+        __atomic_store_n (&first->tail, first->tail + record_size (first_r.len), __ATOMIC_RELEASE);
+        wrote = 1;
+    }
+
+    for (link = &buffers; (b = *link); )
+    {
+        dropped += __atomic_load_n (&b->dropped, __ATOMIC_RELAXED);
+        if (__atomic_load_n (&b->closed, __ATOMIC_ACQUIRE) && !peek (b, &r))
+        {
+            *link = b->next;
+            dropped_gone += b->dropped;
+            free (b);
+            continue;
+        }
+        link = &b->next;
+    }
+    if (dropped > dropped_reported)
+    {
+        fprintf (stderr, "log: %lu messages dropped\n", dropped - dropped_reported);
+        dropped_reported = dropped;
+    }
+    if (wrote)
+    {
+        fflush (stdout);
+        fflush (stderr);
+    }
+}
+
+static void *flush_loop(void *arg)
+{
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+    while (1)
+    {
+        nanosleep (&ts, NULL);
+        pthread_mutex_lock (&log_lock);
+        if (stopping)
+        {
+            pthread_mutex_unlock (&log_lock);
+            break;
+        }
+        drain ();
+        pthread_mutex_unlock (&log_lock);
+    }
+    return NULL;
+}
+
+// Last words at exit, later messages are written directly
+static void log_exit()
+{
+    pthread_mutex_lock (&log_lock);
+    drain ();
+    __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&log_lock);
+}
+
+static void thread_gone(void *arg)
+{
+    __atomic_store_n (&((Log_Buffer *) arg)->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void log_setup()
+{
+    pthread_key_create (&log_key, thread_gone);
+    if (pthread_create (&flusher, NULL, flush_loop, NULL) == 0)
+        pthread_detach (flusher);
+    else
+        stopping = 1;
+    atexit (log_exit);
+}
+
+static Log_Buffer *own_buffer()
+{
+    Log_Buffer *b;
+
+    if (own)
+        return own;
+    pthread_once (&log_once, log_setup);
+    b = (Log_Buffer *) calloc (1, sizeof (*b));
+    if (!b)
+        return NULL;
+    pthread_setspecific (log_key, b);
+    pthread_mutex_lock (&log_lock);
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock (&log_lock);
+    own = b;
+    return b;
+}
+
+void log_write(int level, const char *format, ...)
+{
+    Log_Buffer *b;
+    Log_Record r;
+    char line[LOG_LINE_MAX];
+    size_t head, pos, skip, need;
+    va_list ap;
+    int len;
+
+    if (level < __atomic_load_n (&log_level, __ATOMIC_RELAXED))
+        return;
+    b = own_buffer ();
+    if (!b || __atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+    {
+        va_start (ap, format);
+        vfprintf ((level >= LOG_LEVEL_WARN) ? stderr : stdout, format, ap);
+        va_end (ap);
+        return;
+    }
+
+    va_start (ap, format);
+    len = vsnprintf (line, sizeof (line), format, ap);
+    va_end (ap);
+    if (len <= 0)
+        return;
+    if (len >= LOG_LINE_MAX)
+        len = LOG_LINE_MAX - 1;
+
+    need = record_size (len);
+    head = b->head;
+    pos = head % LOG_BUFFER_SIZE;
+    skip = (LOG_BUFFER_SIZE - pos < need) ? LOG_BUFFER_SIZE - pos : 0;
+    if (LOG_BUFFER_SIZE - (head - __atomic_load_n (&b->tail, __ATOMIC_ACQUIRE)) < skip + need)
+    {
+        __atomic_add_fetch (&b->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (skip)
+    {
+        r.len = LOG_WRAP;
+        memcpy (b->data + pos, &r, sizeof (r));
+        head += skip;
+        pos = 0;
+    }
+    r.seq = __atomic_fetch_add (&log_seq, 1, __ATOMIC_RELAXED);
+    r.len = len;
+    r.level = level;
+    memcpy (b->data + pos, &r, sizeof (r));
+    memcpy (b->data + pos + sizeof (r), line, len);
+    __atomic_store_n (&b->head, head + need, __ATOMIC_RELEASE);
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n (&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level_by_name(const char *name)
+{
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    int i;
+
+    for (i = 0; i < (int) (sizeof (names) / sizeof (names[0])); i++)
+        if (!strcmp (name, names[i]))
+            return i;
+    return -1;
+}
+
+void log_flush()
+{
+    pthread_mutex_lock (&log_lock);
+    if (!stopping)
+        drain ();
+    pthread_mutex_unlock (&log_lock);
+}
+
+unsigned long log_dropped()
+{
+    unsigned long dropped;
+    Log_Buffer *b;
+
+    pthread_mutex_lock (&log_lock);
+    dropped = dropped_gone;
+    for (b = buffers; b; b = b->next)
+        dropped += __atomic_load_n (&b->dropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&log_lock);
+    return dropped;
+}
+
+#ifdef __cplusplus
+}
+#endif
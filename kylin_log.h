@@ -0,0 +1,55 @@
+#ifndef KYLIN_LOG_H
+#define KYLIN_LOG_H
+
+#include "sane/sane.h"
+
+/**
+ * Leveled diagnostics.  Levels under LOG_MIN_LEVEL are compiled out, the
+ * arguments are not even evaluated; build with -DLOG_MIN_LEVEL=0 for the
+ * debug messages.  Enabled messages are formatted into a buffer of the
+ * calling thread, without a lock, and a background thread writes them out
+ * in the order they were logged: debug and info to stdout, warnings and
+ * errors to stderr.  When a buffer is full the message is dropped and
+ * counted.  The thread starts with the first message and everything still
+ * buffered is written at exit or by log_flush().
+ **/
+enum log_level
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL	LOG_LEVEL_INFO
+#endif
+
+#define LOG_ENV	"KYLIN_SANE_LOG"    /* init() sets the level: debug, info, warn or error */
+
+#define log_at(level, ...) \
+    do { if ((level) >= LOG_MIN_LEVEL) log_write ((level), __VA_ARGS__); } while (0)
+#define log_debug(...)	log_at (LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)	log_at (LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)	log_at (LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...)	log_at (LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void log_write(int level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+// Runtime threshold on top of LOG_MIN_LEVEL
+void log_set_level(int level);
+// Level named by name, -1 if unknown
+int log_level_by_name(const char *name);
+// Write out what every thread has buffered so far
+void log_flush();
+// Messages dropped on full buffers since the start
+unsigned long log_dropped();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,340 @@
+#include <math.h>
+#include <string.h>
+
+#include "kylin_cpu.h"
+#include "kylin_lut.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int simd_disabled = 0;
+
+void levels_init(Levels *levels)
+{
+    levels->black = 0.;
+    levels->white = 1.;
+    levels->gamma = 1.;
+    levels->contrast = 0.;
+    levels->brightness = 0.;
+}
+
+// Curve on [0, 1]
+static double levels_map(const Levels *l, double x)
+{
+    double range = l->white - l->black;
+    double v;
+
+    if (range > 0.)
+        v = (x - l->black) / range;
+    else
+        v = (x >= l->black) ? 1. : 0.;
+    if (v < 0.)
+        v = 0.;
+    if (v > 1.)
+        v = 1.;
+
+    if (l->gamma > 0. && l->gamma != 1.)
+        v = pow (v, 1. / l->gamma);
+
+    if (l->contrast != 0.)
+    {
+        double c = l->contrast;
+
+        if (c > 0.99)
+            c = 0.99;
+        if (c < -1.)
+            c = -1.;
+        v = (v - 0.5) * (1. + c) / (1. - c) + 0.5;
+    }
+    v += l->brightness;
+
+    if (v < 0.)
+        v = 0.;
+    if (v > 1.)
+        v = 1.;
+    return v;
+}
+
+void lut_build_8(const Levels *levels, uint8_t *table)
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+        table[i] = (uint8_t) lrint (levels_map (levels, i / 255.) * 255.);
+}
+
+void lut_build_16(const Levels *levels, uint16_t *table)
+{
+    int i;
+
+    for (i = 0; i < 65536; i++)
+        table[i] = (uint16_t) lrint (levels_map (levels, i / 65535.) * 65535.);
+}
+
+/* -------------------------------------------- */
+// Lookup kernels
+
+static void apply_8_scalar(const uint8_t *tables, int channels, const uint8_t *src, uint8_t *dst, size_t n)
+{
+    size_t i;
+
+    if (channels == 1)
+    {
+        for (i = 0; i < n; i++)
+            dst[i] = tables[src[i]];
+        return;
+    }
+    for (i = 0; i + 3 <= n; i += 3)
+    {
+        dst[i] = tables[src[i]];
+        dst[i + 1] = tables[256 + src[i + 1]];
+        dst[i + 2] = tables[512 + src[i + 2]];
+    }
+    for (; i < n; i++)
+        dst[i] = tables[(i % 3) * 256 + src[i]];
+}
+
+static void apply_16_scalar(const uint16_t *tables, int channels, const uint16_t *src, uint16_t *dst, size_t n)
+{
+    size_t i;
+
+    if (channels == 1)
+    {
+        for (i = 0; i < n; i++)
+            dst[i] = tables[src[i]];
+        return;
+    }
+    for (i = 0; i + 3 <= n; i += 3)
+    {
+        dst[i] = tables[src[i]];
+        dst[i + 1] = tables[65536 + src[i + 1]];
+        dst[i + 2] = tables[131072 + src[i + 2]];
+    }
+    for (; i < n; i++)
+        dst[i] = tables[(i % 3) * 65536 + src[i]];
+}
+
+#ifdef KYLIN_X86
+/**
+ * 24 samples per round: three gathers of eight 32-bit words, lane j of
+ * gather k reads table (8k + j) % channels, so the channel offsets repeat
+ * every round.  The unwanted high bytes of each word are masked off.
+ **/
+static void channel_offsets(int channels, int entries, int offsets[24])
+{
+    int i;
+
+    for (i = 0; i < 24; i++)
+        offsets[i] = (channels == 1) ? 0 : (i % 3) * entries;
+}
+
+__attribute__((target("avx2")))
+static void apply_8_avx2(const uint8_t *tables, int channels, const uint8_t *src, uint8_t *dst, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi32 (0xff);
+    const __m256i low_bytes = _mm256_setr_epi8 (0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i gather_low = _mm256_setr_epi32 (0, 4, 1, 1, 1, 1, 1, 1);
+    const int *base = (const int *)tables;
+    int offsets[24];
+    __m256i off[3];
+    size_t i = 0;
+    int k;
+
+    channel_offsets (channels, 256, offsets);
+    for (k = 0; k < 3; k++)
+        off[k] = _mm256_loadu_si256 ((const __m256i *)(offsets + 8 * k));
+
+    for (; i + 24 <= n; i += 24)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            __m256i idx = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *)(src + i + 8 * k)));
+            __m256i v;
+
+            idx = _mm256_add_epi32 (idx, off[k]);
+            v = _mm256_and_si256 (_mm256_i32gather_epi32 (base, idx, 1), mask);
+            v = _mm256_shuffle_epi8 (v, low_bytes);
+            v = _mm256_permutevar8x32_epi32 (v, gather_low);
+            _mm_storel_epi64 ((__m128i *)(dst + i + 8 * k), _mm256_castsi256_si128 (v));
+        }
+    }
+    apply_8_scalar (tables, channels, src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void apply_16_avx2(const uint16_t *tables, int channels, const uint16_t *src, uint16_t *dst, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi32 (0xffff);
+    const int *base = (const int *)tables;
+    int offsets[24];
+    __m256i off[3];
+    size_t i = 0;
+    int k;
+
+    channel_offsets (channels, 65536, offsets);
+    for (k = 0; k < 3; k++)
+        off[k] = _mm256_loadu_si256 ((const __m256i *)(offsets + 8 * k));
+
+    for (; i + 24 <= n; i += 24)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            __m256i idx = _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *)(src + i + 8 * k)));
+            __m256i v;
+
+            idx = _mm256_add_epi32 (idx, off[k]);
+            v = _mm256_and_si256 (_mm256_i32gather_epi32 (base, idx, 2), mask);
+            v = _mm256_packus_epi32 (v, v);
+            v = _mm256_permute4x64_epi64 (v, 0x08);
+            _mm_storeu_si128 ((__m128i *)(dst + i + 8 * k), _mm256_castsi256_si128 (v));
+        }
+    }
+    apply_16_scalar (tables, channels, src + i, dst + i, n - i);
+}
+#endif
+
+void lut_set_simd(int enable)
+{
+    simd_disabled = !enable;
+}
+
+int lut_simd_enabled()
+{
+#ifdef KYLIN_X86
+    return !simd_disabled && cpu_has_avx2 ();
+#else
+    return 0;
+#endif
+}
+
+void lut_apply_8(const uint8_t *tables, int channels, const uint8_t *src, uint8_t *dst, size_t n)
+{
+#ifdef KYLIN_X86
+    if (lut_simd_enabled ())
+    {
+        apply_8_avx2 (tables, channels, src, dst, n);
+        return;
+    }
+#endif
+    apply_8_scalar (tables, channels, src, dst, n);
+}
+
+void lut_apply_16(const uint16_t *tables, int channels, const uint16_t *src, uint16_t *dst, size_t n)
+{
+#ifdef KYLIN_X86
+    if (lut_simd_enabled ())
+    {
+        apply_16_avx2 (tables, channels, src, dst, n);
+        return;
+    }
+#endif
+    apply_16_scalar (tables, channels, src, dst, n);
+}
+
+/* -------------------------------------------- */
+// Stage
+
+typedef struct
+{
+    Levels levels[3];
+    int channels;           /* curves given by the caller */
+    int depth;              /* depth the tables were built for, 0: none */
+    int table_channels;     /* tables in use for the current format */
+    void *tables;
+} Lut_Stage;
+
+static SANE_Status lut_configure(Strip_Stage *stage, const Strip_Format *in, Strip_Format *out)
+{
+    Lut_Stage *l = (Lut_Stage *)stage->priv;
+    int channels, entries, i;
+
+    if (in->depth != 8 && in->depth != 16)
+        return SANE_STATUS_UNSUPPORTED;
+
+    channels = (in->format == SANE_FRAME_RGB) ? l->channels : 1;
+    entries = (in->depth == 8) ? 256 : 65536;
+
+    // tables survive from page to page while the format stays the same
+    if (l->depth != in->depth || l->table_channels != channels)
+    {
+        size_t size = (size_t)(channels * entries + LUT_PAD) * (in->depth / 8);
+        void *tables = realloc (l->tables, size);
+
+        if (!tables)
+            return SANE_STATUS_NO_MEM;
+        memset (tables, 0, size);
+        l->tables = tables;
+        for (i = 0; i < channels; i++)
+        {
+            if (in->depth == 8)
+                lut_build_8 (&l->levels[i], (uint8_t *)tables + i * entries);
+            else
+                lut_build_16 (&l->levels[i], (uint16_t *)tables + i * entries);
+        }
+        l->depth = in->depth;
+        l->table_channels = channels;
+    }
+
+    *out = *in;
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status lut_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    Lut_Stage *l = (Lut_Stage *)stage->priv;
+    size_t bytes = (size_t) in->lines * stage->in.bytes_per_line;
+
+    if (l->depth == 8)
+        lut_apply_8 ((const uint8_t *)l->tables, l->table_channels, in->data, out->data, bytes);
+    else
+        lut_apply_16 ((const uint16_t *)l->tables, l->table_channels,
+                      (const uint16_t *)in->data, (uint16_t *)out->data, bytes / 2);
+
+    out->lines = in->lines;
+    out->y = in->y;
+    return SANE_STATUS_GOOD;
+}
+
+static void lut_destroy(Strip_Stage *stage)
+{
+    Lut_Stage *l = (Lut_Stage *)stage->priv;
+
+    free (l->tables);
+    free (l);
+    free (stage);
+}
+
+Strip_Stage *lut_stage_create(const Levels *levels, int channels)
+{
+    Strip_Stage *stage;
+    Lut_Stage *l;
+    int i;
+
+    if (channels != 1 && channels != 3)
+        return NULL;
+    stage = (Strip_Stage *)calloc (1, sizeof (Strip_Stage));
+    l = (Lut_Stage *)calloc (1, sizeof (Lut_Stage));
+    if (!stage || !l)
+    {
+        free (stage);
+        free (l);
+        return NULL;
+    }
+    for (i = 0; i < 3; i++)
+        l->levels[i] = levels[(channels == 3) ? i : 0];
+    l->channels = channels;
+
+    stage->name = "lut";
+    stage->configure = lut_configure;
+    stage->process = lut_process;
+    stage->destroy = lut_destroy;
+    stage->priv = l;
+    stage->parallel = 1;
+    return stage;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef KYLIN_LUT_H
+#define KYLIN_LUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Gamma / levels correction done on the host, for devices without (or
+ * with slow) gamma-table, brightness and contrast options.  Every sample
+ * goes through a lookup table built from these parameters, one table per
+ * colour channel, 256 entries for 8-bit and 65536 entries for 16-bit data.
+ **/
+typedef struct
+{
+    double black;           /* input level mapped to 0, 0 .. 1 */
+    double white;           /* input level mapped to full scale, 0 .. 1 */
+    double gamma;           /* output = input ^ (1 / gamma) */
+    double contrast;        /* -1 .. 1, slope around mid gray */
+    double brightness;      /* -1 .. 1, offset added last */
+} Levels;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Identity curve
+void levels_init(Levels *levels);
+void lut_build_8(const Levels *levels, uint8_t *table);
+void lut_build_16(const Levels *levels, uint16_t *table);
+
+/**
+ * Map n interleaved samples; sample i uses table i % channels.  The tables
+ * are stored back to back and followed by LUT_PAD spare entries, the
+ * vector code reads a little past the entry it looks up.
+ **/
+#define LUT_PAD	4
+void lut_apply_8(const uint8_t *tables, int channels, const uint8_t *src, uint8_t *dst, size_t n);
+void lut_apply_16(const uint16_t *tables, int channels, const uint16_t *src, uint16_t *dst, size_t n);
+// The vector lookup is used when the CPU has AVX2, unless disabled here
+void lut_set_simd(int enable);
+int lut_simd_enabled();
+
+// levels holds one curve for every sample, or channels == 3 curves for red, green, blue
+Strip_Stage *lut_stage_create(const Levels *levels, int channels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
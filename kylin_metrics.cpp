@@ -0,0 +1,404 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kylin_metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+#define METRIC_STATUSES	13      /* SANE_STATUS_GOOD .. ACCESS_DENIED, then any other */
+#define METRIC_BUCKETS	11
+
+typedef enum
+{
+    METRIC_COUNTER,
+    METRIC_HISTOGRAM,
+    METRIC_GAUGE
+} Metric_Type;
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+    Metric_Type type;
+    int by_status;
+} Metric;
+
+// In enum metric_id order
+static const Metric metrics[METRIC_COUNT] =
+{
+    { "kylin_scans_total", "Scans by result", METRIC_COUNTER, 1 },
+    { "kylin_pages_total", "Pages written", METRIC_COUNTER, 0 },
+    { "kylin_read_bytes_total", "Bytes returned by sane_read", METRIC_COUNTER, 0 },
+    { "kylin_opens_total", "Devices opened, by result", METRIC_COUNTER, 1 },
+    { "kylin_first_byte_seconds", "Time from sane_start to the first byte", METRIC_HISTOGRAM, 0 },
+    { "kylin_scan_seconds", "Time of a whole scan", METRIC_HISTOGRAM, 0 },
+    { "kylin_open_seconds", "Time to open a device", METRIC_HISTOGRAM, 0 },
+    { "kylin_get_devices_seconds", "Time to list the devices", METRIC_HISTOGRAM, 0 },
+    { "kylin_write_seconds", "Time from submitting a page file write to its completion", METRIC_HISTOGRAM, 0 },
+    { "kylin_read_bytes_per_second", "Transfer rate of the last scan", METRIC_GAUGE, 0 },
+    { "kylin_devices", "Devices found by the last search", METRIC_GAUGE, 0 },
+    { "kylin_scanning", "1 while a scan runs", METRIC_GAUGE, 0 },
+    { "kylin_write_in_flight_bytes", "Bytes of page file writes not completed", METRIC_GAUGE, 0 },
+};
+
+static const char *status_names[METRIC_STATUSES] =
+{
+    "GOOD", "UNSUPPORTED", "CANCELLED", "DEVICE_BUSY", "INVAL", "EOF", "JAMMED",
+    "NO_DOCS", "COVER_OPEN", "IO_ERROR", "NO_MEM", "ACCESS_DENIED", "OTHER"
+};
+
+// Upper bounds in seconds, the last bucket is +Inf
+static const double buckets[METRIC_BUCKETS - 1] = { 0.01, 0.05, 0.1, 0.25, 0.5, 1., 2.5, 5., 10., 30. };
+
+/**
+ * Slots of one thread: a counter takes one per label, a histogram one per
+ * bucket plus its sum.  Only the owning thread writes them.
+ **/
+#define SLOTS_MAX	(4 * METRIC_STATUSES + 5 * (METRIC_BUCKETS + 1))
+
+typedef struct Metric_Shard
+{
+    double slots[SLOTS_MAX];
+    struct Metric_Shard *next;
+} Metric_Shard;
+
+static int slot_base[METRIC_COUNT];
+static int slots_used = -1;
+static Metric_Shard *shards = NULL;     /* never freed, the counts of ended threads stay */
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Metric_Shard *own_shard = NULL;
+static double gauges[METRIC_COUNT];
+
+typedef struct
+{
+    pthread_t thread;
+    int running;
+    int stop[2];            /* pipe that ends the thread */
+    int listen_fd;
+    char socket_path[PATH_MAX];
+    char file_path[PATH_MAX];
+    double interval;
+} Metrics_Export;
+
+static Metrics_Export metrics_export = { 0, 0, { -1, -1 }, -1 };
+
+// Called with shards_lock held
+static void layout_slots()
+{
+    int i, n = 0;
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        slot_base[i] = n;
+        if (metrics[i].type == METRIC_HISTOGRAM)
+            n += METRIC_BUCKETS + 1;
+        else if (metrics[i].type == METRIC_COUNTER)
+            n += metrics[i].by_status ? METRIC_STATUSES : 1;
+    }
+    slots_used = n;
+}
+
+static Metric_Shard *get_shard()
+{
+    Metric_Shard *shard = own_shard;
+
+    if (shard)
+        return shard;
+    shard = (Metric_Shard *)calloc (1, sizeof (Metric_Shard));
+    if (!shard)
+        return NULL;
+    pthread_mutex_lock (&shards_lock);
+    if (slots_used < 0)
+        layout_slots ();
+    shard->next = shards;
+    __atomic_store_n (&shards, shard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&shards_lock);
+    own_shard = shard;
+    return shard;
+}
+
+// The owner is the only writer, a plain add published with a relaxed store
+static void slot_add(Metric_Shard *shard, int slot, double value)
+{
+    double v = shard->slots[slot] + value;
+
+    __atomic_store (&shard->slots[slot], &v, __ATOMIC_RELAXED);
+}
+
+void metric_add(int id, SANE_Status status, double value)
+{
+    Metric_Shard *shard = get_shard ();
+    int slot;
+
+    if (!shard || id < 0 || id >= METRIC_COUNT || metrics[id].type != METRIC_COUNTER)
+        return;
+    slot = slot_base[id];
+    if (metrics[id].by_status)
+        slot += ((unsigned) status < METRIC_STATUSES - 1) ? (int) status : METRIC_STATUSES - 1;
+    slot_add (shard, slot, value);
+}
+
+void metric_observe(int id, double value)
+{
+    Metric_Shard *shard = get_shard ();
+    int b = 0;
+
+    if (!shard || id < 0 || id >= METRIC_COUNT || metrics[id].type != METRIC_HISTOGRAM)
+        return;
+    while (b < METRIC_BUCKETS - 1 && value > buckets[b])
+        b++;
+    slot_add (shard, slot_base[id] + b, 1.);
+    slot_add (shard, slot_base[id] + METRIC_BUCKETS, value);
+}
+
+void metric_set(int id, double value)
+{
+    if (id < 0 || id >= METRIC_COUNT || metrics[id].type != METRIC_GAUGE)
+        return;
+    __atomic_store (&gauges[id], &value, __ATOMIC_RELAXED);
+}
+
+static double slot_sum(int slot)
+{
+    const Metric_Shard *shard;
+    double sum = 0., v;
+
+    for (shard = __atomic_load_n (&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next)
+    {
+        __atomic_load (&shard->slots[slot], &v, __ATOMIC_RELAXED);
+        sum += v;
+    }
+    return sum;
+}
+
+void metrics_write(FILE *fp)
+{
+    double v, count;
+    int i, j;
+
+    pthread_mutex_lock (&shards_lock);
+    if (slots_used < 0)
+        layout_slots ();
+    pthread_mutex_unlock (&shards_lock);
+
+    for (i = 0; i < METRIC_COUNT; i++)
+    {
+        const Metric *m = &metrics[i];
+
+        fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name,
+                 (m->type == METRIC_COUNTER) ? "counter" : (m->type == METRIC_GAUGE) ? "gauge" : "histogram");
+        switch (m->type)
+        {
+            case METRIC_COUNTER:
+                if (!m->by_status)
+                {
+                    fprintf (fp, "%s %.17g\n", m->name, slot_sum (slot_base[i]));
+                    break;
+                }
+                for (j = 0; j < METRIC_STATUSES; j++)
+                {
+                    v = slot_sum (slot_base[i] + j);
+                    if (v > 0.)
+                        fprintf (fp, "%s{status=\"%s\"} %.17g\n", m->name, status_names[j], v);
+                }
+                break;
+            case METRIC_HISTOGRAM:
+                count = 0.;
+                for (j = 0; j < METRIC_BUCKETS; j++)
+                {
+                    count += slot_sum (slot_base[i] + j);
+                    if (j < METRIC_BUCKETS - 1)
+                        fprintf (fp, "%s_bucket{le=\"%g\"} %.17g\n", m->name, buckets[j], count);
+                    else
+                        fprintf (fp, "%s_bucket{le=\"+Inf\"} %.17g\n", m->name, count);
+                }
+                fprintf (fp, "%s_sum %.17g\n%s_count %.17g\n", m->name,
+                         slot_sum (slot_base[i] + METRIC_BUCKETS), m->name, count);
+                break;
+            case METRIC_GAUGE:
+                __atomic_load (&gauges[i], &v, __ATOMIC_RELAXED);
+                fprintf (fp, "%s %.17g\n", m->name, v);
+                break;
+        }
+    }
+}
+
+static void write_metrics_file()
+{
+    char tmp[PATH_MAX + 8];
+    FILE *fp;
+    int failed;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", metrics_export.file_path);
+    fp = fopen (tmp, "w");
+    if (!fp)
+        return;
+    metrics_write (fp);
+    failed = (fclose (fp) != 0);
+    if (failed || rename (tmp, metrics_export.file_path))
+        remove (tmp);
+}
+
+static void serve_client(int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char request[512];
+    ssize_t n = 0;
+    FILE *fp;
+
+    // a scraper sends a request first, a plain reader may not
+    if (poll (&pfd, 1, 100) > 0)
+        n = read (fd, request, sizeof (request) - 1);
+    fp = fdopen (fd, "w");
+    if (!fp)
+    {
+        close (fd);
+        return;
+    }
+    if (n >= 4 && !memcmp (request, "GET ", 4))
+        fprintf (fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    metrics_write (fp);
+    fclose (fp);
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The file is written every interval however often the socket is scraped
+static void *metrics_main(void *)
+{
+    struct pollfd fds[2];
+    int periodic = (metrics_export.file_path[0] && metrics_export.interval > 0.);
+    double deadline = now_sec () + metrics_export.interval;
+
+    fds[0].fd = metrics_export.stop[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = metrics_export.listen_fd;
+    fds[1].events = POLLIN;
+    while (1)
+    {
+        int timeout = -1, n;
+
+        if (periodic)
+        {
+            double left = deadline - now_sec ();
+
+            timeout = (left > 0.) ? (int) (left * 1000.) + 1 : 0;
+        }
+        n = poll (fds, (metrics_export.listen_fd >= 0) ? 2 : 1, timeout);
+        if (n > 0 && fds[0].revents)
+            break;
+        if (n > 0 && fds[1].revents & POLLIN)
+        {
+            int fd = accept (metrics_export.listen_fd, NULL, NULL);
+
+            if (fd >= 0)
+                serve_client (fd);
+        }
+        if (periodic && now_sec () >= deadline)
+        {
+            write_metrics_file ();
+            deadline += metrics_export.interval;
+            // after a long stall the next write is an interval away, not a burst of them
+            if (deadline < now_sec ())
+                deadline = now_sec () + metrics_export.interval;
+        }
+    }
+    if (metrics_export.file_path[0])
+        write_metrics_file ();
+    return NULL;
+}
+
+static SANE_Status listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+        return SANE_STATUS_INVAL;
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return SANE_STATUS_IO_ERROR;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    unlink (path);
+    if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen (fd, 4) != 0)
+    {
+        close (fd);
+        return SANE_STATUS_ACCESS_DENIED;
+    }
+    metrics_export.listen_fd = fd;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status metrics_start(const char *socket_path, const char *file_path, double interval)
+{
+    SANE_Status status;
+
+    metrics_stop ();
+    if ((socket_path && strlen (socket_path) >= PATH_MAX) || (file_path && strlen (file_path) >= PATH_MAX))
+        return SANE_STATUS_INVAL;
+    if (!socket_path && !file_path)
+        return SANE_STATUS_GOOD;
+    strcpy (metrics_export.socket_path, socket_path ? socket_path : "");
+    strcpy (metrics_export.file_path, file_path ? file_path : "");
+    metrics_export.interval = interval;
+    if (socket_path)
+    {
+        status = listen_unix (socket_path);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    if (pipe (metrics_export.stop) != 0
+        || pthread_create (&metrics_export.thread, NULL, metrics_main, NULL) != 0)
+    {
+        metrics_stop ();
+        return SANE_STATUS_NO_MEM;
+    }
+    metrics_export.running = 1;
+    return SANE_STATUS_GOOD;
+}
+
+void metrics_stop()
+{
+    if (metrics_export.running)
+    {
+        write (metrics_export.stop[1], "s", 1);
+        pthread_join (metrics_export.thread, NULL);
+        metrics_export.running = 0;
+    }
+    if (metrics_export.stop[0] >= 0)
+    {
+        close (metrics_export.stop[0]);
+        close (metrics_export.stop[1]);
+        metrics_export.stop[0] = metrics_export.stop[1] = -1;
+    }
+    if (metrics_export.listen_fd >= 0)
+    {
+        close (metrics_export.listen_fd);
+        metrics_export.listen_fd = -1;
+        unlink (metrics_export.socket_path);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef KYLIN_METRICS_H
+#define KYLIN_METRICS_H
+
+#include <stdio.h>
+
+#include "sane/sane.h"
+
+/**
+ * Metrics of the library in the Prometheus text format.  Counters and
+ * histograms are kept per thread: an update is a relaxed atomic store to
+ * the thread's own slots, with no lock and no shared cache line, so they
+ * can sit on the read path.  Exposition adds up the threads.  Gauges are
+ * single values set from anywhere.
+ **/
+enum metric_id
+{
+    METRIC_SCANS = 0,           /* counter by SANE_Status */
+    METRIC_PAGES,               /* counter, pages written */
+    METRIC_BYTES_READ,          /* counter */
+    METRIC_OPENS,               /* counter by SANE_Status */
+    METRIC_FIRST_BYTE_SECONDS,  /* histogram */
+    METRIC_SCAN_SECONDS,        /* histogram */
+    METRIC_OPEN_SECONDS,        /* histogram */
+    METRIC_GET_DEVICES_SECONDS, /* histogram */
+    METRIC_WRITE_SECONDS,       /* histogram, of one write to a page file */
+    METRIC_READ_RATE,           /* gauge, bytes/s of the last scan */
+    METRIC_DEVICES,             /* gauge, found by the last get_devices */
+    METRIC_SCANNING,            /* gauge, 1 while a scan runs */
+    METRIC_WRITE_IN_FLIGHT,     /* gauge, bytes of page file writes not completed */
+    METRIC_COUNT
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counter; status picks the label of the counters by SANE_Status, else ignored
+void metric_add(int id, SANE_Status status, double value);
+void metric_observe(int id, double value);
+void metric_set(int id, double value);
+void metrics_write(FILE *fp);
+/**
+ * Serve the metrics on a Unix socket (an HTTP GET gets an HTTP reply, so
+ * curl --unix-socket and scrapers through a proxy work) and/or write them
+ * to file_path every interval seconds, replaced in one rename.  Either
+ * path may be NULL.
+ **/
+SANE_Status metrics_start(const char *socket_path, const char *file_path, double interval);
+void metrics_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include <strings.h>
+
+#include "kylin_papersize.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static const Paper_Size paper_size_table[] =
+{
+    // ISO 216 A series
+    { "A2", 420., 594. },
+    { "A3", 297., 420. },
+    { "A4", 210., 297. },
+    { "A5", 148., 210. },
+    { "A6", 105., 148. },
+    { "A7", 74., 105. },
+    { "A8", 52., 74. },
+    // ISO 216 B series
+    { "B3", 353., 500. },
+    { "B4", 250., 353. },
+    { "B5", 176., 250. },
+    { "B6", 125., 176. },
+    { "B7", 88., 125. },
+    { "JIS-B5", 182., 257. },
+    // North America
+    { "Letter", 215.9, 279.4 },
+    { "Legal", 215.9, 355.6 },
+    { "Executive", 184.15, 266.7 },
+    { "Tabloid", 279.4, 431.8 },
+    { "Statement", 139.7, 215.9 },
+    // Cards
+    { "ID-1", 85.6, 53.98 },            /* ISO 7810: credit, ID and most business cards */
+    { "Business-Card-US", 88.9, 50.8 },
+    { "Business-Card-EU", 85., 55. },
+    { "Business-Card-CN", 90., 54. },
+    // Photos
+    { "Photo-3.5x5", 88.9, 127. },
+    { "Photo-4x6", 101.6, 152.4 },
+    { "Photo-5x7", 127., 177.8 },
+    { "Photo-8x10", 203.2, 254. },
+    { "Photo-10x15", 100., 150. },
+    { "Photo-13x18", 130., 180. },
+};
+
+const Paper_Size *paper_size_find(const char *name)
+{
+    size_t i;
+
+    if (!name)
+        return NULL;
+    for (i = 0; i < sizeof (paper_size_table) / sizeof (paper_size_table[0]); i++)
+        if (!strcasecmp (name, paper_size_table[i].name))
+            return &paper_size_table[i];
+    return NULL;
+}
+
+const Paper_Size *paper_sizes(int *count)
+{
+    *count = sizeof (paper_size_table) / sizeof (paper_size_table[0]);
+    return paper_size_table;
+}
+
+SANE_Word range_snap(const SANE_Range *range, SANE_Word value, int up)
+{
+    SANE_Word steps;
+
+    if (value < range->min)
+        value = range->min;
+    if (value > range->max)
+        value = range->max;
+    if (range->quant <= 0)
+        return value;
+
+    steps = (value - range->min) / range->quant;
+    // max itself need not be on the grid
+    if (up && range->min + steps * range->quant < value
+        && range->min + (steps + 1) * range->quant <= range->max)
+        steps++;
+    return range->min + steps * range->quant;
+}
+
+#ifdef __cplusplus
+}
+#endif
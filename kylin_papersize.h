@@ -0,0 +1,37 @@
+#ifndef KYLIN_PAPERSIZE_H
+#define KYLIN_PAPERSIZE_H
+
+#include "sane/sane.h"
+
+/**
+ * Paper sizes known by name, in millimetres as the sheet is usually fed:
+ * cards landscape, everything else portrait.  Anything else is
+ * scanned with set_scan_area() as a custom size.
+ **/
+typedef struct
+{
+    const char *name;
+    double width;
+    double height;
+} Paper_Size;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Case-insensitive lookup, NULL if unknown
+const Paper_Size *paper_size_find(const char *name);
+// The whole catalogue
+const Paper_Size *paper_sizes(int *count);
+
+/**
+ * Nearest value a range constraint accepts: clamped to [min, max] and put
+ * on the quant grid, rounding up when up is set and down otherwise.
+ **/
+SANE_Word range_snap(const SANE_Range *range, SANE_Word value, int up);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,301 @@
+#include <math.h>
+#include <string.h>
+
+#include "kylin_phash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PHASH_DCT	9       /* frequencies computed, 0 (the mean) is left out */
+
+typedef struct
+{
+    Strip_Sink *next;
+    Strip_Format fmt;
+    int bin_start[PHASH_SIZE + 1];  /* first pixel of each column of the small image */
+    uint32_t *rows;                 /* PHASH_SIZE brightness sums per line */
+    size_t rows_size;               /* lines rows has room for */
+    int lines;
+    uint64_t result;
+} Phash_Sink;
+
+/* -------------------------------------------- */
+// Lines
+
+static uint32_t bin_sum(const Phash_Sink *h, const SANE_Byte *line, int x0, int x1)
+{
+    uint32_t sum = 0;
+    int x;
+
+    if (h->fmt.depth == 1)
+    {
+        // set bits are black
+        for (x = x0; x < x1; x++)
+            sum += ((line[x >> 3] >> (7 - (x & 7))) & 1) ? 0 : 255;
+    }
+    else if (h->fmt.format == SANE_FRAME_GRAY && h->fmt.depth == 8)
+    {
+        for (x = x0; x < x1; x++)
+            sum += line[x];
+    }
+    else if (h->fmt.format == SANE_FRAME_GRAY)
+    {
+        const uint16_t *px = (const uint16_t *)line;
+
+        for (x = x0; x < x1; x++)
+            sum += px[x] >> 8;
+    }
+    else if (h->fmt.depth == 8)
+    {
+        const uint8_t *px = line + 3 * x0;
+
+        for (x = x0; x < x1; x++, px += 3)
+            sum += (px[0] + 2 * px[1] + px[2]) >> 2;
+    }
+    else
+    {
+        const uint16_t *px = (const uint16_t *)line + 3 * x0;
+
+        for (x = x0; x < x1; x++, px += 3)
+            sum += (px[0] + 2 * px[1] + px[2]) >> 10;
+    }
+    return sum;
+}
+
+static SANE_Status reduce_line(Phash_Sink *h, const SANE_Byte *line)
+{
+    uint32_t *row;
+    int b;
+
+    if ((size_t) h->lines >= h->rows_size)
+    {
+        size_t size = h->rows_size + STRIP_HEIGHT;
+        uint32_t *rows = (uint32_t *)realloc (h->rows, size * PHASH_SIZE * sizeof (uint32_t));
+
+        if (!rows)
+            return SANE_STATUS_NO_MEM;
+        h->rows = rows;
+        h->rows_size = size;
+    }
+    row = h->rows + (size_t) h->lines++ * PHASH_SIZE;
+    for (b = 0; b < PHASH_SIZE; b++)
+        row[b] = bin_sum (h, line, h->bin_start[b], h->bin_start[b + 1]);
+    return SANE_STATUS_GOOD;
+}
+
+/* -------------------------------------------- */
+// Hash
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Rows of the page down to the small image, then its low frequencies
+static uint64_t page_hash(const Phash_Sink *h)
+{
+    double image[PHASH_SIZE][PHASH_SIZE], cosines[PHASH_DCT][PHASH_SIZE];
+    double partial[PHASH_DCT][PHASH_SIZE], dct[PHASH_BITS], sorted[PHASH_BITS], median;
+    uint64_t hash = 0;
+    int r, b, u, v, i;
+
+    if (!h->lines)
+        return 0;
+    for (r = 0; r < PHASH_SIZE; r++)
+    {
+        int y0 = (int)((int64_t) r * h->lines / PHASH_SIZE);
+        int y1 = (int)((int64_t)(r + 1) * h->lines / PHASH_SIZE);
+        int y;
+
+        // pages of fewer lines than that repeat them
+        if (y1 <= y0)
+            y1 = y0 + 1;
+        for (b = 0; b < PHASH_SIZE; b++)
+        {
+            double sum = 0.;
+            int width = h->bin_start[b + 1] - h->bin_start[b];
+
+            for (y = y0; y < y1; y++)
+                sum += h->rows[(size_t) y * PHASH_SIZE + b];
+            image[r][b] = width ? sum / ((double)(y1 - y0) * width) : 0.;
+        }
+    }
+
+    for (u = 0; u < PHASH_DCT; u++)
+        for (i = 0; i < PHASH_SIZE; i++)
+            cosines[u][i] = cos ((2 * i + 1) * u * M_PI / (2 * PHASH_SIZE));
+    // DCT-II along the rows, then down the columns, low frequencies only
+    for (u = 0; u < PHASH_DCT; u++)
+        for (r = 0; r < PHASH_SIZE; r++)
+        {
+            double sum = 0.;
+
+            for (b = 0; b < PHASH_SIZE; b++)
+                sum += image[r][b] * cosines[u][b];
+            partial[u][r] = sum;
+        }
+    i = 0;
+    for (v = 1; v < PHASH_DCT; v++)
+        for (u = 1; u < PHASH_DCT; u++)
+        {
+            double sum = 0.;
+
+            for (r = 0; r < PHASH_SIZE; r++)
+                sum += partial[u][r] * cosines[v][r];
+            dct[i++] = sum;
+        }
+
+    memcpy (sorted, dct, sizeof (sorted));
+    qsort (sorted, PHASH_BITS, sizeof (double), compare_double);
+    median = (sorted[PHASH_BITS / 2 - 1] + sorted[PHASH_BITS / 2]) / 2.;
+    for (i = 0; i < PHASH_BITS; i++)
+        if (dct[i] > median)
+            hash |= (uint64_t) 1 << i;
+    return hash;
+}
+
+int phash_distance(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll (a ^ b);
+}
+
+/* -------------------------------------------- */
+// Sink
+
+static SANE_Status phash_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Phash_Sink *h = (Phash_Sink *)sink->priv;
+    int b;
+
+    if (fmt->format == SANE_FRAME_RGB && fmt->depth == 1)
+        return SANE_STATUS_UNSUPPORTED;
+
+    h->fmt = *fmt;
+    h->lines = 0;
+    h->result = 0;
+    for (b = 0; b <= PHASH_SIZE; b++)
+        h->bin_start[b] = (int)((int64_t) b * fmt->pixels_per_line / PHASH_SIZE);
+    if (!h->next->begin)
+        return SANE_STATUS_GOOD;
+    return h->next->begin (h->next, fmt);
+}
+
+static SANE_Status phash_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Phash_Sink *h = (Phash_Sink *)sink->priv;
+    SANE_Status status;
+    int line;
+
+    for (line = 0; line < strip->lines; line++)
+    {
+        status = reduce_line (h, strip->data + (size_t) line * h->fmt.bytes_per_line);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    return h->next->write (h->next, strip);
+}
+
+static SANE_Status phash_sink_end(Strip_Sink *sink, int lines)
+{
+    Phash_Sink *h = (Phash_Sink *)sink->priv;
+
+    h->result = page_hash (h);
+    if (!h->next->end)
+        return SANE_STATUS_GOOD;
+    return h->next->end (h->next, lines);
+}
+
+static void phash_sink_destroy(Strip_Sink *sink)
+{
+    Phash_Sink *h = (Phash_Sink *)sink->priv;
+
+    free (h->rows);
+    free (h);
+    free (sink);
+}
+
+Strip_Sink *phash_sink_create(Strip_Sink *next)
+{
+    Strip_Sink *sink;
+    Phash_Sink *h;
+
+    if (!next)
+        return NULL;
+    sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    h = (Phash_Sink *)calloc (1, sizeof (Phash_Sink));
+    if (!sink || !h)
+    {
+        free (sink);
+        free (h);
+        return NULL;
+    }
+    h->next = next;
+
+    sink->begin = phash_sink_begin;
+    sink->write = phash_sink_write;
+    sink->end = phash_sink_end;
+    sink->destroy = phash_sink_destroy;
+    sink->priv = h;
+    return sink;
+}
+
+uint64_t phash_sink_result(Strip_Sink *sink)
+{
+    return ((Phash_Sink *)sink->priv)->result;
+}
+
+/* -------------------------------------------- */
+// Index
+
+void phash_index_init(Phash_Index *index)
+{
+    memset (index, 0, sizeof (*index));
+}
+
+SANE_Status phash_index_add(Phash_Index *index, uint64_t hash, const char *path)
+{
+    if (index->n == index->size)
+    {
+        int size = index->size ? 2 * index->size : 16;
+        Phash_Entry *entries = (Phash_Entry *)realloc (index->entries, size * sizeof (Phash_Entry));
+
+        if (!entries)
+            return SANE_STATUS_NO_MEM;
+        index->entries = entries;
+        index->size = size;
+    }
+    index->entries[index->n].hash = hash;
+    snprintf (index->entries[index->n].path, sizeof (index->entries[index->n].path), "%s", path);
+    index->n++;
+    return SANE_STATUS_GOOD;
+}
+
+const Phash_Entry *phash_index_match(const Phash_Index *index, uint64_t hash, int threshold, int *distance)
+{
+    const Phash_Entry *best = NULL;
+    int i, d;
+
+    for (i = 0; i < index->n; i++)
+    {
+        d = phash_distance (hash, index->entries[i].hash);
+        if (d <= threshold && (!best || d < *distance))
+        {
+            best = &index->entries[i];
+            *distance = d;
+        }
+    }
+    return best;
+}
+
+void phash_index_clear(Phash_Index *index)
+{
+    free (index->entries);
+    phash_index_init (index);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef KYLIN_PHASH_H
+#define KYLIN_PHASH_H
+
+#include <stdint.h>
+
+#include "kylin_pipeline.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+/**
+ * Perceptual hash of a page while it is written, to find pages fed twice.
+ * Every line is reduced to PHASH_SIZE column sums of its brightness as
+ * it arrives; at the end of the page those rows are reduced to a
+ * PHASH_SIZE x PHASH_SIZE image, whose lowest 8x8 DCT frequencies above
+ * the mean give one bit each: set when over their median.  Pages that
+ * look alike differ in few bits, whatever the resolution or noise.
+ **/
+#define PHASH_SIZE	32
+#define PHASH_BITS	64
+#define PHASH_DEFAULT_THRESHOLD	10      /* bits two copies of a page may differ in */
+
+typedef struct
+{
+    uint64_t hash;
+    char path[PATH_MAX];
+} Phash_Entry;
+
+// Hashes of the pages of a batch
+typedef struct
+{
+    Phash_Entry *entries;
+    int n;
+    int size;
+} Phash_Index;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sink passing pages on to next and hashing them on the way; next stays owned by the caller
+Strip_Sink *phash_sink_create(Strip_Sink *next);
+// Hash of the last page that ended on the sink, 0 if it had no lines
+uint64_t phash_sink_result(Strip_Sink *sink);
+int phash_distance(uint64_t a, uint64_t b);
+
+void phash_index_init(Phash_Index *index);
+SANE_Status phash_index_add(Phash_Index *index, uint64_t hash, const char *path);
+/**
+ * Closest page within threshold bits of hash, NULL if none; *distance is
+ * set to its distance.
+ **/
+const Phash_Entry *phash_index_match(const Phash_Index *index, uint64_t hash, int threshold, int *distance);
+void phash_index_clear(Phash_Index *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1012 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include "kylin_log.h"
+#include "kylin_pipeline.h"
+#include "kylin_trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void strip_format_from_parameters(const SANE_Parameters *parm, Strip_Format *fmt)
+{
+    fmt->format = (parm->format == SANE_FRAME_GRAY) ? SANE_FRAME_GRAY : SANE_FRAME_RGB;
+    fmt->depth = parm->depth;
+    fmt->pixels_per_line = parm->pixels_per_line;
+    fmt->bytes_per_line = parm->bytes_per_line;
+    fmt->lines = parm->lines;
+}
+
+int strip_format_channels(const Strip_Format *fmt)
+{
+    return (fmt->format == SANE_FRAME_RGB) ? 3 : 1;
+}
+
+int strip_format_line_bytes(SANE_Frame format, int depth, int pixels_per_line)
+{
+    int samples = pixels_per_line * ((format == SANE_FRAME_RGB) ? 3 : 1);
+
+    if (depth == 1)
+        return (samples + 7) / 8;
+    return samples * (depth / 8);
+}
+
+/* -------------------------------------------- */
+// Strip buffer pool
+
+static void pool_lock(Strip_Pool *pool)
+{
+    while (__atomic_exchange_n (&pool->lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield ();
+}
+
+static void pool_unlock(Strip_Pool *pool)
+{
+    __atomic_store_n (&pool->lock, 0, __ATOMIC_RELEASE);
+}
+
+static Strip *pool_take(Strip_Pool *pool, size_t size)
+{
+    Strip **link, *strip;
+
+    // first fit on the free list
+    for (link = &pool->free_list; *link; link = &(*link)->next)
+    {
+        if ((*link)->size >= size)
+        {
+            strip = *link;
+            *link = strip->next;
+            pool->available--;
+            strip->next = NULL;
+            return strip;
+        }
+    }
+
+    // grow a free strip rather than adding one more to the pool
+    if (pool->free_list)
+    {
+        SANE_Byte *data;
+
+        strip = pool->free_list;
+        data = (SANE_Byte *)realloc (strip->data, size);
+        if (!data)
+            return NULL;
+        pool->free_list = strip->next;
+        pool->available--;
+        strip->data = data;
+        strip->size = size;
+        strip->next = NULL;
+        return strip;
+    }
+
+    strip = (Strip *)calloc (1, sizeof (Strip));
+    if (!strip)
+        return NULL;
+    strip->data = (SANE_Byte *)malloc (size);
+    if (!strip->data)
+    {
+        free (strip);
+        return NULL;
+    }
+    strip->size = size;
+    pool->allocated++;
+    return strip;
+}
+
+Strip *strip_pool_get(Strip_Pool *pool, size_t size)
+{
+    Strip *strip;
+
+    pool_lock (pool);
+    strip = pool_take (pool, size);
+    pool_unlock (pool);
+    return strip;
+}
+
+void strip_pool_put(Strip_Pool *pool, Strip *strip)
+{
+    if (!strip)
+        return;
+    pool_lock (pool);
+    strip->next = pool->free_list;
+    pool->free_list = strip;
+    pool->available++;
+    pool_unlock (pool);
+}
+
+void strip_pool_clear(Strip_Pool *pool)
+{
+    Strip *strip;
+
+    pool_lock (pool);
+    while ((strip = pool->free_list) != NULL)
+    {
+        pool->free_list = strip->next;
+        free (strip->data);
+        free (strip);
+        pool->allocated--;
+    }
+    pool->available = 0;
+    pool_unlock (pool);
+}
+
+/* -------------------------------------------- */
+// Pipeline
+
+typedef struct
+{
+    Strip_Pipeline *p;
+    Strip *strip;
+    SANE_Status status;
+    int done;
+} Strip_Job;
+
+struct Pipeline_Parallel
+{
+    Thread_Pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Strip_Job *jobs;        /* reorder window, job n lives in jobs[n % window] */
+    int window;
+    int submitted;          /* jobs of this page handed to the pool */
+    int next;               /* next job to pass on in page order */
+    int ready;              /* finished jobs not passed on yet */
+    int max_in_flight;
+    int max_ready;
+    uint64_t jobs_total;
+    SANE_Status status;     /* first failure of the page, scanning thread only */
+};
+
+void pipeline_init(Strip_Pipeline *p)
+{
+    memset (p, 0, sizeof (*p));
+}
+
+SANE_Status pipeline_add_stage(Strip_Pipeline *p, Strip_Stage *stage)
+{
+    if (!stage)
+        return SANE_STATUS_NO_MEM;
+    if (p->active || p->n_stages >= PIPELINE_MAX_STAGES)
+    {
+        log_warn("pipeline: can not add stage %s\n", stage->name);
+        return SANE_STATUS_INVAL;
+    }
+    p->stages[p->n_stages++] = stage;
+    return SANE_STATUS_GOOD;
+}
+
+void pipeline_clear_stages(Strip_Pipeline *p)
+{
+    int i;
+
+    for (i = 0; i < p->n_stages; i++)
+    {
+        if (p->stages[i]->destroy)
+            p->stages[i]->destroy (p->stages[i]);
+        p->stages[i] = NULL;
+    }
+    p->n_stages = 0;
+}
+
+void pipeline_set_sink(Strip_Pipeline *p, Strip_Sink *sink)
+{
+    p->sink = sink;
+}
+
+const Strip_Format *pipeline_output_format(const Strip_Pipeline *p)
+{
+    if (p->n_stages)
+        return &p->stages[p->n_stages - 1]->out;
+    return &p->in;
+}
+
+SANE_Status pipeline_begin(Strip_Pipeline *p, const Strip_Format *in)
+{
+    SANE_Status status;
+    Strip_Format fmt = *in;
+    int i;
+
+    if (p->active)
+        pipeline_cancel (p);
+
+    p->in = *in;
+    for (i = 0; i < p->n_stages; i++)
+    {
+        Strip_Stage *stage = p->stages[i];
+
+        stage->in = fmt;
+        status = stage->configure (stage, &fmt, &stage->out);
+        if (status != SANE_STATUS_GOOD)
+        {
+            log_warn("pipeline: stage %s does not accept format=%d depth=%d (%s)\n",
+                     stage->name, fmt.format, fmt.depth, sane_strstatus (status));
+            return status;
+        }
+        fmt = stage->out;
+    }
+
+    p->n_parallel = 0;
+    if (p->par)
+    {
+        while (p->n_parallel < p->n_stages && p->stages[p->n_parallel]->parallel
+               && !p->stages[p->n_parallel]->flush)
+            p->n_parallel++;
+        p->par->submitted = 0;
+        p->par->next = 0;
+        p->par->status = SANE_STATUS_GOOD;
+    }
+
+    p->fill = 0;
+    p->y = 0;
+    p->seq = 0;
+    p->lines_out = 0;
+
+    if (p->sink && p->sink->begin)
+    {
+        status = p->sink->begin (p->sink, &fmt);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    p->active = 1;
+    return SANE_STATUS_GOOD;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static SANE_Status stage_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    uint64_t start = now_ns (), ns, max;
+    double span = trace_begin ();
+    SANE_Status status;
+
+    status = stage->process (stage, in, out);
+    ns = now_ns () - start;
+    trace_end (span, stage->name, NULL);
+
+    __atomic_add_fetch (&stage->stats.strips, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&stage->stats.lines, in->lines, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&stage->stats.ns, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n (&stage->stats.max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n (&stage->stats.max_ns, &max, ns, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return status;
+}
+
+// Run stages[from..to) on *strip; the strip finally holding the result is left in *strip
+static SANE_Status apply_stages(Strip_Pipeline *p, int from, int to, Strip **strip)
+{
+    SANE_Status status;
+    int i;
+
+    for (i = from; i < to && (*strip)->lines > 0; i++)
+    {
+        Strip_Stage *stage = p->stages[i];
+        Strip *out;
+
+        out = strip_pool_get (&p->pool, (size_t) stage->out.bytes_per_line * STRIP_HEIGHT);
+        if (!out)
+            return SANE_STATUS_NO_MEM;
+        out->lines = 0;
+        out->y = (*strip)->y;
+        out->seq = (*strip)->seq;
+
+        status = stage_process (stage, *strip, out);
+        strip_pool_put (&p->pool, *strip);
+        *strip = out;
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+// Run a strip through stages[from..] into the sink; the strip goes back to the pool
+static SANE_Status run_stages(Strip_Pipeline *p, int from, Strip *strip)
+{
+    SANE_Status status;
+
+    status = apply_stages (p, from, p->n_stages, &strip);
+    if (status == SANE_STATUS_GOOD && strip->lines > 0 && p->sink)
+    {
+        status = p->sink->write (p->sink, strip);
+        p->lines_out += strip->lines;
+    }
+    strip_pool_put (&p->pool, strip);
+    return status;
+}
+
+/* -------------------------------------------- */
+// Parallel stages
+
+static void strip_job_run(void *arg)
+{
+    Strip_Job *job = (Strip_Job *)arg;
+    Strip_Pipeline *p = job->p;
+    Pipeline_Parallel *par = p->par;
+    SANE_Status status;
+
+    status = apply_stages (p, 0, p->n_parallel, &job->strip);
+
+    pthread_mutex_lock (&par->lock);
+    job->status = status;
+    job->done = 1;
+    par->ready++;
+    if (par->ready > par->max_ready)
+        par->max_ready = par->ready;
+    pthread_cond_broadcast (&par->cond);
+    pthread_mutex_unlock (&par->lock);
+}
+
+/**
+ * Pass finished jobs in page order to the serial stages, waiting until at
+ * most keep jobs are still outstanding.  After a failure the remaining
+ * strips are dropped.
+ **/
+static SANE_Status collect_jobs(Strip_Pipeline *p, int keep)
+{
+    Pipeline_Parallel *par = p->par;
+
+    pthread_mutex_lock (&par->lock);
+    while (par->next < par->submitted)
+    {
+        Strip_Job *job = &par->jobs[par->next % par->window];
+        SANE_Status status;
+        Strip *strip;
+
+        if (!job->done)
+        {
+            if (par->submitted - par->next <= keep)
+                break;
+            pthread_cond_wait (&par->cond, &par->lock);
+            continue;
+        }
+
+        strip = job->strip;
+        status = job->status;
+        job->strip = NULL;
+        job->done = 0;
+        par->next++;
+        par->ready--;
+        pthread_mutex_unlock (&par->lock);
+
+        if (status == SANE_STATUS_GOOD && par->status == SANE_STATUS_GOOD)
+            status = run_stages (p, p->n_parallel, strip);
+        else
+            strip_pool_put (&p->pool, strip);
+        if (par->status == SANE_STATUS_GOOD)
+            par->status = status;
+
+        pthread_mutex_lock (&par->lock);
+    }
+    pthread_mutex_unlock (&par->lock);
+    return par->status;
+}
+
+static SANE_Status dispatch_strip(Strip_Pipeline *p, Strip *strip)
+{
+    Pipeline_Parallel *par = p->par;
+    SANE_Status status;
+    Strip_Job *job;
+
+    if (!par || p->n_parallel == 0)
+        return run_stages (p, 0, strip);
+
+    // wait for a free slot in the reorder window
+    status = collect_jobs (p, par->window - 1);
+    if (status != SANE_STATUS_GOOD)
+    {
+        strip_pool_put (&p->pool, strip);
+        return status;
+    }
+
+    pthread_mutex_lock (&par->lock);
+    job = &par->jobs[par->submitted % par->window];
+    job->p = p;
+    job->strip = strip;
+    job->status = SANE_STATUS_GOOD;
+    job->done = 0;
+    par->submitted++;
+    par->jobs_total++;
+    if (par->submitted - par->next > par->max_in_flight)
+        par->max_in_flight = par->submitted - par->next;
+    pthread_mutex_unlock (&par->lock);
+
+    if (thread_pool_submit (par->pool, strip_job_run, job) != 0)
+        strip_job_run (job);
+
+    // pass on whatever is already done without waiting
+    return collect_jobs (p, par->window);
+}
+
+SANE_Status pipeline_set_thread_pool(Strip_Pipeline *p, Thread_Pool *pool, int window)
+{
+    Pipeline_Parallel *par;
+
+    if (p->active)
+        return SANE_STATUS_DEVICE_BUSY;
+
+    if (p->par)
+    {
+        pthread_cond_destroy (&p->par->cond);
+        pthread_mutex_destroy (&p->par->lock);
+        free (p->par->jobs);
+        free (p->par);
+        p->par = NULL;
+    }
+    if (!pool)
+        return SANE_STATUS_GOOD;
+
+    if (window <= 0)
+        window = 2 * thread_pool_size (pool);
+
+    par = (Pipeline_Parallel *)calloc (1, sizeof (Pipeline_Parallel));
+    if (!par)
+        return SANE_STATUS_NO_MEM;
+    par->jobs = (Strip_Job *)calloc (window, sizeof (Strip_Job));
+    if (!par->jobs)
+    {
+        free (par);
+        return SANE_STATUS_NO_MEM;
+    }
+    pthread_mutex_init (&par->lock, NULL);
+    pthread_cond_init (&par->cond, NULL);
+    par->pool = pool;
+    par->window = window;
+    p->par = par;
+    return SANE_STATUS_GOOD;
+}
+
+void pipeline_get_stats(Strip_Pipeline *p, Pipeline_Stats *stats)
+{
+    Pipeline_Parallel *par = p->par;
+
+    memset (stats, 0, sizeof (*stats));
+    if (!par)
+        return;
+
+    pthread_mutex_lock (&par->lock);
+    stats->window = par->window;
+    stats->in_flight = par->submitted - par->next;
+    stats->max_in_flight = par->max_in_flight;
+    stats->ready = par->ready;
+    stats->max_ready = par->max_ready;
+    stats->jobs = par->jobs_total;
+    pthread_mutex_unlock (&par->lock);
+    thread_pool_get_stats (par->pool, &stats->pool);
+}
+
+void pipeline_print_stats(Strip_Pipeline *p)
+{
+    Pipeline_Stats stats;
+    int i;
+
+    for (i = 0; i < p->n_stages; i++)
+    {
+        Stage_Stats *s = &p->stages[i]->stats;
+
+        log_info("stage %s%s: %llu strips, %llu lines, avg %.1f us, max %.1f us\n",
+                 p->stages[i]->name, (i < p->n_parallel) ? " (parallel)" : "",
+                 (unsigned long long) s->strips, (unsigned long long) s->lines,
+                 s->strips ? s->ns / 1000. / s->strips : 0., s->max_ns / 1000.);
+    }
+
+    if (p->par)
+    {
+        pipeline_get_stats (p, &stats);
+        log_info("parallel: window=%d max in flight=%d max ready=%d jobs=%llu, "
+                 "pool threads=%d queued=%d stolen=%llu\n",
+                 stats.window, stats.max_in_flight, stats.max_ready,
+                 (unsigned long long) stats.jobs, stats.pool.threads, stats.pool.queued,
+                 (unsigned long long) stats.pool.stolen);
+    }
+}
+
+static SANE_Status emit_pending(Strip_Pipeline *p)
+{
+    Strip *strip = p->pending;
+    size_t bpl = p->in.bytes_per_line;
+
+    p->pending = NULL;
+    strip->lines = (int)((p->fill + bpl - 1) / bpl);
+    // a frame should end on a line boundary; pad a short last line
+    if (p->fill % bpl)
+    {
+        log_warn("pipeline: last line short by %zu bytes\n", bpl - p->fill % bpl);
+        memset (strip->data + p->fill, 0, strip->lines * bpl - p->fill);
+    }
+    strip->y = p->y;
+    strip->seq = p->seq++;
+    p->y += strip->lines;
+    p->fill = 0;
+
+    return dispatch_strip (p, strip);
+}
+
+SANE_Status pipeline_push(Strip_Pipeline *p, const SANE_Byte *data, size_t len)
+{
+    size_t strip_bytes = (size_t) p->in.bytes_per_line * STRIP_HEIGHT;
+    SANE_Status status;
+
+    while (len > 0)
+    {
+        size_t n;
+
+        if (!p->pending)
+        {
+            p->pending = strip_pool_get (&p->pool, strip_bytes);
+            if (!p->pending)
+                return SANE_STATUS_NO_MEM;
+            p->fill = 0;
+        }
+
+        n = strip_bytes - p->fill;
+        if (n > len)
+            n = len;
+        memcpy (p->pending->data + p->fill, data, n);
+        p->fill += n;
+        data += n;
+        len -= n;
+
+        if (p->fill == strip_bytes)
+        {
+            status = emit_pending (p);
+            if (status != SANE_STATUS_GOOD)
+                return status;
+        }
+    }
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status pipeline_end(Strip_Pipeline *p)
+{
+    SANE_Status status = SANE_STATUS_GOOD;
+    int i;
+
+    if (p->pending && p->fill > 0)
+    {
+        status = emit_pending (p);
+    }
+    else if (p->pending)
+    {
+        strip_pool_put (&p->pool, p->pending);
+        p->pending = NULL;
+    }
+    if (p->par)
+    {
+        SANE_Status collected = collect_jobs (p, 0);
+
+        if (status == SANE_STATUS_GOOD)
+            status = collected;
+    }
+
+    // lines kept back by a stage still go through the stages after it
+    for (i = 0; i < p->n_stages && status == SANE_STATUS_GOOD; i++)
+    {
+        Strip_Stage *stage = p->stages[i];
+
+        while (stage->flush && status == SANE_STATUS_GOOD)
+        {
+            Strip *out = strip_pool_get (&p->pool, (size_t) stage->out.bytes_per_line * STRIP_HEIGHT);
+
+            if (!out)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            out->lines = 0;
+            out->y = 0;
+            out->seq = p->seq;
+            status = stage->flush (stage, out);
+            if (status != SANE_STATUS_GOOD || out->lines == 0)
+            {
+                strip_pool_put (&p->pool, out);
+                break;
+            }
+            p->seq++;
+            status = run_stages (p, i + 1, out);
+        }
+    }
+
+    p->active = 0;
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    if (p->sink && p->sink->end)
+        status = p->sink->end (p->sink, p->lines_out);
+    return status;
+}
+
+void pipeline_cancel(Strip_Pipeline *p)
+{
+    // wait for the strips still on the pool and drop them
+    if (p->par)
+    {
+        if (p->par->status == SANE_STATUS_GOOD)
+            p->par->status = SANE_STATUS_CANCELLED;
+        collect_jobs (p, 0);
+    }
+    if (p->pending)
+    {
+        strip_pool_put (&p->pool, p->pending);
+        p->pending = NULL;
+    }
+    p->fill = 0;
+    p->active = 0;
+}
+
+void pipeline_release(Strip_Pipeline *p)
+{
+    pipeline_cancel (p);
+    pipeline_set_thread_pool (p, NULL, 0);
+    strip_pool_clear (&p->pool);
+}
+
+/* -------------------------------------------- */
+// PNM file sink
+
+#define PNM_HEADER_MAX	64
+
+typedef struct
+{
+    File_Writer *writer;
+    Strip_Format fmt;
+    uint64_t height_pos;    /* file offset of the height field */
+    SANE_Byte *swap;        /* big-endian copy of 16-bit strips */
+    size_t swap_size;
+    Digest *digest;         /* of the file as written, NULL: none */
+} Pnm_Sink;
+
+/**
+ * An unknown height is written as a fixed-width field padded with blanks,
+ * which PNM readers skip as whitespace, so it can be patched in place.
+ * Returns the length of the header in buf.
+ **/
+static int format_pnm_header (SANE_Frame format, int width, int height, int depth, char *buf, size_t size, long *height_pos)
+{
+    const char *magic;
+    int n;
+
+    switch (format)
+    {
+        case SANE_FRAME_RED:
+        case SANE_FRAME_GREEN:
+        case SANE_FRAME_BLUE:
+        case SANE_FRAME_RGB:
+            magic = "P6";
+            break;
+        default:
+            magic = (depth == 1) ? "P4" : "P5";
+            break;
+    }
+    n = snprintf (buf, size, "%s\n# SANE data follows\n%d ", magic, width);
+
+    *height_pos = n;
+    if (height < 0)
+        n += snprintf (buf + n, size - n, "%-10d\n", 0);
+    else
+        n += snprintf (buf + n, size - n, "%d\n", height);
+
+    if (format != SANE_FRAME_GRAY || depth != 1)
+        n += snprintf (buf + n, size - n, "%d\n", (depth <= 8) ? 255 : 65535);
+    return n;
+}
+
+static SANE_Status pnm_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Pnm_Sink *s = (Pnm_Sink *)sink->priv;
+    char header[PNM_HEADER_MAX];
+    uint64_t start = file_writer_tell (s->writer);
+    long height_pos;
+    int n;
+
+    s->fmt = *fmt;
+    n = format_pnm_header (fmt->format, fmt->pixels_per_line, fmt->lines, fmt->depth, header, sizeof (header), &height_pos);
+    s->height_pos = start + height_pos;
+    if (fmt->lines >= 0)
+        file_writer_reserve (s->writer, start + n + (uint64_t) fmt->lines * fmt->bytes_per_line);
+    if (file_writer_write (s->writer, header, n) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    if (s->digest)
+    {
+        digest_init (s->digest, s->digest->kind);
+        // a header still to be patched is hashed at the end
+        if (fmt->lines >= 0)
+            digest_update (s->digest, header, n);
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status pnm_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Pnm_Sink *s = (Pnm_Sink *)sink->priv;
+    size_t len = (size_t) strip->lines * s->fmt.bytes_per_line;
+    const SANE_Byte *data = strip->data;
+    SANE_Status status;
+    double span;
+
+#if !defined(WORDS_BIGENDIAN)
+    // PNM samples wider than 8 bits are big-endian
+    if (s->fmt.depth == 16)
+    {
+        size_t i;
+
+        if (s->swap_size < len)
+        {
+            SANE_Byte *swap = (SANE_Byte *)realloc (s->swap, len);
+            if (!swap)
+                return SANE_STATUS_NO_MEM;
+            s->swap = swap;
+            s->swap_size = len;
+        }
+        for (i = 0; i + 1 < len; i += 2)
+        {
+            s->swap[i] = data[i + 1];
+            s->swap[i + 1] = data[i];
+        }
+        data = s->swap;
+    }
+#endif
+
+    span = trace_begin ();
+    status = file_writer_write (s->writer, data, len);
+    trace_end (span, "write", NULL);
+    if (s->digest)
+        digest_update (s->digest, data, len);
+    return status;
+}
+
+/**
+ * Put the patched header in front of the data hashed so far.  A CRC is
+ * combined with that of the header; other digests read the file again.
+ **/
+static SANE_Status pnm_digest_header(Pnm_Sink *s, int lines)
+{
+    char header[PNM_HEADER_MAX];
+    uint64_t offset = 0;
+    long height_pos;
+    int n;
+
+    n = format_pnm_header (s->fmt.format, s->fmt.pixels_per_line, -1, s->fmt.depth, header, sizeof (header), &height_pos);
+    snprintf (header + height_pos, sizeof (header) - height_pos, "%-10d", lines);
+    header[height_pos + 10] = '\n';
+
+    if (s->digest->kind == DIGEST_CRC32C)
+    {
+        Digest *d = s->digest;
+
+        d->crc = crc32c_combine (crc32c (0, header, n), d->crc, d->length);
+        d->length += n;
+        return SANE_STATUS_GOOD;
+    }
+
+    digest_init (s->digest, s->digest->kind);
+    while (1)
+    {
+        SANE_Byte chunk[64 * 1024];
+        ssize_t got = file_writer_read (s->writer, offset, chunk, sizeof (chunk));
+
+        if (got < 0)
+            return SANE_STATUS_IO_ERROR;
+        if (!got)
+            break;
+        digest_update (s->digest, chunk, got);
+        offset += got;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status pnm_sink_end(Strip_Sink *sink, int lines)
+{
+    Pnm_Sink *s = (Pnm_Sink *)sink->priv;
+    double span;
+    int failed;
+
+    if (s->fmt.lines < 0)
+    {
+        char height[16];
+
+        snprintf (height, sizeof (height), "%-10d", lines);
+        if (file_writer_patch (s->writer, s->height_pos, height, 10) != SANE_STATUS_GOOD)
+            return SANE_STATUS_IO_ERROR;
+        if (s->digest && pnm_digest_header (s, lines) != SANE_STATUS_GOOD)
+            return SANE_STATUS_IO_ERROR;
+    }
+    else if (lines != s->fmt.lines)
+    {
+        // the header already promised the height, the file would not read back
+        log_error("pnm sink: expected %d lines, got %d\n", s->fmt.lines, lines);
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    span = trace_begin ();
+    failed = (file_writer_flush (s->writer) != SANE_STATUS_GOOD);
+    trace_end (span, "flush", NULL);
+    return failed ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+static void pnm_sink_destroy(Strip_Sink *sink)
+{
+    Pnm_Sink *s = (Pnm_Sink *)sink->priv;
+
+    free (s->swap);
+    free (s);
+    free (sink);
+}
+
+Strip_Sink *pnm_sink_create(File_Writer *writer)
+{
+    Strip_Sink *sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    Pnm_Sink *s = (Pnm_Sink *)calloc (1, sizeof (Pnm_Sink));
+
+    if (!sink || !s)
+    {
+        free (sink);
+        free (s);
+        return NULL;
+    }
+    s->writer = writer;
+    sink->begin = pnm_sink_begin;
+    sink->write = pnm_sink_write;
+    sink->end = pnm_sink_end;
+    sink->destroy = pnm_sink_destroy;
+    sink->priv = s;
+    return sink;
+}
+
+void pnm_sink_set_digest(Strip_Sink *sink, Digest *digest)
+{
+    ((Pnm_Sink *)sink->priv)->digest = digest;
+}
+
+/* -------------------------------------------- */
+// Pipeline sink
+
+static SANE_Status pipeline_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    return pipeline_begin ((Strip_Pipeline *)sink->priv, fmt);
+}
+
+static SANE_Status pipeline_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Strip_Pipeline *branch = (Strip_Pipeline *)sink->priv;
+
+    return pipeline_push (branch, strip->data, (size_t) strip->lines * branch->in.bytes_per_line);
+}
+
+static SANE_Status pipeline_sink_end(Strip_Sink *sink, int lines)
+{
+    return pipeline_end ((Strip_Pipeline *)sink->priv);
+}
+
+static void pipeline_sink_destroy(Strip_Sink *sink)
+{
+    free (sink);
+}
+
+Strip_Sink *pipeline_sink_create(Strip_Pipeline *branch)
+{
+    Strip_Sink *sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+
+    if (!sink)
+        return NULL;
+    sink->begin = pipeline_sink_begin;
+    sink->write = pipeline_sink_write;
+    sink->end = pipeline_sink_end;
+    sink->destroy = pipeline_sink_destroy;
+    sink->priv = branch;
+    return sink;
+}
+
+/* -------------------------------------------- */
+// Tee sink
+
+typedef struct
+{
+    Strip_Sink *sinks[TEE_MAX_SINKS];
+    int n_sinks;
+} Tee_Sink;
+
+static SANE_Status tee_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Tee_Sink *t = (Tee_Sink *)sink->priv;
+    SANE_Status status;
+    int i;
+
+    for (i = 0; i < t->n_sinks; i++)
+    {
+        if (!t->sinks[i]->begin)
+            continue;
+        status = t->sinks[i]->begin (t->sinks[i], fmt);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status tee_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Tee_Sink *t = (Tee_Sink *)sink->priv;
+    SANE_Status status;
+    int i;
+
+    for (i = 0; i < t->n_sinks; i++)
+    {
+        status = t->sinks[i]->write (t->sinks[i], strip);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+// Every sink gets its end, the first failure is returned
+static SANE_Status tee_sink_end(Strip_Sink *sink, int lines)
+{
+    Tee_Sink *t = (Tee_Sink *)sink->priv;
+    SANE_Status status = SANE_STATUS_GOOD, s;
+    int i;
+
+    for (i = 0; i < t->n_sinks; i++)
+    {
+        if (!t->sinks[i]->end)
+            continue;
+        s = t->sinks[i]->end (t->sinks[i], lines);
+        if (status == SANE_STATUS_GOOD)
+            status = s;
+    }
+    return status;
+}
+
+static void tee_sink_destroy(Strip_Sink *sink)
+{
+    free (sink->priv);
+    free (sink);
+}
+
+Strip_Sink *tee_sink_create()
+{
+    Strip_Sink *sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    Tee_Sink *t = (Tee_Sink *)calloc (1, sizeof (Tee_Sink));
+
+    if (!sink || !t)
+    {
+        free (sink);
+        free (t);
+        return NULL;
+    }
+    sink->begin = tee_sink_begin;
+    sink->write = tee_sink_write;
+    sink->end = tee_sink_end;
+    sink->destroy = tee_sink_destroy;
+    sink->priv = t;
+    return sink;
+}
+
+SANE_Status tee_sink_add(Strip_Sink *tee, Strip_Sink *sink)
+{
+    Tee_Sink *t = (Tee_Sink *)tee->priv;
+
+    if (!sink)
+        return SANE_STATUS_NO_MEM;
+    if (t->n_sinks >= TEE_MAX_SINKS)
+        return SANE_STATUS_INVAL;
+    t->sinks[t->n_sinks++] = sink;
+    return SANE_STATUS_GOOD;
+}
+
+void strip_sink_destroy(Strip_Sink *sink)
+{
+    if (sink && sink->destroy)
+        sink->destroy (sink);
+}
+
+#ifdef __cplusplus
+}
+#endif
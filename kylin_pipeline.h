@@ -0,0 +1,200 @@
+#ifndef KYLIN_PIPELINE_H
+#define KYLIN_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sane/sane.h"
+
+#include "kylin_threadpool.h"
+#include "kylin_digest.h"
+#include "kylin_writer.h"
+
+/**
+ * Strip processing pipeline.
+ *
+ * Data returned by sane_read() is reassembled into strips of complete
+ * lines (STRIP_HEIGHT lines, the last strip of a page may be shorter),
+ * passed through a chain of stages and handed to a sink.  Strip buffers
+ * are recycled through a pool, so once the first strips of a page went
+ * through the chain no more memory is allocated.
+ **/
+
+#define STRIP_HEIGHT	256
+#define PIPELINE_MAX_STAGES	16
+
+// Layout of the lines travelling between two stages
+typedef struct
+{
+    SANE_Frame format;      /* SANE_FRAME_GRAY or SANE_FRAME_RGB */
+    int depth;              /* bits per sample: 1, 8 or 16 (host byte order) */
+    int pixels_per_line;
+    int bytes_per_line;
+    int lines;              /* -1 while the page height is unknown */
+} Strip_Format;
+
+typedef struct Strip
+{
+    SANE_Byte *data;
+    size_t size;            /* capacity of data in bytes */
+    int lines;              /* complete lines held in data */
+    int y;                  /* page row of the first line */
+    int seq;                /* strip number within the page */
+    struct Strip *next;     /* pool free list */
+} Strip;
+
+typedef struct
+{
+    Strip *free_list;
+    int allocated;          /* strips owned by the pool */
+    int available;          /* strips currently on the free list */
+    int lock;               /* spin lock, strips are taken by pool workers too */
+} Strip_Pool;
+
+typedef struct
+{
+    uint64_t strips;
+    uint64_t lines;
+    uint64_t ns;            /* total time spent in process() */
+    uint64_t max_ns;
+} Stage_Stats;
+
+typedef struct Strip_Stage Strip_Stage;
+
+/**
+ * A stage declares its output format from its input format in configure()
+ * and converts one strip at a time in process().  The output strip has
+ * room for STRIP_HEIGHT lines of the output format; a stage sets out->lines
+ * and out->y, and may emit zero lines (e.g. a crop above its window).
+ * flush() is optional and emits lines a stage kept back at end of page.
+ * A stage that keeps no state between strips and has no flush() may set
+ * parallel, its process() then runs on several strips at once.
+ **/
+struct Strip_Stage
+{
+    const char *name;
+    SANE_Status (*configure) (Strip_Stage *stage, const Strip_Format *in, Strip_Format *out);
+    SANE_Status (*process) (Strip_Stage *stage, const Strip *in, Strip *out);
+    SANE_Status (*flush) (Strip_Stage *stage, Strip *out);
+    void (*destroy) (Strip_Stage *stage);
+    void *priv;
+    int parallel;
+    Strip_Format in;
+    Strip_Format out;
+    Stage_Stats stats;
+};
+
+typedef struct Strip_Sink Strip_Sink;
+
+struct Strip_Sink
+{
+    SANE_Status (*begin) (Strip_Sink *sink, const Strip_Format *fmt);
+    SANE_Status (*write) (Strip_Sink *sink, const Strip *strip);
+    SANE_Status (*end) (Strip_Sink *sink, int lines);
+    void (*destroy) (Strip_Sink *sink);
+    void *priv;
+};
+
+typedef struct Pipeline_Parallel Pipeline_Parallel;
+
+typedef struct
+{
+    int window;             /* strips allowed in flight */
+    int in_flight;          /* strips submitted and not yet written */
+    int max_in_flight;
+    int ready;              /* finished strips waiting for an earlier one */
+    int max_ready;
+    uint64_t jobs;
+    Thread_Pool_Stats pool;
+} Pipeline_Stats;
+
+typedef struct
+{
+    Strip_Stage *stages[PIPELINE_MAX_STAGES];
+    int n_stages;
+    Strip_Sink *sink;
+    Strip_Pool pool;
+    Strip_Format in;
+    Strip *pending;         /* strip being reassembled from sane_read data */
+    size_t fill;            /* bytes in pending */
+    int y;                  /* page row of the next line */
+    int seq;
+    int lines_out;          /* lines delivered to the sink */
+    int active;             /* between begin and end */
+    Pipeline_Parallel *par; /* NULL: every stage runs on the scanning thread */
+    int n_parallel;         /* leading stages run on the thread pool */
+} Strip_Pipeline;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fill a strip format from the parameters of a frame
+void strip_format_from_parameters(const SANE_Parameters *parm, Strip_Format *fmt);
+int strip_format_channels(const Strip_Format *fmt);
+// Bytes per line for a format with the given width
+int strip_format_line_bytes(SANE_Frame format, int depth, int pixels_per_line);
+
+Strip *strip_pool_get(Strip_Pool *pool, size_t size);
+void strip_pool_put(Strip_Pool *pool, Strip *strip);
+void strip_pool_clear(Strip_Pool *pool);
+
+void pipeline_init(Strip_Pipeline *p);
+// The pipeline owns the stage and destroys it in pipeline_clear_stages()
+SANE_Status pipeline_add_stage(Strip_Pipeline *p, Strip_Stage *stage);
+void pipeline_clear_stages(Strip_Pipeline *p);
+// The sink stays owned by the caller
+void pipeline_set_sink(Strip_Pipeline *p, Strip_Sink *sink);
+// Configure the chain for a page of the given input format
+SANE_Status pipeline_begin(Strip_Pipeline *p, const Strip_Format *in);
+// Feed raw bytes as returned by sane_read
+SANE_Status pipeline_push(Strip_Pipeline *p, const SANE_Byte *data, size_t len);
+// Flush the last strip and the stages, then close the page on the sink
+SANE_Status pipeline_end(Strip_Pipeline *p);
+// Drop a page in progress without writing anything more
+void pipeline_cancel(Strip_Pipeline *p);
+// Release the pooled buffers
+void pipeline_release(Strip_Pipeline *p);
+const Strip_Format *pipeline_output_format(const Strip_Pipeline *p);
+
+/**
+ * Run the leading parallel stages on a thread pool, with at most window
+ * strips in flight.  Strips are handed to the remaining stages and the
+ * sink in page order, so the output does not depend on the pool.
+ * A NULL pool goes back to running everything on the calling thread.
+ **/
+SANE_Status pipeline_set_thread_pool(Strip_Pipeline *p, Thread_Pool *pool, int window);
+void pipeline_get_stats(Strip_Pipeline *p, Pipeline_Stats *stats);
+void pipeline_print_stats(Strip_Pipeline *p);
+
+/**
+ * Writes strips as a PNM file; the height is patched at end if it was
+ * unknown, and the file reserved up front if it was known.  The writer
+ * stays owned by the caller.
+ **/
+Strip_Sink *pnm_sink_create(File_Writer *writer);
+/**
+ * Hash the file as it is written, header included; digest->kind says how
+ * and the digest stays owned by the caller.  With an unknown height the
+ * file is read back at the end, unless the digest is a CRC.
+ **/
+void pnm_sink_set_digest(Strip_Sink *sink, Digest *digest);
+// Feeds strips into another pipeline, e.g. a branch of a tee
+Strip_Sink *pipeline_sink_create(Strip_Pipeline *branch);
+// Hands every strip to each of its sinks in turn; the sinks stay owned by the caller
+#define TEE_MAX_SINKS	8
+Strip_Sink *tee_sink_create();
+SANE_Status tee_sink_add(Strip_Sink *tee, Strip_Sink *sink);
+void strip_sink_destroy(Strip_Sink *sink);
+
+// Built-in stages (kylin_stages.cpp)
+Strip_Stage *convert_stage_create(SANE_Frame format);
+Strip_Stage *crop_stage_create(int x, int y, int width, int height);
+Strip_Stage *threshold_stage_create(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
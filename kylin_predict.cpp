@@ -0,0 +1,150 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kylin_predict.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HISTORY_WEIGHT	0.3     /* of the newest scan in the moving averages */
+
+static Scan_History history[HISTORY_MAX];
+static int n_history = 0;
+
+static Scan_History *history_entry(const char *device, int dpi, int create)
+{
+    Scan_History *h;
+    int i;
+
+    for (i = 0; i < n_history; i++)
+        if (history[i].dpi == dpi && !strcmp (history[i].device, device))
+            return &history[i];
+    if (!create)
+        return NULL;
+
+    // full: the least used entry goes
+    if (n_history < HISTORY_MAX)
+        h = &history[n_history++];
+    else
+    {
+        h = &history[0];
+        for (i = 1; i < n_history; i++)
+            if (history[i].scans < h->scans)
+                h = &history[i];
+    }
+    memset (h, 0, sizeof (*h));
+    snprintf (h->device, sizeof (h->device), "%s", device);
+    h->dpi = dpi;
+    return h;
+}
+
+void history_record(const char *device, int dpi, double warmup, size_t bytes, double transfer_seconds)
+{
+    Scan_History *h;
+    double rate;
+
+    if (!device || transfer_seconds <= 0. || !bytes)
+        return;
+    h = history_entry (device, dpi, 1);
+    rate = bytes / transfer_seconds;
+    if (h->scans == 0)
+    {
+        h->warmup = warmup;
+        h->rate = rate;
+    }
+    else
+    {
+        h->warmup += HISTORY_WEIGHT * (warmup - h->warmup);
+        h->rate += HISTORY_WEIGHT * (rate - h->rate);
+    }
+    h->scans++;
+}
+
+const Scan_History *history_find(const char *device, int dpi)
+{
+    const Scan_History *best = NULL;
+    int i;
+
+    if (!device)
+        return NULL;
+    for (i = 0; i < n_history; i++)
+    {
+        if (strcmp (history[i].device, device))
+            continue;
+        if (!best || abs (history[i].dpi - dpi) < abs (best->dpi - dpi))
+            best = &history[i];
+    }
+    return best;
+}
+
+void history_clear()
+{
+    n_history = 0;
+}
+
+SANE_Status history_load(const char *path)
+{
+    FILE *fp = fopen (path, "r");
+    Scan_History h;
+
+    if (!fp)
+        return SANE_STATUS_ACCESS_DENIED;
+    memset (&h, 0, sizeof (h));
+    while (fscanf (fp, "%63s %d %d %lf %lf", h.device, &h.dpi, &h.scans, &h.warmup, &h.rate) == 5)
+    {
+        Scan_History *e = history_entry (h.device, h.dpi, 1);
+
+        *e = h;
+    }
+    fclose (fp);
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status history_save(const char *path)
+{
+    FILE *fp = fopen (path, "w");
+    int i, failed;
+
+    if (!fp)
+        return SANE_STATUS_ACCESS_DENIED;
+    for (i = 0; i < n_history; i++)
+        fprintf (fp, "%s %d %d %.3f %.0f\n", history[i].device, history[i].dpi,
+                 history[i].scans, history[i].warmup, history[i].rate);
+    failed = (fclose (fp) != 0);
+    return failed ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+void scan_predict(const char *device, int dpi, const SANE_Parameters *parm, double height_mm,
+                  Scan_Prediction *prediction)
+{
+    const Scan_History *h = history_find (device, dpi);
+    int lines = parm->lines;
+    double rate;
+
+    if (lines < 0)
+        lines = (int) ceil (height_mm / 25.4 * dpi);
+    prediction->bytes = (size_t) parm->bytes_per_line * lines;
+    if (parm->format >= SANE_FRAME_RED && parm->format <= SANE_FRAME_BLUE)
+        prediction->bytes *= 3;
+
+    if (h)
+    {
+        prediction->warmup = h->warmup;
+        rate = h->rate;
+        prediction->from_history = (h->dpi == dpi) ? 2 : 1;
+    }
+    else
+    {
+        prediction->warmup = HISTORY_DEFAULT_WARMUP;
+        rate = HISTORY_DEFAULT_RATE;
+        prediction->from_history = 0;
+    }
+    prediction->seconds = prediction->warmup + prediction->bytes / rate;
+}
+
+#ifdef __cplusplus
+}
+#endif
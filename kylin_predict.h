@@ -0,0 +1,59 @@
+#ifndef KYLIN_PREDICT_H
+#define KYLIN_PREDICT_H
+
+#include <stddef.h>
+
+#include "sane/sane.h"
+
+/**
+ * Scan history and predictions.  Every finished scan records how long
+ * the device took to send its first byte (lamp warm-up, carriage travel)
+ * and the rate of the transfer after that, per device and resolution.
+ * Predictions combine that with the parameters of the next scan.
+ **/
+#define HISTORY_MAX	64
+#define HISTORY_DEFAULT_WARMUP	5.          /* s, for a device never seen */
+#define HISTORY_DEFAULT_RATE	(2. * 1e6)  /* bytes/s */
+
+typedef struct
+{
+    char device[64];
+    int dpi;
+    int scans;
+    double warmup;          /* s from sane_start to the first byte, moving average */
+    double rate;            /* bytes/s after the first byte, moving average */
+} Scan_History;
+
+typedef struct
+{
+    size_t bytes;           /* sent by the device */
+    double warmup;
+    double seconds;         /* warm-up and transfer */
+    size_t peak_memory;     /* held by the host at once */
+    int from_history;       /* 0: defaults, 1: nearest resolution, 2: this resolution */
+} Scan_Prediction;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void history_record(const char *device, int dpi, double warmup, size_t bytes, double transfer_seconds);
+// Entry for device at dpi, else the one nearest in resolution, NULL if the device is unknown
+const Scan_History *history_find(const char *device, int dpi);
+void history_clear();
+// One entry per line: device dpi scans warmup rate
+SANE_Status history_load(const char *path);
+SANE_Status history_save(const char *path);
+
+/**
+ * Bytes and time of a scan with these parameters; height_mm stands in for
+ * an unknown number of lines.  peak_memory is left to the caller.
+ **/
+void scan_predict(const char *device, int dpi, const SANE_Parameters *parm, double height_mm,
+                  Scan_Prediction *prediction);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kylin_log.h"
+#include "kylin_readprof.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BACKTRACK_FACTOR	8.      /* times the median read */
+#define BACKTRACK_MIN	0.05        /* s, shorter reads are never counted */
+#define PARALLEL_HOST_SHARE	0.5     /* of the transfer spent on the host */
+#define SPIKE_FACTOR	10.         /* times the median host gap */
+#define RATE_WINDOW	0.25            /* s per line rate counter in the timeline */
+
+void read_profile_init(Read_Profile *profile, int bytes_per_line)
+{
+    memset (profile, 0, sizeof (*profile));
+    profile->bytes_per_line = bytes_per_line;
+}
+
+void read_profile_release(Read_Profile *profile)
+{
+    free (profile->samples);
+    memset (profile, 0, sizeof (*profile));
+}
+
+void read_profile_add(Read_Profile *profile, double start, double end, int len)
+{
+    Read_Sample *s;
+
+    if (profile->n_samples == profile->alloc)
+    {
+        int alloc = profile->alloc ? 2 * profile->alloc : 1024;
+
+        s = (Read_Sample *)realloc (profile->samples, alloc * sizeof (Read_Sample));
+        if (!s)
+            return;
+        profile->samples = s;
+        profile->alloc = alloc;
+    }
+    s = &profile->samples[profile->n_samples++];
+    s->start = start;
+    s->end = end;
+    s->len = len;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+void read_profile_report(const Read_Profile *profile, size_t read_size, Read_Report *report)
+{
+    const Read_Sample *s = profile->samples;
+    int n = profile->n_samples, i, spikes = 0;
+    double *durations, transfer, rate, median_gap;
+
+    memset (report, 0, sizeof (*report));
+    report->reads = n;
+    if (!n)
+        return;
+    durations = (double *)malloc (n * sizeof (double));
+    if (!durations)
+        return;
+    for (i = 0; i < n; i++)
+    {
+        durations[i] = s[i].end - s[i].start;
+        report->bytes += s[i].len;
+        report->read_time += durations[i];
+        if (i)
+            report->host_time += s[i].start - s[i - 1].end;
+    }
+    qsort (durations, n, sizeof (double), compare_double);
+    report->median_read = durations[n / 2];
+    // and of the host gaps
+    for (i = 1; i < n; i++)
+        durations[i - 1] = s[i].start - s[i - 1].end;
+    qsort (durations, n - 1, sizeof (double), compare_double);
+    median_gap = (n > 1) ? durations[(n - 1) / 2] : 0.;
+    free (durations);
+
+    transfer = s[n - 1].end - s[0].start;
+    if (transfer > 0. && profile->bytes_per_line > 0)
+        report->line_rate = (double) report->bytes / profile->bytes_per_line / transfer;
+
+    // time of a read over what its length takes at the average rate
+    rate = (report->read_time > 0.) ? report->bytes / report->read_time : 0.;
+    for (i = 1; i < n && rate > 0.; i++)
+    {
+        double excess = s[i].end - s[i].start - s[i].len / rate, gap;
+
+        if (excess < BACKTRACK_MIN || excess < BACKTRACK_FACTOR * report->median_read)
+            continue;
+        // the host kept the device waiting just before
+        gap = s[i].start - s[i - 1].end;
+        if (gap > report->median_read)
+        {
+            report->backtracks++;
+            report->backtrack_time += excess;
+            if (gap > SPIKE_FACTOR * median_gap)
+                spikes++;
+        }
+        else
+            report->pauses++;
+    }
+
+    if (!report->backtracks)
+        return;
+    /**
+     * Gaps far over the usual one are a strip going through the pipeline,
+     * which the thread pool takes off the reading thread; otherwise every
+     * call costs too much and fewer, larger reads help.
+     **/
+    if (spikes * 2 > report->backtracks || (transfer > 0. && report->host_time > PARALLEL_HOST_SHARE * transfer))
+        report->suggest_parallel = 1;
+    if (spikes * 2 <= report->backtracks && read_size < READ_SIZE_MAX)
+        report->suggested_read_size = (read_size * 4 < READ_SIZE_MAX) ? read_size * 4 : READ_SIZE_MAX;
+}
+
+void read_report_print(const Read_Report *report)
+{
+    log_info("reads: %d, %.1f MB, %.0f lines/s, %.2f s in sane_read, %.2f s on the host, median read %.2f ms\n",
+             report->reads, report->bytes / 1e6, report->line_rate, report->read_time,
+             report->host_time, report->median_read * 1e3);
+    if (report->backtracks || report->pauses)
+        log_info("reads: %d backtracks (%.2f s lost), %d device pauses\n",
+                 report->backtracks, report->backtrack_time, report->pauses);
+    if (report->suggested_read_size)
+        log_info("reads: the host does not keep up, read %zu bytes at a time\n", report->suggested_read_size);
+    if (report->suggest_parallel)
+        log_info("reads: the pipeline holds up the reads, run it in parallel\n");
+}
+
+SANE_Status read_profile_write_timeline(const Read_Profile *profile, const char *path)
+{
+    const Read_Sample *s = profile->samples;
+    double t0, window = 0.;
+    size_t window_bytes = 0;
+    FILE *fp;
+    int i, failed;
+
+    if (!profile->n_samples)
+        return SANE_STATUS_INVAL;
+    fp = fopen (path, "w");
+    if (!fp)
+        return SANE_STATUS_ACCESS_DENIED;
+
+    // microseconds from the first call
+    t0 = s[0].start;
+    fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf (fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"sane_read\"}}");
+    for (i = 0; i < profile->n_samples; i++)
+    {
+        fprintf (fp, ",\n{\"name\":\"read\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"bytes\":%d}}",
+                 (s[i].start - t0) * 1e6, (s[i].end - s[i].start) * 1e6, s[i].len);
+        if (i)
+            fprintf (fp, ",\n{\"name\":\"host\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f}",
+                     (s[i - 1].end - t0) * 1e6, (s[i].start - s[i - 1].end) * 1e6);
+
+        window_bytes += s[i].len;
+        if (s[i].end - t0 - window >= RATE_WINDOW || i == profile->n_samples - 1)
+        {
+            double lines = profile->bytes_per_line ? (double) window_bytes / profile->bytes_per_line : 0.;
+            double span = s[i].end - t0 - window;
+
+            fprintf (fp, ",\n{\"name\":\"lines/s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.1f,\"args\":{\"rate\":%.0f}}",
+                     window * 1e6, (span > 0.) ? lines / span : 0.);
+            window = s[i].end - t0;
+            window_bytes = 0;
+        }
+    }
+    fprintf (fp, "\n]}\n");
+    failed = (fclose (fp) != 0);
+    return failed ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,70 @@
+#ifndef KYLIN_READPROF_H
+#define KYLIN_READPROF_H
+
+#include <stddef.h>
+
+#include "sane/sane.h"
+
+/**
+ * Profile of the sane_read calls of one scan.  Every call that returned
+ * data is kept with the time it was made and the time it returned; the
+ * time between two calls is spent by the host.
+ *
+ * A scanner whose buffer fills up because the host does not read fast
+ * enough stops, moves the carriage back and scans the lines again, so
+ * the read after a long host gap takes far longer than its length would
+ * at the average rate.  Such reads are counted as backtracks; long reads
+ * without a host gap before them are the device pausing on its own.
+ **/
+#define READ_SIZE_MIN	(32 * 1024)
+#define READ_SIZE_MAX	(1024 * 1024)
+
+typedef struct
+{
+    double start;           /* sane_read called */
+    double end;             /* and returned */
+    int len;
+} Read_Sample;
+
+typedef struct
+{
+    Read_Sample *samples;
+    int n_samples;
+    int alloc;
+    int bytes_per_line;
+} Read_Profile;
+
+typedef struct
+{
+    int reads;
+    size_t bytes;
+    double line_rate;       /* lines/s from the first to the last byte */
+    double read_time;       /* s in sane_read */
+    double host_time;       /* s between the calls */
+    double median_read;     /* s of one call */
+    int backtracks;
+    double backtrack_time;  /* s lost in them */
+    int pauses;
+    size_t suggested_read_size;     /* 0: the read size is fine */
+    int suggest_parallel;   /* the host time is in the pipeline, spread it over threads */
+} Read_Report;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void read_profile_init(Read_Profile *profile, int bytes_per_line);
+void read_profile_release(Read_Profile *profile);
+// Drops samples when out of memory, the profile is then only shorter
+void read_profile_add(Read_Profile *profile, double start, double end, int len);
+// read_size: the buffer given to sane_read
+void read_profile_report(const Read_Profile *profile, size_t read_size, Read_Report *report);
+void read_report_print(const Read_Report *report);
+// Trace-event JSON with one span per read and host gap, for chrome://tracing or Perfetto
+SANE_Status read_profile_write_timeline(const Read_Profile *profile, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
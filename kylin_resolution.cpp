@@ -0,0 +1,114 @@
+#include <math.h>
+
+#include "kylin_resolution.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SANE_Word resolution_pick(const SANE_Option_Descriptor *opt, int dpi, int *met)
+{
+    SANE_Word want = (opt->type == SANE_TYPE_FIXED) ? SANE_FIX (dpi) : dpi;
+    SANE_Word best = -1, highest = 0;
+    int i;
+
+    *met = 1;
+    if (opt->constraint_type == SANE_CONSTRAINT_WORD_LIST)
+    {
+        for (i = 1; i <= opt->constraint.word_list[0]; i++)
+        {
+            SANE_Word w = opt->constraint.word_list[i];
+
+            if (w >= want && (best < 0 || w < best))
+                best = w;
+            if (w > highest)
+                highest = w;
+        }
+        if (best < 0)
+        {
+            *met = 0;
+            return highest;
+        }
+        return best;
+    }
+    if (opt->constraint_type == SANE_CONSTRAINT_RANGE)
+    {
+        const SANE_Range *range = opt->constraint.range;
+
+        if (want < range->min)
+            want = range->min;
+        if (want > range->max)
+        {
+            want = range->max;
+            *met = 0;
+        }
+        if (range->quant > 0)
+        {
+            SANE_Word steps = (want - range->min + range->quant - 1) / range->quant;
+
+            if (range->min + steps * range->quant > range->max)
+            {
+                steps--;
+                *met = 0;
+            }
+            want = range->min + steps * range->quant;
+        }
+    }
+    return want;
+}
+
+int resolution_dpi(const SANE_Option_Descriptor *opt, SANE_Word value)
+{
+    if (opt->type == SANE_TYPE_FIXED)
+        return (int) floor (SANE_UNFIX (value) + 0.5);
+    return value;
+}
+
+SANE_Status resolution_plan(const SANE_Option_Descriptor *opt, const Resolution_Target *target,
+                            Resolution_Plan *plan)
+{
+    int need = target->min_dpi;
+
+    if (target->min_dpi < 0 || target->output_dpi < 0)
+        return SANE_STATUS_INVAL;
+    // downscaling only, so the scan has to be at least as fine as the output
+    if (target->output_dpi > need)
+        need = target->output_dpi;
+
+    plan->value = resolution_pick (opt, need, &plan->met);
+    plan->scan_dpi = resolution_dpi (opt, plan->value);
+    if (plan->scan_dpi <= 0)
+        return SANE_STATUS_INVAL;
+    plan->output_dpi = target->output_dpi ? target->output_dpi : plan->scan_dpi;
+    if (plan->output_dpi > plan->scan_dpi)
+        plan->output_dpi = plan->scan_dpi;
+    plan->scale = (double) plan->output_dpi / plan->scan_dpi;
+    plan->scan_bytes = plan->output_bytes = 0;
+    return SANE_STATUS_GOOD;
+}
+
+void resolution_plan_bytes(Resolution_Plan *plan, const SANE_Parameters *parm, double height_mm)
+{
+    SANE_Frame format = parm->format;
+    int lines = parm->lines;
+    int frames = 1;
+    int width, height;
+
+    if (lines < 0)
+        lines = (int) ceil (height_mm / 25.4 * plan->scan_dpi);
+    // three-pass colour comes out of the pipeline as RGB
+    if (format >= SANE_FRAME_RED && format <= SANE_FRAME_BLUE)
+    {
+        format = SANE_FRAME_RGB;
+        frames = 3;
+    }
+    plan->scan_bytes = (size_t) parm->bytes_per_line * lines * frames;
+
+    width = (int) ceil (parm->pixels_per_line * plan->scale);
+    height = (int) ceil (lines * plan->scale);
+    plan->output_bytes = (size_t) strip_format_line_bytes (format, parm->depth, width) * height;
+}
+
+#ifdef __cplusplus
+}
+#endif
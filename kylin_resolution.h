@@ -0,0 +1,54 @@
+#ifndef KYLIN_RESOLUTION_H
+#define KYLIN_RESOLUTION_H
+
+#include <stddef.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Resolution planning.  Data grows with dpi squared, so the device is set
+ * to the lowest resolution that meets the target; an exact output dpi
+ * below that is reached by downscaling on the host.
+ **/
+typedef struct
+{
+    int min_dpi;            /* effective resolution needed, e.g. 280 for OCR */
+    int output_dpi;         /* exact resolution of the files, 0: as scanned */
+} Resolution_Target;
+
+typedef struct
+{
+    SANE_Word value;        /* for the resolution option */
+    int scan_dpi;
+    int output_dpi;
+    int met;                /* the device reaches the target */
+    double scale;           /* host downscale, output_dpi / scan_dpi */
+    size_t scan_bytes;      /* per page from the device, 0: not known yet */
+    size_t output_bytes;    /* per page after downscaling */
+} Resolution_Plan;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Option value of the lowest resolution opt accepts at or above dpi (word
+ * list, or range rounded up to quant), else of its highest; *met tells
+ * which.  Handles int and fixed resolution options.
+ **/
+SANE_Word resolution_pick(const SANE_Option_Descriptor *opt, int dpi, int *met);
+int resolution_dpi(const SANE_Option_Descriptor *opt, SANE_Word value);
+
+SANE_Status resolution_plan(const SANE_Option_Descriptor *opt, const Resolution_Target *target,
+                            Resolution_Plan *plan);
+/**
+ * Page sizes of a plan from the parameters the device reports at the
+ * planned resolution; height_mm stands in for an unknown number of lines.
+ **/
+void resolution_plan_bytes(Resolution_Plan *plan, const SANE_Parameters *parm, double height_mm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
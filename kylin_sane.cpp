@@ -14,12 +14,130 @@ typedef struct
 }
 Image;
 
-#define STRIP_HEIGHT	256
 static SANE_Handle device = NULL;
-static int verbose;
-static int progress = 0;
+static const Scan_Backend *backend = &sane_backend;     /* calls of the scan path */
 static SANE_Byte *buffer;
 static size_t buffer_size;
+static Strip_Pipeline pipeline;
+
+// Extra downscaled copies written from the same scan
+typedef struct
+{
+    char suffix[32];
+    double scale;
+    int max_size;
+} Scan_Output;
+
+#define SCAN_MAX_OUTPUTS	4
+static Scan_Output scan_outputs[SCAN_MAX_OUTPUTS];
+static int n_scan_outputs = 0;
+
+static int blank_action = BLANK_OFF;
+static Blank_Config blank_config;
+static Blank_Result blank_result;
+static int blank_result_valid = 0;
+static int page_stats_on = 0;
+static Page_Stats page_stats;
+static int page_stats_valid = 0;
+static int scan_digest = DIGEST_NONE;
+static char scan_digest_hex[DIGEST_HEX_MAX];
+static int scan_file_flags = WRITER_PREALLOCATE;
+static int scan_file_depth = WRITER_DEFAULT_DEPTH;
+static Durable_Config durable_config = { DURABLE_NONE, DURABLE_GROUP_PAGES, DURABLE_GROUP_INTERVAL };
+static Shm_Ring *shm_output = NULL;
+static double shm_output_timeout = 0.;
+static int duplicate_on = 0;
+static int duplicate_threshold = PHASH_DEFAULT_THRESHOLD;
+static Phash_Index duplicate_index;
+static Duplicate_Result duplicate_result;
+static int duplicate_result_valid = 0;
+
+// Scan area taken from a preview scan
+#define AUTO_CROP_DELTA	24      /* 8-bit gray levels between background and document */
+static int auto_geometry = 0;
+static int scan_area_set = 0;       /* set_scan_area() was called */
+static int mode_set = 0;            /* set_scan_mode() was called */
+
+// Resolution chosen by set_scan_resolution()
+static int resolution_set = 0;
+static double scan_resample = 1.;   /* host downscale of every page */
+
+// Timing of the scan in progress, recorded into the history when it ends
+typedef struct
+{
+    double start;           /* before sane_start */
+    double first_byte;      /* 0: nothing read yet */
+    double end;
+    size_t bytes;
+} Scan_Timing;
+
+static char device_name[64];
+static Scan_Timing scan_timing;
+static char history_path[PATH_MAX];
+static size_t memory_budget = 0;    /* bytes, 0: no limit */
+static int auto_preview_dpi = 75;
+static double auto_margin = 2.;     /* mm */
+
+/**
+ * Cancellation of the scan in progress from another thread.  cancle_scan()
+ * sets requested and calls sane_cancel, which stops a blocked sane_read;
+ * scan_it also checks requested between reads.  In non-blocking mode the
+ * wait for data polls the select fd together with a pipe cancle_scan()
+ * writes to.
+ **/
+#define CANCEL_DRAIN_TIMEOUT	2.      /* s of reads after sane_cancel before giving up */
+#define CANCEL_LATENCY_TARGET	0.25    /* s from the request to the device being idle */
+#define SCAN_POLL_MS	100
+
+typedef struct
+{
+    int active;             /* between sane_start and the end of do_scan */
+    int requested;
+    double requested_at;
+    double latency;         /* of the last cancelled scan, s */
+    int nonblocking;        /* use non-blocking reads when the backend can */
+    int select_fd;          /* of the current frame, -1: blocking reads */
+    int wake[2];            /* pipe, -1 until non-blocking mode is first used */
+} Scan_Cancel;
+
+static Scan_Cancel scan_cancel = { 0, 0, 0., 0., 0, -1, { -1, -1 } };
+
+/**
+ * A read that stalls for the set_stall_watchdog() timeout is cancelled by
+ * the watchdog, and the device closed and opened again.  The handle the
+ * caller has is then stale_handle; live_handle() maps it to the new one.
+ **/
+static SANE_Handle stale_handle = NULL;
+
+// Profile of the reads of every scan, see kylin_readprof.h
+static int read_profile_on = 0;
+static int read_profile_auto = 0;   /* take the suggested read size and parallel mode */
+static int read_profile_active = 0; /* scan_it records, not for previews */
+static size_t read_size = READ_SIZE_MIN;
+static Read_Profile read_profile;
+static Read_Report read_report;
+static int read_report_valid = 0;
+
+// Option value kept across a reopen
+typedef struct
+{
+    char *name;
+    void *value;
+} Saved_Option;
+
+// Files written by one scan
+typedef struct
+{
+    char path[PATH_MAX];
+    char part_path[PATH_MAX];
+    File_Writer *writer;
+    Strip_Sink *sink;           /* PNM writer of writer */
+    Strip_Pipeline branch;      /* downscaler of an extra output */
+    Strip_Sink *branch_sink;    /* feeds branch from the tee */
+    Digest digest;              /* of the file as written */
+    char digest_path[PATH_MAX + 8];
+    char digest_part_path[PATH_MAX + 16];
+} Scan_File;
 
 /* -------------------------------------------- */
 // 设置n的i位为1，i从0开始
@@ -40,49 +158,219 @@ auth_callback (SANE_String_Const resource,
 {
 }
 
-static void write_pnm_header (SANE_Frame format, int width, int height, int depth, FILE *ofp)
+static int current_dpi(SANE_Handle sane_handle);
+static const SANE_Option_Descriptor *get_optdesc_by_name(SANE_Handle device, const char *name, int *option_num);
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sane_start, and the io mode of the new frame
+static SANE_Status start_frame()
 {
-    switch (format)
+    SANE_Status status;
+    SANE_Int fd;
+
+    double span = trace_begin ();
+
+    scan_cancel.select_fd = -1;
+    status = backend->start (device);
+    trace_end (span, "sane_start", NULL);
+    if (status != SANE_STATUS_GOOD || !scan_cancel.nonblocking)
+        return status;
+    if (backend->set_io_mode (device, SANE_TRUE) == SANE_STATUS_GOOD)
     {
-        case SANE_FRAME_RED:
-        case SANE_FRAME_GREEN:
-        case SANE_FRAME_BLUE:
-        case SANE_FRAME_RGB:
-            fprintf (ofp, "P6\n# SANE data follows\n%d %d\n%d\n", width, height, (depth <= 8) ? 255 : 65535);
-            break;
-        default:
-            if (depth == 1)
-                fprintf (ofp, "P4\n# SANE data follows\n%d %d\n", width, height);
-            else
-                fprintf (ofp, "P5\n# SANE data follows\n%d %d\n%d\n", width, height,(depth <= 8) ? 255 : 65535);
-            break;
+        if (backend->get_select_fd (device, &fd) == SANE_STATUS_GOOD)
+            scan_cancel.select_fd = fd;
+        else
+            backend->set_io_mode (device, SANE_FALSE);
     }
+    return SANE_STATUS_GOOD;
 }
 
-static SANE_Status scan_it (FILE *ofp)
+static int cancel_requested()
 {
-    int i, len, first_frame = 1, offset = 0, must_buffer = 0, hundred_percent;
-    SANE_Byte min = 0xff, max = 0;
+    return __atomic_load_n (&scan_cancel.requested, __ATOMIC_ACQUIRE);
+}
+
+static SANE_Handle live_handle(SANE_Handle sane_handle)
+{
+    return (sane_handle && sane_handle == stale_handle) ? device : sane_handle;
+}
+
+// Watchdog handler, on its thread: make the stalled read return
+static void stall_cancel(void *)
+{
+    cancle_scan (device);
+}
+
+// Values of the settable options, by name
+static int save_options(SANE_Handle sane_handle, Saved_Option **saved)
+{
+    const SANE_Option_Descriptor *opt;
+    SANE_Int count = 0;
+    int i, n = 0;
+
+    *saved = NULL;
+    if (sane_control_option (sane_handle, 0, SANE_ACTION_GET_VALUE, &count, NULL) != SANE_STATUS_GOOD || count <= 1)
+        return 0;
+    *saved = (Saved_Option *)calloc (count, sizeof (Saved_Option));
+    if (!*saved)
+        return 0;
+    for (i = 1; i < count; i++)
+    {
+        opt = sane_get_option_descriptor (sane_handle, i);
+        if (!opt || !opt->name || !opt->name[0] || opt->size <= 0
+            || opt->type == SANE_TYPE_BUTTON || opt->type == SANE_TYPE_GROUP
+            || !SANE_OPTION_IS_ACTIVE (opt->cap) || !SANE_OPTION_IS_SETTABLE (opt->cap))
+            continue;
+        (*saved)[n].value = malloc (opt->size);
+        (*saved)[n].name = strdup (opt->name);
+        if (!(*saved)[n].value || !(*saved)[n].name
+            || sane_control_option (sane_handle, i, SANE_ACTION_GET_VALUE, (*saved)[n].value, NULL) != SANE_STATUS_GOOD)
+        {
+            free ((*saved)[n].value);
+            free ((*saved)[n].name);
+            continue;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Set the saved values in their original order (none without a handle) and free them
+static void restore_options(SANE_Handle sane_handle, Saved_Option *saved, int n)
+{
+    const SANE_Option_Descriptor *opt;
+    int i, optnum;
+
+    for (i = 0; i < n; i++)
+    {
+        opt = sane_handle ? get_optdesc_by_name (sane_handle, saved[i].name, &optnum) : NULL;
+
+        if (opt && SANE_OPTION_IS_ACTIVE (opt->cap) && SANE_OPTION_IS_SETTABLE (opt->cap))
+            sane_control_option (sane_handle, optnum, SANE_ACTION_SET_VALUE, saved[i].value, NULL);
+        free (saved[i].value);
+        free (saved[i].name);
+    }
+    free (saved);
+}
+
+/**
+ * After a stall the handle may be wedged: close the device and open it
+ * again with the options it had.
+ **/
+static SANE_Status reopen_device()
+{
+    Saved_Option *saved;
+    SANE_Handle handle;
+    SANE_Status status;
+    int n;
+
+    n = save_options (device, &saved);
+    sane_close (device);
+    status = sane_open (device_name, &handle);
+    if (status != SANE_STATUS_GOOD)
+    {
+        log_warn("stall: cannot open %s again (%s)\n", device_name, sane_strstatus (status));
+        restore_options (NULL, saved, n);
+        return status;
+    }
+    restore_options (handle, saved, n);
+    // the handle the caller got from open_device stays usable
+    if (!stale_handle)
+        stale_handle = device;
+    device = handle;
+    log_info("stall: %s opened again, %d options restored\n", device_name, n);
+    return SANE_STATUS_GOOD;
+}
+
+// Non-blocking mode: wait for data or a cancel request
+static void wait_readable()
+{
+    struct pollfd fds[2];
+
+    fds[0].fd = scan_cancel.select_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = scan_cancel.wake[0];
+    fds[1].events = POLLIN;
+    poll (fds, 2, SCAN_POLL_MS);
+}
+
+// After sane_cancel the backend reports CANCELLED once the device stopped
+static void drain_cancelled()
+{
+    double deadline = now_sec () + CANCEL_DRAIN_TIMEOUT;
+    SANE_Status status;
+    SANE_Int len;
+
+    do
+    {
+        status = backend->read (device, buffer, buffer_size, &len);
+        if (status == SANE_STATUS_GOOD && len == 0 && scan_cancel.select_fd >= 0)
+            wait_readable ();
+    } while (status == SANE_STATUS_GOOD && now_sec () < deadline);
+}
+
+static void scan_begin_cancellable()
+{
+    char c;
+
+    if (scan_cancel.wake[0] >= 0)
+        while (read (scan_cancel.wake[0], &c, 1) == 1)
+            ;
+    __atomic_store_n (&scan_cancel.requested, 0, __ATOMIC_RELEASE);
+    __atomic_store_n (&scan_cancel.active, 1, __ATOMIC_RELEASE);
+    metric_set (METRIC_SCANNING, 1);
+}
+
+static void scan_end_cancellable(SANE_Status status)
+{
+    __atomic_store_n (&scan_cancel.active, 0, __ATOMIC_RELEASE);
+    metric_set (METRIC_SCANNING, 0);
+    if (status == SANE_STATUS_CANCELLED && cancel_requested ())
+    {
+        scan_cancel.latency = now_sec () - scan_cancel.requested_at;
+        log_info("scan cancelled, idle after %.0f ms%s\n", scan_cancel.latency * 1e3,
+               (scan_cancel.latency > CANCEL_LATENCY_TARGET) ? " (over target)" : "");
+    }
+    // nothing before the next scan begins may see it
+    __atomic_store_n (&scan_cancel.requested, 0, __ATOMIC_RELEASE);
+}
+
+static SANE_Status scan_it (Strip_Pipeline *p, Strip_Sink *sink)
+{
+    int len, first_frame = 1, must_buffer = 0;
     SANE_Parameters parm;
     SANE_Status status;
     Image image = { 0, 0, 0, 0, 0 };
     static const char *format_name[] = {"gray", "RGB", "red", "green", "blue"};
-    SANE_Word total_bytes = 0, expected_bytes;
-    SANE_Int hang_over = -1;
+    SANE_Word expected_bytes;
+    size_t frame_bytes = 0, image_size = 0;
+    Strip_Format fmt;
+    Scan_Chunk chunk;
+    Scan_Chunk_Kernel consume;
+
+    pipeline_set_sink (p, sink);
+    scan_chunk_init (&chunk, p);
 
     do
     {
         if (!first_frame)
         {
-            status = sane_start (device);
+            status = start_frame ();
             if (status != SANE_STATUS_GOOD)
             {
                 goto cleanup;
             }
         }
 
-        status = sane_get_parameters (device, &parm);
-		fprintf (stderr, "Parm : stat=%s form=%d,lf=%d,bpl=%d,pixpl=%d,lin=%d,dep=%d\n",
+        status = backend->get_parameters (device, &parm);
+		log_debug ("Parm : stat=%s form=%d,lf=%d,bpl=%d,pixpl=%d,lin=%d,dep=%d\n",
 			sane_strstatus (status),
 			parm.format, parm.last_frame,
 			parm.bytes_per_line, parm.pixels_per_line,
@@ -95,15 +383,17 @@ static SANE_Status scan_it (FILE *ofp)
 
         if (first_frame)
         {
+            if (read_profile_active)
+                read_profile.bytes_per_line = parm.bytes_per_line;
             if (parm.lines >= 0)
             {
-                 fprintf (stderr, "scanning image of size %dx%d pixels at %d bits/pixel\n",
+                 log_info ("scanning image of size %dx%d pixels at %d bits/pixel\n",
                       parm.pixels_per_line, parm.lines,
                       parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
             }
            else
            {
-                 fprintf (stderr, "scanning image %d pixels wide and "
+                 log_info ("scanning image %d pixels wide and "
                       "variable height at %d bits/pixel\n",
                       parm.pixels_per_line,
                       parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
@@ -115,24 +405,24 @@ static SANE_Status scan_it (FILE *ofp)
                 case SANE_FRAME_BLUE:
                   assert (parm.depth == 8);
                   must_buffer = 1;
-                  offset = parm.format - SANE_FRAME_RED;
+                  chunk.offset = parm.format - SANE_FRAME_RED;
                   break;
                 case SANE_FRAME_RGB:
-                  printf("SANE_FRAME_RGB\n");
+                  log_debug("SANE_FRAME_RGB\n");
                   assert ((parm.depth == 8) || (parm.depth == 16));
 
                 case SANE_FRAME_GRAY:
                     assert ((parm.depth == 1) || (parm.depth == 8) || (parm.depth == 16));
-                    if (parm.lines < 0)
-                    {
-                        printf("parm.format = SANE_FRAME_GRAY, parm.lines < 0\n");
-                        must_buffer = 1;
-                        offset = 0;
-                    }
-                    else
+                    /**
+                     * An unknown height no longer needs the whole image in
+                     * memory: the sink patches the height when the page ends.
+                     **/
+                    log_debug("SANE_FRAME_GRAY\n");
+                    strip_format_from_parameters (&parm, &fmt);
+                    status = pipeline_begin (p, &fmt);
+                    if (status != SANE_STATUS_GOOD)
                     {
-                        printf("SANE_FRAME_GRAY\n");
-                        write_pnm_header (parm.format, parm.pixels_per_line, parm.lines, parm.depth, ofp);
+                        goto cleanup;
                     }
                   break;
                 default:
@@ -142,154 +432,104 @@ static SANE_Status scan_it (FILE *ofp)
             if (must_buffer)
             {
                 /**
-                 * We're either scanning a multi-frame image or the
-                 * scanner doesn't know what the eventual image height
-                 * will be (common for hand-held scanners).  In either
-                 * case, we need to buffer all data before we can write
-                 * the image.
+                 * We're scanning a multi-frame image, the three
+                 * channels have to be interleaved before the image
+                 * can go through the pipeline.
                  */
-                image.width = parm.bytes_per_line;
+                image.width = parm.bytes_per_line * 3;
                 if (parm.lines >= 0)
-                    image.height = parm.lines - STRIP_HEIGHT + 1;
+                    image.height = parm.lines;
                 else
-                    image.height = 0;
+                    image.height = STRIP_HEIGHT;
 
                 image.x = image.width - 1;
                 image.y = -1;
-                /*
-                if (!advance (&image))
+                image_size = (size_t) image.width * image.height;
+                image.data = (uint8_t *)malloc (image_size);
+                if (!image.data)
                 {
                     status = SANE_STATUS_NO_MEM;
                     goto cleanup;
                 }
-                */
+                chunk.image = image.data;
             }
         }
         else
         {
             assert (parm.format >= SANE_FRAME_RED && parm.format <= SANE_FRAME_BLUE);
-            offset = parm.format - SANE_FRAME_RED;
+            chunk.offset = parm.format - SANE_FRAME_RED;
             image.x = image.y = 0;
         }
+        // everything that depends on the frame is decided here, not per chunk
+        consume = scan_chunk_kernel (must_buffer);
 
-        hundred_percent = parm.bytes_per_line * parm.lines * ((parm.format == SANE_FRAME_RGB || parm.format == SANE_FRAME_GRAY) ? 1:3);
+        frame_bytes = 0;
 
         while (1)
         {
-            double progr;
-            status = sane_read (device, buffer, buffer_size, &len);
-            total_bytes += (SANE_Word) len;
-            progr = ((total_bytes * 100.) / (double) hundred_percent);
-            if (progr > 100.)
-                progr = 100.;
+            double read_start = read_profile_active ? now_sec () : 0.;
+            double span = trace_begin ();
+            char args[32];
+
+            if (cancel_requested ())
+            {
+                status = SANE_STATUS_CANCELLED;
+                goto cleanup;
+            }
+            status = backend->read (device, buffer, buffer_size, &len);
+            if (span > 0.)
+            {
+                snprintf (args, sizeof (args), "\"bytes\":%d", len);
+                trace_end (span, "sane_read", args);
+            }
+            if (read_profile_active && len > 0)
+                read_profile_add (&read_profile, read_start, now_sec (), len);
+            if (status == SANE_STATUS_GOOD && len == 0 && scan_cancel.select_fd >= 0)
+            {
+                wait_readable ();
+                continue;
+            }
+            if (len > 0)
+            {
+                watchdog_feed (len);
+                metric_add (METRIC_BYTES_READ, SANE_STATUS_GOOD, len);
+            }
+            if (len > 0 && !scan_timing.first_byte)
+                scan_timing.first_byte = now_sec ();
+            scan_timing.bytes += len;
 
             if (status != SANE_STATUS_GOOD)
             {
                 if (status != SANE_STATUS_EOF)
                 {
-                    return status;
+                    goto cleanup;
                 }
                 break;
             }
 
             if (must_buffer)
             {
-                printf("must_buffer = %d\n", must_buffer);
-                switch (parm.format)
+                // grow by strips while the height is unknown
+                while (chunk.offset + 3 * (size_t) len > image_size)
                 {
-                    case SANE_FRAME_RED:
-                    case SANE_FRAME_GREEN:
-                    case SANE_FRAME_BLUE:
-                        for (i = 0; i < len; ++i)
-                        {
-                            image.data[offset + 3 * i] = buffer[i];
-                            /*
-                            if (!advance (&image))
-                            {
-                                status = SANE_STATUS_NO_MEM;
-                                goto cleanup;
-                            }
-                            */
-                        }
-                        offset += 3 * len;
-                        break;
-                    case SANE_FRAME_RGB:
-                        for (i = 0; i < len; ++i)
-                        {
-                            image.data[offset + i] = buffer[i];
-                            /*
-                            if (!advance (&image))
-                            {
-                                status = SANE_STATUS_NO_MEM;
-                                goto cleanup;
-                            }
-                            */
-                        }
-                        offset += len;
-                        break;
-                    case SANE_FRAME_GRAY:
-                        for (i = 0; i < len; ++i)
-                        {
-                            image.data[offset + i] = buffer[i];
-                            /*
-                            if (!advance (&image))
-                            {
-                                status = SANE_STATUS_NO_MEM;
-                                goto cleanup;
-                            }
-                            */
-                        }
-                        offset += len;
-                        break;
-                    default:
-                        break;
-                }
-            }
-            else			/* ! must_buffer */
-            {
-                if ((parm.depth != 16)) 
-                    fwrite (buffer, 1, len, ofp);
-                else
-                {
-#if !defined(WORDS_BIGENDIAN)
-                    int i, start = 0;
-                    /* check if we have saved one byte from the last sane_read */
-                    if (hang_over > -1)
-                    {
-                        if (len > 0)
-                        {
-                            fwrite (buffer, 1, 1, ofp);
-                            buffer[0] = (SANE_Byte) hang_over;
-                            hang_over = -1;
-                            start = 1;
-                        }
-                    }
-                    /* now do the byte-swapping */
-                    for (i = start; i < (len - 1); i += 2)
+                    uint8_t *data = (uint8_t *)realloc (image.data, image_size + (size_t) image.width * STRIP_HEIGHT);
+                    if (!data)
                     {
-                        unsigned char LSB;
-                        LSB = buffer[i];
-                        buffer[i] = buffer[i + 1];
-                        buffer[i + 1] = LSB;
+                        status = SANE_STATUS_NO_MEM;
+                        goto cleanup;
                     }
-                    /* check if we have an odd number of bytes */
-                    if (((len - start) % 2) != 0)
-                    {
-                        hang_over = buffer[len - 1];
-                        len--;
-                    }
-#endif
-                    fwrite (buffer, 1, len, ofp);
+                    image.data = chunk.image = data;
+                    image_size += (size_t) image.width * STRIP_HEIGHT;
                 }
+                frame_bytes += len;
             }
 
-            if (verbose && parm.depth == 8)
+            span = trace_begin ();
+            status = consume (&chunk, buffer, len);
+            trace_end (span, "pipeline", NULL);
+            if (status != SANE_STATUS_GOOD)
             {
-              for (i = 0; i < len; ++i)
-                if (buffer[i] >= max)
-                    max = buffer[i];
-                else if (buffer[i] < min)
-                    min = buffer[i];
+                goto cleanup;
             }
         }
         first_frame = 0;
@@ -297,34 +537,55 @@ static SANE_Status scan_it (FILE *ofp)
 
     if (must_buffer)
     {
-        image.height = image.y;
-        write_pnm_header (parm.format, parm.pixels_per_line,image.height, parm.depth, ofp);
-
-#if !defined(WORDS_BIGENDIAN)
-        if (parm.depth == 16)
-        {
-            int i;
-            for (i = 0; i < image.height * image.width; i += 2)
-            {
-                unsigned char LSB;
-                LSB = image.data[i];
-                image.data[i] = image.data[i + 1];
-                image.data[i + 1] = LSB;
-            }
-        }
-#endif
-        fwrite (image.data, 1, image.height * image.width, ofp);
+        image.height = frame_bytes / parm.bytes_per_line;
+
+        fmt.format = SANE_FRAME_RGB;
+        fmt.depth = parm.depth;
+        fmt.pixels_per_line = parm.pixels_per_line;
+        fmt.bytes_per_line = image.width;
+        fmt.lines = image.height;
+        status = pipeline_begin (p, &fmt);
+        if (status == SANE_STATUS_GOOD)
+            status = pipeline_push (p, image.data, (size_t) image.height * image.width);
+        if (status != SANE_STATUS_GOOD)
+            goto cleanup;
     }
 
-    fflush( ofp );
+    status = pipeline_end (p);
+    if (p->n_stages)
+        pipeline_print_stats (p);
 
 cleanup:
+    if (status != SANE_STATUS_GOOD)
+        pipeline_cancel (p);
+    pipeline_set_sink (p, NULL);
+
     if (image.data)
         free (image.data);
 
     return status;
 }
 
+// Stages applied by scan_it to every page
+Strip_Pipeline *get_scan_pipeline()
+{
+    return &pipeline;
+}
+
+// Run the stages on the thread pool shared by all scans
+SANE_Status set_scan_parallel(SANE_Bool enable)
+{
+    Thread_Pool *pool = NULL;
+
+    if (enable)
+    {
+        pool = thread_pool_default ();
+        if (!pool)
+            return SANE_STATUS_NO_MEM;
+    }
+    return pipeline_set_thread_pool (&pipeline, pool, 0);
+}
+
 
 SANE_Status kylin_sane_get_parameters(SANE_Handle device)
 {
@@ -332,7 +593,7 @@ SANE_Status kylin_sane_get_parameters(SANE_Handle device)
     SANE_Parameters parm;
 
     status = sane_get_parameters (device, &parm);
-    fprintf (stderr, "Parm : stat=%s form=%d,lf=%d,bpl=%d,pixpl=%d,lin=%d,dep=%d\n",
+    log_debug ("Parm : stat=%s form=%d,lf=%d,bpl=%d,pixpl=%d,lin=%d,dep=%d\n",
         sane_strstatus (status),
         parm.format, parm.last_frame,
         parm.bytes_per_line, parm.pixels_per_line,
@@ -341,79 +602,636 @@ SANE_Status kylin_sane_get_parameters(SANE_Handle device)
     return status;
 }
 
+// Write an extra downscaled copy of every page to <name><pid><suffix>.pnm
+SANE_Status add_scan_output(SANE_String_Const suffix, double scale, int max_size)
+{
+    Scan_Output *output;
+
+    if (n_scan_outputs >= SCAN_MAX_OUTPUTS)
+        return SANE_STATUS_NO_MEM;
+    if (!suffix || strlen (suffix) >= sizeof (output->suffix) || scale <= 0. || scale > 1.)
+        return SANE_STATUS_INVAL;
+
+    output = &scan_outputs[n_scan_outputs++];
+    strcpy (output->suffix, suffix);
+    output->scale = scale;
+    output->max_size = max_size;
+    return SANE_STATUS_GOOD;
+}
+
+void clear_scan_outputs()
+{
+    n_scan_outputs = 0;
+}
+
+SANE_Status set_blank_detection(int action, const Blank_Config *config)
+{
+    if (action < BLANK_OFF || action > BLANK_DROP)
+        return SANE_STATUS_INVAL;
+    if (config && (config->margin < 0. || config->margin >= 0.5 || config->max_coverage < 0.))
+        return SANE_STATUS_INVAL;
+
+    blank_action = action;
+    if (config)
+        blank_config = *config;
+    else
+        blank_config_init (&blank_config);
+    // only a page that may be dropped is worth holding back
+    if (action != BLANK_DROP)
+        blank_config.defer_bytes = 0;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status get_blank_result(Blank_Result *result)
+{
+    if (!blank_result_valid)
+        return SANE_STATUS_INVAL;
+    *result = blank_result;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_page_stats(SANE_Bool enable)
+{
+    page_stats_on = enable;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status get_page_stats(Page_Stats *stats)
+{
+    if (!page_stats_valid)
+        return SANE_STATUS_INVAL;
+    *stats = page_stats;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_digest(int kind)
+{
+    if (kind != DIGEST_NONE && !digest_name (kind))
+        return SANE_STATUS_INVAL;
+    scan_digest = kind;
+    scan_digest_hex[0] = '\0';
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status get_scan_digest(char *hex)
+{
+    if (!scan_digest_hex[0])
+        return SANE_STATUS_INVAL;
+    strcpy (hex, scan_digest_hex);
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_file_flags(int flags)
+{
+    if (flags & ~(WRITER_PREALLOCATE | WRITER_DIRECT | WRITER_ASYNC))
+        return SANE_STATUS_INVAL;
+    scan_file_flags = flags;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_durability(const Durable_Config *config)
+{
+    // pages waiting for a group go under the policy they were written with
+    durable_flush (NULL);
+    if (!config)
+    {
+        durable_config_init (&durable_config);
+        return SANE_STATUS_GOOD;
+    }
+    if (!durable_policy_name (config->policy) || config->group_pages < 1 || config->group_interval < 0.)
+        return SANE_STATUS_INVAL;
+    durable_config = *config;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_shm_output(const char *name, int slots, size_t slot_size, double timeout)
+{
+    if (timeout < 0.)
+        return SANE_STATUS_INVAL;
+    // the ring being replaced may have the same name
+    shm_ring_destroy (shm_output);
+    shm_output = NULL;
+    if (!name)
+        return SANE_STATUS_GOOD;
+
+    shm_output = shm_ring_create (name, slots ? slots : SHM_RING_DEFAULT_SLOTS,
+                                  slot_size ? slot_size : SHM_RING_DEFAULT_SLOT_SIZE);
+    if (!shm_output)
+    {
+        int err = errno;
+
+        log_warn("shared memory output %s: %s\n", name, strerror (err));
+        if (err == EINVAL)
+            return SANE_STATUS_INVAL;
+        return err == EEXIST ? SANE_STATUS_DEVICE_BUSY : SANE_STATUS_ACCESS_DENIED;
+    }
+    shm_output_timeout = timeout;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_write_depth(int depth)
+{
+    if (depth < 2 || depth > WRITER_MAX_DEPTH)
+        return SANE_STATUS_INVAL;
+    scan_file_depth = depth;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_duplicate_detection(SANE_Bool enable, int threshold)
+{
+    if (threshold < 0 || threshold > PHASH_BITS)
+        return SANE_STATUS_INVAL;
+    duplicate_on = enable;
+    duplicate_threshold = threshold;
+    return SANE_STATUS_GOOD;
+}
+
+void clear_duplicate_index()
+{
+    phash_index_clear (&duplicate_index);
+    duplicate_result_valid = 0;
+}
+
+SANE_Status get_duplicate_result(Duplicate_Result *result)
+{
+    if (!duplicate_result_valid)
+        return SANE_STATUS_INVAL;
+    *result = duplicate_result;
+    return SANE_STATUS_GOOD;
+}
+
+// Look the page up among those of the batch so far
+static void find_duplicate(uint64_t hash, const char *path)
+{
+    const Phash_Entry *match;
+    int distance = 0;
+
+    memset (&duplicate_result, 0, sizeof (duplicate_result));
+    duplicate_result.hash = hash;
+    match = phash_index_match (&duplicate_index, hash, duplicate_threshold, &distance);
+    if (match)
+    {
+        duplicate_result.duplicate = 1;
+        duplicate_result.distance = distance;
+        snprintf (duplicate_result.of, sizeof (duplicate_result.of), "%s", match->path);
+        log_info("page %s: duplicate of %s (%d bits apart)\n", path, match->path, distance);
+    }
+    duplicate_result_valid = 1;
+}
+
+static void print_page_stats(const char *path, const Page_Stats *stats)
+{
+    static const char *names[] = { "red", "green", "blue" };
+    int c;
+
+    for (c = 0; c < stats->channels; c++)
+    {
+        const Channel_Stats *ch = &stats->channel[c];
+
+        log_info("page %s: %s samples %u..%u, mean %.1f, deviation %.1f\n", path,
+                 (stats->channels == 1) ? "gray" : names[c], ch->min, ch->max, ch->mean, sqrt (ch->variance));
+    }
+}
+
+/**
+ * Open the .part files of a scan.  The first file gets the page as
+ * scanned, each extra output gets it through its own downscaler; with
+ * extra outputs *sink is a tee feeding all of them.
+ **/
+static SANE_Status open_scan_files(Scan_File *files, int n_files, Strip_Sink **sink, Strip_Sink **tee)
+{
+    SANE_Status status;
+    int i;
+
+    for (i = 0; i < n_files; i++)
+    {
+        Scan_File *file = &files[i];
+
+        // an earlier page of the same name may still wait for its group
+        if (durable_flush (file->part_path) != SANE_STATUS_GOOD)
+            log_warn("commit of the group before %s failed\n", file->path);
+        if (NULL == (file->writer = file_writer_open (file->part_path, scan_file_flags
+                                                | ((durable_config.policy == DURABLE_WRITE_BEHIND) ? WRITER_WRITE_BEHIND : 0),
+                                                scan_file_depth)))
+            return SANE_STATUS_ACCESS_DENIED;
+        file->sink = pnm_sink_create (file->writer);
+        if (!file->sink)
+            return SANE_STATUS_NO_MEM;
+        if (scan_digest != DIGEST_NONE)
+        {
+            digest_init (&file->digest, scan_digest);
+            pnm_sink_set_digest (file->sink, &file->digest);
+        }
+
+        if (i > 0)
+        {
+            const Scan_Output *output = &scan_outputs[i - 1];
+
+            pipeline_init (&file->branch);
+            status = pipeline_add_stage (&file->branch, downscale_stage_create (output->scale, output->max_size));
+            if (status != SANE_STATUS_GOOD)
+                return status;
+            pipeline_set_sink (&file->branch, file->sink);
+            file->branch_sink = pipeline_sink_create (&file->branch);
+            if (!file->branch_sink)
+                return SANE_STATUS_NO_MEM;
+        }
+    }
+
+    if (n_files == 1)
+    {
+        *sink = files[0].sink;
+        return SANE_STATUS_GOOD;
+    }
+
+    *tee = tee_sink_create ();
+    if (!*tee)
+        return SANE_STATUS_NO_MEM;
+    for (i = 0; i < n_files; i++)
+    {
+        status = tee_sink_add (*tee, i ? files[i].branch_sink : files[i].sink);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    *sink = *tee;
+    return SANE_STATUS_GOOD;
+}
+
+// Remove the .part files of a page that is not kept
+static void drop_scan_files(Scan_File *files, int n_files)
+{
+    int i;
+
+    for (i = 0; i < n_files; i++)
+    {
+        file_writer_close (files[i].writer);
+        files[i].writer = NULL;
+        remove (files[i].part_path);
+        if (files[i].digest_part_path[0])
+            remove (files[i].digest_part_path);
+    }
+}
+
+/**
+ * <path>.<digest> in the format of the checksum tools: digest, two blanks,
+ * file name.  It is written as a .part file too and committed with the page.
+ **/
+static SANE_Status write_digest_file(Scan_File *file)
+{
+    char hex[DIGEST_HEX_MAX];
+    const char *name = strrchr (file->path, '/');
+    FILE *fp;
+    int failed;
+
+    snprintf (file->digest_path, sizeof (file->digest_path), "%s.%s", file->path, digest_name (file->digest.kind));
+    snprintf (file->digest_part_path, sizeof (file->digest_part_path), "%s.part", file->digest_path);
+    if (NULL == (fp = fopen (file->digest_part_path, "w")))
+        return SANE_STATUS_ACCESS_DENIED;
+    digest_hex (&file->digest, hex);
+    fprintf (fp, "%s  %s\n", hex, name ? name + 1 : file->path);
+    failed = (fclose (fp) != 0);
+    return failed ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+static void print_writer_stats(const Scan_File *file)
+{
+    Writer_Stats ws;
+
+    file_writer_get_stats (file->writer, &ws);
+    log_debug("page %s: %llu writes, %llu bytes preallocated%s%s\n", file->path,
+              (unsigned long long) ws.writes, (unsigned long long) ws.preallocated,
+              ws.direct ? ", direct" : "", ws.async ? ", io_uring" : "");
+    if (ws.completions)
+        log_debug("page %s: write latency %.2f ms mean, %.2f ms max, %.1f MB in flight at most, %llu waits\n",
+                  file->path, ws.latency_ns / 1e6 / ws.completions, ws.max_latency_ns / 1e6,
+                  ws.max_in_flight / 1e6, (unsigned long long) ws.waits);
+}
+
+// Give the files their final names as the durability policy says
+static SANE_Status commit_scan_files(Scan_File *files, int n_files)
+{
+    Durable_File commit[2 * (1 + SCAN_MAX_OUTPUTS)];
+    SANE_Status status;
+    double span;
+    int i, n = 0;
+
+    for (i = 0; i < n_files; i++)
+    {
+        print_writer_stats (&files[i]);
+        if (file_writer_finish (files[i].writer) != SANE_STATUS_GOOD)
+            return SANE_STATUS_ACCESS_DENIED;
+        commit[n].fd = files[i].writer->fd;
+        commit[n].from = files[i].part_path;
+        commit[n++].to = files[i].path;
+        if (scan_digest != DIGEST_NONE)
+        {
+            status = write_digest_file (&files[i]);
+            if (status != SANE_STATUS_GOOD)
+                return status;
+            commit[n].fd = -1;
+            commit[n].from = files[i].digest_part_path;
+            commit[n++].to = files[i].digest_path;
+        }
+    }
+
+    span = trace_begin ();
+    status = durable_commit (&durable_config, commit, n);
+    if (span > 0.)
+    {
+        char args[32];
+
+        snprintf (args, sizeof (args), "\"policy\":\"%s\"", durable_policy_name (durable_config.policy));
+        trace_end (span, "commit", args);
+    }
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    for (i = 0; i < n_files; i++)
+        files[i].digest_part_path[0] = '\0';
+
+    if (scan_digest != DIGEST_NONE)
+    {
+        digest_hex (&files[0].digest, scan_digest_hex);
+        log_info("page %s: %s %s\n", files[0].path, digest_name (scan_digest), scan_digest_hex);
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static void close_scan_files(Scan_File *files, int n_files)
+{
+    int i;
+
+    for (i = 0; i < n_files; i++)
+    {
+        Scan_File *file = &files[i];
+
+        file_writer_close (file->writer);
+        file->writer = NULL;
+        strip_sink_destroy (file->branch_sink);
+        pipeline_clear_stages (&file->branch);
+        pipeline_release (&file->branch);
+        strip_sink_destroy (file->sink);
+    }
+}
+
+/**
+ * Report on the reads of the scan just done, with the timeline next to
+ * the page, and take the suggestions if asked to.
+ **/
+static void finish_read_profile(const char *page_path)
+{
+    char path[PATH_MAX];
+    size_t n = strlen (page_path);
+
+    if (n > 4 && !strcmp (page_path + n - 4, ".pnm"))
+        n -= 4;
+    snprintf (path, sizeof (path), "%.*s.timeline.json", (int) n, page_path);
+    read_profile_report (&read_profile, buffer_size, &read_report);
+    read_report_valid = 1;
+    read_report_print (&read_report);
+    if (read_profile_write_timeline (&read_profile, path) == SANE_STATUS_GOOD)
+        log_info("read timeline: %s\n", path);
+
+    if (!read_profile_auto)
+        return;
+    if (read_report.suggested_read_size)
+        read_size = read_report.suggested_read_size;
+    if (read_report.suggest_parallel && pipeline.n_stages)
+        set_scan_parallel (SANE_TRUE);
+}
+
 SANE_Status do_scan(const char *fileName)
 {
 	SANE_Status status;
-	FILE *ofp = NULL;
-	char path[PATH_MAX];
-	char part_path[PATH_MAX];
-	buffer_size = (32 * 1024);
+	Scan_File files[1 + SCAN_MAX_OUTPUTS];
+	int n_files = 1 + n_scan_outputs;
+	Strip_Sink *sink = NULL, *tee = NULL, *blank = NULL, *stats = NULL, *phash = NULL, *resample_sink = NULL;
+	Strip_Sink *shm = NULL;
+	Strip_Pipeline resample;
+	int i;
+	buffer_size = read_size;
     buffer = (SANE_Byte*)malloc (buffer_size);
 
+    memset (files, 0, sizeof (files));
+    pipeline_init (&resample);
+    // start_scan began it before its preview; a replay did not
+    if (!__atomic_load_n (&scan_cancel.active, __ATOMIC_ACQUIRE))
+        scan_begin_cancellable ();
+
+    // no device to ask when replaying
+    if (memory_budget && device)
+    {
+        Scan_Prediction prediction;
+
+        status = predict_scan (device, &prediction);
+        if (status == SANE_STATUS_GOOD && prediction.peak_memory > memory_budget)
+        {
+            log_warn("scan needs about %.1f MB, over the budget of %.1f MB\n",
+                   prediction.peak_memory / 1e6, memory_budget / 1e6);
+            free (buffer);
+            buffer = NULL;
+            scan_end_cancellable (SANE_STATUS_NO_MEM);
+            metric_add (METRIC_SCANS, SANE_STATUS_NO_MEM, 1);
+            return SANE_STATUS_NO_MEM;
+        }
+    }
+
 	do
 	{
         int dwProcessID = getpid();
-        sprintf (path, "%s%d.pnm", fileName, dwProcessID);
-        strcpy (part_path, path);
-        strcat (part_path, ".part");
+        for (i = 0; i < n_files; i++)
+        {
+            sprintf (files[i].path, "%s%d%s.pnm", fileName, dwProcessID, i ? scan_outputs[i - 1].suffix : "");
+            strcpy (files[i].part_path, files[i].path);
+            strcat (files[i].part_path, ".part");
 
-        printf("picture name: %s\n", path);
+            log_info("picture name: %s\n", files[i].path);
+        }
 
-		status = sane_start (device);
+        memset (&scan_timing, 0, sizeof (scan_timing));
+        scan_timing.start = now_sec ();
+        watchdog_arm (device_name, "scan");
+		status = start_frame ();
 		if (status != SANE_STATUS_GOOD)
 		{
 			break;
 		}
 
-        if (NULL == (ofp = fopen (part_path, "w")))
+        status = open_scan_files (files, n_files, &sink, &tee);
+        if (status != SANE_STATUS_GOOD)
         {
-            status = SANE_STATUS_ACCESS_DENIED;
             break;
         }
+        if (scan_resample < 1.)
+        {
+            status = pipeline_add_stage (&resample, downscale_stage_create (scan_resample, 0));
+            if (status != SANE_STATUS_GOOD)
+            {
+                break;
+            }
+            pipeline_set_sink (&resample, sink);
+            resample_sink = pipeline_sink_create (&resample);
+            if (!resample_sink)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            sink = resample_sink;
+        }
+        if (blank_action != BLANK_OFF)
+        {
+            blank = blank_sink_create (sink, &blank_config);
+            if (!blank)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            sink = blank;
+        }
+        blank_result_valid = 0;
+        if (page_stats_on)
+        {
+            stats = stats_sink_create (sink);
+            if (!stats)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            sink = stats;
+        }
+        page_stats_valid = 0;
+        scan_digest_hex[0] = '\0';
+        if (duplicate_on)
+        {
+            phash = phash_sink_create (sink);
+            if (!phash)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            sink = phash;
+        }
+        duplicate_result_valid = 0;
+        // last, so the consumer gets every strip before anything holds it back
+        if (shm_output)
+        {
+            shm = shm_ring_sink_create (sink, shm_output, shm_output_timeout);
+            if (!shm)
+            {
+                status = SANE_STATUS_NO_MEM;
+                break;
+            }
+            sink = shm;
+        }
 
-		status = scan_it (ofp);
+        read_profile_init (&read_profile, 0);
+        read_profile_active = read_profile_on;
+		status = scan_it (&pipeline, sink);
+        // only the device is watched: ending the sinks and committing may take long on a slow disk
+        watchdog_disarm ();
+        if (watchdog_fired ())
+            status = SANE_STATUS_IO_ERROR;
+        scan_timing.end = now_sec ();
+        if (read_profile_active)
+        {
+            read_profile_active = 0;
+            finish_read_profile (files[0].path);
+            read_profile_release (&read_profile);
+        }
+        if ((status == SANE_STATUS_GOOD || status == SANE_STATUS_EOF) && scan_timing.first_byte && device)
+        {
+            history_record (device_name, current_dpi (device), scan_timing.first_byte - scan_timing.start,
+                            scan_timing.bytes, scan_timing.end - scan_timing.first_byte);
+            metric_observe (METRIC_FIRST_BYTE_SECONDS, scan_timing.first_byte - scan_timing.start);
+            if (scan_timing.end > scan_timing.first_byte)
+                metric_set (METRIC_READ_RATE, scan_timing.bytes / (scan_timing.end - scan_timing.first_byte));
+            if (history_path[0])
+                history_save (history_path);
+        }
 
 		switch (status)
 		{
 			case SANE_STATUS_GOOD:
 			case SANE_STATUS_EOF:
-                 {
+                  if (blank)
+                  {
+                      blank_sink_result (blank, &blank_result);
+                      blank_result_valid = 1;
+                      log_info("page %s: %s, ink coverage %.3f%%%s\n", files[0].path,
+                             blank_result.blank ? "blank" : "not blank", blank_result.coverage * 100.,
+                             blank_result.written ? "" : ", not written");
+                  }
+                  if (stats)
+                  {
+                      stats_sink_result (stats, &page_stats);
+                      page_stats_valid = 1;
+                      print_page_stats (files[0].path, &page_stats);
+                  }
+                  if (blank && blank_result.blank && blank_action == BLANK_DROP)
+                  {
+                      drop_scan_files (files, n_files);
                       status = SANE_STATUS_GOOD;
-                      if (!ofp || 0 != fclose(ofp))
-                      {
-                          status = SANE_STATUS_ACCESS_DENIED;
-                          break;
-                      }
-                      else
-                      {
-                          ofp = NULL;
-                          if (rename (part_path, path))
-                          {
-                              status = SANE_STATUS_ACCESS_DENIED;
-                              break;
-                          }
-                      }
+                      break;
                   }
+                  if (phash)
+                      find_duplicate (phash_sink_result (phash), files[0].path);
+                  status = commit_scan_files (files, n_files);
+                  if (status == SANE_STATUS_GOOD)
+                      metric_add (METRIC_PAGES, status, 1);
+                  if (status == SANE_STATUS_GOOD && phash)
+                      status = phash_index_add (&duplicate_index, duplicate_result.hash, files[0].path);
 				  break;
 			default:
                   break;
 		}
 	}while (0);
+    // the breaks before the read
+    watchdog_disarm ();
 
     if (SANE_STATUS_GOOD != status)
     {
-        sane_cancel (device);
+        backend->cancel (device);
+        // a wedged device would block the drain forever, it is reopened below
+        if (SANE_STATUS_CANCELLED == status && !watchdog_fired ())
+            drain_cancelled ();
+        // leave nothing half written behind
+        drop_scan_files (files, n_files);
+        // free the strips but keep the thread pool set_scan_parallel() gave
+        pipeline_cancel (&pipeline);
+        strip_pool_clear (&pipeline.pool);
+        shm_ring_sink_cancel (shm);
     }
-    if (ofp)
+    if (shm)
     {
-        fclose (ofp);
-        ofp = NULL;
+        Shm_Ring_Stats ss;
+
+        shm_ring_get_stats (shm_output, &ss);
+        log_debug("shared memory output: %llu records, %llu dropped, %llu waits for the consumer (%.1f ms)\n",
+                  (unsigned long long) ss.records, (unsigned long long) ss.dropped,
+                  (unsigned long long) ss.waits, ss.wait_ns / 1e6);
+    }
+    if (watchdog_fired () && device)
+    {
+        reopen_device ();
+        status = SANE_STATUS_IO_ERROR;
     }
+    close_scan_files (files, n_files);
+    strip_sink_destroy (shm);
+    strip_sink_destroy (phash);
+    strip_sink_destroy (stats);
+    strip_sink_destroy (blank);
+    strip_sink_destroy (resample_sink);
+    pipeline_clear_stages (&resample);
+    pipeline_release (&resample);
+    strip_sink_destroy (tee);
     if (buffer)
     {
         free (buffer);
         buffer = NULL;
     }
+    scan_end_cancellable (status);
+    metric_add (METRIC_SCANS, status, 1);
+    if (scan_timing.start)
+        metric_observe (METRIC_SCAN_SECONDS, now_sec () - scan_timing.start);
 
     return status;
 }
@@ -423,20 +1241,39 @@ SANE_Status do_scan(const char *fileName)
 void init()
 {
     SANE_Int version_code = 0;
+    double span;
+
+    if (getenv (LOG_ENV) && log_level_by_name (getenv (LOG_ENV)) >= 0)
+        log_set_level (log_level_by_name (getenv (LOG_ENV)));
+    if (getenv (TRACE_ENV) && !trace_enabled ())
+        trace_start (getenv (TRACE_ENV));
+    span = trace_begin ();
 	sane_init (&version_code, auth_callback);
-    printf("SANE version code: %d\n", version_code);
+    log_debug("SANE version code: %d\n", version_code);
+    trace_end (span, "init", NULL);
 }
 
 // Get all devices
 //查询所有连接设备。这里会比较耗时
 SANE_Status get_devices(const SANE_Device ***device_list)
 {
-    printf("Get all devices...\n");
+    log_debug("Get all devices...\n");
 	SANE_Status sane_status;
+    double span = trace_begin (), start = now_sec ();
+    int n = 0;
+
 	if (sane_status = sane_get_devices (device_list, SANE_FALSE))
 	{
-		printf("sane_get_devices status: %s\n", sane_strstatus(sane_status));
+		log_error("sane_get_devices status: %s\n", sane_strstatus(sane_status));
 	}	
+    else
+    {
+        while ((*device_list)[n])
+            n++;
+        metric_set (METRIC_DEVICES, n);
+    }
+    metric_observe (METRIC_GET_DEVICES_SECONDS, now_sec () - start);
+    trace_end (span, "get_devices", NULL);
     return sane_status;
 }
 
@@ -446,13 +1283,23 @@ SANE_Status open_device(SANE_Device *device, SANE_Handle *sane_handle)
 {
     SANE_Status sane_status;
 
-    printf("Name: %s, vendor: %s, model: %s, type: %s\n",
+    log_debug("Name: %s, vendor: %s, model: %s, type: %s\n",
 		 device->name, device->model, device->vendor, device->type);
 
+    double span = trace_begin (), start = now_sec ();
+
     if (sane_status = sane_open(device->name, sane_handle))
     {
-        printf("sane_open status: %s\n", sane_strstatus(sane_status));
+        log_error("sane_open status: %s\n", sane_strstatus(sane_status));
     }
+    else
+    {
+        snprintf(device_name, sizeof(device_name), "%s", device->name);
+        trace_set_device (device_name);
+    }
+    metric_observe (METRIC_OPEN_SECONDS, now_sec () - start);
+    metric_add (METRIC_OPENS, sane_status, 1);
+    trace_end (span, "open_device", NULL);
 
     return sane_status;
 }
@@ -470,14 +1317,14 @@ int get_option_colors(SANE_Handle sane_handle, int optnum)
     const SANE_Option_Descriptor *opt;
     int i = 0;
 
-    printf("begin get option[%d] colors\n", optnum);
+    log_debug("begin get option[%d] colors\n", optnum);
 
     opt = sane_get_option_descriptor(sane_handle, optnum);
 
-    printf("begin print all colors:\n");
+    log_debug("begin print all colors:\n");
 	for(i=0; opt->constraint.string_list[i] != NULL; i++)
 	{
-        printf("optnum[%d] colors string: %s \n", optnum, *(opt->constraint.string_list+i));
+        log_debug("optnum[%d] colors string: %s \n", optnum, *(opt->constraint.string_list+i));
         if(!strcmp("Color", *(opt->constraint.string_list+i)))
         {
             SET_1_BIT(ret, 0);
@@ -503,16 +1350,16 @@ SANE_Status set_option_colors(SANE_Handle sane_handle, int optnum, SANE_String v
     SANE_Status status;
     const SANE_Option_Descriptor *opt;
 
-    printf("\nbegin set option[%d] color: %s \n", optnum, val_color);
+    log_debug("\nbegin set option[%d] color: %s \n", optnum, val_color);
 
     status = sane_control_option(sane_handle, optnum, SANE_ACTION_SET_VALUE, val_color, NULL);
     if (status != SANE_STATUS_GOOD)
 	{
-		printf("Option did not set\n");
+		log_warn("Option did not set\n");
         return status;
     }
 
-    printf("set color option success!\n\n");
+    log_debug("set color option success!\n\n");
     return status;
 }
 
@@ -529,14 +1376,14 @@ int get_option_sources(SANE_Handle sane_handle, int optnum)
     const SANE_Option_Descriptor *opt;
     int i = 0;
 
-    printf("begin get option[%d] sources\n", optnum);
+    log_debug("begin get option[%d] sources\n", optnum);
 
     opt = sane_get_option_descriptor(sane_handle, optnum);
 
-    printf("begin print all sources:\n");
+    log_debug("begin print all sources:\n");
 	for(i=0; opt->constraint.string_list[i] != NULL; i++)
 	{
-        printf("optnum[%d] sources string: %s \n", optnum, *(opt->constraint.string_list+i));
+        log_debug("optnum[%d] sources string: %s \n", optnum, *(opt->constraint.string_list+i));
         if(!strcmp("Flatbed", *(opt->constraint.string_list+i)))
         {
             SET_1_BIT(ret, 0);
@@ -554,16 +1401,16 @@ SANE_Status set_option_sources(SANE_Handle sane_handle, int optnum, SANE_String
     SANE_Status status;
     const SANE_Option_Descriptor *opt;
 
-    printf("begin set option[%d] source: %s \n", optnum, val_source);
+    log_debug("begin set option[%d] source: %s \n", optnum, val_source);
 
     status = sane_control_option(sane_handle, optnum, SANE_ACTION_SET_VALUE, val_source, NULL);
     if (status != SANE_STATUS_GOOD)
 	{
-		printf("Option did not set\n");
+		log_warn("Option did not set\n");
         return status;
     }
 
-    printf("set source option success!\n\n");
+    log_debug("set source option success!\n\n");
     return status;
 }
 
@@ -580,14 +1427,14 @@ void get_option_resolutions(SANE_Handle sane_handle, int optnum)
     const SANE_Option_Descriptor *opt;
     int i = 0;
 
-    printf("begin get option[%d] resolution \n", optnum);
+    log_debug("begin get option[%d] resolution \n", optnum);
 
     opt = sane_get_option_descriptor(sane_handle, optnum);
 
-    printf("begin print all resolutions:\n");
+    log_debug("begin print all resolutions:\n");
 	for(i=0; opt->constraint.word_list[i]; i++)
 	{
-        printf("optnum[%d] resolutions int: %d \n", optnum, *(opt->constraint.word_list+i));
+        log_debug("optnum[%d] resolutions int: %d \n", optnum, *(opt->constraint.word_list+i));
     }
 }
 
@@ -601,16 +1448,16 @@ SANE_Status set_option_resolutions(SANE_Handle sane_handle, int optnum, SANE_Int
     SANE_Status status;
     const SANE_Option_Descriptor *opt;
 
-    printf("\nbegin set option[%d] resolution: %d \n", optnum, val_resolution);
+    log_debug("\nbegin set option[%d] resolution: %d \n", optnum, val_resolution);
 
     status = sane_control_option(sane_handle, optnum, SANE_ACTION_SET_VALUE, &val_resolution, NULL);
     if (status != SANE_STATUS_GOOD)
 	{
-		printf("Option did not set\n");
+		log_warn("Option did not set\n");
         return status;
     }
 
-    printf("set resolution option success!\n\n");
+    log_debug("set resolution option success!\n\n");
     return status;
 }
 
@@ -629,14 +1476,14 @@ void get_option_sizes(SANE_Handle sane_handle, int optnum)
     const SANE_Option_Descriptor *opt;
     int i = 0;
 
-    printf("begin get option[%d] size \n", optnum);
+    log_debug("begin get option[%d] size \n", optnum);
 
     opt = sane_get_option_descriptor(sane_handle, optnum);
 
-    printf("begin print all sizes:\n");
+    log_debug("begin print all sizes:\n");
 	for(i=0; opt->constraint.word_list[i]; i++)
 	{
-        printf("optnum[%d] sizes int: %d \n", optnum, *(opt->constraint.word_list+i));
+        log_debug("optnum[%d] sizes int: %d \n", optnum, *(opt->constraint.word_list+i));
     }
 }
 
@@ -650,16 +1497,16 @@ SANE_Status set_option_sizes(SANE_Handle sane_handle, int optnum, SANE_Int val_s
     SANE_Status status;
     const SANE_Option_Descriptor *opt;
 
-    printf("\nbegin set option[%d] size: %d \n", optnum, val_size);
+    log_debug("\nbegin set option[%d] size: %d \n", optnum, val_size);
 
     status = sane_control_option(sane_handle, optnum, SANE_ACTION_SET_VALUE, &val_size, NULL);
     if (status != SANE_STATUS_GOOD)
 	{
-		printf("Option did not set\n");
+		log_warn("Option did not set\n");
         return status;
     }
 
-    printf("set size option success!\n\n");
+    log_debug("set size option success!\n\n");
     return status;
 }
 
@@ -672,40 +1519,18 @@ SANE_Status set_option_sizes(SANE_Handle sane_handle, int optnum, SANE_Int val_s
  */
 SANE_Status set_option_sizes_real(SANE_Handle sane_handle, SANE_Int val_size_br_x, SANE_Int val_size_br_y)
 {
-    SANE_Status status = SANE_STATUS_GOOD;
-    printf("size Bottom-right xy=[%d, %d]\n", val_size_br_x, val_size_br_y);
+    log_debug("size Bottom-right xy=[%d, %d]\n", val_size_br_x, val_size_br_y);
 
-    status = set_option_sizes(sane_handle, 10, SANE_FIX(val_size_br_x));
-    status = set_option_sizes(sane_handle, 11, SANE_FIX(val_size_br_y));
-
-    return status;
+    return set_scan_area(sane_handle, 0., 0., val_size_br_x, val_size_br_y);
 }
 
 SANE_Status set_option_sizes_all(SANE_Handle sane_handle, int type)
 {
-    SANE_Status status = SANE_STATUS_GOOD;
-
-    switch (type) {
-    case A2:
-        status = set_option_sizes_real(sane_handle, 420, 594);
-        break;
-    case A3:
-        status = set_option_sizes_real(sane_handle, 297, 420);
-        break;
-    case A4:
-        status = set_option_sizes_real(sane_handle, 210, 297);
-        break;
-    case A5:
-        status = set_option_sizes_real(sane_handle, 148, 210);
-        break;
-    case A6:
-        status = set_option_sizes_real(sane_handle, 105, 144);
-        break;
-    default:
-        status = SANE_STATUS_UNSUPPORTED;
-    }
+    static const char *size_names[] = { NULL, "A2", "A3", "A4", "A5", "A6" };
 
-    return status;
+    if (type < A2 || type > A6)
+        return SANE_STATUS_UNSUPPORTED;
+    return set_paper_size(sane_handle, size_names[type]);
 }
 
 
@@ -759,7 +1584,7 @@ static const SANE_Option_Descriptor *get_optdesc_by_name(SANE_Handle device, con
 	
 	/* Get the number of options. */
 	status = sane_control_option (device, 0, SANE_ACTION_GET_VALUE, &num_dev_options, 0);
-	printf("get option 0 value (%s)\n", sane_strstatus(status));
+	log_debug("get option 0 value (%s)\n", sane_strstatus(status));
 
 	for (*option_num = 0; *option_num < num_dev_options; (*option_num)++) {
 
@@ -767,7 +1592,7 @@ static const SANE_Option_Descriptor *get_optdesc_by_name(SANE_Handle device, con
 		opt = sane_get_option_descriptor (device, *option_num);
 	
 		if (opt->name && strcmp(opt->name, name) == 0) {
-            printf("get option descriptor for option %d, opt->name=%s name=%s\n", *option_num, opt->name, name);
+            log_debug("get option descriptor for option %d, opt->name=%s name=%s\n", *option_num, opt->name, name);
 			return(opt);
 		}
 	}
@@ -787,26 +1612,26 @@ static void set_option_value(SANE_Handle device, int option_num,
 	int rc;
 
 	if(!SANE_OPTION_IS_SETTABLE(opt->cap))
-		  printf("option is not settable");
+		  log_warn("option is not settable\n");
 
 	switch(opt->constraint_type) {
 	case SANE_CONSTRAINT_WORD_LIST:
 		if(opt->constraint.word_list[0] <= 0)
         {
-			printf("no value in the list for option %s", opt->name);
+			log_warn("no value in the list for option %s\n", opt->name);
             return;
         }
 		val_int = *(SANE_Int *)optval;
 		status = sane_control_option (device, option_num,
 									  SANE_ACTION_SET_VALUE, &val_int, NULL);
 		if(status != SANE_STATUS_GOOD)
-			  printf("cannot set option %s to %d (%s)", opt->name, val_int, sane_strstatus(status));
+			  log_warn("cannot set option %s to %d (%s)\n", opt->name, val_int, sane_strstatus(status));
 		break;
 
 	case SANE_CONSTRAINT_STRING_LIST:
 		if(opt->constraint.string_list[0] == NULL)
         {
-			printf("no value in the list for option %s", opt->name);
+			log_warn("no value in the list for option %s\n", opt->name);
             return;
         }
 
@@ -814,7 +1639,7 @@ static void set_option_value(SANE_Handle device, int option_num,
 		status = sane_control_option (device, option_num, 
 									  SANE_ACTION_SET_VALUE, val_string, NULL);
 		if(status != SANE_STATUS_GOOD)
-			  printf("cannot set option %s to [%s] (%s)", opt->name, val_string, sane_strstatus(status));
+			  log_warn("cannot set option %s to [%s] (%s)\n", opt->name, val_string, sane_strstatus(status));
 		free(val_string);
 		break;
 
@@ -823,7 +1648,7 @@ static void set_option_value(SANE_Handle device, int option_num,
 		status = sane_control_option (device, option_num,
 									  SANE_ACTION_SET_VALUE, &val_int, NULL);
 		if(status != SANE_STATUS_GOOD)
-			  printf("cannot set option %s to %d (%s)", opt->name, val_int, sane_strstatus(status));
+			  log_warn("cannot set option %s to %d (%s)\n", opt->name, val_int, sane_strstatus(status));
 		break;
 		
 	default:
@@ -837,15 +1662,15 @@ void display_option_value(SANE_Handle device, int optnum)
 
     opt = sane_get_option_descriptor(device, optnum);
 
-    printf("\n\nGet options %d:\n", optnum);
-    printf("opt name: %s\n",opt->name);
-    printf("opt title: %s\n",opt->title);
-    printf("opt type: %d \n",opt->type);
-    printf("opt description: %s\n",opt->desc);
-    printf("opt cap: %d \n", opt->cap);
-    printf("opt size: %d \n", opt->size);
-    printf("opt unit: %d \n", opt->unit);
-    printf("\n");
+    log_debug("\n\nGet options %d:\n", optnum);
+    log_debug("opt name: %s\n",opt->name);
+    log_debug("opt title: %s\n",opt->title);
+    log_debug("opt type: %d \n",opt->type);
+    log_debug("opt description: %s\n",opt->desc);
+    log_debug("opt cap: %d \n", opt->cap);
+    log_debug("opt size: %d \n", opt->size);
+    log_debug("opt unit: %d \n", opt->unit);
+    log_debug("\n");
 }
 
 
@@ -867,31 +1692,37 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
     SANE_Word val_resolution; //分辨率
 
 	SANE_Int num_dev_options;
+    double span = trace_begin ();
+    char args[96];
 
 	opt = get_optdesc_by_name(device, option_name, &optnum);
-    printf("optnum = %d\n", optnum);
+    log_debug("optnum = %d\n", optnum);
 	if (opt) {
 		
 		optval = guards_malloc(opt->size);
         /* Get default optval(different format) */
 		status = sane_control_option (device, optnum, SANE_ACTION_GET_VALUE, optval, NULL);
 		
-        printf("status = %s opt->type = %d\n",sane_strstatus(status), opt->type);
+        log_debug("status = %s opt->type = %d\n",sane_strstatus(status), opt->type);
         switch(optnum)
         {
             case 2:
                 if(opt->type == SANE_TYPE_STRING)
                 {
                     val_string_color = (SANE_String)optval;
-                    printf("Default color= %s constraint_type=%d\n", val_string_color, opt->constraint_type);
+                    log_debug("Default color= %s constraint_type=%d\n", val_string_color, opt->constraint_type);
                 }
                 val_string_color = (SANE_String)"Color";
 
                 get_option_colors(device, optnum);
-                status = set_option_colors(device, optnum, (SANE_String)"Color");
-                if(status != SANE_STATUS_GOOD)
+                // colour unless the caller chose a mode
+                if (!mode_set)
                 {
-                  printf("cannot set option %s to %s (%s)\n", opt->name, val_string_color, sane_strstatus(status));
+                    status = set_option_colors(device, optnum, (SANE_String)"Color");
+                    if(status != SANE_STATUS_GOOD)
+                    {
+                      log_warn("cannot set option %s to %s (%s)\n", opt->name, val_string_color, sane_strstatus(status));
+                    }
                 }
                 break;
 
@@ -899,7 +1730,7 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 if(opt->type == SANE_TYPE_STRING)
                 {
                     val_string_source = (SANE_String)optval;
-                    printf("Default source= %s constraint_type=%d\n", val_string_source, opt->constraint_type);
+                    log_debug("Default source= %s constraint_type=%d\n", val_string_source, opt->constraint_type);
                 }
                 get_option_sources(device, optnum);
                 status = set_option_sources(device, optnum, (SANE_String)"Transparency Adapter");
@@ -909,14 +1740,16 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 if(opt->type == SANE_TYPE_INT)
                 {
                     val_resolution = *(SANE_Word*)optval;
-                    printf("resolution = %d constraint_type=%d\n", val_resolution, opt->constraint_type);
+                    log_debug("resolution = %d constraint_type=%d\n", val_resolution, opt->constraint_type);
 
                 }
 
                 if(opt->constraint_type == SANE_CONSTRAINT_WORD_LIST)
                 {
                     get_option_resolutions(device, optnum);
-                    set_option_resolutions(device, optnum, 300);
+                    // 300 dpi unless the caller planned a resolution
+                    if (!resolution_set)
+                        set_option_resolutions(device, optnum, 300);
                 }
                 break;
 
@@ -924,7 +1757,7 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 if(opt->type == SANE_TYPE_FIXED)
                 {
                     val_size = SANE_UNFIX(*(SANE_Word*) optval);
-                    printf("size Top-left x= %d constraint_type=%d\n", val_size, opt->constraint_type);
+                    log_debug("size Top-left x= %d constraint_type=%d\n", val_size, opt->constraint_type);
                 }
 
                 if(opt->constraint_type == SANE_CONSTRAINT_RANGE)
@@ -937,7 +1770,7 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 if(opt->type == SANE_TYPE_FIXED)
                 {
                     val_size = SANE_UNFIX(*(SANE_Word*) optval);
-                    printf("size Top-left y= %d constraint_type=%d\n", val_size, opt->constraint_type);
+                    log_debug("size Top-left y= %d constraint_type=%d\n", val_size, opt->constraint_type);
                 }
 
                 if(opt->constraint_type == SANE_CONSTRAINT_RANGE)
@@ -950,21 +1783,23 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 if(opt->type == SANE_TYPE_FIXED)
                 {
                     val_size = SANE_UNFIX(*(SANE_Word*) optval);
-                    printf("size Botton-right x= %d constraint_type=%d\n", val_size, opt->constraint_type);
+                    log_debug("size Botton-right x= %d constraint_type=%d\n", val_size, opt->constraint_type);
                 }
 
                 val_size = SANE_FIX(210);
                 if(opt->constraint_type == SANE_CONSTRAINT_RANGE)
                 {
                     get_option_sizes(device, optnum);
-                    set_option_sizes(device, optnum, val_size);
+                    // A4 width unless the caller chose a scan area
+                    if (!scan_area_set)
+                        set_option_sizes(device, optnum, val_size);
                 }
                 break;
             case 11:
                 if(opt->type == SANE_TYPE_FIXED)
                 {
                     val_size = SANE_UNFIX(*(SANE_Word*) optval);
-                    printf("size Botton-right y= %d constraint_type=%d\n", val_size, opt->constraint_type);
+                    log_debug("size Botton-right y= %d constraint_type=%d\n", val_size, opt->constraint_type);
                 }
 
                 if(opt->constraint_type == SANE_CONSTRAINT_RANGE)
@@ -975,7 +1810,7 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
                 break;
 
             default:
-                printf("optnum = %d\n", optnum);
+                log_debug("optnum = %d\n", optnum);
 
         }
 
@@ -1021,6 +1856,8 @@ static char *get_option_value(SANE_Handle device, const char *option_name)
 		strcpy(str, "backend default");
 	}
 
+    snprintf (args, sizeof (args), "\"option\":\"%s\"", option_name);
+    trace_end (span, "option", args);
 	return(str);
 }
 
@@ -1071,70 +1908,70 @@ void set_color(SANE_Handle sane_handle)
     {
         //默认模式，所以扫描模式为灰度GRAY
         case 0: //Read-only option that specifies how many options a specific devices supports.
-            printf("opt_num = 0\n");
+            log_debug("opt_num = 0\n");
             frameType = NULL;
             break;
 
         case 2: //扫描模式 Scan mode
-            printf("扫描模式\n");
+            log_debug("扫描模式\n");
             frameType = (SANE_String)"Color"; //彩色
             //frameType = "Gray"; //灰度，默认
             //frameType = "Lineart" //黑白
             break;
 
         case 3: //扫描来源 Scan source
-            printf("Scan Source:\n"); 
+            log_debug("Scan Source:\n"); 
             frameType= (SANE_String)"Flatbed"; //平板
             break;
 
         case 4: //预览模式, Request a preview-quality scan
-            printf("Scan preview\n");
+            log_debug("Scan preview\n");
             frameType = (SANE_String)"preview";
             break;
 
             //Number of bits per sample, typical values are 1 for "line-art" and 8 for multibit scans.""
         case 5: //Bit depth
-            printf("Bit depth\n");
+            log_debug("Bit depth\n");
             break;
 
             //Sets the resolution of the scanned image.
         case 6: //分辨率 resolution
-            printf("分辨率\n");
+            log_debug("分辨率\n");
             break;
 
         default:
-            printf("opt_num = %d\n", opt_num);
+            log_debug("opt_num = %d\n", opt_num);
     }
 
     /* if(opt_num == 0) //Read-only, 不进行设置 */
     /*     return; */
 
-    printf("frametype is %s\n", frameType);
+    log_debug("frametype is %s\n", frameType);
 
     opt = sane_get_option_descriptor(sane_handle, opt_num);
 
 
-    printf("\n\n==> Color default options:");
-	printf("The default format: %d\n", parm.format);
-    printf("opt name: %s\n",opt->name);
-    printf("opt title: %s\n",opt->title);
-    printf("opt type: %d \n",opt->type);
-    printf("opt description: %s\n",opt->desc);
-    printf("opt cap: %d \n", opt->cap);
-    printf("opt size: %d \n", opt->size);
-    printf("opt unit: %d \n", opt->unit);
-    printf("\n");
+    log_debug("\n\n==> Color default options:");
+	log_debug("The default format: %d\n", parm.format);
+    log_debug("opt name: %s\n",opt->name);
+    log_debug("opt title: %s\n",opt->title);
+    log_debug("opt type: %d \n",opt->type);
+    log_debug("opt description: %s\n",opt->desc);
+    log_debug("opt cap: %d \n", opt->cap);
+    log_debug("opt size: %d \n", opt->size);
+    log_debug("opt unit: %d \n", opt->unit);
+    log_debug("\n");
 
 	for(int i=0;i<4;i++)
 	{
-        printf("opt strin list:string: %s \n",*(opt->constraint.string_list+i));
+        log_debug("opt strin list:string: %s \n",*(opt->constraint.string_list+i));
 //        printf("opt strin list:word: %d \n\n",*(opt->constraint.word_list+i));
     }
 
 
     if(opt->type == SANE_TYPE_FIXED)
     {
-        printf("SANE_TYPE_FIXED\n");
+        log_debug("SANE_TYPE_FIXED\n");
     //    dpi = SANE_FIX(bestdpi);
     }
 
@@ -1142,21 +1979,21 @@ void set_color(SANE_Handle sane_handle)
     status = sane_control_option(sane_handle, opt_num, SANE_ACTION_SET_VALUE, frameType, &info);
     if (status != SANE_STATUS_GOOD)
 	{
-		printf("Option did not set\n");
+		log_warn("Option did not set\n");
     }
 
-    printf("\nset control option success!\n");
+    log_debug("\nset control option success!\n");
 
     opt = sane_get_option_descriptor(sane_handle, opt_num);
-    printf("\n\nColor Set options:");
-    printf("opt name: %s\n",opt->name);
-    printf("opt title: %s\n",opt->title);
-    printf("opt type: %d \n",opt->type);
-    printf("opt description: %s\n",opt->desc);
-    printf("opt cap: %d \n", opt->cap);
-    printf("opt size: %d \n", opt->size);
-    printf("opt unit: %d \n", opt->unit);
-    printf("\n");
+    log_debug("\n\nColor Set options:");
+    log_debug("opt name: %s\n",opt->name);
+    log_debug("opt title: %s\n",opt->title);
+    log_debug("opt type: %d \n",opt->type);
+    log_debug("opt description: %s\n",opt->desc);
+    log_debug("opt cap: %d \n", opt->cap);
+    log_debug("opt size: %d \n", opt->size);
+    log_debug("opt unit: %d \n", opt->unit);
+    log_debug("\n");
 }
 
 void test_options(SANE_Handle device)
@@ -1210,7 +2047,7 @@ void test_options(SANE_Handle device)
             SANE_CAP_ADVANCED)) == 0)
         //printf("invalid capabilities for option [%d, %s] (%x)", option_num, opt->name, opt->cap);
 
-		printf("option [%d, %s] must have a title\n", option_num, opt->name);
+		log_warn("option [%d, %s] must have a title\n", option_num, opt->name);
 		if(opt->title != NULL)
 			//printf("option [%d, %s] must have a title", option_num, opt->name);
 
@@ -1228,14 +2065,14 @@ void test_options(SANE_Handle device)
 			if(opt->name == NULL || *opt->name == 0)
 				  //printf("option [%d, %s] has a name", option_num, opt->name);
 			if(!SANE_OPTION_IS_SETTABLE (opt->cap))
-				  printf("option [%d, %s], group option is settable\n", option_num, opt->name);
+				  log_warn("option [%d, %s], group option is settable\n", option_num, opt->name);
 		} else {
 			if (option_num == 0) {
 				if(opt->name != NULL && *opt->name ==0)
-					  printf("option 0 must have an empty name (ie. \"\")\n");
+					  log_warn("option 0 must have an empty name (ie. \"\")\n");
 			} else {
 				if(opt->name != NULL && *opt->name !=0)
-					  printf("option %d must have a name\n", option_num);
+					  log_warn("option %d must have a name\n", option_num);
 			}
 		}
 
@@ -1327,14 +2164,429 @@ void test_options(SANE_Handle device)
 
 }
 
+/* -------------------------------------------- */
+// Auto geometry
+
+static const char *geometry_names[4] = { SANE_NAME_SCAN_TL_X, SANE_NAME_SCAN_TL_Y,
+                                         SANE_NAME_SCAN_BR_X, SANE_NAME_SCAN_BR_Y };
+
+// Word sized (bool, int, fixed) option by name
+static SANE_Status get_option_word(SANE_Handle sane_handle, const char *name, SANE_Word *value)
+{
+    const SANE_Option_Descriptor *opt;
+    int optnum;
+
+    opt = get_optdesc_by_name (sane_handle, name, &optnum);
+    if (!opt || opt->size != sizeof (SANE_Word))
+        return SANE_STATUS_UNSUPPORTED;
+    return sane_control_option (sane_handle, optnum, SANE_ACTION_GET_VALUE, value, NULL);
+}
+
+static SANE_Status set_option_word(SANE_Handle sane_handle, const char *name, SANE_Word value)
+{
+    const SANE_Option_Descriptor *opt;
+    int optnum;
+
+    opt = get_optdesc_by_name (sane_handle, name, &optnum);
+    if (!opt || opt->size != sizeof (SANE_Word)
+        || !SANE_OPTION_IS_ACTIVE (opt->cap) || !SANE_OPTION_IS_SETTABLE (opt->cap))
+        return SANE_STATUS_UNSUPPORTED;
+    return sane_control_option (sane_handle, optnum, SANE_ACTION_SET_VALUE, &value, NULL);
+}
+
+/**
+ * Scan width x height mm at x, y from the corner of the bed.  The values
+ * are put on the grid of each option's range here, top-left rounding down
+ * and bottom-right up, so they are set in one pass with nothing left for
+ * the backend to round.
+ **/
+SANE_Status set_scan_area(SANE_Handle sane_handle, double x, double y, double width, double height)
+{
+    double mm[4] = { x, y, x + width, y + height };
+    SANE_Word value[4];
+    int optnum[4];
+    SANE_Status status;
+    SANE_Int info;
+    int i;
+
+    sane_handle = live_handle (sane_handle);
+    if (width <= 0. || height <= 0.)
+        return SANE_STATUS_INVAL;
+
+    for (i = 0; i < 4; i++)
+    {
+        const SANE_Option_Descriptor *opt = get_optdesc_by_name (sane_handle, geometry_names[i], &optnum[i]);
+        int up = (i >= 2);
+
+        if (!opt || opt->size != sizeof (SANE_Word) || opt->unit != SANE_UNIT_MM
+            || (opt->type != SANE_TYPE_FIXED && opt->type != SANE_TYPE_INT)
+            || !SANE_OPTION_IS_SETTABLE (opt->cap))
+            return SANE_STATUS_UNSUPPORTED;
+
+        if (opt->type == SANE_TYPE_FIXED)
+        {
+            if (opt->constraint_type == SANE_CONSTRAINT_RANGE)
+                mm[i] += SANE_UNFIX (opt->constraint.range->min);
+            value[i] = SANE_FIX (mm[i]);
+        }
+        else
+        {
+            if (opt->constraint_type == SANE_CONSTRAINT_RANGE)
+                mm[i] += opt->constraint.range->min;
+            value[i] = (SANE_Word)(up ? ceil (mm[i]) : floor (mm[i]));
+        }
+        if (opt->constraint_type == SANE_CONSTRAINT_RANGE)
+        {
+            const SANE_Range *range = opt->constraint.range;
+            SANE_Word wanted = value[i];
+
+            value[i] = range_snap (range, wanted, up);
+            if (wanted - value[i] > range->quant || value[i] - wanted > range->quant)
+                log_info("scan area: %s cut to the bed\n", geometry_names[i]);
+        }
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        status = sane_control_option (sane_handle, optnum[i], SANE_ACTION_SET_VALUE, &value[i], &info);
+        if (status != SANE_STATUS_GOOD)
+        {
+            log_warn("cannot set option %s (%s)\n", geometry_names[i], sane_strstatus (status));
+            return status;
+        }
+        if (info & SANE_INFO_INEXACT)
+            log_info("option %s rounded by the backend to %d\n", geometry_names[i], value[i]);
+    }
+    scan_area_set = 1;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_mode(SANE_Handle sane_handle, SANE_String_Const mode)
+{
+    const SANE_Option_Descriptor *opt;
+    SANE_Status status;
+    char *value;
+    int optnum;
+
+    sane_handle = live_handle (sane_handle);
+    opt = get_optdesc_by_name (sane_handle, SANE_NAME_SCAN_MODE, &optnum);
+    if (!opt || opt->type != SANE_TYPE_STRING || !SANE_OPTION_IS_SETTABLE (opt->cap))
+        return SANE_STATUS_UNSUPPORTED;
+    if (!mode || strlen (mode) >= (size_t) opt->size)
+        return SANE_STATUS_INVAL;
+
+    // the backend may read opt->size bytes
+    value = (char *)calloc (1, opt->size);
+    if (!value)
+        return SANE_STATUS_NO_MEM;
+    strcpy (value, mode);
+    status = sane_control_option (sane_handle, optnum, SANE_ACTION_SET_VALUE, value, NULL);
+    free (value);
+    if (status == SANE_STATUS_GOOD)
+        mode_set = 1;
+    return status;
+}
+
+SANE_String_Const get_device_name()
+{
+    return device_name;
+}
+
+SANE_Status set_paper_size(SANE_Handle sane_handle, SANE_String_Const name)
+{
+    const Paper_Size *size = paper_size_find (name);
+
+    if (!size)
+        return SANE_STATUS_INVAL;
+    log_info("paper size %s: %.1fx%.1f mm\n", size->name, size->width, size->height);
+    return set_scan_area (sane_handle, 0., 0., size->width, size->height);
+}
+
+/**
+ * Scan the whole bed at preview resolution and set the scan area to the
+ * document found on it, with auto_margin around it.  The scan area stays
+ * as it was when no document is found.
+ **/
+static SANE_Status set_geometry_from_preview()
+{
+    const SANE_Option_Descriptor *opt, *res_opt;
+    SANE_Word saved[4], bed[4], resolution = 0, preview = SANE_FALSE;
+    Strip_Pipeline preview_pipeline;
+    Strip_Sink *bbox;
+    Bbox_Result box;
+    SANE_Status status;
+    double mm_x, mm_y, area[4];
+    int optnum, i, met;
+
+    for (i = 0; i < 4; i++)
+    {
+        opt = get_optdesc_by_name (device, geometry_names[i], &optnum);
+        if (!opt || opt->type != SANE_TYPE_FIXED || opt->constraint_type != SANE_CONSTRAINT_RANGE)
+            return SANE_STATUS_UNSUPPORTED;
+        bed[i] = (i < 2) ? opt->constraint.range->min : opt->constraint.range->max;
+        status = sane_control_option (device, optnum, SANE_ACTION_GET_VALUE, &saved[i], NULL);
+        if (status != SANE_STATUS_GOOD)
+            return status;
+    }
+    for (i = 0; i < 4; i++)
+        set_option_word (device, geometry_names[i], bed[i]);
+
+    res_opt = get_optdesc_by_name (device, SANE_NAME_SCAN_RESOLUTION, &optnum);
+    if (res_opt && get_option_word (device, SANE_NAME_SCAN_RESOLUTION, &resolution) == SANE_STATUS_GOOD)
+        set_option_word (device, SANE_NAME_SCAN_RESOLUTION, resolution_pick (res_opt, auto_preview_dpi, &met));
+    else
+        res_opt = NULL;
+    get_option_word (device, SANE_NAME_PREVIEW, &preview);
+    set_option_word (device, SANE_NAME_PREVIEW, SANE_TRUE);
+
+    memset (&box, 0, sizeof (box));
+    pipeline_init (&preview_pipeline);
+    bbox = bbox_sink_create (AUTO_CROP_DELTA);
+    buffer_size = (32 * 1024);
+    buffer = (SANE_Byte*)malloc (buffer_size);
+    if (!bbox || !buffer)
+        status = SANE_STATUS_NO_MEM;
+    else
+    {
+        watchdog_arm (device_name, "preview");
+        status = start_frame ();
+    }
+    if (status == SANE_STATUS_GOOD)
+        status = scan_it (&preview_pipeline, bbox);
+    watchdog_disarm ();
+    backend->cancel (device);
+    if (watchdog_fired ())
+    {
+        // the settings are put back below, on the reopened handle
+        reopen_device ();
+        status = SANE_STATUS_IO_ERROR;
+    }
+    if (status == SANE_STATUS_GOOD)
+        bbox_sink_result (bbox, &box);
+    strip_sink_destroy (bbox);
+    pipeline_release (&preview_pipeline);
+    free (buffer);
+    buffer = NULL;
+
+    set_option_word (device, SANE_NAME_PREVIEW, preview);
+    if (res_opt)
+        set_option_word (device, SANE_NAME_SCAN_RESOLUTION, resolution);
+
+    if (status != SANE_STATUS_GOOD || !box.found)
+    {
+        for (i = 0; i < 4; i++)
+            set_option_word (device, geometry_names[i], saved[i]);
+        log_info("auto geometry: no document found (%s), scan area unchanged\n", sane_strstatus (status));
+        return status;
+    }
+
+    // the preview covered the whole bed
+    mm_x = SANE_UNFIX (bed[2] - bed[0]) / box.width;
+    mm_y = SANE_UNFIX (bed[3] - bed[1]) / box.height;
+    area[0] = SANE_UNFIX (bed[0]) + box.x0 * mm_x - auto_margin;
+    area[1] = SANE_UNFIX (bed[1]) + box.y0 * mm_y - auto_margin;
+    area[2] = SANE_UNFIX (bed[0]) + box.x1 * mm_x + auto_margin;
+    area[3] = SANE_UNFIX (bed[1]) + box.y1 * mm_y + auto_margin;
+    status = set_scan_area (device, area[0] - SANE_UNFIX (bed[0]), area[1] - SANE_UNFIX (bed[1]),
+                            area[2] - area[0], area[3] - area[1]);
+    log_info("auto geometry: document at %.1f,%.1f - %.1f,%.1f mm (background %d)\n",
+           area[0], area[1], area[2], area[3], box.background);
+    return status;
+}
+
+/**
+ * Set the lowest resolution that gives min_dpi; with output_dpi the pages
+ * are also downscaled on the host to exactly that.  The plan, with the
+ * page sizes the device reports for the current scan area, goes to *plan.
+ **/
+SANE_Status set_scan_resolution(SANE_Handle sane_handle, int min_dpi, int output_dpi, Resolution_Plan *plan)
+{
+    const SANE_Option_Descriptor *opt;
+    Resolution_Target target;
+    Resolution_Plan p;
+    SANE_Parameters parm;
+    SANE_Word tl_y, br_y;
+    SANE_Status status;
+    double height = 297.;
+    int optnum;
+
+    sane_handle = live_handle (sane_handle);
+    opt = get_optdesc_by_name (sane_handle, SANE_NAME_SCAN_RESOLUTION, &optnum);
+    if (!opt || opt->size != sizeof (SANE_Word) || !SANE_OPTION_IS_SETTABLE (opt->cap))
+        return SANE_STATUS_UNSUPPORTED;
+
+    target.min_dpi = min_dpi;
+    target.output_dpi = output_dpi;
+    status = resolution_plan (opt, &target, &p);
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    status = sane_control_option (sane_handle, optnum, SANE_ACTION_SET_VALUE, &p.value, NULL);
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    resolution_set = 1;
+    scan_resample = p.scale;
+
+    if (get_option_word (sane_handle, SANE_NAME_SCAN_TL_Y, &tl_y) == SANE_STATUS_GOOD
+        && get_option_word (sane_handle, SANE_NAME_SCAN_BR_Y, &br_y) == SANE_STATUS_GOOD)
+        height = SANE_UNFIX (br_y - tl_y);
+    if (sane_get_parameters (sane_handle, &parm) == SANE_STATUS_GOOD)
+        resolution_plan_bytes (&p, &parm, height);
+
+    log_info("resolution: scan %d dpi%s, output %d dpi, %.1f MB per page (%.1f MB from the device)\n",
+           p.scan_dpi, p.met ? "" : " (below target)", p.output_dpi, p.output_bytes / 1e6, p.scan_bytes / 1e6);
+    if (plan)
+        *plan = p;
+    return SANE_STATUS_GOOD;
+}
+
+int pick_scan_resolution(SANE_Handle sane_handle, int min_dpi)
+{
+    const SANE_Option_Descriptor *opt;
+    Resolution_Target target;
+    Resolution_Plan p;
+    int optnum;
+
+    sane_handle = live_handle (sane_handle);
+    opt = get_optdesc_by_name (sane_handle, SANE_NAME_SCAN_RESOLUTION, &optnum);
+    if (!opt || opt->size != sizeof (SANE_Word))
+        return min_dpi;
+    target.min_dpi = min_dpi;
+    target.output_dpi = 0;
+    if (resolution_plan (opt, &target, &p) != SANE_STATUS_GOOD)
+        return min_dpi;
+    return p.scan_dpi;
+}
+
+/* -------------------------------------------- */
+// Prediction
+
+static int current_dpi(SANE_Handle sane_handle)
+{
+    const SANE_Option_Descriptor *opt;
+    SANE_Word value;
+    int optnum;
+
+    opt = get_optdesc_by_name (sane_handle, SANE_NAME_SCAN_RESOLUTION, &optnum);
+    if (!opt || opt->size != sizeof (SANE_Word)
+        || sane_control_option (sane_handle, optnum, SANE_ACTION_GET_VALUE, &value, NULL) != SANE_STATUS_GOOD)
+        return 0;
+    return resolution_dpi (opt, value);
+}
+
+/**
+ * Host memory of a scan: the read buffer, the strip being filled and one
+ * buffer per stage for each strip in flight, the extra outputs and the
+ * resampler, a held back blank page, and for three-pass colour the whole
+ * interleaved image.
+ **/
+static size_t predict_memory(const SANE_Parameters *parm, size_t bytes)
+{
+    size_t strip = (size_t) parm->bytes_per_line * STRIP_HEIGHT;
+    size_t branch;
+    Pipeline_Stats stats;
+    size_t memory = 32 * 1024;
+    int window;
+
+    if (parm->format >= SANE_FRAME_RED && parm->format <= SANE_FRAME_BLUE)
+    {
+        strip *= 3;
+        memory += bytes;
+    }
+    pipeline_get_stats (&pipeline, &stats);
+    window = stats.window ? stats.window : 1;
+    memory += strip * (1 + (size_t) window * (pipeline.n_stages + 1));
+
+    // a downscaler keeps a float sum per input sample
+    branch = 2 * strip + (size_t) parm->bytes_per_line * sizeof (float);
+    memory += branch * n_scan_outputs;
+    if (scan_resample < 1.)
+        memory += branch;
+    if (blank_action == BLANK_DROP)
+        memory += (blank_config.defer_bytes < bytes) ? blank_config.defer_bytes : bytes;
+    return memory;
+}
+
+SANE_Status predict_scan(SANE_Handle sane_handle, Scan_Prediction *prediction)
+{
+    SANE_Parameters parm;
+    SANE_Word tl_y, br_y;
+    SANE_Status status;
+    double height = 297.;
+
+    sane_handle = live_handle (sane_handle);
+    status = sane_get_parameters (sane_handle, &parm);
+    if (status != SANE_STATUS_GOOD)
+        return status;
+    if (get_option_word (sane_handle, SANE_NAME_SCAN_TL_Y, &tl_y) == SANE_STATUS_GOOD
+        && get_option_word (sane_handle, SANE_NAME_SCAN_BR_Y, &br_y) == SANE_STATUS_GOOD)
+        height = SANE_UNFIX (br_y - tl_y);
+
+    scan_predict (device_name, current_dpi (sane_handle), &parm, height, prediction);
+    prediction->peak_memory = predict_memory (&parm, prediction->bytes);
+    log_info("prediction: %.1f MB in %.1f s (warm-up %.1f s, %s), peak memory %.1f MB\n",
+           prediction->bytes / 1e6, prediction->seconds, prediction->warmup,
+           prediction->from_history ? "from history" : "no history", prediction->peak_memory / 1e6);
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_memory_budget(size_t bytes)
+{
+    memory_budget = bytes;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_history_file(SANE_String_Const path)
+{
+    if (!path)
+    {
+        history_path[0] = 0;
+        return SANE_STATUS_GOOD;
+    }
+    if (strlen (path) >= sizeof (history_path))
+        return SANE_STATUS_INVAL;
+    strcpy (history_path, path);
+    // a missing file is a new history
+    history_load (history_path);
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_auto_geometry(SANE_Bool enable, int preview_dpi, double margin_mm)
+{
+    if (enable && (preview_dpi <= 0 || margin_mm < 0.))
+        return SANE_STATUS_INVAL;
+    auto_geometry = enable;
+    if (enable)
+    {
+        auto_preview_dpi = preview_dpi;
+        auto_margin = margin_mm;
+    }
+    return SANE_STATUS_GOOD;
+}
+
 // Start scanning
 //扫描文档
 SANE_Status start_scan(SANE_Handle sane_handle, SANE_String_Const fileName)
 {
     SANE_Status sane_status;
-    device = sane_handle;
+    double span;
+
+    device = live_handle (sane_handle);
+    trace_set_device (device_name);
+    span = trace_begin ();
 
-    printf("start_scan: %s\n", kylin_display_scan_parameters(device));
+    log_info("start_scan: %s\n", kylin_display_scan_parameters(device));
+
+    // from here on, so a cancel during the preview stops the scan too
+    scan_begin_cancellable ();
+    if (auto_geometry)
+    {
+        sane_status = set_geometry_from_preview ();
+        if (sane_status != SANE_STATUS_GOOD && sane_status != SANE_STATUS_UNSUPPORTED)
+        {
+            scan_end_cancellable (sane_status);
+            return sane_status;
+        }
+    }
 
     //test_options(device);
     //view_default(devide);
@@ -1352,28 +2604,145 @@ SANE_Status start_scan(SANE_Handle sane_handle, SANE_String_Const fileName)
     //view_default(devide);
 
     //return SANE_STATUS_GOOD;
-    return do_scan(fileName);
+    sane_status = do_scan(fileName);
+    trace_end (span, "start_scan", NULL);
+    return sane_status;
 }
 
 // Cancel scanning
 //扫描结束
 void cancle_scan(SANE_Handle sane_handle)
 {
-    sane_cancel(sane_handle);
+    sane_handle = live_handle (sane_handle);
+    if (__atomic_load_n (&scan_cancel.active, __ATOMIC_ACQUIRE) && !cancel_requested ())
+    {
+        scan_cancel.requested_at = now_sec ();
+        __atomic_store_n (&scan_cancel.requested, 1, __ATOMIC_RELEASE);
+        if (scan_cancel.wake[1] >= 0)
+            write (scan_cancel.wake[1], "c", 1);
+    }
+    // safe at any time, a blocked sane_read returns CANCELLED
+    backend->cancel(sane_handle);
+}
+
+SANE_Status set_scan_nonblocking(SANE_Bool enable)
+{
+    if (enable && scan_cancel.wake[0] < 0)
+    {
+        if (pipe (scan_cancel.wake) != 0)
+            return SANE_STATUS_NO_MEM;
+        fcntl (scan_cancel.wake[0], F_SETFL, O_NONBLOCK);
+        fcntl (scan_cancel.wake[1], F_SETFL, O_NONBLOCK);
+    }
+    scan_cancel.nonblocking = enable;
+    return SANE_STATUS_GOOD;
+}
+
+double get_cancel_latency()
+{
+    return scan_cancel.latency;
 }
 
 // Close SANE device
 //关闭设备
 void close_device(SANE_Handle sane_handle)
 {
+    sane_handle = live_handle (sane_handle);
+    if (sane_handle == device)
+        stale_handle = NULL;
     sane_close(sane_handle);
 }
 
+SANE_Status set_read_profile(SANE_Bool enable, SANE_Bool auto_tune)
+{
+    read_profile_on = enable;
+    read_profile_auto = enable && auto_tune;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status get_read_report(Read_Report *report)
+{
+    if (!read_report_valid)
+        return SANE_STATUS_INVAL;
+    *report = read_report;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status set_scan_capture(SANE_Handle sane_handle, SANE_String_Const path)
+{
+    const Scan_Backend *capture;
+
+    backend = &sane_backend;
+    if (!path)
+        return capture_end ();
+    capture = capture_begin (path, live_handle (sane_handle));
+    if (!capture)
+        return SANE_STATUS_ACCESS_DENIED;
+    backend = capture;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status replay_scan(SANE_String_Const capture_path, SANE_String_Const fileName, double speed)
+{
+    static Replay *replay = NULL;
+    static char replay_path[PATH_MAX];
+    const Scan_Backend *saved_backend = backend;
+    SANE_Handle saved_device = device;
+    SANE_Status status;
+
+    if (replay && strcmp (replay_path, capture_path))
+    {
+        replay_close (replay);
+        replay = NULL;
+    }
+    if (!replay)
+    {
+        replay = replay_open (capture_path, speed);
+        if (!replay)
+            return SANE_STATUS_IO_ERROR;
+        snprintf (replay_path, sizeof (replay_path), "%s", capture_path);
+    }
+    if (!replay_pending (replay))
+    {
+        replay_close (replay);
+        replay = NULL;
+        return SANE_STATUS_NO_DOCS;
+    }
+
+    backend = replay_backend (replay);
+    device = NULL;
+    status = do_scan (fileName);
+    device = saved_device;
+    backend = saved_backend;
+    return status;
+}
+
+SANE_Status set_stall_watchdog(double timeout, SANE_String_Const log_path)
+{
+    if (watchdog_set_log (log_path) != 0)
+        return SANE_STATUS_INVAL;
+    if (watchdog_start (timeout, stall_cancel, NULL) != 0)
+        return SANE_STATUS_NO_MEM;
+    return SANE_STATUS_GOOD;
+}
+
 // Release SANE resources
 //释放所有资源
 void my_sane_exit()
 {
+    watchdog_stop ();
+    capture_end ();
+    backend = &sane_backend;
+    metrics_stop ();
+    trace_stop ();
+    pipeline_clear_stages (&pipeline);
+    pipeline_release (&pipeline);
+    phash_index_clear (&duplicate_index);
+    shm_ring_destroy (shm_output);
+    shm_output = NULL;
+    durable_flush (NULL);
     sane_exit();
+    log_flush ();
 }
 
 // 可以借此整理出未识别设备的情况
@@ -1382,7 +2751,7 @@ int check_search_scan_devices()
     const char *devname = 0;
 
     // 1. initialize SANE
-    printf("SANE Init\n");
+    log_info("SANE Init\n");
     init();
 
     // 2. get all devices
@@ -1391,7 +2760,7 @@ int check_search_scan_devices()
     if (sane_status = get_devices(&device_list))
     {
         // 6. release resources
-        printf("Exit\n");
+        log_info("Exit\n");
         my_sane_exit();
         return -1;
     }	
@@ -1403,7 +2772,7 @@ void kylinNorScan()
     const char *devname = 0;
 
     // 1. initialize SANE
-    printf("SANE Init\n");
+    log_info("SANE Init\n");
     init();
 
     do 
@@ -1424,62 +2793,62 @@ void kylinNorScan()
         {
             if (column + strlen (device_list[i]->name) + 1 >= 80)
          {
-           printf ("\n    ");
+           log_info ("\n    ");
            column = 4;
          }
            if (column > 4)
          {
-           fputc (' ', stdout);
+           log_info (" ");
            column += 1;
          }
-           fputs (device_list[i]->name, stdout);
+           log_info ("%s", device_list[i]->name);
            column += strlen (device_list[i]->name);
         }
-       fputc ('\n', stdout);
+       log_info ("\n");
 
 
         for (i = 0; device_list[i]; ++i)
         {
-          printf ("device `%s' is a %s %s %s\n",
+          log_info ("device `%s' is a %s %s %s\n",
              device_list[i]->name, device_list[i]->vendor,
              device_list[i]->model, device_list[i]->type);
         }
         if (!device_list[0])
         {
-            fprintf (stderr, "no SANE devices found\n");
+            log_error ("no SANE devices found\n");
             break;
         }
         devname = device_list[0]->name;
-        printf("device_list->name = %s\n", devname);
+        log_info("device_list->name = %s\n", devname);
 
         // 3. open a device
-        printf("Open a device\n");
+        log_info("Open a device\n");
         SANE_Handle sane_handle = NULL;
         SANE_Device *device = (SANE_Device *)*device_list;
         if (!device) 
         {
-            printf("No device connected!\n");
+            log_error("No device connected!\n");
             break;
         }
 
         if (sane_status = open_device(device, &sane_handle))
         {
-            printf("Open device failed!\n");
+            log_error("Open device failed!\n");
             break;
         }
 
         // 4. start scanning
-        printf("Scanning...\n");
+        log_info("Scanning...\n");
         start_scan(sane_handle, "helloworld");
         cancle_scan(sane_handle);
 
         // 5. close device
-        printf("Close the device\n");
+        log_info("Close the device\n");
         close_device(sane_handle);
     }while(0);    
 
     // 6. release resources
-    printf("Exit\n");
+    log_info("Exit\n");
     my_sane_exit();
 
 }
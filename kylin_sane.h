@@ -1,13 +1,40 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "sane/sane.h"
 #include "sane/saneopts.h"
 
+#include "kylin_pipeline.h"
+#include "kylin_downscale.h"
+#include "kylin_blank.h"
+#include "kylin_stats.h"
+#include "kylin_phash.h"
+#include "kylin_digest.h"
+#include "kylin_writer.h"
+#include "kylin_durable.h"
+#include "kylin_shmring.h"
+#include "kylin_autocrop.h"
+#include "kylin_papersize.h"
+#include "kylin_resolution.h"
+#include "kylin_predict.h"
+#include "kylin_jobs.h"
+#include "kylin_watchdog.h"
+#include "kylin_readprof.h"
+#include "kylin_trace.h"
+#include "kylin_metrics.h"
+#include "kylin_capture.h"
+#include "kylin_scanloop.h"
+#include "kylin_log.h"
+
 
 
 #ifndef PATH_MAX
@@ -25,12 +52,29 @@ enum sizes_type
     A6
 };
 
+typedef struct
+{
+    uint64_t hash;          /* perceptual hash of the page */
+    int duplicate;          /* an earlier page of the batch looks the same */
+    int distance;           /* bits the hashes differ in */
+    char of[PATH_MAX];      /* that page */
+} Duplicate_Result;
+
+// What do_scan does with blank pages
+enum blank_action
+{
+    BLANK_OFF = 0,
+    BLANK_MARK,             /* report them, keep the files */
+    BLANK_DROP              /* report them, write no files */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * Initialize SANE
+ * Initialize SANE; with KYLIN_SANE_TRACE set to a path, tracing starts
+ * here (see kylin_trace.h) and stops in my_sane_exit()
  **/
 void init();
 // Get all devices
@@ -39,12 +83,104 @@ SANE_Status get_devices(const SANE_Device ***device_list);
 SANE_Status open_device(SANE_Device *device, SANE_Handle *sane_handle);
 // Start scanning
 SANE_Status start_scan(SANE_Handle sane_handle, SANE_String_Const fileName);
-// Cancel scanning
+// Cancel scanning; from another thread this stops a running start_scan,
+// which then returns SANE_STATUS_CANCELLED and removes its partial files
 void cancle_scan(SANE_Handle sane_handle);
+// Read in non-blocking mode where the backend supports it
+SANE_Status set_scan_nonblocking(SANE_Bool enable);
+// Seconds from the last cancel request to the device being idle again
+double get_cancel_latency();
+// Scan area in mm from the corner of the bed, set in one pass
+SANE_Status set_scan_area(SANE_Handle sane_handle, double x, double y, double width, double height);
+// Scan mode by value, e.g. SANE_VALUE_SCAN_MODE_GRAY; kept instead of the colour default
+SANE_Status set_scan_mode(SANE_Handle sane_handle, SANE_String_Const mode);
+// Name of the device opened last
+SANE_String_Const get_device_name();
+// Scan area of a size from the paper_sizes() catalogue, e.g. "A4", "Letter", "ID-1"
+SANE_Status set_paper_size(SANE_Handle sane_handle, SANE_String_Const name);
+// Lowest device resolution giving min_dpi, downscaled on the host to output_dpi if > 0
+SANE_Status set_scan_resolution(SANE_Handle sane_handle, int min_dpi, int output_dpi, Resolution_Plan *plan);
+// Device dpi set_scan_resolution() would scan at for min_dpi; min_dpi if the device cannot tell
+int pick_scan_resolution(SANE_Handle sane_handle, int min_dpi);
+// Bytes, time and host memory of a scan with the current settings
+SANE_Status predict_scan(SANE_Handle sane_handle, Scan_Prediction *prediction);
+// Refuse scans predicted to need more host memory than this (0: no limit) with SANE_STATUS_NO_MEM
+SANE_Status set_memory_budget(size_t bytes);
+// Keep the per-device timing history in this file, loaded now and saved after every scan
+SANE_Status set_scan_history_file(SANE_String_Const path);
+/**
+ * Profile the sane_read calls of every scan: print line rate, host time
+ * and backtracks, and write <page>.timeline.json.  With auto_tune the next
+ * scans use the suggested read size and parallel mode.
+ **/
+SANE_Status set_read_profile(SANE_Bool enable, SANE_Bool auto_tune);
+// Report on the last profiled scan
+SANE_Status get_read_report(Read_Report *report);
+// Record the scans of sane_handle to a capture file (kylin_capture.h) until called with NULL
+SANE_Status set_scan_capture(SANE_Handle sane_handle, SANE_String_Const path);
+/**
+ * Scan the next recorded page of a capture instead of a device, through
+ * the same pipeline and outputs; speed as in replay_open().  Returns
+ * SANE_STATUS_NO_DOCS when the capture has no more pages.
+ **/
+SANE_Status replay_scan(SANE_String_Const capture_path, SANE_String_Const fileName, double speed);
+/**
+ * Cancel a scan that gets no data for timeout seconds (0: never), then
+ * close and open the device again with the same options; start_scan
+ * returns SANE_STATUS_IO_ERROR and the handle stays usable.  Stalls are
+ * kept for stall_events() and appended to log_path if not NULL.
+ **/
+SANE_Status set_stall_watchdog(double timeout, SANE_String_Const log_path);
 // Close SANE device
 void close_device(SANE_Handle sane_handle);
 // Release SANE resources
 void my_sane_exit();
+// Pipeline applied to scanned pages; add stages before start_scan
+Strip_Pipeline *get_scan_pipeline();
+// Process strips on the shared thread pool; output is the same as serial
+SANE_Status set_scan_parallel(SANE_Bool enable);
+// Also write each page downscaled by scale and fitted into max_size pixels (if > 0;
+// the width only when the backend does not know the height) to <name><pid><suffix>.pnm,
+// from the same acquisition
+SANE_Status add_scan_output(SANE_String_Const suffix, double scale, int max_size);
+void clear_scan_outputs();
+// Check every page for ink; config NULL means blank_config_init() defaults
+SANE_Status set_blank_detection(int action, const Blank_Config *config);
+// Result for the last page scanned with detection on
+SANE_Status get_blank_result(Blank_Result *result);
+// Histogram, range, mean and variance per channel of every page as it is written
+SANE_Status set_page_stats(SANE_Bool enable);
+// Statistics of the last page scanned with them on
+SANE_Status get_page_stats(Page_Stats *stats);
+// Hash every file as it is written and put the digest in <file>.crc32c or
+// <file>.xxh64 next to it; DIGEST_NONE turns it off
+SANE_Status set_scan_digest(int kind);
+// Hex digest of the last page written with digests on, hex has DIGEST_HEX_MAX bytes
+SANE_Status get_scan_digest(char *hex);
+// How page files are written, writer_flags; WRITER_PREALLOCATE by default
+SANE_Status set_scan_file_flags(int flags);
+// Buffers a page file has in flight with WRITER_ASYNC, WRITER_DEFAULT_DEPTH by default
+SANE_Status set_scan_write_depth(int depth);
+// What is synced before a page gets its final name; NULL means durable_config_init(), DURABLE_NONE.
+// With DURABLE_GROUP, durable_flush(NULL) at the end of a batch gives the last pages their names
+SANE_Status set_scan_durability(const Durable_Config *config);
+/**
+ * Publish the strips of every page in the shared memory ring name as
+ * they are scanned (kylin_shmring.h), slots of slot_size bytes, 0 for the
+ * defaults; a consumer behind holds the scan up to timeout seconds, 0 for
+ * as long as it lives.  NULL removes the ring.
+ **/
+SANE_Status set_scan_shm_output(const char *name, int slots, size_t slot_size, double timeout);
+// Compare every page with those scanned since clear_duplicate_index(); pages whose
+// hashes differ in at most threshold bits are duplicates (PHASH_DEFAULT_THRESHOLD)
+SANE_Status set_duplicate_detection(SANE_Bool enable, int threshold);
+// Start a new batch
+void clear_duplicate_index();
+// Result for the last page scanned with detection on
+SANE_Status get_duplicate_result(Duplicate_Result *result);
+// Before each scan find the document with a preview of the whole bed at about
+// preview_dpi and scan only its area, plus margin_mm on every side
+SANE_Status set_auto_geometry(SANE_Bool enable, int preview_dpi, double margin_mm);
 
 #ifdef __cplusplus
 }
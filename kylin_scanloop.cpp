@@ -0,0 +1,37 @@
+#include <string.h>
+
+#include "kylin_scanloop.h"
+
+/**
+ * The kernels are templates, instantiated for each kind of frame that
+ * scan_chunk_kernel() can return; only the selector has C linkage.  A
+ * one-pass chunk is handed on whole whatever its depth, byte order or
+ * whether the page is measured, so interleave is the only parameter that
+ * changes the code: variants on those would compile to the same push.
+ **/
+template <bool Interleave>
+static SANE_Status consume_chunk(Scan_Chunk *chunk, const SANE_Byte *data, int len)
+{
+    if (Interleave)
+    {
+        uint8_t *out = chunk->image + chunk->offset;
+        int i;
+
+        for (i = 0; i < len; i++)
+            out[3 * i] = data[i];
+        chunk->offset += 3 * (size_t) len;
+        return SANE_STATUS_GOOD;
+    }
+    return pipeline_push (chunk->pipeline, data, len);
+}
+
+extern "C" void scan_chunk_init(Scan_Chunk *chunk, Strip_Pipeline *pipeline)
+{
+    memset (chunk, 0, sizeof (*chunk));
+    chunk->pipeline = pipeline;
+}
+
+extern "C" Scan_Chunk_Kernel scan_chunk_kernel(int interleave)
+{
+    return interleave ? consume_chunk<true> : consume_chunk<false>;
+}
@@ -0,0 +1,39 @@
+#ifndef KYLIN_SCANLOOP_H
+#define KYLIN_SCANLOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Inner loop of scan_it: what is done with each chunk sane_read returned.
+ * There is one kernel per kind of frame, chosen once per frame, so the
+ * loop over a chunk has no format tests left in it: one-pass frames go
+ * to the pipeline, the frames of a three-pass scan are spread into every
+ * third byte of the page.  Page statistics come from the stats sink
+ * (kylin_stats.h); depth and byte order are handled by the stages and
+ * the PNM sink, so the kernels are not specialized on them.
+ **/
+typedef struct
+{
+    Strip_Pipeline *pipeline;
+    uint8_t *image;         /* three-pass: the interleaved page */
+    size_t offset;          /* of the next sample in image */
+} Scan_Chunk;
+
+typedef SANE_Status (*Scan_Chunk_Kernel) (Scan_Chunk *chunk, const SANE_Byte *data, int len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void scan_chunk_init(Scan_Chunk *chunk, Strip_Pipeline *pipeline);
+// interleave: a frame of a three-pass scan
+Scan_Chunk_Kernel scan_chunk_kernel(int interleave);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
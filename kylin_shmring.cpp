@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kylin_shmring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHM_POLL_NS	100000000ull        /* how often a waiting side checks the other lives */
+
+typedef struct
+{
+    Strip_Sink *next;
+    Shm_Ring *ring;
+    double timeout;
+    SANE_Parameters parameters;
+    int lines_per_record;
+    int open;               /* a page was begun and not ended */
+    int publishing;         /* its records go into the ring */
+} Shm_Ring_Sink;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int process_alive(pid_t pid)
+{
+    return pid > 0 && (kill (pid, 0) == 0 || errno == EPERM);
+}
+
+// Not FUTEX_PRIVATE_FLAG: the word is shared with another process
+static void futex_wait(uint32_t *word, uint32_t value, uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    syscall (SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+    syscall (SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static Shm_Record *ring_slot(const Shm_Ring *ring, uint32_t seq)
+{
+    Shm_Ring_Header *h = ring->header;
+
+    return (Shm_Record *)((SANE_Byte *)h + h->records + (size_t) (seq & (h->slots - 1)) * h->stride);
+}
+
+static Shm_Ring_Header *map_ring(int fd, size_t *size)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat (fd, &st) || (size_t) st.st_size < sizeof (Shm_Ring_Header))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return (Shm_Ring_Header *)map;
+}
+
+// A ring of ours whose producer is gone, safe to replace
+static int stale_ring(const char *name)
+{
+    Shm_Ring_Header *h;
+    size_t size;
+    int fd = shm_open (name, O_RDWR, 0), stale;
+
+    if (fd < 0)
+        return 0;
+    h = map_ring (fd, &size);
+    close (fd);
+    if (!h)
+        return 0;
+    stale = __atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) == SHM_RING_MAGIC
+            && !process_alive (h->producer_pid);
+    munmap (h, size);
+    return stale;
+}
+
+/* -------------------------------------------- */
+// Producer
+
+Shm_Ring *shm_ring_create(const char *name, int slots, size_t slot_size)
+{
+    Shm_Ring *ring;
+    Shm_Ring_Header *h;
+    size_t stride, size;
+    int fd;
+
+    if (!name || name[0] != '/' || strlen (name) >= sizeof (ring->name)
+        || slots < 2 || (slots & (slots - 1)) || !slot_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    stride = (sizeof (Shm_Record) + slot_size + 63) & ~(size_t) 63;
+    size = sizeof (Shm_Ring_Header) + (size_t) slots * stride;
+
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST && stale_ring (name))
+    {
+        shm_unlink (name);
+        fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0)
+        return NULL;
+    ring = (Shm_Ring *)calloc (1, sizeof (Shm_Ring));
+    if (!ring || ftruncate (fd, size) || !(h = map_ring (fd, &size)))
+    {
+        close (fd);
+        shm_unlink (name);
+        free (ring);
+        return NULL;
+    }
+    close (fd);
+
+    h->version = SHM_RING_VERSION;
+    h->slots = slots;
+    h->stride = stride;
+    h->slot_size = stride - sizeof (Shm_Record);
+    h->records = sizeof (Shm_Ring_Header);
+    h->producer_pid = getpid ();
+    // a consumer checks the magic before anything else
+    __atomic_store_n (&h->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    strcpy (ring->name, name);
+    ring->producer = 1;
+    ring->header = h;
+    ring->size = size;
+    return ring;
+}
+
+void shm_ring_destroy(Shm_Ring *ring)
+{
+    if (!ring)
+        return;
+    if (!ring->producer)
+    {
+        shm_ring_detach (ring);
+        return;
+    }
+    // a consumer waiting for records sees the producer gone
+    __atomic_store_n (&ring->header->producer_pid, 0, __ATOMIC_SEQ_CST);
+    futex_wake (&ring->header->head);
+    shm_unlink (ring->name);
+    munmap (ring->header, ring->size);
+    free (ring);
+}
+
+void shm_ring_get_stats(const Shm_Ring *ring, Shm_Ring_Stats *stats)
+{
+    *stats = ring->stats;
+}
+
+// Give up on the consumer, unless it went away by itself
+static void detach_consumer(Shm_Ring *ring, pid_t pid)
+{
+    if (pid && __atomic_compare_exchange_n (&ring->header->consumer_pid, &pid, 0, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ring->stats.detached++;
+}
+
+/**
+ * Wait until the slot of record head is free; 0 if the consumer was
+ * detached meanwhile.
+ **/
+static int wait_room(Shm_Ring_Sink *s, uint32_t head)
+{
+    Shm_Ring *ring = s->ring;
+    Shm_Ring_Header *h = ring->header;
+    uint64_t start = 0, now, wait;
+    uint32_t tail;
+    pid_t pid;
+
+    for (;;)
+    {
+        if (head - __atomic_load_n (&h->tail, __ATOMIC_ACQUIRE) < h->slots)
+            break;
+        pid = __atomic_load_n (&h->consumer_pid, __ATOMIC_SEQ_CST);
+        if (!process_alive (pid))
+        {
+            detach_consumer (ring, pid);
+            break;
+        }
+        now = now_ns ();
+        if (!start)
+        {
+            start = now;
+            ring->stats.waits++;
+        }
+        else if (s->timeout > 0. && now - start >= (uint64_t) (s->timeout * 1e9))
+        {
+            detach_consumer (ring, pid);
+            break;
+        }
+
+        __atomic_store_n (&h->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n (&h->tail, __ATOMIC_SEQ_CST);
+
+        wait = SHM_POLL_NS;
+        if (s->timeout > 0. && start + (uint64_t) (s->timeout * 1e9) - now < wait)
+            wait = start + (uint64_t) (s->timeout * 1e9) - now;
+        if (head - tail >= h->slots)
+            futex_wait (&h->tail, tail, wait);
+        __atomic_store_n (&h->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+    if (start)
+        ring->stats.wait_ns += now_ns () - start;
+    return __atomic_load_n (&h->consumer_pid, __ATOMIC_SEQ_CST) != 0;
+}
+
+static void publish(Shm_Ring_Sink *s, int type, const Strip *strip, int y, int lines, const SANE_Byte *data, size_t bytes)
+{
+    Shm_Ring *ring = s->ring;
+    Shm_Ring_Header *h = ring->header;
+    uint32_t head = __atomic_load_n (&h->head, __ATOMIC_RELAXED);
+    Shm_Record *r;
+
+    if (!s->publishing)
+    {
+        ring->stats.dropped++;
+        return;
+    }
+    if (!wait_room (s, head))
+    {
+        s->publishing = 0;
+        ring->stats.dropped++;
+        return;
+    }
+
+    r = ring_slot (ring, head);
+    r->type = type;
+    r->page = h->page;
+    r->seq = ring->stats.records;
+    r->strip = strip ? strip->seq : -1;
+    r->y = y;
+    r->lines = lines;
+    r->bytes = bytes;
+    r->parameters = s->parameters;
+    if (bytes)
+        memcpy ((SANE_Byte *)r + sizeof (Shm_Record), data, bytes);
+
+    __atomic_store_n (&h->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&h->consumer_waiting, __ATOMIC_SEQ_CST))
+        futex_wake (&h->head);
+    ring->stats.records++;
+    ring->stats.bytes += bytes;
+}
+
+static SANE_Status shm_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Shm_Ring_Sink *s = (Shm_Ring_Sink *)sink->priv;
+    Shm_Ring_Header *h = s->ring->header;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    if (s->next && s->next->begin)
+        status = s->next->begin (s->next, fmt);
+    if (status != SANE_STATUS_GOOD)
+        return status;
+
+    // the previous page never ended
+    if (s->open)
+        publish (s, SHM_RECORD_CANCEL, NULL, 0, 0, NULL, 0);
+
+    s->parameters.format = fmt->format;
+    s->parameters.last_frame = SANE_TRUE;
+    s->parameters.bytes_per_line = fmt->bytes_per_line;
+    s->parameters.pixels_per_line = fmt->pixels_per_line;
+    s->parameters.lines = fmt->lines;
+    s->parameters.depth = fmt->depth;
+    s->lines_per_record = fmt->bytes_per_line ? (int)(h->slot_size / fmt->bytes_per_line) : 0;
+    s->open = 1;
+    s->publishing = s->lines_per_record > 0
+                    && process_alive (__atomic_load_n (&h->consumer_pid, __ATOMIC_SEQ_CST));
+
+    h->parameters = s->parameters;
+    h->page++;
+    publish (s, SHM_RECORD_BEGIN, NULL, 0, 0, NULL, 0);
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status shm_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Shm_Ring_Sink *s = (Shm_Ring_Sink *)sink->priv;
+    size_t bpl = s->parameters.bytes_per_line;
+    int done, n;
+
+    for (done = 0; done < strip->lines; done += n)
+    {
+        n = strip->lines - done;
+        if (n > s->lines_per_record)
+            n = s->lines_per_record;
+        publish (s, SHM_RECORD_STRIP, strip, strip->y + done, n,
+                 strip->data + (size_t) done * bpl, (size_t) n * bpl);
+    }
+    if (!s->next)
+        return SANE_STATUS_GOOD;
+    return s->next->write (s->next, strip);
+}
+
+static SANE_Status shm_sink_end(Strip_Sink *sink, int lines)
+{
+    Shm_Ring_Sink *s = (Shm_Ring_Sink *)sink->priv;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    if (s->next && s->next->end)
+        status = s->next->end (s->next, lines);
+    if (status == SANE_STATUS_GOOD)
+        publish (s, SHM_RECORD_END, NULL, 0, lines, NULL, 0);
+    else
+        publish (s, SHM_RECORD_CANCEL, NULL, 0, 0, NULL, 0);
+    s->open = 0;
+    return status;
+}
+
+static void shm_sink_destroy(Strip_Sink *sink)
+{
+    free (sink->priv);
+    free (sink);
+}
+
+Strip_Sink *shm_ring_sink_create(Strip_Sink *next, Shm_Ring *ring, double timeout)
+{
+    Strip_Sink *sink;
+    Shm_Ring_Sink *s;
+
+    if (!ring || !ring->producer || timeout < 0.)
+        return NULL;
+    sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    s = (Shm_Ring_Sink *)calloc (1, sizeof (Shm_Ring_Sink));
+    if (!sink || !s)
+    {
+        free (sink);
+        free (s);
+        return NULL;
+    }
+    s->next = next;
+    s->ring = ring;
+    s->timeout = timeout;
+
+    sink->begin = shm_sink_begin;
+    sink->write = shm_sink_write;
+    sink->end = shm_sink_end;
+    sink->destroy = shm_sink_destroy;
+    sink->priv = s;
+    return sink;
+}
+
+void shm_ring_sink_cancel(Strip_Sink *sink)
+{
+    Shm_Ring_Sink *s;
+
+    if (!sink)
+        return;
+    s = (Shm_Ring_Sink *)sink->priv;
+    if (s->open)
+        publish (s, SHM_RECORD_CANCEL, NULL, 0, 0, NULL, 0);
+    s->open = 0;
+}
+
+/* -------------------------------------------- */
+// Consumer
+
+Shm_Ring *shm_ring_attach(const char *name)
+{
+    Shm_Ring *ring;
+    Shm_Ring_Header *h;
+    pid_t pid, me = getpid ();
+    int fd;
+
+    if (!name || strlen (name) >= sizeof (ring->name))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    fd = shm_open (name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    ring = (Shm_Ring *)calloc (1, sizeof (Shm_Ring));
+    h = ring ? map_ring (fd, &ring->size) : NULL;
+    close (fd);
+    if (!h)
+    {
+        free (ring);
+        return NULL;
+    }
+    if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || h->version != SHM_RING_VERSION
+        || ring->size < h->records + (size_t) h->slots * h->stride)
+    {
+        munmap (h, ring->size);
+        free (ring);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // start where the producer is; it does not publish until we are attached
+    ring->next = __atomic_load_n (&h->head, __ATOMIC_ACQUIRE);
+    pid = __atomic_load_n (&h->consumer_pid, __ATOMIC_SEQ_CST);
+    if ((pid && pid != me && process_alive (pid))
+        || !__atomic_compare_exchange_n (&h->consumer_pid, &pid, me, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        munmap (h, ring->size);
+        free (ring);
+        errno = EBUSY;
+        return NULL;
+    }
+    __atomic_store_n (&h->tail, ring->next, __ATOMIC_SEQ_CST);
+    futex_wake (&h->tail);
+
+    strcpy (ring->name, name);
+    ring->header = h;
+    return ring;
+}
+
+SANE_Status shm_ring_next(Shm_Ring *ring, const Shm_Record **record, const SANE_Byte **data, double timeout)
+{
+    Shm_Ring_Header *h = ring->header;
+    uint64_t start = now_ns (), now, wait;
+    const Shm_Record *r;
+
+    for (;;)
+    {
+        if (__atomic_load_n (&h->consumer_pid, __ATOMIC_SEQ_CST) != getpid ())
+            return SANE_STATUS_IO_ERROR;
+        if (__atomic_load_n (&h->head, __ATOMIC_ACQUIRE) != ring->next)
+            break;
+        if (!process_alive (__atomic_load_n (&h->producer_pid, __ATOMIC_SEQ_CST)))
+        {
+            // it may have published a last record before going
+            if (__atomic_load_n (&h->head, __ATOMIC_ACQUIRE) != ring->next)
+                break;
+            return SANE_STATUS_EOF;
+        }
+        now = now_ns ();
+        if (timeout >= 0. && now - start >= (uint64_t) (timeout * 1e9))
+            return SANE_STATUS_DEVICE_BUSY;
+
+        wait = SHM_POLL_NS;
+        if (timeout >= 0. && start + (uint64_t) (timeout * 1e9) - now < wait)
+            wait = start + (uint64_t) (timeout * 1e9) - now;
+        __atomic_store_n (&h->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&h->head, __ATOMIC_SEQ_CST) == ring->next)
+            futex_wait (&h->head, ring->next, wait);
+        __atomic_store_n (&h->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    r = ring_slot (ring, ring->next);
+    *record = r;
+    if (data)
+        *data = (const SANE_Byte *)r + sizeof (Shm_Record);
+    return SANE_STATUS_GOOD;
+}
+
+void shm_ring_release(Shm_Ring *ring)
+{
+    Shm_Ring_Header *h = ring->header;
+
+    if (__atomic_load_n (&h->head, __ATOMIC_ACQUIRE) == ring->next)
+        return;
+    __atomic_store_n (&h->tail, ++ring->next, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&h->producer_waiting, __ATOMIC_SEQ_CST))
+        futex_wake (&h->tail);
+}
+
+void shm_ring_detach(Shm_Ring *ring)
+{
+    pid_t me = getpid ();
+
+    if (!ring)
+        return;
+    if (ring->producer)
+    {
+        shm_ring_destroy (ring);
+        return;
+    }
+    // a producer waiting for room gives up on us
+    if (__atomic_compare_exchange_n (&ring->header->consumer_pid, &me, 0, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        futex_wake (&ring->header->tail);
+    munmap (ring->header, ring->size);
+    free (ring);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,139 @@
+#ifndef KYLIN_SHMRING_H
+#define KYLIN_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Strips of the pages being scanned, published in a POSIX shared memory
+ * ring for a consumer in another process (e.g. OCR), which can work on
+ * the top of a page while the bottom is still being scanned.
+ *
+ * The ring has a power of two of slots, each a Shm_Record followed by
+ * up to slot_size bytes of whole lines, in the layout of the page with
+ * 16-bit samples in host byte order.  A page is a SHM_RECORD_BEGIN with
+ * its parameters, its strips (split over several records if a strip does
+ * not fit a slot) and a SHM_RECORD_END with its height; a page cut short
+ * ends with SHM_RECORD_CANCEL.  Records are numbered from the creation
+ * of the ring.
+ *
+ * There is one producer and one consumer.  head counts the records
+ * published, tail those the consumer is done with; both are futex words,
+ * so either side sleeps in the kernel until the other moves (an eventfd
+ * would have to be passed over a socket to an unrelated process).  A page
+ * begun with no consumer attached is dropped; an attached consumer that
+ * falls behind makes the producer wait, for as long as the consumer
+ * process lives or up to the timeout given, after which it is detached
+ * and the rest of the page dropped.
+ **/
+#define SHM_RING_MAGIC	0x5248534b      /* "KSHR" */
+#define SHM_RING_VERSION	1
+#define SHM_RING_DEFAULT_SLOTS	16
+#define SHM_RING_DEFAULT_SLOT_SIZE	(4 * 1024 * 1024)   /* a 300 dpi A4 RGB strip */
+
+enum shm_record_type
+{
+    SHM_RECORD_BEGIN = 1,
+    SHM_RECORD_STRIP,
+    SHM_RECORD_END,
+    SHM_RECORD_CANCEL
+};
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t page;          /* pages begun since the ring was created */
+    uint64_t seq;           /* record number */
+    int32_t strip;          /* strip number within the page */
+    int32_t y;              /* page row of the first line */
+    int32_t lines;          /* lines in the data; END: lines of the page */
+    uint32_t bytes;         /* bytes of data after the record */
+    SANE_Parameters parameters;     /* of the page */
+} __attribute__((aligned(64))) Shm_Record;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t stride;        /* bytes from one record to the next */
+    uint64_t slot_size;     /* room for data in a slot */
+    uint64_t records;       /* offset of the first record */
+    SANE_Parameters parameters;     /* of the page being published */
+    uint32_t page;
+    int32_t producer_pid;
+    int32_t consumer_pid;   /* 0: nobody attached */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t consumer_waiting;
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t producer_waiting;
+} __attribute__((aligned(64))) Shm_Ring_Header;
+
+typedef struct
+{
+    uint64_t records;       /* published */
+    uint64_t bytes;
+    uint64_t dropped;       /* records with no consumer to take them */
+    uint64_t waits;         /* times the ring was full */
+    uint64_t wait_ns;
+    uint64_t detached;      /* consumers given up on */
+} Shm_Ring_Stats;
+
+// Either end of a ring, mapped into this process
+typedef struct
+{
+    char name[256];
+    int producer;
+    Shm_Ring_Header *header;
+    size_t size;
+    uint32_t next;          /* consumer: record being read */
+    Shm_Ring_Stats stats;
+} Shm_Ring;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create the ring name (as for shm_open, "/ocr") with slots slots of
+ * slot_size bytes; a ring left by a producer that died is replaced.
+ **/
+Shm_Ring *shm_ring_create(const char *name, int slots, size_t slot_size);
+// Unmap, unlink and free; NULL is ignored
+void shm_ring_destroy(Shm_Ring *ring);
+/**
+ * Sink passing pages on to next, if not NULL, and publishing them in the
+ * ring; waits at most timeout seconds (0: as long as the consumer lives)
+ * for room.  Ring and next stay owned by the caller.
+ **/
+Strip_Sink *shm_ring_sink_create(Strip_Sink *next, Shm_Ring *ring, double timeout);
+// End the page in progress with SHM_RECORD_CANCEL, e.g. after a failed scan
+void shm_ring_sink_cancel(Strip_Sink *sink);
+void shm_ring_get_stats(const Shm_Ring *ring, Shm_Ring_Stats *stats);
+
+/**
+ * Consumer side.  Attaching starts at the next record published; it
+ * should be a BEGIN, but records up to one are best skipped.  NULL with
+ * errno EBUSY if another live consumer is attached.
+ **/
+Shm_Ring *shm_ring_attach(const char *name);
+/**
+ * Wait up to timeout seconds (< 0: forever) for the next record; data
+ * follows it.  SANE_STATUS_DEVICE_BUSY when none came in time, and
+ * SANE_STATUS_EOF when the producer is gone and the ring is empty,
+ * SANE_STATUS_IO_ERROR once the producer detached this consumer.
+ **/
+SANE_Status shm_ring_next(Shm_Ring *ring, const Shm_Record **record, const SANE_Byte **data, double timeout);
+// Give the slot of the last record back to the producer
+void shm_ring_release(Shm_Ring *ring);
+// Detach, unmap and free; NULL is ignored
+void shm_ring_detach(Shm_Ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
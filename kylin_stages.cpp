@@ -0,0 +1,279 @@
+#include <string.h>
+
+#include "kylin_pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void stage_free(Strip_Stage *stage)
+{
+    free (stage->priv);
+    free (stage);
+}
+
+static Strip_Stage *stage_alloc(const char *name, size_t priv_size)
+{
+    Strip_Stage *stage = (Strip_Stage *)calloc (1, sizeof (Strip_Stage));
+
+    if (!stage)
+        return NULL;
+    if (priv_size)
+    {
+        stage->priv = calloc (1, priv_size);
+        if (!stage->priv)
+        {
+            free (stage);
+            return NULL;
+        }
+    }
+    stage->name = name;
+    stage->destroy = stage_free;
+    return stage;
+}
+
+/* -------------------------------------------- */
+// Colour conversion: RGB <-> gray, 8 or 16 bits
+
+typedef struct
+{
+    SANE_Frame format;
+} Convert_Stage;
+
+static SANE_Status convert_configure(Strip_Stage *stage, const Strip_Format *in, Strip_Format *out)
+{
+    Convert_Stage *c = (Convert_Stage *)stage->priv;
+
+    if (in->depth != 8 && in->depth != 16)
+        return SANE_STATUS_UNSUPPORTED;
+
+    *out = *in;
+    out->format = c->format;
+    out->bytes_per_line = strip_format_line_bytes (out->format, out->depth, out->pixels_per_line);
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status convert_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    const Strip_Format *fi = &stage->in, *fo = &stage->out;
+    int n = fi->pixels_per_line;
+    int line, i;
+
+    for (line = 0; line < in->lines; line++)
+    {
+        const SANE_Byte *src = in->data + (size_t) line * fi->bytes_per_line;
+        SANE_Byte *dst = out->data + (size_t) line * fo->bytes_per_line;
+
+        if (fi->format == fo->format)
+        {
+            memcpy (dst, src, fo->bytes_per_line);
+        }
+        else if (fi->format == SANE_FRAME_RGB)
+        {
+            // ITU-R BT.601 luma in 8.8 fixed point
+            if (fi->depth == 8)
+            {
+                for (i = 0; i < n; i++)
+                    dst[i] = (SANE_Byte)((77 * src[3 * i] + 150 * src[3 * i + 1] + 29 * src[3 * i + 2]) >> 8);
+            }
+            else
+            {
+                const uint16_t *s = (const uint16_t *)src;
+                uint16_t *d = (uint16_t *)dst;
+
+                for (i = 0; i < n; i++)
+                    d[i] = (uint16_t)((77u * s[3 * i] + 150u * s[3 * i + 1] + 29u * s[3 * i + 2]) >> 8);
+            }
+        }
+        else
+        {
+            int bytes = fi->depth / 8;
+
+            for (i = 0; i < n; i++)
+            {
+                memcpy (dst + (3 * i) * bytes, src + i * bytes, bytes);
+                memcpy (dst + (3 * i + 1) * bytes, src + i * bytes, bytes);
+                memcpy (dst + (3 * i + 2) * bytes, src + i * bytes, bytes);
+            }
+        }
+    }
+    out->lines = in->lines;
+    out->y = in->y;
+    return SANE_STATUS_GOOD;
+}
+
+Strip_Stage *convert_stage_create(SANE_Frame format)
+{
+    Strip_Stage *stage;
+
+    if (format != SANE_FRAME_GRAY && format != SANE_FRAME_RGB)
+        return NULL;
+    stage = stage_alloc ("convert", sizeof (Convert_Stage));
+    if (!stage)
+        return NULL;
+    ((Convert_Stage *)stage->priv)->format = format;
+    stage->configure = convert_configure;
+    stage->process = convert_process;
+    stage->parallel = 1;
+    return stage;
+}
+
+/* -------------------------------------------- */
+// Crop to a window given in pixels; height <= 0 keeps everything below y
+
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} Crop_Stage;
+
+static SANE_Status crop_configure(Strip_Stage *stage, const Strip_Format *in, Strip_Format *out)
+{
+    Crop_Stage *c = (Crop_Stage *)stage->priv;
+    int width = c->width;
+
+    if (c->x < 0 || c->y < 0 || c->x >= in->pixels_per_line)
+        return SANE_STATUS_INVAL;
+    if (in->depth == 1 && c->x % 8)
+        return SANE_STATUS_UNSUPPORTED;
+
+    if (width <= 0 || c->x + width > in->pixels_per_line)
+        width = in->pixels_per_line - c->x;
+
+    *out = *in;
+    out->pixels_per_line = width;
+    out->bytes_per_line = strip_format_line_bytes (in->format, in->depth, width);
+    if (in->lines >= 0)
+    {
+        out->lines = in->lines - c->y;
+        if (c->height > 0 && out->lines > c->height)
+            out->lines = c->height;
+        if (out->lines < 0)
+            out->lines = 0;
+    }
+    else if (c->height > 0)
+    {
+        // the scan may still end above the bottom of the window
+        out->lines = -1;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status crop_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    Crop_Stage *c = (Crop_Stage *)stage->priv;
+    const Strip_Format *fi = &stage->in, *fo = &stage->out;
+    int first = in->y, last = in->y + in->lines;
+    size_t skip;
+    int row;
+
+    if (first < c->y)
+        first = c->y;
+    if (c->height > 0 && last > c->y + c->height)
+        last = c->y + c->height;
+
+    if (fi->depth == 1)
+        skip = c->x / 8;
+    else
+        skip = (size_t) c->x * strip_format_channels (fi) * (fi->depth / 8);
+
+    out->lines = 0;
+    out->y = first - c->y;
+    for (row = first; row < last; row++)
+    {
+        memcpy (out->data + (size_t) out->lines * fo->bytes_per_line,
+                in->data + (size_t)(row - in->y) * fi->bytes_per_line + skip,
+                fo->bytes_per_line);
+        out->lines++;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+Strip_Stage *crop_stage_create(int x, int y, int width, int height)
+{
+    Strip_Stage *stage = stage_alloc ("crop", sizeof (Crop_Stage));
+    Crop_Stage *c;
+
+    if (!stage)
+        return NULL;
+    c = (Crop_Stage *)stage->priv;
+    c->x = x;
+    c->y = y;
+    c->width = width;
+    c->height = height;
+    stage->configure = crop_configure;
+    stage->process = crop_process;
+    stage->parallel = 1;
+    return stage;
+}
+
+/* -------------------------------------------- */
+// Threshold gray to line-art; samples darker than level become black
+
+typedef struct
+{
+    int level;              /* 0..255 */
+} Threshold_Stage;
+
+static SANE_Status threshold_configure(Strip_Stage *stage, const Strip_Format *in, Strip_Format *out)
+{
+    if (in->format != SANE_FRAME_GRAY || (in->depth != 8 && in->depth != 16))
+        return SANE_STATUS_UNSUPPORTED;
+
+    *out = *in;
+    out->depth = 1;
+    out->bytes_per_line = strip_format_line_bytes (SANE_FRAME_GRAY, 1, in->pixels_per_line);
+    return SANE_STATUS_GOOD;
+}
+
+static SANE_Status threshold_process(Strip_Stage *stage, const Strip *in, Strip *out)
+{
+    Threshold_Stage *t = (Threshold_Stage *)stage->priv;
+    const Strip_Format *fi = &stage->in, *fo = &stage->out;
+    int n = fi->pixels_per_line;
+    int line, i;
+
+    for (line = 0; line < in->lines; line++)
+    {
+        const SANE_Byte *src = in->data + (size_t) line * fi->bytes_per_line;
+        SANE_Byte *dst = out->data + (size_t) line * fo->bytes_per_line;
+
+        memset (dst, 0, fo->bytes_per_line);
+        if (fi->depth == 8)
+        {
+            for (i = 0; i < n; i++)
+                if (src[i] < t->level)
+                    dst[i >> 3] |= 0x80 >> (i & 7);
+        }
+        else
+        {
+            const uint16_t *s = (const uint16_t *)src;
+
+            for (i = 0; i < n; i++)
+                if ((s[i] >> 8) < t->level)
+                    dst[i >> 3] |= 0x80 >> (i & 7);
+        }
+    }
+    out->lines = in->lines;
+    out->y = in->y;
+    return SANE_STATUS_GOOD;
+}
+
+Strip_Stage *threshold_stage_create(int level)
+{
+    Strip_Stage *stage = stage_alloc ("threshold", sizeof (Threshold_Stage));
+
+    if (!stage)
+        return NULL;
+    ((Threshold_Stage *)stage->priv)->level = level;
+    stage->configure = threshold_configure;
+    stage->process = threshold_process;
+    stage->parallel = 1;
+    return stage;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,325 @@
+#include <string.h>
+
+#include "kylin_cpu.h"
+#include "kylin_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Each channel is counted into STATS_SPLIT tables in turn, so a run of
+ * equal samples (paper) does not wait on the increment of the one before.
+ * The tables are added into the page histogram after every strip.
+ **/
+#define STATS_SPLIT	4
+
+typedef struct
+{
+    Strip_Sink *next;
+    Strip_Format fmt;
+    int channels;
+    uint64_t sum[STATS_MAX_CHANNELS];       /* 16-bit */
+    uint64_t sumsq[STATS_MAX_CHANNELS];
+    unsigned min[STATS_MAX_CHANNELS];
+    unsigned max[STATS_MAX_CHANNELS];
+    uint32_t bins[STATS_SPLIT][STATS_MAX_CHANNELS][STATS_BINS];
+    Page_Stats stats;
+    Page_Stats result;
+} Stats_Sink;
+
+static void count_gray8(Stats_Sink *s, const uint8_t *px, int n)
+{
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        s->bins[0][0][px[i]]++;
+        s->bins[1][0][px[i + 1]]++;
+        s->bins[2][0][px[i + 2]]++;
+        s->bins[3][0][px[i + 3]]++;
+    }
+    for (; i < n; i++)
+        s->bins[0][0][px[i]]++;
+}
+
+static void count_rgb8(Stats_Sink *s, const uint8_t *px, int n)
+{
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2, px += 6)
+    {
+        s->bins[0][0][px[0]]++;
+        s->bins[0][1][px[1]]++;
+        s->bins[0][2][px[2]]++;
+        s->bins[1][0][px[3]]++;
+        s->bins[1][1][px[4]]++;
+        s->bins[1][2][px[5]]++;
+    }
+    for (; i < n; i++, px += 3)
+    {
+        s->bins[2][0][px[0]]++;
+        s->bins[2][1][px[1]]++;
+        s->bins[2][2][px[2]]++;
+    }
+}
+
+// 1-bit lines: set bits are black, the leftmost pixel is the high bit
+static void count_bits(Stats_Sink *s, const uint8_t *line, int n)
+{
+    uint32_t black = 0;
+    int i = 0;
+
+    for (; i + 8 <= n / 8; i += 8)
+    {
+        uint64_t w;
+
+        memcpy (&w, line + i, 8);
+        black += __builtin_popcountll (w);
+    }
+    for (; i < n / 8; i++)
+        black += __builtin_popcount (line[i]);
+    if (n & 7)
+        black += __builtin_popcount (line[i] & (0xff00 >> (n & 7)));
+    s->bins[0][0][1] += black;
+    s->bins[0][0][0] += n - black;
+}
+
+static void sums16(Stats_Sink *s, const uint16_t *px, int n)
+{
+    int c;
+
+    for (c = 0; c < s->channels; c++)
+    {
+        const uint16_t *p = px + c;
+        uint64_t sum = 0, sumsq = 0;
+        unsigned lo = s->min[c], hi = s->max[c];
+        int i;
+
+        for (i = 0; i < n; i++, p += s->channels)
+        {
+            s->bins[i & (STATS_SPLIT - 1)][c][*p >> 8]++;
+            sum += *p;
+            sumsq += (uint32_t) *p * *p;
+            lo = (*p < lo) ? *p : lo;
+            hi = (*p > hi) ? *p : hi;
+        }
+        s->sum[c] += sum;
+        s->sumsq[c] += sumsq;
+        s->min[c] = lo;
+        s->max[c] = hi;
+    }
+}
+
+#ifdef KYLIN_X86
+/**
+ * 16 gray samples at a time: lowest and highest in 16-bit lanes, sums in
+ * 32-bit lanes and squares in 64-bit lanes.  A line is short enough for
+ * the 32-bit sums not to overflow; the histogram stays scalar.
+ **/
+__attribute__((target("avx2")))
+static void sums16_gray_avx2(Stats_Sink *s, const uint16_t *px, int n)
+{
+    __m256i lo = _mm256_set1_epi16 (-1), hi = _mm256_setzero_si256 ();
+    __m256i sum = _mm256_setzero_si256 (), sq = _mm256_setzero_si256 ();
+    uint16_t lanes16[16];
+    uint32_t lanes32[8];
+    uint64_t lanes64[4];
+    int i, k;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)(px + i));
+        __m256i a = _mm256_cvtepu16_epi32 (_mm256_castsi256_si128 (v));
+        __m256i b = _mm256_cvtepu16_epi32 (_mm256_extracti128_si256 (v, 1));
+
+        lo = _mm256_min_epu16 (lo, v);
+        hi = _mm256_max_epu16 (hi, v);
+        sum = _mm256_add_epi32 (sum, _mm256_add_epi32 (a, b));
+        sq = _mm256_add_epi64 (sq, _mm256_mul_epu32 (a, a));
+        sq = _mm256_add_epi64 (sq, _mm256_mul_epu32 (b, b));
+        a = _mm256_srli_epi64 (a, 32);
+        b = _mm256_srli_epi64 (b, 32);
+        sq = _mm256_add_epi64 (sq, _mm256_mul_epu32 (a, a));
+        sq = _mm256_add_epi64 (sq, _mm256_mul_epu32 (b, b));
+        for (k = 0; k < 16; k++)
+            s->bins[k & (STATS_SPLIT - 1)][0][px[i + k] >> 8]++;
+    }
+
+    _mm256_storeu_si256 ((__m256i *)lanes16, lo);
+    for (k = 0; k < 16; k++)
+        if (lanes16[k] < s->min[0])
+            s->min[0] = lanes16[k];
+    _mm256_storeu_si256 ((__m256i *)lanes16, hi);
+    for (k = 0; k < 16; k++)
+        if (lanes16[k] > s->max[0])
+            s->max[0] = lanes16[k];
+    _mm256_storeu_si256 ((__m256i *)lanes32, sum);
+    for (k = 0; k < 8; k++)
+        s->sum[0] += lanes32[k];
+    _mm256_storeu_si256 ((__m256i *)lanes64, sq);
+    for (k = 0; k < 4; k++)
+        s->sumsq[0] += lanes64[k];
+    sums16 (s, px + i, n - i);
+}
+#endif
+
+static void measure_line(Stats_Sink *s, const SANE_Byte *line)
+{
+    int n = s->fmt.pixels_per_line;
+
+    if (s->fmt.depth == 1)
+        count_bits (s, line, n);
+    else if (s->fmt.depth == 8 && s->channels == 1)
+        count_gray8 (s, line, n);
+    else if (s->fmt.depth == 8)
+        count_rgb8 (s, line, n);
+#ifdef KYLIN_X86
+    else if (s->channels == 1 && cpu_has_avx2 ())
+        sums16_gray_avx2 (s, (const uint16_t *)line, n);
+#endif
+    else
+        sums16 (s, (const uint16_t *)line, n);
+}
+
+// Add the strip tables into the page histogram
+static void fold_bins(Stats_Sink *s)
+{
+    int c, j, v;
+
+    for (c = 0; c < s->channels; c++)
+        for (j = 0; j < STATS_SPLIT; j++)
+            for (v = 0; v < STATS_BINS; v++)
+                s->stats.channel[c].histogram[v] += s->bins[j][c][v];
+    memset (s->bins, 0, sizeof (s->bins));
+}
+
+static void finish_page(Stats_Sink *s, int lines)
+{
+    Page_Stats *st = &s->stats;
+    int c, v;
+
+    st->lines = lines;
+    st->samples = (uint64_t) lines * s->fmt.pixels_per_line;
+    for (c = 0; c < s->channels; c++)
+    {
+        Channel_Stats *ch = &st->channel[c];
+        double sum = 0., sumsq = 0.;
+
+        if (!st->samples)
+            continue;
+        if (s->fmt.depth == 16)
+        {
+            ch->min = s->min[c];
+            ch->max = s->max[c];
+            sum = (double) s->sum[c];
+            sumsq = (double) s->sumsq[c];
+        }
+        else
+        {
+            ch->min = STATS_BINS;
+            ch->max = 0;
+            for (v = 0; v < STATS_BINS; v++)
+            {
+                if (!ch->histogram[v])
+                    continue;
+                if (ch->min == STATS_BINS)
+                    ch->min = v;
+                ch->max = v;
+                sum += (double) v * ch->histogram[v];
+                sumsq += (double) v * v * ch->histogram[v];
+            }
+        }
+        ch->mean = sum / st->samples;
+        ch->variance = sumsq / st->samples - ch->mean * ch->mean;
+        if (ch->variance < 0.)
+            ch->variance = 0.;
+    }
+}
+
+static SANE_Status stats_sink_begin(Strip_Sink *sink, const Strip_Format *fmt)
+{
+    Stats_Sink *s = (Stats_Sink *)sink->priv;
+    int c;
+
+    if (fmt->format == SANE_FRAME_RGB && fmt->depth == 1)
+        return SANE_STATUS_UNSUPPORTED;
+
+    s->fmt = *fmt;
+    s->channels = strip_format_channels (fmt);
+    memset (&s->stats, 0, sizeof (s->stats));
+    memset (s->bins, 0, sizeof (s->bins));
+    s->stats.channels = s->channels;
+    s->stats.depth = fmt->depth;
+    for (c = 0; c < STATS_MAX_CHANNELS; c++)
+    {
+        s->sum[c] = s->sumsq[c] = 0;
+        s->min[c] = 0xffff;
+        s->max[c] = 0;
+    }
+    if (!s->next->begin)
+        return SANE_STATUS_GOOD;
+    return s->next->begin (s->next, fmt);
+}
+
+static SANE_Status stats_sink_write(Strip_Sink *sink, const Strip *strip)
+{
+    Stats_Sink *s = (Stats_Sink *)sink->priv;
+    int line;
+
+    for (line = 0; line < strip->lines; line++)
+        measure_line (s, strip->data + (size_t) line * s->fmt.bytes_per_line);
+    fold_bins (s);
+    return s->next->write (s->next, strip);
+}
+
+static SANE_Status stats_sink_end(Strip_Sink *sink, int lines)
+{
+    Stats_Sink *s = (Stats_Sink *)sink->priv;
+
+    finish_page (s, lines);
+    s->result = s->stats;
+    if (!s->next->end)
+        return SANE_STATUS_GOOD;
+    return s->next->end (s->next, lines);
+}
+
+static void stats_sink_destroy(Strip_Sink *sink)
+{
+    free (sink->priv);
+    free (sink);
+}
+
+Strip_Sink *stats_sink_create(Strip_Sink *next)
+{
+    Strip_Sink *sink;
+    Stats_Sink *s;
+
+    if (!next)
+        return NULL;
+    sink = (Strip_Sink *)calloc (1, sizeof (Strip_Sink));
+    s = (Stats_Sink *)calloc (1, sizeof (Stats_Sink));
+    if (!sink || !s)
+    {
+        free (sink);
+        free (s);
+        return NULL;
+    }
+    s->next = next;
+
+    sink->begin = stats_sink_begin;
+    sink->write = stats_sink_write;
+    sink->end = stats_sink_end;
+    sink->destroy = stats_sink_destroy;
+    sink->priv = s;
+    return sink;
+}
+
+void stats_sink_result(Strip_Sink *sink, Page_Stats *stats)
+{
+    *stats = ((Stats_Sink *)sink->priv)->result;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,48 @@
+#ifndef KYLIN_STATS_H
+#define KYLIN_STATS_H
+
+#include <stdint.h>
+
+#include "kylin_pipeline.h"
+
+/**
+ * Sample statistics of a page while it is written: per channel the
+ * histogram, lowest and highest sample, mean and variance.  8-bit and
+ * 1-bit pages are only counted into the histogram, everything else is
+ * read off it at the end of the page; 16-bit samples are binned by their
+ * high byte, their sums are kept exactly.  1-bit samples are 1 for black.
+ **/
+#define STATS_MAX_CHANNELS	3
+#define STATS_BINS	256
+
+typedef struct
+{
+    unsigned min, max;
+    double mean;
+    double variance;
+    uint64_t histogram[STATS_BINS];
+} Channel_Stats;
+
+typedef struct
+{
+    int channels;           /* 1 gray, 3 RGB */
+    int depth;
+    int lines;
+    uint64_t samples;       /* per channel */
+    Channel_Stats channel[STATS_MAX_CHANNELS];
+} Page_Stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sink passing pages on to next and measuring them on the way; next stays owned by the caller
+Strip_Sink *stats_sink_create(Strip_Sink *next);
+// Statistics of the last page that ended on the sink
+void stats_sink_result(Strip_Sink *sink, Page_Stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
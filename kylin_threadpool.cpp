@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kylin_log.h"
+#include "kylin_threadpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    Task_Func func;
+    void *arg;
+} Task;
+
+// Ring of tasks; the owner takes from head, thieves from tail
+typedef struct
+{
+    pthread_mutex_t lock;
+    Task *tasks;
+    int capacity;
+    int head;
+    int count;
+} Task_Deque;
+
+struct Thread_Pool
+{
+    pthread_t *threads;
+    Task_Deque *deques;
+    int n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int queued;             /* tasks in the deques, atomic */
+    int sleeping;           /* workers waiting on wake, atomic, changed under lock */
+    int stop;               /* under lock */
+    unsigned int next;      /* round-robin deque for outside submissions */
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t stolen;
+};
+
+typedef struct
+{
+    Thread_Pool *pool;
+    int index;
+} Worker_Arg;
+
+static __thread Thread_Pool *worker_pool = NULL;
+static __thread int worker_index = -1;
+
+static int deque_push(Task_Deque *d, Task task)
+{
+    pthread_mutex_lock (&d->lock);
+    if (d->count == d->capacity)
+    {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        Task *tasks = (Task *)malloc (capacity * sizeof (Task));
+        int i;
+
+        if (!tasks)
+        {
+            pthread_mutex_unlock (&d->lock);
+            return -1;
+        }
+        for (i = 0; i < d->count; i++)
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        free (d->tasks);
+        d->tasks = tasks;
+        d->capacity = capacity;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->count) % d->capacity] = task;
+    d->count++;
+    pthread_mutex_unlock (&d->lock);
+    return 0;
+}
+
+static int deque_take(Task_Deque *d, Task *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock (&d->lock);
+    if (d->count > 0)
+    {
+        if (steal)
+        {
+            *task = d->tasks[(d->head + d->count - 1) % d->capacity];
+        }
+        else
+        {
+            *task = d->tasks[d->head];
+            d->head = (d->head + 1) % d->capacity;
+        }
+        d->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock (&d->lock);
+    return found;
+}
+
+static int find_task(Thread_Pool *pool, int self, Task *task)
+{
+    int i;
+
+    if (deque_take (&pool->deques[self], task, 0))
+        return 1;
+    for (i = 1; i < pool->n_threads; i++)
+    {
+        if (deque_take (&pool->deques[(self + i) % pool->n_threads], task, 1))
+        {
+            __atomic_add_fetch (&pool->stolen, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *data)
+{
+    Worker_Arg *arg = (Worker_Arg *)data;
+    Thread_Pool *pool = arg->pool;
+    int self = arg->index;
+    Task task;
+
+    free (arg);
+    worker_pool = pool;
+    worker_index = self;
+
+    while (1)
+    {
+        if (find_task (pool, self, &task))
+        {
+            __atomic_sub_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+            task.func (task.arg);
+            __atomic_add_fetch (&pool->executed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // only an idle worker takes the lock; sleeping is raised before
+        // queued is looked at, so a submitter either sees it or is seen
+        pthread_mutex_lock (&pool->lock);
+        __atomic_add_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n (&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->stop)
+            pthread_cond_wait (&pool->wake, &pool->lock);
+        __atomic_sub_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&pool->queued, __ATOMIC_SEQ_CST) == 0 && pool->stop)
+        {
+            pthread_mutex_unlock (&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock (&pool->lock);
+    }
+    return NULL;
+}
+
+Thread_Pool *thread_pool_create(int n_threads)
+{
+    Thread_Pool *pool;
+    int i;
+
+    if (n_threads <= 0)
+    {
+        n_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+        if (n_threads <= 0)
+            n_threads = 1;
+    }
+
+    pool = (Thread_Pool *)calloc (1, sizeof (Thread_Pool));
+    if (!pool)
+        return NULL;
+    pool->threads = (pthread_t *)calloc (n_threads, sizeof (pthread_t));
+    pool->deques = (Task_Deque *)calloc (n_threads, sizeof (Task_Deque));
+    if (!pool->threads || !pool->deques)
+    {
+        free (pool->threads);
+        free (pool->deques);
+        free (pool);
+        return NULL;
+    }
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->wake, NULL);
+    for (i = 0; i < n_threads; i++)
+        pthread_mutex_init (&pool->deques[i].lock, NULL);
+
+    for (i = 0; i < n_threads; i++)
+    {
+        Worker_Arg *arg = (Worker_Arg *)malloc (sizeof (Worker_Arg));
+
+        if (!arg)
+            break;
+        arg->pool = pool;
+        arg->index = i;
+        if (pthread_create (&pool->threads[i], NULL, worker_main, arg) != 0)
+        {
+            free (arg);
+            break;
+        }
+    }
+    pool->n_threads = i;
+    if (pool->n_threads == 0)
+    {
+        log_warn("thread pool: can not start workers\n");
+        thread_pool_destroy (pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void thread_pool_destroy(Thread_Pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock (&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast (&pool->wake);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++)
+        pthread_join (pool->threads[i], NULL);
+
+    for (i = 0; i < pool->n_threads; i++)
+    {
+        pthread_mutex_destroy (&pool->deques[i].lock);
+        free (pool->deques[i].tasks);
+    }
+    pthread_cond_destroy (&pool->wake);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->deques);
+    free (pool->threads);
+    free (pool);
+}
+
+int thread_pool_submit(Thread_Pool *pool, Task_Func func, void *arg)
+{
+    Task task = { func, arg };
+    int target;
+
+    if (worker_pool == pool && worker_index >= 0)
+        target = worker_index;
+    else
+        target = __atomic_fetch_add (&pool->next, 1, __ATOMIC_RELAXED) % pool->n_threads;
+
+    // counted before it is published: a thief may take it and count it off at once
+    __atomic_add_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+    if (deque_push (&pool->deques[target], task) != 0)
+    {
+        __atomic_sub_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    __atomic_add_fetch (&pool->submitted, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n (&pool->sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock (&pool->lock);
+        pthread_cond_signal (&pool->wake);
+        pthread_mutex_unlock (&pool->lock);
+    }
+    return 0;
+}
+
+int thread_pool_size(const Thread_Pool *pool)
+{
+    return pool->n_threads;
+}
+
+void thread_pool_get_stats(Thread_Pool *pool, Thread_Pool_Stats *stats)
+{
+    stats->threads = pool->n_threads;
+    stats->queued = __atomic_load_n (&pool->queued, __ATOMIC_RELAXED);
+    stats->submitted = __atomic_load_n (&pool->submitted, __ATOMIC_RELAXED);
+    stats->executed = __atomic_load_n (&pool->executed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n (&pool->stolen, __ATOMIC_RELAXED);
+}
+
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static Thread_Pool *default_pool = NULL;
+
+static void default_pool_create()
+{
+    default_pool = thread_pool_create (0);
+}
+
+Thread_Pool *thread_pool_default()
+{
+    pthread_once (&default_once, default_pool_create);
+    return default_pool;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef KYLIN_THREADPOOL_H
+#define KYLIN_THREADPOOL_H
+
+#include <stdint.h>
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a task deque.  Tasks submitted from outside the pool
+ * are spread round-robin over the deques, tasks submitted by a worker go
+ * to its own deque.  A worker runs its oldest task first and, when its
+ * deque is empty, steals the newest task of another worker.
+ **/
+
+typedef void (*Task_Func) (void *arg);
+
+typedef struct Thread_Pool Thread_Pool;
+
+typedef struct
+{
+    int threads;
+    int queued;             /* tasks waiting in the deques */
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t stolen;        /* tasks run by a worker other than the one queued to */
+} Thread_Pool_Stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// n_threads <= 0 starts one worker per online CPU
+Thread_Pool *thread_pool_create(int n_threads);
+// Runs the queued tasks, then joins the workers
+void thread_pool_destroy(Thread_Pool *pool);
+int thread_pool_submit(Thread_Pool *pool, Task_Func func, void *arg);
+int thread_pool_size(const Thread_Pool *pool);
+void thread_pool_get_stats(Thread_Pool *pool, Thread_Pool_Stats *stats);
+// Pool shared by all scans of the process, created on first use
+Thread_Pool *thread_pool_default();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
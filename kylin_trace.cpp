@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kylin_trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAX_DEVICES	16
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int on;
+    FILE *fp;
+    double origin;          /* s, CLOCK_MONOTONIC */
+    char devices[TRACE_MAX_DEVICES][64];
+    int n_devices;
+    int pid;                /* track of the current device */
+} Tracer;
+
+static Tracer tracer = { PTHREAD_MUTEX_INITIALIZER };
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// JSON string body, quotes and control characters escaped
+static void put_string(FILE *fp, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf (fp, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf (fp, "\\u%04x", *s);
+        else
+            fputc (*s, fp);
+    }
+}
+
+// Called with the lock held
+static void name_track(int pid, const char *name)
+{
+    fprintf (tracer.fp, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"", pid);
+    put_string (tracer.fp, name);
+    fprintf (tracer.fp, "\"}}");
+}
+
+SANE_Status trace_start(const char *path)
+{
+    FILE *fp = fopen (path, "w");
+
+    if (!fp)
+        return SANE_STATUS_ACCESS_DENIED;
+    trace_stop ();
+    pthread_mutex_lock (&tracer.lock);
+    tracer.fp = fp;
+    tracer.origin = now_sec ();
+    tracer.n_devices = 0;
+    tracer.pid = 0;
+    // the array format, a missing "]" is allowed
+    fprintf (fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"kylin-sane\"}}");
+    __atomic_store_n (&tracer.on, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&tracer.lock);
+    return SANE_STATUS_GOOD;
+}
+
+void trace_stop()
+{
+    pthread_mutex_lock (&tracer.lock);
+    if (tracer.fp)
+    {
+        fprintf (tracer.fp, "\n]\n");
+        fclose (tracer.fp);
+        tracer.fp = NULL;
+    }
+    __atomic_store_n (&tracer.on, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&tracer.lock);
+}
+
+int trace_enabled()
+{
+    return __atomic_load_n (&tracer.on, __ATOMIC_ACQUIRE);
+}
+
+void trace_set_device(const char *device)
+{
+    int i;
+
+    if (!trace_enabled ())
+        return;
+    pthread_mutex_lock (&tracer.lock);
+    tracer.pid = 0;
+    if (device && device[0] && tracer.fp)
+    {
+        for (i = 0; i < tracer.n_devices; i++)
+            if (!strcmp (tracer.devices[i], device))
+                break;
+        if (i == tracer.n_devices && i < TRACE_MAX_DEVICES)
+        {
+            snprintf (tracer.devices[i], sizeof (tracer.devices[i]), "%s", device);
+            tracer.n_devices++;
+            name_track (i + 1, device);
+        }
+        // past the last device the spans go to the library's track
+        if (i < TRACE_MAX_DEVICES)
+            tracer.pid = i + 1;
+    }
+    pthread_mutex_unlock (&tracer.lock);
+}
+
+double trace_begin()
+{
+    double t;
+
+    if (!trace_enabled ())
+        return 0.;
+    t = (now_sec () - tracer.origin) * 1e6;
+    // 0 stands for off
+    return (t > 0.) ? t : 0.001;
+}
+
+void trace_end(double start, const char *name, const char *args)
+{
+    double end;
+
+    if (start <= 0. || !trace_enabled ())
+        return;
+    end = (now_sec () - tracer.origin) * 1e6;
+    pthread_mutex_lock (&tracer.lock);
+    if (tracer.fp)
+    {
+        fprintf (tracer.fp, ",\n{\"name\":\"");
+        put_string (tracer.fp, name);
+        fprintf (tracer.fp, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f",
+                 tracer.pid, (long) syscall (SYS_gettid), start, end - start);
+        if (args)
+            fprintf (tracer.fp, ",\"args\":{%s}", args);
+        fputc ('}', tracer.fp);
+    }
+    pthread_mutex_unlock (&tracer.lock);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef KYLIN_TRACE_H
+#define KYLIN_TRACE_H
+
+#include "sane/sane.h"
+
+/**
+ * Trace of what the library does, as Chrome trace-event JSON that opens
+ * in chrome://tracing or Perfetto.  Each device gets a process track and
+ * each thread working for it a thread track under that.  Events are
+ * appended to the file as they end, so a trace of a process that never
+ * stops tracing still loads.
+ *
+ * Spans are timed with trace_begin() and trace_end(); trace_begin()
+ * returns 0 when tracing is off and trace_end() then does nothing.
+ **/
+#define TRACE_ENV	"KYLIN_SANE_TRACE"  /* init() starts tracing to this path */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SANE_Status trace_start(const char *path);
+void trace_stop();
+int trace_enabled();
+// Device the following spans belong to, NULL or "": the library itself
+void trace_set_device(const char *device);
+// Microseconds since tracing started, 0 when off
+double trace_begin();
+// args: the members of a JSON object, e.g. "\"bytes\":42", or NULL
+void trace_end(double start, const char *name, const char *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
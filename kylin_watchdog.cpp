@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kylin_log.h"
+#include "kylin_watchdog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+#define WATCHDOG_MIN_PERIOD	0.01    /* s between checks, at least */
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;
+    int stop;
+    double timeout;
+    Stall_Handler on_stall;
+    void *arg;
+
+    int armed;
+    int fired;
+    char device[64];
+    char phase[8];
+    double last;            /* time of the last byte, or of arming */
+    size_t bytes;
+
+    char log_path[PATH_MAX];
+    Stall_Event events[STALL_EVENTS_MAX];
+    int n_events;           /* ever recorded, the last STALL_EVENTS_MAX are kept */
+} Watchdog;
+
+static Watchdog watchdog = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Called with the lock held
+static void record_event(const Stall_Event *event)
+{
+    FILE *fp;
+
+    watchdog.events[watchdog.n_events % STALL_EVENTS_MAX] = *event;
+    watchdog.n_events++;
+    if (!watchdog.log_path[0])
+        return;
+    fp = fopen (watchdog.log_path, "a");
+    if (!fp)
+        return;
+    fprintf (fp, "%ld %s %s %.1f %zu\n", (long) event->when, event->device, event->phase,
+             event->stalled, event->bytes);
+    fclose (fp);
+}
+
+static void *watchdog_main(void *)
+{
+    struct timespec until;
+    double period;
+
+    pthread_mutex_lock (&watchdog.lock);
+    while (!watchdog.stop)
+    {
+        Stall_Event event;
+        double last, idle;
+
+        __atomic_load (&watchdog.last, &last, __ATOMIC_RELAXED);
+        idle = now_sec () - last;
+
+        if (watchdog.armed && !watchdog.fired && idle > watchdog.timeout)
+        {
+            Stall_Handler on_stall = watchdog.on_stall;
+            void *arg = watchdog.arg;
+
+            watchdog.fired = 1;
+            memset (&event, 0, sizeof (event));
+            strcpy (event.device, watchdog.device);
+            event.bytes = __atomic_load_n (&watchdog.bytes, __ATOMIC_RELAXED);
+            snprintf (event.phase, sizeof (event.phase), "%s/%s", watchdog.phase, event.bytes ? "read" : "start");
+            event.when = time (NULL);
+            event.stalled = idle;
+            record_event (&event);
+            log_warn("stall: %s, no data for %.1f s in %s after %zu bytes\n",
+                     event.device, event.stalled, event.phase, event.bytes);
+
+            // the handler may block on the backend, not on us
+            pthread_mutex_unlock (&watchdog.lock);
+            if (on_stall)
+                on_stall (arg);
+            pthread_mutex_lock (&watchdog.lock);
+            continue;
+        }
+
+        period = watchdog.timeout / 4.;
+        if (period < WATCHDOG_MIN_PERIOD)
+            period = WATCHDOG_MIN_PERIOD;
+        clock_gettime (CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t) period;
+        until.tv_nsec += (long) ((period - (time_t) period) * 1e9);
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait (&watchdog.wake, &watchdog.lock, &until);
+    }
+    pthread_mutex_unlock (&watchdog.lock);
+    return NULL;
+}
+
+int watchdog_start(double timeout, Stall_Handler on_stall, void *arg)
+{
+    int ret = 0;
+
+    if (timeout <= 0.)
+    {
+        watchdog_stop ();
+        return 0;
+    }
+    pthread_mutex_lock (&watchdog.lock);
+    watchdog.timeout = timeout;
+    watchdog.on_stall = on_stall;
+    watchdog.arg = arg;
+    if (!watchdog.running)
+    {
+        watchdog.stop = 0;
+        ret = pthread_create (&watchdog.thread, NULL, watchdog_main, NULL);
+        watchdog.running = (ret == 0);
+    }
+    pthread_cond_signal (&watchdog.wake);
+    pthread_mutex_unlock (&watchdog.lock);
+    return ret;
+}
+
+void watchdog_stop()
+{
+    pthread_mutex_lock (&watchdog.lock);
+    if (!watchdog.running)
+    {
+        pthread_mutex_unlock (&watchdog.lock);
+        return;
+    }
+    watchdog.stop = 1;
+    pthread_cond_signal (&watchdog.wake);
+    pthread_mutex_unlock (&watchdog.lock);
+    pthread_join (watchdog.thread, NULL);
+    watchdog.running = 0;
+}
+
+void watchdog_arm(const char *device, const char *phase)
+{
+    pthread_mutex_lock (&watchdog.lock);
+    snprintf (watchdog.device, sizeof (watchdog.device), "%s", device);
+    snprintf (watchdog.phase, sizeof (watchdog.phase), "%s", phase);
+    watchdog.bytes = 0;
+    watchdog.last = now_sec ();
+    watchdog.fired = 0;
+    watchdog.armed = 1;
+    pthread_mutex_unlock (&watchdog.lock);
+}
+
+void watchdog_feed(size_t bytes)
+{
+    double now = now_sec ();
+
+    // no lock, this runs between reads
+    __atomic_store (&watchdog.last, &now, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&watchdog.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void watchdog_disarm()
+{
+    pthread_mutex_lock (&watchdog.lock);
+    watchdog.armed = 0;
+    pthread_mutex_unlock (&watchdog.lock);
+}
+
+int watchdog_fired()
+{
+    int fired;
+
+    pthread_mutex_lock (&watchdog.lock);
+    fired = watchdog.fired;
+    pthread_mutex_unlock (&watchdog.lock);
+    return fired;
+}
+
+int watchdog_set_log(const char *path)
+{
+    if (path && strlen (path) >= sizeof (watchdog.log_path))
+        return ENAMETOOLONG;
+    pthread_mutex_lock (&watchdog.lock);
+    strcpy (watchdog.log_path, path ? path : "");
+    pthread_mutex_unlock (&watchdog.lock);
+    return 0;
+}
+
+int stall_events(Stall_Event *events, int max_events)
+{
+    int first, n, i;
+
+    pthread_mutex_lock (&watchdog.lock);
+    n = (watchdog.n_events < STALL_EVENTS_MAX) ? watchdog.n_events : STALL_EVENTS_MAX;
+    first = watchdog.n_events - n;
+    for (i = 0; i < n && i < max_events; i++)
+        events[i] = watchdog.events[(first + i) % STALL_EVENTS_MAX];
+    pthread_mutex_unlock (&watchdog.lock);
+    return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
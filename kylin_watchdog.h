@@ -0,0 +1,49 @@
+#ifndef KYLIN_WATCHDOG_H
+#define KYLIN_WATCHDOG_H
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Stall watchdog.  While armed, a thread checks how long ago the reader
+ * last fed it; once that is over the timeout it records a stall event and
+ * calls the handler, which is expected to make the blocked reader return
+ * (sane_cancel).  The watchdog then stays quiet until armed again.
+ **/
+#define STALL_EVENTS_MAX	32
+
+typedef struct
+{
+    char device[64];
+    char phase[16];         /* "scan/start": waiting for the first byte, "scan/read", "preview/..." */
+    time_t when;
+    double stalled;         /* s since the last byte */
+    size_t bytes;           /* read before the stall */
+} Stall_Event;
+
+typedef void (*Stall_Handler) (void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start the watchdog thread, or with timeout <= 0 stop it
+int watchdog_start(double timeout, Stall_Handler on_stall, void *arg);
+void watchdog_stop();
+// phase: "scan" or "preview"
+void watchdog_arm(const char *device, const char *phase);
+// Progress: bytes more read, safe to call for every sane_read
+void watchdog_feed(size_t bytes);
+void watchdog_disarm();
+// The watchdog fired since it was armed
+int watchdog_fired();
+// Append every stall to this file, one line each; NULL: none
+int watchdog_set_log(const char *path);
+// Last events, oldest first; returns how many there are
+int stall_events(Stall_Event *events, int max_events);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
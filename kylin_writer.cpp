@@ -0,0 +1,653 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define KYLIN_IO_URING
+#endif
+#endif
+
+#include "kylin_metrics.h"
+#include "kylin_writer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ALIGN_DOWN(n)	((n) & ~(uint64_t) (WRITER_ALIGN - 1))
+#define ALIGN_UP(n)	ALIGN_DOWN ((n) + WRITER_ALIGN - 1)
+
+static uint64_t in_flight_total = 0;    /* all writers of the process */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void write_started(File_Writer *w, size_t len)
+{
+    uint64_t total = __atomic_add_fetch (&in_flight_total, len, __ATOMIC_RELAXED);
+
+    w->stats.in_flight += len;
+    if (w->stats.in_flight > w->stats.max_in_flight)
+        w->stats.max_in_flight = w->stats.in_flight;
+    metric_set (METRIC_WRITE_IN_FLIGHT, (double) total);
+}
+
+static void write_completed(File_Writer *w, size_t len, uint64_t start_ns)
+{
+    uint64_t total = __atomic_sub_fetch (&in_flight_total, len, __ATOMIC_RELAXED);
+    uint64_t ns = now_ns () - start_ns;
+
+    w->stats.in_flight -= len;
+    w->stats.completions++;
+    w->stats.latency_ns += ns;
+    if (ns > w->stats.max_latency_ns)
+        w->stats.max_latency_ns = ns;
+    metric_set (METRIC_WRITE_IN_FLIGHT, (double) total);
+    metric_observe (METRIC_WRITE_SECONDS, ns / 1e9);
+}
+
+static SANE_Status write_at(File_Writer *w, const void *data, size_t len, uint64_t offset)
+{
+    const SANE_Byte *p = (const SANE_Byte *)data;
+    uint64_t start = now_ns ();
+    size_t total = len;
+
+    write_started (w, total);
+    while (len)
+    {
+        ssize_t n = pwrite (w->fd, p, len, offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        w->stats.writes++;
+        w->stats.bytes += n;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    write_completed (w, total, start);
+    return len ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+// Write-out of a range just written, see WRITER_WRITE_BEHIND
+static void write_behind(File_Writer *w, uint64_t offset, size_t len)
+{
+    if (!(w->flags & WRITER_WRITE_BEHIND) || w->direct || !w->regular)
+        return;
+    sync_file_range (w->fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    if (offset >= 2 * WRITER_BUFFER_SIZE)
+        sync_file_range (w->fd, offset - 2 * WRITER_BUFFER_SIZE, WRITER_BUFFER_SIZE,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+}
+
+/* -------------------------------------------- */
+// io_uring, through the system calls: the library does not link liburing
+
+#ifdef KYLIN_IO_URING
+
+struct Writer_Ring
+{
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    int fixed;              /* the pool is registered */
+    int pending;            /* writes in flight */
+    int busy[WRITER_MAX_DEPTH];
+    size_t len[WRITER_MAX_DEPTH];
+    uint64_t offset[WRITER_MAX_DEPTH];
+    uint64_t start_ns[WRITER_MAX_DEPTH];
+};
+
+static void ring_close(Writer_Ring *r)
+{
+    if (r->sqes)
+        munmap (r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap (r->cq_ptr, r->cq_size);
+    if (r->sq_ptr)
+        munmap (r->sq_ptr, r->sq_size);
+    close (r->fd);
+    free (r);
+}
+
+// Whether the kernel of the ring knows op; kernels before the probe (5.6) know none of the newer ones
+static int ring_supports(int fd, int op)
+{
+    struct io_uring_probe *probe;
+    int ok;
+
+    probe = (struct io_uring_probe *)calloc (1, sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op));
+    if (!probe)
+        return 0;
+    ok = (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+          && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED));
+    free (probe);
+    return ok;
+}
+
+static Writer_Ring *ring_open(File_Writer *w)
+{
+    struct io_uring_params p;
+    struct iovec iov[WRITER_MAX_DEPTH];
+    Writer_Ring *r;
+    int i;
+
+    r = (Writer_Ring *)calloc (1, sizeof (Writer_Ring));
+    if (!r)
+        return NULL;
+    memset (&p, 0, sizeof (p));
+    r->fd = syscall (__NR_io_uring_setup, w->depth, &p);
+    if (r->fd < 0)
+    {
+        free (r);
+        return NULL;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_size = r->cq_size = (r->sq_size > r->cq_size) ? r->sq_size : r->cq_size;
+    r->sq_ptr = mmap (NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+        r->sq_ptr = NULL;
+        ring_close (r);
+        return NULL;
+    }
+    r->cq_ptr = r->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        r->cq_ptr = mmap (NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+        {
+            r->cq_ptr = NULL;
+            ring_close (r);
+            return NULL;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap (NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        ring_close (r);
+        return NULL;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    // pinned buffers save the kernel mapping them on every write; over
+    // RLIMIT_MEMLOCK plain writes are used, where the kernel has them
+    for (i = 0; i < w->depth; i++)
+    {
+        iov[i].iov_base = w->pool + (size_t) i * WRITER_BUFFER_SIZE;
+        iov[i].iov_len = WRITER_BUFFER_SIZE;
+    }
+    r->fixed = (syscall (__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, w->depth) == 0);
+    if (!r->fixed && !ring_supports (r->fd, IORING_OP_WRITE))
+    {
+        ring_close (r);
+        return NULL;
+    }
+    return r;
+}
+
+static SANE_Status ring_submit(File_Writer *w, int slot, size_t len, uint64_t offset)
+{
+    Writer_Ring *r = w->ring;
+    unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    int n;
+
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = w->fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t) (w->pool + (size_t) slot * WRITER_BUFFER_SIZE);
+    sqe->len = len;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    r->sq_array[index] = index;
+    __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    r->busy[slot] = 1;
+    r->len[slot] = len;
+    r->offset[slot] = offset;
+    r->start_ns[slot] = now_ns ();
+    r->pending++;
+    write_started (w, len);
+    do
+        n = syscall (__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+    while (n < 0 && errno == EINTR);
+    if (n == 1)
+        return SANE_STATUS_GOOD;
+
+    // not taken: the entry is withdrawn and the caller writes itself
+    __atomic_store_n (r->sq_tail, tail, __ATOMIC_RELEASE);
+    r->busy[slot] = 0;
+    r->pending--;
+    write_completed (w, len, r->start_ns[slot]);
+    return SANE_STATUS_IO_ERROR;
+}
+
+// Take the completions there are, with wait at least one; -1 if the ring failed
+static int ring_reap(File_Writer *w, int wait)
+{
+    Writer_Ring *r = w->ring;
+    unsigned head = *r->cq_head;
+
+    while (wait && head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (syscall (__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            w->error = SANE_STATUS_IO_ERROR;
+            return -1;
+        }
+    }
+    while (head != __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        int slot = (int) cqe->user_data, res = cqe->res;
+
+        head++;
+        __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+        r->busy[slot] = 0;
+        r->pending--;
+        write_completed (w, r->len[slot], r->start_ns[slot]);
+        if (res > 0)
+        {
+            w->stats.writes++;
+            w->stats.bytes += res;
+        }
+        if (res < 0)
+            w->error = SANE_STATUS_IO_ERROR;
+        // a short write is finished here
+        else if ((size_t) res < r->len[slot]
+                 && write_at (w, w->pool + (size_t) slot * WRITER_BUFFER_SIZE + res, r->len[slot] - res,
+                              r->offset[slot] + res) != SANE_STATUS_GOOD)
+            w->error = SANE_STATUS_IO_ERROR;
+        else
+            write_behind (w, r->offset[slot], r->len[slot]);
+    }
+    return 0;
+}
+
+/**
+ * Also after an error: the buffers are not reused or freed before the
+ * kernel is done with them.  Should waiting fail, the completions still
+ * arrive in the mapped ring and are polled for.
+ **/
+static SANE_Status ring_drain(File_Writer *w)
+{
+    const struct timespec tick = { 0, 1000000 };
+
+    while (w->ring->pending)
+    {
+        if (ring_reap (w, 1) < 0)
+        {
+            nanosleep (&tick, NULL);
+            ring_reap (w, 0);
+        }
+    }
+    return w->error;
+}
+
+// Submit the full buffer and fill a free one meanwhile
+static SANE_Status submit_buffer(File_Writer *w)
+{
+    Writer_Ring *r = w->ring;
+    int slot = (int) ((w->buf - w->pool) / WRITER_BUFFER_SIZE);
+
+    if (ring_submit (w, slot, w->fill, w->offset) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    w->offset += w->fill;
+    w->fill = 0;
+    w->clean = 0;
+
+    ring_reap (w, 0);
+    while (1)
+    {
+        for (slot = 0; slot < w->depth; slot++)
+        {
+            if (!r->busy[slot])
+            {
+                w->buf = w->pool + (size_t) slot * WRITER_BUFFER_SIZE;
+                return w->error;
+            }
+        }
+        w->stats.waits++;
+        if (ring_reap (w, 1) < 0)
+            return w->error;
+    }
+}
+
+#else
+
+static Writer_Ring *ring_open(File_Writer *w)
+{
+    return NULL;
+}
+
+static void ring_close(Writer_Ring *r)
+{
+}
+
+static SANE_Status ring_drain(File_Writer *w)
+{
+    return w->error;
+}
+
+static SANE_Status submit_buffer(File_Writer *w)
+{
+    return SANE_STATUS_IO_ERROR;
+}
+
+#endif
+
+/* -------------------------------------------- */
+
+static SANE_Status set_direct(File_Writer *w, int on)
+{
+    int fl = fcntl (w->fd, F_GETFL);
+
+    if (fl < 0 || fcntl (w->fd, F_SETFL, on ? (fl | O_DIRECT) : (fl & ~O_DIRECT)) < 0)
+        return SANE_STATUS_IO_ERROR;
+    return SANE_STATUS_GOOD;
+}
+
+// Bytes that O_DIRECT cannot take go through the page cache
+static SANE_Status write_cached(File_Writer *w, const void *data, size_t len, uint64_t offset)
+{
+    SANE_Status status;
+
+    if (!w->direct)
+        return write_at (w, data, len, offset);
+    if (set_direct (w, 0) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    status = write_at (w, data, len, offset);
+    if (set_direct (w, 1) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    return status;
+}
+
+static SANE_Status alloc_pool(File_Writer *w, int depth)
+{
+    void *pool = NULL;
+
+    free (w->pool);
+    w->pool = w->buf = NULL;
+    if (posix_memalign (&pool, WRITER_ALIGN, (size_t) depth * WRITER_BUFFER_SIZE))
+        return SANE_STATUS_NO_MEM;
+    w->pool = w->buf = (SANE_Byte *)pool;
+    w->depth = depth;
+    return SANE_STATUS_GOOD;
+}
+
+File_Writer *file_writer_open(const char *path, int flags, int depth)
+{
+    File_Writer *w = (File_Writer *)calloc (1, sizeof (File_Writer));
+    struct stat st;
+
+    if (!w)
+        return NULL;
+    if (!(flags & WRITER_ASYNC))
+        depth = 1;
+    else if (depth < 2)
+        depth = 2;
+    else if (depth > WRITER_MAX_DEPTH)
+        depth = WRITER_MAX_DEPTH;
+    if (alloc_pool (w, depth) != SANE_STATUS_GOOD)
+    {
+        free (w);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->flags = flags;
+
+    w->fd = -1;
+    if (flags & WRITER_DIRECT)
+    {
+        w->fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+        w->direct = (w->fd >= 0);
+    }
+    // tmpfs and some others refuse O_DIRECT with EINVAL
+    if (w->fd < 0)
+        w->fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (w->fd < 0)
+    {
+        int err = errno;
+
+        free (w->pool);
+        free (w);
+        errno = err;
+        return NULL;
+    }
+    w->regular = (fstat (w->fd, &st) == 0 && S_ISREG (st.st_mode));
+    w->stats.direct = w->direct;
+
+    if (flags & WRITER_ASYNC)
+    {
+        w->ring = ring_open (w);
+        // synchronous writes need a single buffer
+        if (!w->ring && alloc_pool (w, 1) != SANE_STATUS_GOOD)
+        {
+            close (w->fd);
+            free (w);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    w->stats.async = (w->ring != NULL);
+    return w;
+}
+
+SANE_Status file_writer_reserve(File_Writer *w, uint64_t size)
+{
+    uint64_t have = w->offset + w->fill;
+
+    if (!(w->flags & WRITER_PREALLOCATE) || !w->regular || size <= have || size <= w->reserved)
+        return SANE_STATUS_GOOD;
+    // not supported by the file system: let the file grow as it is written
+    if (fallocate (w->fd, 0, have, size - have) == 0)
+    {
+        w->stats.preallocated += size - have;
+        w->reserved = size;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+/**
+ * Wait for the writes in flight, then write the whole blocks of the
+ * buffer.  The partial block at the end is written through the page cache
+ * but kept at the start of the buffer, so the next flush writes it again
+ * with the rest of its block and offsets stay aligned.
+ **/
+SANE_Status file_writer_flush(File_Writer *w)
+{
+    size_t whole = w->direct ? ALIGN_DOWN (w->fill) : w->fill;
+
+    if (w->ring && ring_drain (w) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    if (w->clean == w->fill)
+        return SANE_STATUS_GOOD;
+    if (whole && write_at (w, w->buf, whole, w->offset) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    if (whole == WRITER_BUFFER_SIZE)
+        write_behind (w, w->offset, whole);
+    if (whole < w->fill)
+    {
+        if (write_cached (w, w->buf + whole, w->fill - whole, w->offset + whole) != SANE_STATUS_GOOD)
+            return SANE_STATUS_IO_ERROR;
+        memmove (w->buf, w->buf + whole, w->fill - whole);
+    }
+    w->offset += whole;
+    w->fill -= whole;
+    w->clean = w->fill;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status file_writer_write(File_Writer *w, const void *data, size_t len)
+{
+    const SANE_Byte *p = (const SANE_Byte *)data;
+
+    while (len)
+    {
+        size_t n = WRITER_BUFFER_SIZE - w->fill;
+
+        if (n > len)
+            n = len;
+        memcpy (w->buf + w->fill, p, n);
+        w->fill += n;
+        p += n;
+        len -= n;
+        if (w->fill < WRITER_BUFFER_SIZE)
+            continue;
+        if (w->ring && submit_buffer (w) == SANE_STATUS_GOOD)
+            continue;
+        // no ring, or it failed: whatever is pending is waited for
+        if (file_writer_flush (w) != SANE_STATUS_GOOD)
+            return SANE_STATUS_IO_ERROR;
+    }
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status file_writer_patch(File_Writer *w, uint64_t offset, const void *data, size_t len)
+{
+    const SANE_Byte *p = (const SANE_Byte *)data;
+    uint64_t start, end;
+    void *block;
+    SANE_Status status;
+
+    if (offset + len > w->offset + w->fill)
+        return SANE_STATUS_INVAL;
+    // still buffered
+    if (offset + len > w->offset)
+    {
+        size_t skip = (offset < w->offset) ? w->offset - offset : 0;
+        size_t at = offset + skip - w->offset;
+
+        memcpy (w->buf + at, p + skip, len - skip);
+        if (w->clean > at)
+            w->clean = at;
+        len = skip;
+    }
+    if (!len)
+        return SANE_STATUS_GOOD;
+    // the bytes may still be on their way
+    if (w->ring && ring_drain (w) != SANE_STATUS_GOOD)
+        return SANE_STATUS_IO_ERROR;
+    if (!w->direct)
+        return write_at (w, p, len, offset);
+
+    // O_DIRECT only takes whole blocks: read them, patch and write back
+    start = ALIGN_DOWN (offset);
+    end = ALIGN_UP (offset + len);
+    if (posix_memalign (&block, WRITER_ALIGN, end - start))
+        return SANE_STATUS_NO_MEM;
+    status = SANE_STATUS_IO_ERROR;
+    if (pread (w->fd, block, end - start, start) == (ssize_t) (end - start))
+    {
+        memcpy ((SANE_Byte *)block + (offset - start), p, len);
+        status = write_at (w, block, end - start, start);
+    }
+    free (block);
+    return status;
+}
+
+ssize_t file_writer_read(File_Writer *w, uint64_t offset, void *data, size_t len)
+{
+    ssize_t n;
+
+    if (file_writer_flush (w) != SANE_STATUS_GOOD)
+        return -1;
+    if (offset >= w->offset + w->fill)
+        return 0;
+    if (len > w->offset + w->fill - offset)
+        len = w->offset + w->fill - offset;
+    // user memory need not be aligned for O_DIRECT
+    if (w->direct && set_direct (w, 0) != SANE_STATUS_GOOD)
+        return -1;
+    do
+        n = pread (w->fd, data, len, offset);
+    while (n < 0 && errno == EINTR);
+    if (w->direct && set_direct (w, 1) != SANE_STATUS_GOOD)
+        return -1;
+    return n;
+}
+
+uint64_t file_writer_tell(const File_Writer *w)
+{
+    return w->offset + w->fill;
+}
+
+void file_writer_get_stats(const File_Writer *w, Writer_Stats *stats)
+{
+    *stats = w->stats;
+}
+
+SANE_Status file_writer_finish(File_Writer *w)
+{
+    uint64_t length = file_writer_tell (w);
+    SANE_Status status = file_writer_flush (w);
+
+    // give back what was allocated for a page that came out shorter
+    if (w->regular && w->reserved > length)
+    {
+        if (ftruncate (w->fd, length) != 0)
+            status = SANE_STATUS_IO_ERROR;
+        else
+            w->reserved = length;
+    }
+    return status;
+}
+
+SANE_Status file_writer_close(File_Writer *w)
+{
+    SANE_Status status;
+
+    if (!w)
+        return SANE_STATUS_GOOD;
+    status = file_writer_finish (w);
+    if (w->ring)
+    {
+        ring_drain (w);
+        ring_close (w->ring);
+    }
+    if (close (w->fd) != 0)
+        status = SANE_STATUS_IO_ERROR;
+    free (w->pool);
+    free (w);
+    return status;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,107 @@
+#ifndef KYLIN_WRITER_H
+#define KYLIN_WRITER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sane/sane.h"
+
+/**
+ * Output file of a scan.  Data is gathered into a WRITER_BUFFER_SIZE
+ * buffer and written a whole buffer at a time, at offsets that are
+ * multiples of it; a file whose size is known is given all its blocks
+ * up front with fallocate(), so concurrent scans do not interleave their
+ * extents.  With WRITER_DIRECT the buffers bypass the page cache; the
+ * last, partial block of a file goes through it.  Where the file system
+ * refuses either, the writer quietly does without.
+ *
+ * With WRITER_ASYNC full buffers are submitted to an io_uring of the
+ * writer, from a pool of depth buffers registered with the ring, and the
+ * caller goes on filling the next one; it only waits when every buffer
+ * is in flight, and in a flush.  Where io_uring is missing or refused, or
+ * the buffers cannot be registered on a kernel without plain ring writes
+ * (before 5.6), the writes are synchronous as without the flag.
+ *
+ * WRITER_WRITE_BEHIND starts write-out of every buffer once it is written
+ * and waits for the one two buffers back, so a file being written holds
+ * few dirty pages and a later fsync is short (see kylin_durable.h).
+ **/
+#define WRITER_BUFFER_SIZE	(1024 * 1024)
+#define WRITER_ALIGN	4096        /* O_DIRECT offsets, lengths and memory */
+#define WRITER_DEFAULT_DEPTH	4
+#define WRITER_MAX_DEPTH	32
+
+enum writer_flags
+{
+    WRITER_PREALLOCATE = 1 << 0,
+    WRITER_DIRECT = 1 << 1,
+    WRITER_ASYNC = 1 << 2,
+    WRITER_WRITE_BEHIND = 1 << 3
+};
+
+typedef struct
+{
+    uint64_t bytes;         /* written to the file, rewrites included */
+    uint64_t writes;        /* write calls */
+    uint64_t preallocated;  /* bytes given by fallocate() */
+    int direct;             /* O_DIRECT was taken */
+    int async;              /* writes go through io_uring */
+    uint64_t in_flight;     /* bytes submitted and not completed */
+    uint64_t max_in_flight;
+    uint64_t completions;
+    uint64_t latency_ns;    /* submission to completion, all writes */
+    uint64_t max_latency_ns;
+    uint64_t waits;         /* every buffer was in flight */
+} Writer_Stats;
+
+typedef struct Writer_Ring Writer_Ring;
+
+typedef struct
+{
+    int fd;
+    int flags;
+    int regular;            /* a regular file, not e.g. /dev/null */
+    int direct;
+    SANE_Byte *buf;         /* buffer being filled, WRITER_ALIGN aligned */
+    SANE_Byte *pool;        /* depth buffers, buf is one of them */
+    int depth;
+    Writer_Ring *ring;      /* NULL: synchronous writes */
+    SANE_Status error;      /* of a write that completed in the background */
+    size_t fill;
+    size_t clean;           /* leading bytes of buf already in the file */
+    uint64_t offset;        /* file offset of buf[0] */
+    uint64_t reserved;      /* size given by fallocate() */
+    Writer_Stats stats;
+} File_Writer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create or truncate path for writing with the given writer_flags, NULL
+ * with errno set; depth is the number of buffers with WRITER_ASYNC.
+ **/
+File_Writer *file_writer_open(const char *path, int flags, int depth);
+// The file will be about size bytes; allocates them with WRITER_PREALLOCATE
+SANE_Status file_writer_reserve(File_Writer *w, uint64_t size);
+SANE_Status file_writer_write(File_Writer *w, const void *data, size_t len);
+// Overwrite bytes already written, e.g. a header field known at the end
+SANE_Status file_writer_patch(File_Writer *w, uint64_t offset, const void *data, size_t len);
+// Write out what is buffered; the file then has everything written so far
+SANE_Status file_writer_flush(File_Writer *w);
+// Read back from the file, flushing first; bytes read or -1
+ssize_t file_writer_read(File_Writer *w, uint64_t offset, void *data, size_t len);
+// Bytes written so far
+uint64_t file_writer_tell(const File_Writer *w);
+void file_writer_get_stats(const File_Writer *w, Writer_Stats *stats);
+// Flush and trim the file to what was written; w->fd stays open, e.g. to be synced
+SANE_Status file_writer_finish(File_Writer *w);
+// Finish and close the file; w is freed either way
+SANE_Status file_writer_close(File_Writer *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
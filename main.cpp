@@ -14,7 +14,7 @@ static struct option *all_options;
 int main()
 {
     // 1. initialize SANE
-    printf("SANE Init\n");
+    log_info("SANE Init\n");
     init();
 
     do 
@@ -35,61 +35,61 @@ int main()
         {
             if (column + strlen (device_list[i]->name) + 1 >= 80)
             {
-              printf ("\n    ");
+              log_info ("\n    ");
               column = 4;
             }
             if (column > 4)
             {
-              fputc (' ', stdout);
+              log_info (" ");
               column += 1;
             }
-            fputs (device_list[i]->name, stdout);
+            log_info ("%s", device_list[i]->name);
             column += strlen (device_list[i]->name);
         }
-        fputc ('\n', stdout);
+        log_info ("\n");
 
 
         for (i = 0; device_list[i]; ++i)
         {
-          printf ("device `%s' is a %s %s %s\n",
+          log_info ("device `%s' is a %s %s %s\n",
              device_list[i]->name, device_list[i]->vendor,
              device_list[i]->model, device_list[i]->type);
         }
         if (!device_list[0])
         {
-            fprintf (stderr, "no SANE devices found\n");
+            log_error ("no SANE devices found\n");
             break;
         }
 
         // 3. open a device
-        printf("Open a device\n");
+        log_info("Open a device\n");
         SANE_Handle sane_handle = NULL;
         SANE_Device *device = (SANE_Device *)*device_list;
         if (!device) 
         {
-            printf("No device connected!\n");
+            log_error("No device connected!\n");
             break;
         }
 
         if (sane_status = open_device(device, &sane_handle))
         {
-            printf("Open device failed!\n");
+            log_error("Open device failed!\n");
             break;
         }
  
 
         // 4. start scanning
-        printf("Scanning...\n");
+        log_info("Scanning...\n");
         start_scan(sane_handle, "helloworld");
         cancle_scan(sane_handle);
 
         // 5. close device
-        printf("Close the device\n");
+        log_info("Close the device\n");
         close_device(sane_handle);
     }while(0);    
 
     // 6. release resources
-    printf("Exit\n");
+    log_info("Exit\n");
     my_sane_exit();
     return 0;
 }